@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * C API. see bitstring.h
+ *
+ * the engine functions are called with NULL lua state. the plan is
+ * validated when it is compiled and sizes are checked before the engine
+ * is called so the engine never reaches its error paths.
+ */
+
+/*
+ * plan returned by bitstring_compile
+ */
+struct BITSTRING_PLAN
+{
+    /* total number of bits packed or unpacked by the plan */
+    size_t bits;
+    /* number of allocated elements in bitmatch */
+    size_t capacity;
+    /* set if an element could not be added while compiling */
+    int out_of_memory;
+    /* must be the last member */
+    BITMATCH bitmatch;
+};
+
+/*
+ * name
+ *      alloc_plan
+ *
+ * description
+ *      allocate or grow a plan to hold element_count elements
+ *
+ * paramenters
+ *      plan - plan to grow or NULL
+ *      element_count - requested number of elements
+ *
+ * returns
+ *      pointer to the plan or NULL if out of memory.
+ *      the original plan is left intact when out of memory
+ */
+static BITSTRING_PLAN *alloc_plan(BITSTRING_PLAN *plan, size_t element_count)
+{
+    size_t size = sizeof(BITSTRING_PLAN) + sizeof(ELEMENT_DESCRIPTION) * (element_count - 1);
+    BITSTRING_PLAN *new_plan = (BITSTRING_PLAN *)realloc(plan, size);
+    if(new_plan == NULL)
+    {
+        return NULL;
+    }
+    if(plan == NULL)
+    {
+        memset(new_plan, 0, size);
+    }
+    new_plan->capacity = element_count;
+    return new_plan;
+}
+
+/*
+ * name
+ *      compile_plan_elem
+ *
+ * description
+ *      handler callback that is called by parse_format
+ *
+ * paramenters
+ *      l - not used
+ *      elem - element description
+ *      arg_index - number of element in format string. starts from 2
+ *      arg - pointer to pointer to the plan that is compiled
+ */
+static void compile_plan_elem(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, void *arg)
+{
+    BITSTRING_PLAN **plan = (BITSTRING_PLAN **)arg;
+    (void)l;
+    (void)arg_index;
+    if((*plan)->out_of_memory)
+    {
+        return;
+    }
+
+    if((*plan)->bitmatch.element_count == (*plan)->capacity)
+    {
+        BITSTRING_PLAN *new_plan = alloc_plan(*plan, (*plan)->capacity * 2);
+        if(new_plan == NULL)
+        {
+            (*plan)->out_of_memory = 1;
+            return;
+        }
+        *plan = new_plan;
+    }
+    memcpy(&(*plan)->bitmatch.elements[(*plan)->bitmatch.element_count], elem, sizeof(ELEMENT_DESCRIPTION));
+    ++(*plan)->bitmatch.element_count;
+}
+
+/*
+ * name
+ *      validate_plan
+ *
+ * description
+ *      verify that all elements of the plan are supported by the C API
+ *      and calculate the size of the plan
+ *
+ * paramenters
+ *      plan - compiled plan
+ *      error - out parameter. buffer for error message
+ *      error_len - size of the error buffer
+ *
+ * returns
+ *      BITSTRING_OK or BITSTRING_ERROR_FORMAT
+ */
+static int validate_plan(BITSTRING_PLAN *plan, char *error, size_t error_len)
+{
+    plan->bits = 0;
+    size_t i;
+    for(i = 0; i < plan->bitmatch.element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &plan->bitmatch.elements[i];
+        if(elem->type != ET_INTEGER)
+        {
+            format_error(error, error_len,
+                    "wrong format: element %d: only int elements are supported", (int)i + 1);
+            return BITSTRING_ERROR_FORMAT;
+        }
+
+        if(elem->constant)
+        {
+            format_error(error, error_len,
+                    "wrong format: element %d: constant values are not supported", (int)i + 1);
+            return BITSTRING_ERROR_FORMAT;
+        }
+
+        if(elem->size == 0 || elem->size > sizeof(lua_Integer) * CHAR_BIT)
+        {
+            format_error(error, error_len,
+                    "size error: element %d size (%d bits) must be between 1 and %d bits",
+                    (int)i + 1, (int)elem->size, (int)(sizeof(lua_Integer) * CHAR_BIT));
+            return BITSTRING_ERROR_FORMAT;
+        }
+
+        if(elem->size % CHAR_BIT != 0 && elem->endianess == EE_LITTLE)
+        {
+            format_error(error, error_len,
+                    "wrong format: element %d: little endianess supported for %d bit bounds only",
+                    (int)i + 1, CHAR_BIT);
+            return BITSTRING_ERROR_FORMAT;
+        }
+        plan->bits += elem->size;
+    }
+    return BITSTRING_OK;
+}
+
+BITSTRING_PLAN *bitstring_compile(const char *format, char *error, size_t error_len)
+{
+    char message[255];
+    if(error == NULL || error_len == 0)
+    {
+        error = message;
+        error_len = sizeof(message);
+    }
+
+    if(format == NULL)
+    {
+        format_error(error, error_len, "invalid parameter: format is NULL");
+        return NULL;
+    }
+
+    size_t default_element_count = 32;
+    BITSTRING_PLAN *plan = alloc_plan(NULL, default_element_count);
+    if(plan == NULL)
+    {
+        format_error(error, error_len, "out of memory");
+        return NULL;
+    }
+
+    if(parse_format(NULL, format, strlen(format), compile_plan_elem, (void *)&plan, error, error_len) != 0)
+    {
+        bitstring_free(plan);
+        return NULL;
+    }
+
+    if(plan->out_of_memory)
+    {
+        format_error(error, error_len, "out of memory");
+        bitstring_free(plan);
+        return NULL;
+    }
+
+    if(validate_plan(plan, error, error_len) != BITSTRING_OK)
+    {
+        bitstring_free(plan);
+        return NULL;
+    }
+    return plan;
+}
+
+void bitstring_free(BITSTRING_PLAN *plan)
+{
+    free(plan);
+}
+
+size_t bitstring_count(const BITSTRING_PLAN *plan)
+{
+    return plan->bitmatch.element_count;
+}
+
+size_t bitstring_bits(const BITSTRING_PLAN *plan)
+{
+    return plan->bits;
+}
+
+size_t bitstring_buffer_size(const BITSTRING_PLAN *plan)
+{
+    return bits_to_bytes(plan->bits) + 1;
+}
+
+int bitstring_pack(
+        const BITSTRING_PLAN *plan,
+        const int64_t *values,
+        size_t count,
+        unsigned char *buffer,
+        size_t buffer_len,
+        size_t *packed_bits)
+{
+    if(plan == NULL || values == NULL || buffer == NULL || count != plan->bitmatch.element_count)
+    {
+        return BITSTRING_ERROR_ARGUMENT;
+    }
+
+    if(buffer_len < bitstring_buffer_size(plan))
+    {
+        return BITSTRING_ERROR_SIZE;
+    }
+
+    PACK_STATE state;
+    state.buffer = NULL;
+    state.prep_buffer = buffer;
+    state.current_bit = 0;
+    state.result_bits = buffer_len * CHAR_BIT;
+
+    size_t i;
+    for(i = 0; i < count; ++i)
+    {
+        /* the engine does not modify the element */
+        ELEMENT_DESCRIPTION *elem = (ELEMENT_DESCRIPTION *)&plan->bitmatch.elements[i];
+        basic_pack_int(NULL, elem, (lua_Integer)values[i], &state);
+    }
+
+    if(packed_bits != NULL)
+    {
+        *packed_bits = state.current_bit;
+    }
+    return BITSTRING_OK;
+}
+
+/*
+ * name
+ *      init_plan_unpack
+ *
+ * description
+ *      verify parameters and initialize unpack state for the C API
+ *
+ * returns
+ *      BITSTRING_OK or error code
+ */
+static int init_plan_unpack(
+        const BITSTRING_PLAN *plan,
+        const unsigned char *buffer,
+        size_t buffer_len,
+        UNPACK_STATE *state)
+{
+    if(buffer == NULL)
+    {
+        return BITSTRING_ERROR_ARGUMENT;
+    }
+
+    if(buffer_len * CHAR_BIT < plan->bits)
+    {
+        return BITSTRING_ERROR_SIZE;
+    }
+
+    state->return_count = 0;
+    state->current_bit = 0;
+    state->source_bits = buffer_len * CHAR_BIT;
+    state->source = buffer;
+    state->source_end = buffer + buffer_len;
+    return BITSTRING_OK;
+}
+
+int bitstring_unpack(
+        const BITSTRING_PLAN *plan,
+        const unsigned char *buffer,
+        size_t buffer_len,
+        int64_t *values,
+        size_t count,
+        size_t *unpacked_bits)
+{
+    if(plan == NULL || values == NULL || count != plan->bitmatch.element_count)
+    {
+        return BITSTRING_ERROR_ARGUMENT;
+    }
+
+    UNPACK_STATE state;
+    int result = init_plan_unpack(plan, buffer, buffer_len, &state);
+    if(result != BITSTRING_OK)
+    {
+        return result;
+    }
+
+    size_t i;
+    for(i = 0; i < count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = (ELEMENT_DESCRIPTION *)&plan->bitmatch.elements[i];
+        values[i] = unpack_int_no_push(NULL, elem, i + 1, &state);
+    }
+
+    if(unpacked_bits != NULL)
+    {
+        *unpacked_bits = state.current_bit;
+    }
+    return BITSTRING_OK;
+}
+
+int bitstring_unpack_fields(
+        const BITSTRING_PLAN *plan,
+        const unsigned char *buffer,
+        size_t buffer_len,
+        void *result,
+        const BITSTRING_FIELD *fields,
+        size_t count,
+        size_t *unpacked_bits)
+{
+    if(plan == NULL || result == NULL || fields == NULL || count != plan->bitmatch.element_count)
+    {
+        return BITSTRING_ERROR_ARGUMENT;
+    }
+
+    size_t i;
+    for(i = 0; i < count; ++i)
+    {
+        size_t size = fields[i].size;
+        if(size != 1 && size != 2 && size != 4 && size != 8)
+        {
+            return BITSTRING_ERROR_ARGUMENT;
+        }
+    }
+
+    UNPACK_STATE state;
+    int status = init_plan_unpack(plan, buffer, buffer_len, &state);
+    if(status != BITSTRING_OK)
+    {
+        return status;
+    }
+
+    unsigned char *base = (unsigned char *)result;
+    for(i = 0; i < count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = (ELEMENT_DESCRIPTION *)&plan->bitmatch.elements[i];
+        lua_Integer value = unpack_int_no_push(NULL, elem, i + 1, &state);
+        unsigned char *member = base + fields[i].offset;
+        /* members may be unaligned in packed structures */
+        if(fields[i].size == 1)
+        {
+            uint8_t tmp = (uint8_t)value;
+            memcpy(member, &tmp, sizeof(tmp));
+        }
+        else if(fields[i].size == 2)
+        {
+            uint16_t tmp = (uint16_t)value;
+            memcpy(member, &tmp, sizeof(tmp));
+        }
+        else if(fields[i].size == 4)
+        {
+            uint32_t tmp = (uint32_t)value;
+            memcpy(member, &tmp, sizeof(tmp));
+        }
+        else
+        {
+            uint64_t tmp = (uint64_t)value;
+            memcpy(member, &tmp, sizeof(tmp));
+        }
+    }
+
+    if(unpacked_bits != NULL)
+    {
+        *unpacked_bits = state.current_bit;
+    }
+    return BITSTRING_OK;
+}
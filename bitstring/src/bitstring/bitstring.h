@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * bitstring C API
+ *
+ * the C API allows embedding the bitstring engine in C and C++ programs
+ * without a lua state. a format string is compiled once into a plan.
+ * the plan is used to pack values from a C array into a caller supplied
+ * buffer and to unpack values from a buffer into a C array or structure.
+ *
+ * the format syntax is the same as in bitstring.pack and bitstring.unpack.
+ * currently only int elements are supported by the C API.
+ *
+ * example
+ *      char error[256];
+ *      BITSTRING_PLAN *plan = bitstring_compile(
+ *          "8:int, 8:int, 16:int:big, 8:int, 1:int, 1:int, 1:int, 5:int",
+ *          error, sizeof(error));
+ *      int64_t values[8] = {1, 0, 6, 13, 0, 0, 1, 0};
+ *      unsigned char buffer[8];
+ *      size_t bits = 0;
+ *      bitstring_pack(plan, values, 8, buffer, sizeof(buffer), &bits);
+ *      bitstring_unpack(plan, buffer, bits / 8, values, 8, &bits);
+ *      bitstring_free(plan);
+ */
+
+#ifndef BITSTRING_H
+#define BITSTRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef WIN32
+#ifdef BITSTRING_EXPORTS
+#define BITSTRING_API __declspec(dllexport)
+#else
+#define BITSTRING_API __declspec(dllimport)
+#endif // BITSTRING_EXPORTS
+#else
+#define BITSTRING_API
+#endif // WIN32
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+/*
+ * result codes of the C API functions
+ */
+typedef enum
+{
+    BITSTRING_OK = 0,
+    /* format string could not be parsed or uses unsupported elements */
+    BITSTRING_ERROR_FORMAT,
+    /* input is shorter than the plan or output buffer is too small */
+    BITSTRING_ERROR_SIZE,
+    /* wrong parameter. for example the number of values does not match the plan */
+    BITSTRING_ERROR_ARGUMENT,
+    /* memory allocation failed */
+    BITSTRING_ERROR_MEMORY,
+} BITSTRING_RESULT;
+
+/*
+ * compiled format. opaque to the user
+ */
+typedef struct BITSTRING_PLAN BITSTRING_PLAN;
+
+/*
+ * describes where an unpacked value is stored inside a C structure
+ */
+typedef struct
+{
+    /* offset of the member from the start of the structure. use offsetof */
+    size_t offset;
+    /* size of the member in bytes. 1, 2, 4 or 8 */
+    size_t size;
+} BITSTRING_FIELD;
+
+/*
+ * name
+ *      bitstring_compile
+ *
+ * description
+ *      compile format string into a plan
+ *
+ * paramenters
+ *      format - zero terminated format string
+ *      error - out parameter. buffer for error message, may be NULL
+ *      error_len - size of the error buffer
+ *
+ * returns
+ *      the plan or NULL on error. the plan is released with bitstring_free
+ */
+BITSTRING_API BITSTRING_PLAN *bitstring_compile(const char *format, char *error, size_t error_len);
+
+/*
+ * name
+ *      bitstring_free
+ *
+ * description
+ *      release a plan returned by bitstring_compile
+ */
+BITSTRING_API void bitstring_free(BITSTRING_PLAN *plan);
+
+/*
+ * name
+ *      bitstring_count
+ *
+ * returns
+ *      number of elements in the plan
+ */
+BITSTRING_API size_t bitstring_count(const BITSTRING_PLAN *plan);
+
+/*
+ * name
+ *      bitstring_bits
+ *
+ * returns
+ *      number of bits that the plan packs or unpacks
+ */
+BITSTRING_API size_t bitstring_bits(const BITSTRING_PLAN *plan);
+
+/*
+ * name
+ *      bitstring_buffer_size
+ *
+ * returns
+ *      minimal size in bytes of the buffer passed to bitstring_pack.
+ *      the engine uses one byte after the packed bits as scratch space
+ */
+BITSTRING_API size_t bitstring_buffer_size(const BITSTRING_PLAN *plan);
+
+/*
+ * name
+ *      bitstring_pack
+ *
+ * description
+ *      pack array of values into buffer
+ *
+ * paramenters
+ *      plan - compiled format
+ *      values - values to pack. one value for each element of the plan
+ *      count - number of values
+ *      buffer - out parameter. buffer for the packed bits
+ *      buffer_len - size of the buffer. see bitstring_buffer_size
+ *      packed_bits - out parameter. number of packed bits, may be NULL
+ *
+ * returns
+ *      BITSTRING_OK or error code
+ */
+BITSTRING_API int bitstring_pack(
+        const BITSTRING_PLAN *plan,
+        const int64_t *values,
+        size_t count,
+        unsigned char *buffer,
+        size_t buffer_len,
+        size_t *packed_bits);
+
+/*
+ * name
+ *      bitstring_unpack
+ *
+ * description
+ *      unpack buffer into array of values
+ *
+ * paramenters
+ *      plan - compiled format
+ *      buffer - input buffer
+ *      buffer_len - length of the input buffer in bytes
+ *      values - out parameter. one value for each element of the plan
+ *      count - number of values
+ *      unpacked_bits - out parameter. number of unpacked bits, may be NULL
+ *
+ * returns
+ *      BITSTRING_OK or error code
+ */
+BITSTRING_API int bitstring_unpack(
+        const BITSTRING_PLAN *plan,
+        const unsigned char *buffer,
+        size_t buffer_len,
+        int64_t *values,
+        size_t count,
+        size_t *unpacked_bits);
+
+/*
+ * name
+ *      bitstring_unpack_fields
+ *
+ * description
+ *      unpack buffer into members of a C structure
+ *
+ * paramenters
+ *      plan - compiled format
+ *      buffer - input buffer
+ *      buffer_len - length of the input buffer in bytes
+ *      result - out parameter. the structure that receives the values
+ *      fields - location of the member for each element of the plan
+ *      count - number of fields
+ *      unpacked_bits - out parameter. number of unpacked bits, may be NULL
+ *
+ * returns
+ *      BITSTRING_OK or error code
+ */
+BITSTRING_API int bitstring_unpack_fields(
+        const BITSTRING_PLAN *plan,
+        const unsigned char *buffer,
+        size_t buffer_len,
+        void *result,
+        const BITSTRING_FIELD *fields,
+        size_t count,
+        size_t *unpacked_bits);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // BITSTRING_H
@@ -0,0 +1,596 @@
+/*
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * bitstring C++17 front-end
+ *
+ * header only. the format is parsed at compile time by a constexpr
+ * implementation of the parse_format state machine and every element
+ * is packed and unpacked with offsets, shifts and masks that are known
+ * at compile time. the format syntax is the same as in bitstring.pack
+ * and bitstring.unpack. only int elements are supported.
+ *
+ * example
+ *      static constexpr char EAP_TLS[] =
+ *          "8:int, 8:int, 16:int:big, 8:int, 1:int, 1:int, 1:int, 5:int";
+ *      using eap_tls = bitstring::layout<EAP_TLS>;
+ *
+ *      auto [code, identifier, length, type, l, m, s, r] = eap_tls::unpack(buffer, buffer_len);
+ *      std::array<unsigned char, eap_tls::bytes> message =
+ *          eap_tls::pack(code, identifier, length, type, l, m, s, r);
+ *      eap_tls::pack_into(buffer, buffer_len, code, identifier, length, type, l, m, s, r);
+ */
+
+#ifndef BITSTRING_HPP
+#define BITSTRING_HPP
+
+#include <array>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace bitstring
+{
+
+namespace detail
+{
+
+/*
+ * element types and endianess. same values as ELEMENT_TYPE and
+ * ELEMENT_ENDIANESS in lbitstring.c
+ */
+enum element_type
+{
+    ET_UNDEFINED = 0,
+    ET_INTEGER,
+    ET_BINARY,
+    ET_FLOAT,
+};
+
+enum element_endianess
+{
+    EE_DEFAULT = 0,
+    EE_BIG,
+    EE_LITTLE,
+};
+
+/*
+ * element description
+ */
+struct element
+{
+    /* size in bits */
+    std::size_t size;
+    element_type type;
+    element_endianess endianess;
+};
+
+/*
+ * result of parsing. capacity N may be smaller then count
+ * when parse is used for counting the elements
+ */
+template <std::size_t N>
+struct parse_result
+{
+    std::size_t count;
+    element elements[N > 0 ? N : 1];
+};
+
+constexpr bool is_delimiter(char c)
+{
+    return c == ',' || c == ' ' || c == '\t' || c == '\n';
+}
+
+constexpr bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+constexpr bool is_alpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/*
+ * name
+ *      totype
+ *
+ * description
+ *      convert type token to type enum value
+ *
+ * throws
+ *      wrong format - unexpected type token. fails the compilation
+ *                     when evaluated at compile time
+ */
+constexpr element_type totype(std::string_view token)
+{
+    if(token == "int")
+    {
+        return ET_INTEGER;
+    }
+    if(token == "bin")
+    {
+        return ET_BINARY;
+    }
+    if(token == "float")
+    {
+        return ET_FLOAT;
+    }
+    throw std::invalid_argument("wrong format: unexpected type token");
+}
+
+/*
+ * name
+ *      toendianess
+ *
+ * description
+ *      convert endianess token to endianess enum value
+ *
+ * throws
+ *      wrong format - unexpected endianess token
+ */
+constexpr element_endianess toendianess(std::string_view token)
+{
+    if(token == "big")
+    {
+        return EE_BIG;
+    }
+    if(token == "little")
+    {
+        return EE_LITTLE;
+    }
+    throw std::invalid_argument("wrong format: unexpected endianess token");
+}
+
+/*
+ * name
+ *      tosize
+ *
+ * description
+ *      convert size token to size value
+ *
+ * throws
+ *      wrong format - all and rest are not supported at compile time
+ */
+constexpr std::size_t tosize(std::string_view token)
+{
+    std::size_t size = 0;
+    for(char c : token)
+    {
+        if(!is_digit(c))
+        {
+            throw std::invalid_argument("wrong format: only numeric sizes are supported");
+        }
+        size = size * 10 + (c - '0');
+    }
+    return size;
+}
+
+/*
+ * name
+ *      add_element
+ *
+ * description
+ *      validate element and store it in the result
+ *
+ * throws
+ *      wrong format - element is not int
+ *      wrong format - little endianess requested for incomplete bytes
+ *      size error - size is zero or exceeds 64 bits
+ */
+template <std::size_t N>
+constexpr void add_element(parse_result<N> &result, const element &elem)
+{
+    if(elem.type != ET_INTEGER)
+    {
+        throw std::invalid_argument("wrong format: only int elements are supported");
+    }
+    if(elem.size == 0 || elem.size > 64)
+    {
+        throw std::invalid_argument("size error: int size must be between 1 and 64 bits");
+    }
+    if(elem.size % CHAR_BIT != 0 && elem.endianess == EE_LITTLE)
+    {
+        throw std::invalid_argument("wrong format: little endianess supported for 8 bit bounds only");
+    }
+    if(result.count < N)
+    {
+        result.elements[result.count] = elem;
+    }
+    ++result.count;
+}
+
+/*
+ * name
+ *      parse
+ *
+ * description
+ *      constexpr version of parse_format from lbitstring.c.
+ *      the same state machine with the same state transitions
+ *          SIZE_STATE -> TYPE_STATE -> ENDIANESS_STATE -> SPACE_STATE -> SIZE_STATE
+ *          SIZE_STATE -> TYPE_STATE -> SPACE_STATE -> SIZE_STATE
+ *
+ * paramenters
+ *      format - the format string
+ *
+ * returns
+ *      count of elements and the first N elements
+ */
+template <std::size_t N>
+constexpr parse_result<N> parse(std::string_view format)
+{
+    enum { SIZE_STATE = 1, TYPE_STATE, ENDIANESS_STATE, SPACE_STATE };
+
+    parse_result<N> result = {};
+    element elem = {0, ET_UNDEFINED, EE_DEFAULT};
+    int state = SPACE_STATE;
+    std::size_t token = 0;
+    std::size_t i = 0;
+    while(i < format.size())
+    {
+        char c = format[i];
+        switch(state)
+        {
+            case SIZE_STATE:
+                if(c == ':' && i > token)
+                {
+                    elem.size = tosize(format.substr(token, i - token));
+                    state = TYPE_STATE;
+                    token = i + 1;
+                }
+                else if(!is_digit(c) && !is_alpha(c))
+                {
+                    throw std::invalid_argument("wrong format: not a digit where digit is expected");
+                }
+                break;
+
+            case TYPE_STATE:
+                if(c == ':' && i > token)
+                {
+                    elem.type = totype(format.substr(token, i - token));
+                    state = ENDIANESS_STATE;
+                    token = i + 1;
+                }
+                else if(is_delimiter(c))
+                {
+                    elem.type = totype(format.substr(token, i - token));
+                    add_element(result, elem);
+                    elem = element{0, ET_UNDEFINED, EE_DEFAULT};
+                    state = SPACE_STATE;
+                }
+                else if(!is_alpha(c))
+                {
+                    throw std::invalid_argument("wrong format: not a letter where letter is expected");
+                }
+                break;
+
+            case ENDIANESS_STATE:
+                if(is_delimiter(c))
+                {
+                    elem.endianess = toendianess(format.substr(token, i - token));
+                    add_element(result, elem);
+                    elem = element{0, ET_UNDEFINED, EE_DEFAULT};
+                    state = SPACE_STATE;
+                }
+                else if(!is_alpha(c))
+                {
+                    throw std::invalid_argument("wrong format: not a letter where letter is expected");
+                }
+                break;
+
+            case SPACE_STATE:
+                if(!is_delimiter(c))
+                {
+                    state = SIZE_STATE;
+                    token = i;
+                    continue;
+                }
+                break;
+        }
+        ++i;
+    }
+
+    if(state == SIZE_STATE)
+    {
+        throw std::invalid_argument("wrong format: incomplete format string");
+    }
+    else if(state == TYPE_STATE)
+    {
+        elem.type = totype(format.substr(token));
+        add_element(result, elem);
+    }
+    else if(state == ENDIANESS_STATE)
+    {
+        elem.endianess = toendianess(format.substr(token));
+        add_element(result, elem);
+    }
+    return result;
+}
+
+/*
+ * smallest unsigned integer that holds Size bits
+ */
+template <std::size_t Size>
+using uint_t =
+    std::conditional_t<(Size <= 8), std::uint8_t,
+    std::conditional_t<(Size <= 16), std::uint16_t,
+    std::conditional_t<(Size <= 32), std::uint32_t, std::uint64_t>>>;
+
+template <std::size_t Size>
+constexpr std::uint64_t mask()
+{
+    return Size >= 64 ? ~std::uint64_t(0) : ((std::uint64_t(1) << Size) - 1);
+}
+
+/*
+ * name
+ *      swap_bytes
+ *
+ * description
+ *      reverse the order of Size / CHAR_BIT least significant bytes
+ */
+template <std::size_t Size>
+inline std::uint64_t swap_bytes(std::uint64_t value)
+{
+    std::uint64_t result = 0;
+    for(std::size_t i = 0; i < Size / CHAR_BIT; ++i)
+    {
+        result = (result << CHAR_BIT) | ((value >> (i * CHAR_BIT)) & 0xff);
+    }
+    return result;
+}
+
+/*
+ * name
+ *      read_bits
+ *
+ * description
+ *      read Size bits at bit Offset of buffer
+ *
+ * rationale
+ *      the bytes that hold the element are loaded into a 64 bit
+ *      accumulator. an unaligned 64 bit element spans 9 bytes, in this
+ *      case the bits of the last byte are shifted in separately.
+ *      all offsets and shifts are compile time constants
+ */
+template <std::size_t Offset, std::size_t Size, element_endianess Endianess>
+inline std::uint64_t read_bits(const unsigned char *buffer)
+{
+    constexpr std::size_t first = Offset / CHAR_BIT;
+    constexpr std::size_t count = (Offset + Size - 1) / CHAR_BIT - first + 1;
+    constexpr std::size_t bit_offset = Offset % CHAR_BIT;
+
+    std::uint64_t result = 0;
+    if constexpr(count <= 8)
+    {
+        for(std::size_t i = 0; i < count; ++i)
+        {
+            result = (result << CHAR_BIT) | buffer[first + i];
+        }
+        result >>= count * CHAR_BIT - bit_offset - Size;
+    }
+    else
+    {
+        constexpr std::size_t tail = bit_offset + Size - 64;
+        for(std::size_t i = 0; i < 8; ++i)
+        {
+            result = (result << CHAR_BIT) | buffer[first + i];
+        }
+        result = (result << tail) | (buffer[first + 8] >> (CHAR_BIT - tail));
+    }
+    result &= mask<Size>();
+
+    if constexpr(Endianess == EE_LITTLE)
+    {
+        result = swap_bytes<Size>(result);
+    }
+    return result;
+}
+
+/*
+ * name
+ *      write_bits
+ *
+ * description
+ *      write Size least significant bits of value at bit Offset of buffer.
+ *      the bytes of the element must be zeroed before
+ */
+template <std::size_t Offset, std::size_t Size, element_endianess Endianess>
+inline void write_bits(unsigned char *buffer, std::uint64_t value)
+{
+    constexpr std::size_t first = Offset / CHAR_BIT;
+    constexpr std::size_t last = (Offset + Size - 1) / CHAR_BIT;
+
+    value &= mask<Size>();
+    if constexpr(Endianess == EE_LITTLE)
+    {
+        value = swap_bytes<Size>(value);
+    }
+
+    for(std::size_t i = first; i <= last; ++i)
+    {
+        /* distance between the end of the element and the end of byte i */
+        std::ptrdiff_t shift =
+            static_cast<std::ptrdiff_t>(Offset + Size) - static_cast<std::ptrdiff_t>((i + 1) * CHAR_BIT);
+        if(shift >= 0)
+        {
+            buffer[i] |= static_cast<unsigned char>(value >> shift);
+        }
+        else
+        {
+            buffer[i] |= static_cast<unsigned char>(value << -shift);
+        }
+    }
+}
+
+} // namespace detail
+
+/*
+ * name
+ *      layout
+ *
+ * description
+ *      pack and unpack specialized for a format known at compile time.
+ *      Format must point to a constexpr zero terminated string with
+ *      static storage duration
+ */
+template <const char *Format>
+class layout
+{
+    static constexpr std::string_view format_ = Format;
+    static constexpr std::size_t count_ = detail::parse<0>(format_).count;
+    static_assert(count_ > 0, "wrong format: empty format string");
+    static constexpr detail::parse_result<count_> parsed_ = detail::parse<count_>(format_);
+
+    static constexpr std::array<std::size_t, count_ + 1> offsets()
+    {
+        std::array<std::size_t, count_ + 1> result = {};
+        for(std::size_t i = 0; i < count_; ++i)
+        {
+            result[i + 1] = result[i] + parsed_.elements[i].size;
+        }
+        return result;
+    }
+    static constexpr std::array<std::size_t, count_ + 1> offsets_ = offsets();
+
+    template <std::size_t I>
+    using value_t = detail::uint_t<parsed_.elements[I].size>;
+
+    template <typename Indexes>
+    struct tuple_of;
+
+    template <std::size_t... I>
+    struct tuple_of<std::index_sequence<I...>>
+    {
+        using type = std::tuple<value_t<I>...>;
+    };
+
+public:
+    /* number of elements */
+    static constexpr std::size_t count = count_;
+    /* number of bits packed or unpacked by the layout */
+    static constexpr std::size_t bits = offsets_[count_];
+    /* number of bytes packed or unpacked by the layout */
+    static constexpr std::size_t bytes = (bits + CHAR_BIT - 1) / CHAR_BIT;
+
+    /* the unpacked values */
+    using tuple_type = typename tuple_of<std::make_index_sequence<count_>>::type;
+
+    /*
+     * name
+     *      unpack
+     *
+     * description
+     *      unpack elements from buffer
+     *
+     * throws
+     *      size error - buffer is shorter then the layout
+     */
+    static tuple_type unpack(const unsigned char *buffer, std::size_t buffer_len)
+    {
+        if(buffer_len < bytes)
+        {
+            throw std::length_error("size error: buffer is shorter then the layout");
+        }
+        return unpack_elements(buffer, std::make_index_sequence<count_>());
+    }
+
+    template <std::size_t N>
+    static tuple_type unpack(const std::array<unsigned char, N> &buffer)
+    {
+        static_assert(N >= bytes, "size error: buffer is shorter then the layout");
+        return unpack_elements(buffer.data(), std::make_index_sequence<count_>());
+    }
+
+    /*
+     * name
+     *      pack_into
+     *
+     * description
+     *      pack values into buffer. bytes that are not covered by the layout
+     *      are not modified
+     *
+     * returns
+     *      number of packed bits
+     *
+     * throws
+     *      size error - buffer is shorter then the layout
+     */
+    template <typename... Values>
+    static std::size_t pack_into(unsigned char *buffer, std::size_t buffer_len, Values... values)
+    {
+        static_assert(sizeof...(Values) == count_, "wrong number of values for the layout");
+        if(buffer_len < bytes)
+        {
+            throw std::length_error("size error: buffer is shorter then the layout");
+        }
+        std::memset(buffer, 0, bytes);
+        pack_elements(buffer, std::make_index_sequence<count_>(), static_cast<std::uint64_t>(values)...);
+        return bits;
+    }
+
+    /*
+     * name
+     *      pack
+     *
+     * description
+     *      pack values into a new array
+     */
+    template <typename... Values>
+    static std::array<unsigned char, bytes> pack(Values... values)
+    {
+        static_assert(sizeof...(Values) == count_, "wrong number of values for the layout");
+        std::array<unsigned char, bytes> result = {};
+        pack_elements(result.data(), std::make_index_sequence<count_>(), static_cast<std::uint64_t>(values)...);
+        return result;
+    }
+
+private:
+    template <std::size_t... I>
+    static tuple_type unpack_elements(const unsigned char *buffer, std::index_sequence<I...>)
+    {
+        return tuple_type(
+                static_cast<value_t<I>>(
+                    detail::read_bits<offsets_[I], parsed_.elements[I].size, parsed_.elements[I].endianess>(buffer))...);
+    }
+
+    template <std::size_t... I, typename... Values>
+    static void pack_elements(unsigned char *buffer, std::index_sequence<I...>, Values... values)
+    {
+        (detail::write_bits<offsets_[I], parsed_.elements[I].size, parsed_.elements[I].endianess>(buffer, values), ...);
+    }
+};
+
+} // namespace bitstring
+
+#endif // BITSTRING_HPP
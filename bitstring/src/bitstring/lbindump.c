@@ -108,6 +108,7 @@ static int l_bindump(lua_State *l)
 {
     size_t len = 0;
     const unsigned char *input = get_substring(l, &len, 1, 2, 3);
+    PROBE_ENTRY(dump, "bindump", len);
 
     luaL_Buffer b; 
     luaL_buffinit(l, &b);
@@ -150,6 +151,7 @@ static int l_bindump(lua_State *l)
         luaL_addsize(&b, column);
     }
     luaL_pushresult(&b);
+    PROBE_RETURN(dump, "bindump", 0, len, lua_objlen(l, -1), 0);
     return 1;
 }
 
@@ -157,6 +159,7 @@ static int l_binstream(lua_State *l)
 {
     size_t len = 0;
     const unsigned char *input = get_substring(l, &len, 1, 2, 3);
+    PROBE_ENTRY(dump, "binstream", len);
 
     luaL_Buffer b; 
     luaL_buffinit(l, &b);
@@ -175,6 +178,7 @@ static int l_binstream(lua_State *l)
         luaL_addsize(&b, column);
     }
     luaL_pushresult(&b);
+    PROBE_RETURN(dump, "binstream", 0, len, lua_objlen(l, -1), 0);
     return 1;
 }
 
@@ -182,6 +186,7 @@ static int l_frombinstream(lua_State *l)
 {
     size_t len = 0;
     const unsigned char *input = get_substring(l, &len, 1, 2, 3);
+    PROBE_ENTRY(dump, "frombinstream", len);
 
     luaL_Buffer b; 
     luaL_buffinit(l, &b);
@@ -213,6 +218,7 @@ static int l_frombinstream(lua_State *l)
         luaL_addsize(&b, current_byte - result);
     }
     luaL_pushresult(&b);
+    PROBE_RETURN(dump, "frombinstream", 0, len, lua_objlen(l, -1), 0);
     return 1;
 }
 
@@ -0,0 +1,754 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * operations on bits of whole strings.
+ * bit offsets are counted from 0, starting at the most significant bit 
+ * of the first byte, as in pack and unpack.
+ */
+
+#define BITS_WORD_BITS 64
+
+/* a short mask is repeated up to this many bytes so it is applied by words */
+#define BITS_MASK_BLOCK 256
+
+typedef enum
+{
+    BO_AND,
+    BO_OR,
+    BO_XOR,
+    BO_NOT,
+} BITWISE_OPERATION;
+
+/*
+ * writes bytes offset .. offset + len - 1 of a result into output
+ */
+typedef void (*FILL_OUTPUT)(unsigned char *output, size_t offset, size_t len, void *arg);
+
+typedef struct
+{
+    BITWISE_OPERATION operation;
+    const unsigned char *a;
+    const unsigned char *mask;
+    size_t mask_len;
+} BITWISE_STATE;
+
+typedef struct
+{
+    const unsigned char *input;
+    size_t len;
+    size_t first_bit;
+    size_t count_bits;
+} SUBBITS_STATE;
+
+typedef struct
+{
+    const unsigned char *input;
+    size_t len;
+    lua_Integer shift;
+} SHIFT_STATE;
+
+/*
+ * name
+ *      popcount64
+ *
+ * returns
+ *      number of set bits in value
+ */
+static int popcount64(uint64_t value)
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(value);
+#else
+    value = value - ((value >> 1) & 0x5555555555555555ull);
+    value = (value & 0x3333333333333333ull) + ((value >> 2) & 0x3333333333333333ull);
+    value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (int)((value * 0x0101010101010101ull) >> 56);
+#endif // __GNUC__
+}
+
+/*
+ * name
+ *      load_word
+ *
+ * description
+ *      read 8 bytes at byte offset as big endian word. bytes after the
+ *      end of input are read as zeros
+ */
+static uint64_t load_word(const unsigned char *input, size_t len, size_t offset)
+{
+    uint64_t word = 0;
+    size_t i;
+    if(offset + sizeof(uint64_t) <= len)
+    {
+        for(i = 0; i < sizeof(uint64_t); ++i)
+        {
+            word = (word << CHAR_BIT) | input[offset + i];
+        }
+        return word;
+    }
+
+    for(i = 0; i < sizeof(uint64_t); ++i)
+    {
+        word = (word << CHAR_BIT) | (offset + i < len ? input[offset + i] : 0);
+    }
+    return word;
+}
+
+/*
+ * name
+ *      check_pattern
+ *
+ * description
+ *      get pattern of pattern_bits bits from number or string argument
+ *
+ * returns
+ *      the pattern in the least significant bits
+ *
+ * throws
+ *      bad argument - pattern_bits is not in 1..64 or pattern is too short
+ */
+static uint64_t check_pattern(lua_State *l, int pattern_param, size_t pattern_bits)
+{
+    if(lua_type(l, pattern_param) == LUA_TSTRING)
+    {
+        size_t pattern_len = 0;
+        const unsigned char *pattern = (const unsigned char *)lua_tolstring(l, pattern_param, &pattern_len);
+        if(pattern_len * CHAR_BIT < pattern_bits)
+        {
+            luaL_argerror(l, pattern_param, "pattern is shorter than pattern_bits");
+        }
+        return load_word(pattern, pattern_len, 0) >> (BITS_WORD_BITS - pattern_bits);
+    }
+
+    if(pattern_bits > sizeof(lua_Integer) * CHAR_BIT)
+    {
+        luaL_argerror(l, pattern_param, "pattern_bits exceeds lua_Integer size, use string pattern");
+    }
+    uint64_t pattern = (uint64_t)luaL_checkinteger(l, pattern_param);
+    if(pattern_bits < BITS_WORD_BITS)
+    {
+        pattern &= (1ull << pattern_bits) - 1;
+    }
+    return pattern;
+}
+
+/*
+ * name
+ *      l_findbits
+ *
+ * description
+ *      lua_CFunction for finding a bit pattern at any bit offset.
+ *      the input is scanned byte by byte with a sliding window of 64 bits 
+ *      and the next byte. the 8 candidates at bit offsets of each byte are 
+ *      compared with the pattern by xor and popcount
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - input string or bitstring.buffer
+ *          2 - pattern. number or string. bits of string are taken from
+ *              the most significant bit of the first byte
+ *          3 - pattern_bits. size of the pattern in bits 1..64
+ *          4 - optional bit offset to start the search from. default 0
+ *          5 - optional number of mismatching bits allowed. default 0
+ *
+ * returns
+ *      bit offset of the first match and number of mismatching bits
+ *      or nil if the pattern is not found
+ */
+static int l_findbits(lua_State *l)
+{
+    size_t len = 0;
+    const unsigned char *input = check_bytes(l, 1, &len);
+    lua_Integer pattern_bits = luaL_checkinteger(l, 3);
+    luaL_argcheck(l, pattern_bits >= 1 && pattern_bits <= BITS_WORD_BITS, 3, "pattern_bits must be 1..64");
+    uint64_t pattern = check_pattern(l, 2, (size_t)pattern_bits);
+    lua_Integer start_bit = luaL_optinteger(l, 4, 0);
+    luaL_argcheck(l, start_bit >= 0, 4, "negative start_bit");
+    lua_Integer max_errors = luaL_optinteger(l, 5, 0);
+    luaL_argcheck(l, max_errors >= 0, 5, "negative max_errors");
+
+    size_t total_bits = len * CHAR_BIT;
+    if((size_t)start_bit + (size_t)pattern_bits > total_bits)
+    {
+        lua_pushnil(l);
+        return 1;
+    }
+
+    /* last bit offset where the pattern fits */
+    size_t last_bit = total_bits - (size_t)pattern_bits;
+    int shift = BITS_WORD_BITS - (int)pattern_bits;
+    size_t offset = (size_t)start_bit / CHAR_BIT;
+    int k = (int)((size_t)start_bit % CHAR_BIT);
+    uint64_t window = load_word(input, len, offset);
+    for(; offset * CHAR_BIT <= last_bit; ++offset, k = 0)
+    {
+        size_t next_offset = offset + sizeof(uint64_t);
+        unsigned char next = next_offset < len ? input[next_offset] : 0;
+        for(; k < CHAR_BIT; ++k)
+        {
+            size_t bit = offset * CHAR_BIT + k;
+            if(bit > last_bit)
+            {
+                break;
+            }
+            uint64_t candidate = k == 0 ? window : (window << k) | (next >> (CHAR_BIT - k));
+            int errors = popcount64((candidate >> shift) ^ pattern);
+            if(errors <= max_errors)
+            {
+                lua_pushinteger(l, (lua_Integer)bit);
+                lua_pushinteger(l, errors);
+                return 2;
+            }
+        }
+        window = (window << CHAR_BIT) | next;
+    }
+    lua_pushnil(l);
+    return 1;
+}
+
+/*
+ * name
+ *      bitwise_words
+ *
+ * description
+ *      apply operation to len bytes of a and b, 8 bytes at a time.
+ *      output may be the same memory as a or b
+ */
+static void bitwise_words(
+        BITWISE_OPERATION operation,
+        unsigned char *output,
+        const unsigned char *a,
+        const unsigned char *b,
+        size_t len)
+{
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t x = 0;
+        uint64_t y = 0;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        switch(operation)
+        {
+            case BO_AND:
+                x &= y;
+                break;
+            case BO_OR:
+                x |= y;
+                break;
+            case BO_XOR:
+                x ^= y;
+                break;
+            case BO_NOT:
+                x = ~x;
+                break;
+        }
+        memcpy(output + i, &x, sizeof(x));
+    }
+    for(; i < len; ++i)
+    {
+        switch(operation)
+        {
+            case BO_AND:
+                output[i] = a[i] & b[i];
+                break;
+            case BO_OR:
+                output[i] = a[i] | b[i];
+                break;
+            case BO_XOR:
+                output[i] = a[i] ^ b[i];
+                break;
+            case BO_NOT:
+                output[i] = (unsigned char)~a[i];
+                break;
+        }
+    }
+}
+
+/*
+ * name
+ *      push_result
+ *
+ * description
+ *      push result string of len bytes. the bytes are written by fill
+ *      directly into a luaL_Buffer, LUAL_BUFFERSIZE bytes at a time
+ *
+ * paramenters
+ *      l - lua state
+ *      len - length of the result
+ *      fill - writes the bytes of the result
+ *      arg - argument of fill
+ *
+ * returns
+ *      number of pushed values
+ *
+ * rationale
+ *      a temporary userdata that is copied into the string costs a 
+ *      second allocation and copy on every call
+ */
+static int push_result(lua_State *l, size_t len, FILL_OUTPUT fill, void *arg)
+{
+    luaL_Buffer b;
+    luaL_buffinit(l, &b);
+    size_t offset = 0;
+    while(offset < len)
+    {
+        size_t chunk = len - offset < LUAL_BUFFERSIZE ? len - offset : LUAL_BUFFERSIZE;
+        fill((unsigned char *)luaL_prepbuffer(&b), offset, chunk, arg);
+        luaL_addsize(&b, chunk);
+        offset += chunk;
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/*
+ * name
+ *      fill_bitwise
+ *
+ * description
+ *      FILL_OUTPUT of bitwise. the mask is repeated from its start at 
+ *      every mask_len bytes of the input
+ */
+static void fill_bitwise(unsigned char *output, size_t offset, size_t len, void *arg)
+{
+    BITWISE_STATE *state = (BITWISE_STATE *)arg;
+    size_t done = 0;
+    while(done < len)
+    {
+        size_t mask_offset = (offset + done) % state->mask_len;
+        size_t chunk = state->mask_len - mask_offset;
+        if(chunk > len - done)
+        {
+            chunk = len - done;
+        }
+        bitwise_words(state->operation, output + done, state->a + offset + done, 
+                state->mask + mask_offset, chunk);
+        done += chunk;
+    }
+}
+
+/*
+ * name
+ *      bitwise
+ *
+ * description
+ *      common implementation of band, bor, bxor and bnot
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - string or bitstring.buffer
+ *          2 - mask. string or bitstring.buffer. a mask shorter than
+ *              the first argument is repeated. not used by bnot
+ *          3 - optional bitstring.buffer that receives the result.
+ *              may be the first argument
+ *      operation - the operation
+ *
+ * returns
+ *      the result string or the output buffer
+ *
+ * throws
+ *      argument error
+ */
+static int bitwise(lua_State *l, BITWISE_OPERATION operation)
+{
+    int output_param = operation == BO_NOT ? 2 : 3;
+    size_t len = 0;
+    check_bytes(l, 1, &len);
+    size_t mask_len = 0;
+    if(operation != BO_NOT)
+    {
+        check_bytes(l, 2, &mask_len);
+        luaL_argcheck(l, mask_len > 0, 2, "empty mask");
+    }
+
+    BUFFER *output_buffer = NULL;
+    if(!lua_isnoneornil(l, output_param))
+    {
+        output_buffer = check_buffer(l, output_param);
+        luaL_argcheck(l, operation == BO_NOT || 
+                !lua_rawequal(l, 2, output_param) || 
+                mask_len == len, output_param, "output buffer is a mask of different length");
+        resize_buffer(l, output_buffer, len);
+    }
+
+    /* resize may have moved the bytes of the arguments */
+    BITWISE_STATE state;
+    state.operation = operation;
+    state.a = check_bytes(l, 1, &len);
+    state.mask = state.a;
+    state.mask_len = len;
+    if(operation != BO_NOT)
+    {
+        state.mask = check_bytes(l, 2, &state.mask_len);
+    }
+
+    /* repeat a short mask so that whole words are processed */
+    unsigned char block[BITS_MASK_BLOCK];
+    if(state.mask_len < len && state.mask_len < BITS_MASK_BLOCK / 2)
+    {
+        size_t block_len = (BITS_MASK_BLOCK / state.mask_len) * state.mask_len;
+        size_t j = 0;
+        for(j = 0; j < block_len; j += state.mask_len)
+        {
+            memcpy(block + j, state.mask, state.mask_len);
+        }
+        state.mask = block;
+        state.mask_len = block_len;
+    }
+
+    if(output_buffer == NULL)
+    {
+        return push_result(l, len, fill_bitwise, &state);
+    }
+    if(len != 0)
+    {
+        fill_bitwise(output_buffer->data, 0, len, &state);
+    }
+    lua_pushvalue(l, output_param);
+    return 1;
+}
+
+/*
+ * name
+ *      l_band, l_bor, l_bxor
+ *
+ * description
+ *      lua_CFunction. bitwise and, or, xor of two byte strings.
+ *      see bitwise for the parameters
+ */
+static int l_band(lua_State *l)
+{
+    return bitwise(l, BO_AND);
+}
+
+static int l_bor(lua_State *l)
+{
+    return bitwise(l, BO_OR);
+}
+
+static int l_bxor(lua_State *l)
+{
+    return bitwise(l, BO_XOR);
+}
+
+/*
+ * name
+ *      l_bnot
+ *
+ * description
+ *      lua_CFunction. bitwise not of byte string
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - string or bitstring.buffer
+ *          2 - optional bitstring.buffer that receives the result
+ *
+ * returns
+ *      the result string or the output buffer
+ */
+static int l_bnot(lua_State *l)
+{
+    return bitwise(l, BO_NOT);
+}
+
+/*
+ * name
+ *      count_bits
+ *
+ * returns
+ *      number of set bits in len bytes
+ */
+static size_t count_bits(const unsigned char *input, size_t len)
+{
+    size_t count = 0;
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t word = 0;
+        memcpy(&word, input + i, sizeof(word));
+        count += popcount64(word);
+    }
+    for(; i < len; ++i)
+    {
+        count += popcount64(input[i]);
+    }
+    return count;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/*
+ * name
+ *      count_bits_popcnt
+ *
+ * description
+ *      count_bits compiled for the popcnt instruction
+ */
+__attribute__((target("popcnt")))
+static size_t count_bits_popcnt(const unsigned char *input, size_t len)
+{
+    size_t count = 0;
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t word = 0;
+        memcpy(&word, input + i, sizeof(word));
+        count += __builtin_popcountll(word);
+    }
+    for(; i < len; ++i)
+    {
+        count += __builtin_popcount(input[i]);
+    }
+    return count;
+}
+#endif // defined(__GNUC__) && defined(__x86_64__)
+
+/*
+ * name
+ *      l_popcount
+ *
+ * description
+ *      lua_CFunction that counts set bits
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - string or bitstring.buffer
+ *          2, 3 - optional start and end positions as in get_substring
+ *
+ * returns
+ *      number of set bits
+ */
+static int l_popcount(lua_State *l)
+{
+    size_t len = 0;
+    const unsigned char *input = get_substring(l, &len, 1, 2, 3);
+#if defined(__GNUC__) && defined(__x86_64__)
+    if(__builtin_cpu_supports("popcnt"))
+    {
+        lua_pushinteger(l, (lua_Integer)count_bits_popcnt(input, len));
+        return 1;
+    }
+#endif // defined(__GNUC__) && defined(__x86_64__)
+    lua_pushinteger(l, (lua_Integer)count_bits(input, len));
+    return 1;
+}
+
+/*
+ * name
+ *      push_bits_result
+ *
+ * description
+ *      push result of subbits and shift as a new string or write it into
+ *      the output buffer. if the output buffer is the source, the source
+ *      is copied first, so the result can be written over it
+ *
+ * paramenters
+ *      l - lua state
+ *      source_param - location of source argument
+ *      output_param - location of optional output buffer argument
+ *      len - size of the result in bytes
+ *      fill - writes the bytes of the result
+ *      arg - argument of fill
+ *      source - in/out parameter. bytes of the source that fill reads
+ *      source_len - length of the source
+ *
+ * returns
+ *      number of pushed values
+ */
+static int push_bits_result(
+        lua_State *l, 
+        int source_param, 
+        int output_param, 
+        size_t len, 
+        FILL_OUTPUT fill, 
+        void *arg,
+        const unsigned char **source,
+        size_t source_len)
+{
+    if(lua_isnoneornil(l, output_param))
+    {
+        return push_result(l, len, fill, arg);
+    }
+
+    BUFFER *output = check_buffer(l, output_param);
+    if(lua_rawequal(l, source_param, output_param))
+    {
+        unsigned char *copy = (unsigned char *)lua_newuserdata(l, source_len);
+        memcpy(copy, *source, source_len);
+        *source = copy;
+    }
+    resize_buffer(l, output, len);
+    if(len != 0)
+    {
+        fill(output->data, 0, len, arg);
+    }
+    lua_pushvalue(l, output_param);
+    return 1;
+}
+
+/*
+ * name
+ *      fill_subbits
+ *
+ * description
+ *      FILL_OUTPUT of subbits
+ */
+static void fill_subbits(unsigned char *output, size_t offset, size_t len, void *arg)
+{
+    SUBBITS_STATE *state = (SUBBITS_STATE *)arg;
+    size_t first_bit = offset * CHAR_BIT;
+    size_t count_bits = state->count_bits - first_bit;
+    if(count_bits > len * CHAR_BIT)
+    {
+        count_bits = len * CHAR_BIT;
+    }
+    copy_bits(output, state->input, state->len, state->first_bit + first_bit, count_bits);
+}
+
+/*
+ * name
+ *      fill_shift
+ *
+ * description
+ *      FILL_OUTPUT of shift
+ */
+static void fill_shift(unsigned char *output, size_t offset, size_t len, void *arg)
+{
+    SHIFT_STATE *state = (SHIFT_STATE *)arg;
+    size_t total_bits = state->len * CHAR_BIT;
+    size_t count = (size_t)(state->shift < 0 ? -state->shift : state->shift);
+    if(count >= total_bits)
+    {
+        memset(output, 0, len);
+    }
+    else if(state->shift >= 0)
+    {
+        /* bits count .. total_bits - 1 followed by zero bits */
+        size_t first_bit = offset * CHAR_BIT;
+        size_t count_bits = 0;
+        if(first_bit < total_bits - count)
+        {
+            count_bits = total_bits - count - first_bit;
+            if(count_bits > len * CHAR_BIT)
+            {
+                count_bits = len * CHAR_BIT;
+            }
+            copy_bits(output, state->input, state->len, count + first_bit, count_bits);
+        }
+        size_t count_bytes = bits_to_bytes(count_bits);
+        memset(output + count_bytes, 0, len - count_bytes);
+    }
+    else
+    {
+        /* output byte skip + 1 + i takes the bits of input bytes i and i + 1 */
+        size_t skip = count / CHAR_BIT;
+        size_t right_shift = count % CHAR_BIT;
+        size_t i = offset;
+        for(; i < offset + len && i <= skip; ++i)
+        {
+            output[i - offset] = i < skip ? 0 : (unsigned char)(state->input[0] >> right_shift);
+        }
+        if(i < offset + len)
+        {
+            copy_bits(output + i - offset, state->input, state->len, 
+                    CHAR_BIT - right_shift + (i - skip - 1) * CHAR_BIT, 
+                    (offset + len - i) * CHAR_BIT);
+        }
+    }
+}
+
+/*
+ * name
+ *      l_subbits
+ *
+ * description
+ *      lua_CFunction that extracts bits at arbitrary bit offset as byte
+ *      aligned string. unused bits of the last byte are zero
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - string or bitstring.buffer
+ *          2 - bit offset of the first bit
+ *          3 - number of bits
+ *          4 - optional bitstring.buffer that receives the result.
+ *              may be the first argument
+ *
+ * returns
+ *      the result string or the output buffer
+ *
+ * throws
+ *      size error - the bits exceed the input
+ */
+static int l_subbits(lua_State *l)
+{
+    size_t len = 0;
+    check_bytes(l, 1, &len);
+    lua_Integer first_bit = luaL_checkinteger(l, 2);
+    luaL_argcheck(l, first_bit >= 0, 2, "negative first_bit");
+    lua_Integer count_bits = luaL_checkinteger(l, 3);
+    luaL_argcheck(l, count_bits >= 0, 3, "negative number of bits");
+    if((size_t)first_bit > len * CHAR_BIT || (size_t)count_bits > len * CHAR_BIT - (size_t)first_bit)
+    {
+        luaL_error(l, "size error: bits %d..%d exceed the input (%d bits)", 
+                (int)first_bit, (int)(first_bit + count_bits), (int)(len * CHAR_BIT));
+    }
+
+    SUBBITS_STATE state;
+    state.input = check_bytes(l, 1, &state.len);
+    state.first_bit = (size_t)first_bit;
+    state.count_bits = (size_t)count_bits;
+    return push_bits_result(l, 1, 4, bits_to_bytes(state.count_bits), fill_subbits, &state,
+            &state.input, state.len);
+}
+
+/*
+ * name
+ *      l_shift
+ *
+ * description
+ *      lua_CFunction that shifts all bits of a string. vacated bits are 
+ *      zero and the length does not change
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - string or bitstring.buffer
+ *          2 - number of bits. positive shifts towards the first byte
+ *              (left), negative towards the last byte (right)
+ *          3 - optional bitstring.buffer that receives the result.
+ *              may be the first argument
+ *
+ * returns
+ *      the result string or the output buffer
+ */
+static int l_shift(lua_State *l)
+{
+    SHIFT_STATE state;
+    state.input = check_bytes(l, 1, &state.len);
+    state.shift = luaL_checkinteger(l, 2);
+    return push_bits_result(l, 1, 3, state.len, fill_shift, &state, &state.input, state.len);
+}
@@ -36,6 +36,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -50,6 +51,7 @@ extern "C"
 
 #include <stdint.h>
 
+#include "bitstring/bitstring.h"
 
 
 #ifdef WIN32
@@ -67,6 +69,13 @@ typedef enum
     ET_BINARY,
     /* floating point number of up to sizeof(lua_Number) * CHAR_BIT bits */
     ET_FLOAT,
+    /* variable length integers. see lvarint.c */
+    ET_ULEB128,
+    ET_SLEB128,
+    ET_QUIC,
+    ET_BERLEN,
+    ET_UE,
+    ET_SE,
 } ELEMENT_TYPE;
 
 /* 
@@ -78,6 +87,12 @@ static const char *TYPES[] =
     "int",
     "bin",
     "float",
+    "uleb128",
+    "sleb128",
+    "quic",
+    "berlen",
+    "ue",
+    "se",
     NULL
 };
 
@@ -105,6 +120,42 @@ static const char *ENDIANESSES[] =
     NULL
 };
 
+/*
+ * errors returned by bitstring.tryunpack and bitstring.trypack 
+ * instead of raising them. see ltry.c
+ */
+typedef enum
+{
+    TE_NONE = 0,
+    /* element does not fit the rest of input */
+    TE_SIZE,
+    /* input does not match constant value */
+    TE_VALUE,
+    /* rest length specifier for incomplete bytes */
+    TE_ALIGN,
+    /* substring positions are out of bounds of the input */
+    TE_POSITION,
+    /* argument of pack has wrong type */
+    TE_TYPE,
+    /* argument of pack is out of range of the element */
+    TE_RANGE,
+} TRY_ERROR;
+
+/*
+ * error codes
+ */
+static const char *TRY_ERRORS[] =
+{
+    "none",
+    "size",
+    "value",
+    "align",
+    "position",
+    "type",
+    "range",
+    NULL
+};
+
 /*
  * all size token
  * when all is specified as size all the binary string parameter should be packed
@@ -121,11 +172,25 @@ static const int ALL = -1;
 static const char *REST_SPECIFIER = "rest";
 static const int REST = -2;
 
+/*
+ * var size token
+ * the size of variable length integer types is taken from the encoded value
+ * may be specified with variable length integer types only
+ */
+static const char *VAR_SPECIFIER = "var";
+static const int VAR = -3;
+
 /*
  * delimit element parts 
  */
 static const char PART_DELIMITER = ':';
 
+/*
+ * delimit constant value of the element
+ * 8:int=0x01
+ */
+static const char VALUE_DELIMITER = '=';
+
 /*
  * delimit elements
  */
@@ -139,6 +204,7 @@ typedef enum
     SIZE_STATE = 1,
     TYPE_STATE,
     ENDIANESS_STATE,
+    VALUE_STATE,
     SPACE_STATE,
 } PARSE_STATE;
 
@@ -152,6 +218,21 @@ typedef struct
     size_t size;
     ELEMENT_TYPE type;
     ELEMENT_ENDIANESS endianess;
+    /* 
+     * set by bitstring.project for elements that are not selected. 
+     * unpack checks and skips them without creating a value. 
+     * skipped fixed size elements are merged into one element of 
+     * ET_UNDEFINED type and size in bits 
+     */
+    int skip;
+    /* 
+     * set for int elements with constant value (8:int=0x01). 
+     * pack emits the value without consuming an argument, 
+     * unpack checks the value without creating it. 
+     * the value is stored masked to size bits 
+     */
+    int constant;
+    lua_Integer value;
 } ELEMENT_DESCRIPTION;
 
 /*
@@ -167,6 +248,8 @@ typedef struct
     size_t current_bit;
     /* space in bits in the temporary prep_buffer */
     size_t result_bits;
+    /* number of constant elements packed so far. they do not consume arguments */
+    int constant_count;
 } PACK_STATE;
 
 /*
@@ -198,6 +281,224 @@ typedef struct
     ELEMENT_DESCRIPTION elements[1];
 } BITMATCH;
 
+/*
+ * bitstring.bitmatch userdata. the bitmatch is immutable and shared 
+ * by all lua states of the process. see lplans.c
+ */
+typedef struct
+{
+    BITMATCH *bitmatch;
+} BITMATCH_HANDLE;
+
+#ifdef BITSTRING_STATS
+/*
+ * counters of calls with a shared bitmatch or with format strings.
+ * kept when configured with --enable-stats. see lstats.c
+ */
+typedef struct
+{
+    uint64_t calls;
+    /* calls that raised an error or returned a try error */
+    uint64_t errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    /* time of calls that succeeded */
+    uint64_t nanoseconds;
+    /* strings and userdata created by calls that succeeded */
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+} STATS_COUNTERS;
+
+/*
+ * counted call in progress
+ */
+typedef struct
+{
+    STATS_COUNTERS *counters;
+    uint64_t start;
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+} STATS_CALL;
+
+static void stats_begin(lua_State *l, STATS_CALL *call);
+static void stats_end(STATS_CALL *call, size_t bytes_in, size_t bytes_out);
+static void stats_alloc(size_t bytes);
+
+#define STATS_BEGIN(l) STATS_CALL stats_call; stats_begin(l, &stats_call)
+#define STATS_END(bytes_in, bytes_out) stats_end(&stats_call, bytes_in, bytes_out)
+#define STATS_ALLOC(bytes) stats_alloc(bytes)
+#else
+#define STATS_BEGIN(l)
+#define STATS_END(bytes_in, bytes_out)
+#define STATS_ALLOC(bytes)
+#endif // BITSTRING_STATS
+
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+/*
+ * USDT probes of the bitstring provider. a probe is a nop until a tracer
+ * attaches to it. entry probes get the layout and the input length.
+ * return probes get the layout, number of elements, input and output 
+ * length and error code. the layout is the format string or the 
+ * bitstring.bitmatch userdata.
+ * every probe has a semaphore that the tracer increments when it 
+ * attaches, and the arguments are evaluated only when it is set. while
+ * a return probe is enabled, PROBE_PROTECT runs the call in protected 
+ * mode, so the probe fires with an error code before a lua error is 
+ * raised again
+ */
+#define PROBE_SEMAPHORE(name) \
+    __extension__ unsigned short bitstring_##name##_semaphore \
+    __attribute__((unused)) __attribute__((section(".probes"))) __attribute__((visibility("hidden")))
+
+PROBE_SEMAPHORE(pack__entry);
+PROBE_SEMAPHORE(pack__return);
+PROBE_SEMAPHORE(unpack__entry);
+PROBE_SEMAPHORE(unpack__return);
+PROBE_SEMAPHORE(compile__entry);
+PROBE_SEMAPHORE(compile__return);
+PROBE_SEMAPHORE(dump__entry);
+PROBE_SEMAPHORE(dump__return);
+
+#define PROBE_ENABLED(name) __builtin_expect(bitstring_##name##_semaphore != 0, 0)
+#define PROBE_ENTRY(name, layout, input_len) \
+    do \
+    { \
+        if(PROBE_ENABLED(name##__entry)) \
+        { \
+            DTRACE_PROBE2(bitstring, name##__entry, layout, (size_t)(input_len)); \
+        } \
+    } while(0)
+#define PROBE_RETURN(name, layout, element_count, input_len, output_len, error) \
+    do \
+    { \
+        if(PROBE_ENABLED(name##__return)) \
+        { \
+            DTRACE_PROBE5(bitstring, name##__return, layout, (size_t)(element_count), \
+                    (size_t)(input_len), (size_t)(output_len), (int)(error)); \
+        } \
+    } while(0)
+
+/*
+ * name
+ *      probe_layout
+ *
+ * returns
+ *      format string or bitmatch userdata of the call for probes
+ */
+static const void *probe_layout(lua_State *l)
+{
+    int type = lua_type(l, 1);
+    return type == LUA_TUSERDATA ? lua_touserdata(l, 1) : type == LUA_TSTRING ? (const void *)lua_tostring(l, 1) : NULL;
+}
+
+/*
+ * name
+ *      probe_element_count
+ *
+ * returns
+ *      number of elements of the bitmatch, 0 for format strings. the 
+ *      first argument must be checked by parse before
+ */
+static size_t probe_element_count(lua_State *l)
+{
+    return lua_type(l, 1) == LUA_TUSERDATA ? ((BITMATCH_HANDLE *)lua_touserdata(l, 1))->bitmatch->element_count : 0;
+}
+
+/* error code of return probes for lua errors without a try error code */
+#define PROBE_RAISED (-1)
+
+/* set while PROBE_PROTECT calls the function that it protects */
+static __thread int PROBE_PROTECTED;
+
+/*
+ * name
+ *      probe_error
+ *
+ * returns
+ *      try error code of the lua error message on top of the stack, or
+ *      PROBE_RAISED
+ */
+static int probe_error(lua_State *l)
+{
+    static const struct
+    {
+        const char *prefix;
+        TRY_ERROR error;
+    } ERRORS[] = 
+    {
+        {"size error", TE_SIZE},
+        {"match error", TE_VALUE},
+        {"invalid parameter", TE_POSITION},
+        {"bad argument", TE_TYPE},
+    };
+    const char *message = lua_tostring(l, -1);
+    size_t i;
+    for(i = 0; message != NULL && i < sizeof(ERRORS) / sizeof(ERRORS[0]); ++i)
+    {
+        if(strncmp(message, ERRORS[i].prefix, strlen(ERRORS[i].prefix)) == 0)
+        {
+            return ERRORS[i].error;
+        }
+    }
+    return PROBE_RAISED;
+}
+
+/*
+ * name
+ *      probe_pcall
+ *
+ * description
+ *      call function with copies of the arguments in protected mode. the
+ *      arguments stay below the results or the error message
+ *
+ * returns
+ *      number of results or -1 when the function raised an error
+ */
+static int probe_pcall(lua_State *l, lua_CFunction function)
+{
+    int top = lua_gettop(l);
+    luaL_checkstack(l, top + 1, "too many arguments");
+    lua_pushcfunction(l, function);
+    int i;
+    for(i = 1; i <= top; ++i)
+    {
+        lua_pushvalue(l, i);
+    }
+    PROBE_PROTECTED = 1;
+    int error = lua_pcall(l, top, LUA_MULTRET, 0);
+    PROBE_PROTECTED = 0;
+    return error != 0 ? -1 : lua_gettop(l) - top;
+}
+
+/*
+ * run the lua_CFunction function again in protected mode while the return
+ * probe is enabled and fire the probe when it raises an error. calls that
+ * are made by the protected function are protected again
+ */
+#define PROBE_PROTECT(name, function) \
+    do \
+    { \
+        if(PROBE_ENABLED(name##__return) && !PROBE_PROTECTED) \
+        { \
+            int result_count = probe_pcall(l, function); \
+            if(result_count < 0) \
+            { \
+                DTRACE_PROBE5(bitstring, name##__return, probe_layout(l), (size_t)0, \
+                        (size_t)0, (size_t)0, probe_error(l)); \
+                lua_error(l); \
+            } \
+            return result_count; \
+        } \
+        PROBE_PROTECTED = 0; \
+    } while(0)
+#else
+#define PROBE_ENTRY(name, layout, input_len)
+#define PROBE_RETURN(name, layout, element_count, input_len, output_len, error)
+#define PROBE_PROTECT(name, function)
+#endif // HAVE_SYS_SDT_H
+
 /*
  * compile state passed between handler function invocations */
 typedef struct
@@ -217,6 +518,16 @@ typedef struct
 typedef void (*ELEM_HANDLER)(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, void *arg);
 
 static BITMATCH *get_bitmatch(lua_State *l, int index);
+static const unsigned char *check_bytes(lua_State *l, int index, size_t *len);
+static void pack_var(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, PACK_STATE *state);
+static void unpack_var(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, UNPACK_STATE *state);
+static int skip_var(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, UNPACK_STATE *state);
+static void project_bitmatch(lua_State *l, int bitmatch_index, int fields_index);
+static void push_shared_bitmatch(lua_State *l, const BITMATCH *bitmatch);
+static void release_bitmatch(BITMATCH *bitmatch);
+static unsigned char *pack_scratch(lua_State *l, size_t len);
+static void release_pack_scratch(lua_State *l);
+static int check_fd(lua_State *l, int index);
 
 /*
  * name
@@ -236,6 +547,103 @@ size_t bits_to_bytes(size_t count_bits)
     return count_bits / CHAR_BIT + ((count_bits % CHAR_BIT == 0) ? 0 : 1);
 }
 
+/*
+ * name
+ *      load_big_endian
+ *
+ * returns
+ *      8 bytes at input as big endian word
+ */
+static uint64_t load_big_endian(const unsigned char *input)
+{
+    uint64_t word = 0;
+    size_t i;
+    for(i = 0; i < sizeof(uint64_t); ++i)
+    {
+        word = (word << CHAR_BIT) | input[i];
+    }
+    return word;
+}
+
+/*
+ * name
+ *      store_big_endian
+ *
+ * description
+ *      write word into 8 bytes at output in big endian order
+ */
+static void store_big_endian(unsigned char *output, uint64_t word)
+{
+    size_t i;
+    for(i = 0; i < sizeof(uint64_t); ++i)
+    {
+        output[i] = (unsigned char)(word >> ((sizeof(uint64_t) - i - 1) * CHAR_BIT));
+    }
+}
+
+/*
+ * name
+ *      copy_bits
+ *
+ * description
+ *      copy bits from arbitrary bit offset of input into byte aligned output.
+ *      the bits are placed from the most significant bit of the first 
+ *      output byte. unused bits of the last output byte are zero
+ *
+ * paramenters
+ *      output - out parameter. bits_to_bytes(count_bits) bytes
+ *      input - input bytes
+ *      input_len - length of input. first_bit + count_bits must not
+ *                  exceed input_len * CHAR_BIT
+ *      first_bit - bit offset in input. 0 is the most significant bit
+ *                  of the first byte
+ *      count_bits - number of bits to copy
+ *
+ * rationale
+ *      unaligned bits are funnel shifted 64 bits at a time. output may 
+ *      be the same memory as input if it does not start after the first 
+ *      input byte
+ */
+static void copy_bits(
+        unsigned char *output, 
+        const unsigned char *input, 
+        size_t input_len, 
+        size_t first_bit, 
+        size_t count_bits)
+{
+    size_t count_bytes = bits_to_bytes(count_bits);
+    const unsigned char *current_byte = input + first_bit / CHAR_BIT;
+    size_t left_shift = first_bit % CHAR_BIT;
+    /* bytes that may be read from current_byte */
+    size_t available = input_len - first_bit / CHAR_BIT;
+
+    if(left_shift == 0)
+    {
+        memmove(output, current_byte, count_bytes);
+    }
+    else
+    {
+        size_t right_shift = CHAR_BIT - left_shift;
+        size_t i = 0;
+        for(; i + sizeof(uint64_t) < available && i + sizeof(uint64_t) <= count_bytes; i += sizeof(uint64_t))
+        {
+            uint64_t word = load_big_endian(current_byte + i);
+            word = (word << left_shift) | (current_byte[i + sizeof(uint64_t)] >> right_shift);
+            store_big_endian(output + i, word);
+        }
+        for(; i < count_bytes; ++i)
+        {
+            unsigned char next = i + 1 < available ? current_byte[i + 1] : 0;
+            output[i] = (unsigned char)((current_byte[i] << left_shift) | (next >> right_shift));
+        }
+    }
+
+    if(count_bits % CHAR_BIT != 0)
+    {
+        output[count_bytes - 1] &= (unsigned char)(0xff << (CHAR_BIT - count_bits % CHAR_BIT));
+    }
+}
+
 /*
  * name
  *      change_endianess
@@ -324,7 +732,7 @@ static lua_Integer clear_unused_bits(lua_Integer value, size_t used_bits)
     {
         return value;
     }
-    lua_Integer mask = (((~0) << used_bits) ^ (~0)); 
+    lua_Integer mask = (lua_Integer)~((~(uint64_t)0) << used_bits);
     return value & mask;
 }
 
@@ -556,7 +964,7 @@ static void pack_aligned_bin(lua_State *l, ELEMENT_DESCRIPTION *elem, const unsi
 {
     size_t reminder = len;
     unsigned char *current_byte = state->prep_buffer + state->current_bit / CHAR_BIT;
-    size_t space = state->prep_buffer + LUAL_BUFFERSIZE - current_byte;
+    size_t space = state->prep_buffer + state->result_bits / CHAR_BIT - current_byte;
     if(reminder <= space)
     {
         memcpy(current_byte, bin, reminder);
@@ -573,6 +981,8 @@ static void pack_aligned_bin(lua_State *l, ELEMENT_DESCRIPTION *elem, const unsi
             current_byte = state->prep_buffer;
             size_t space = reminder <= LUAL_BUFFERSIZE ? reminder : LUAL_BUFFERSIZE;
             memcpy(current_byte, bin, space);
+            bin += space;
+            current_byte += space;
             reminder -= space;
             state->current_bit = space * CHAR_BIT;
         }
@@ -751,7 +1161,23 @@ static void pack_elem(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, vo
     }
 
     PACK_STATE *state = (PACK_STATE *)arg;
-    if(elem->type == ET_INTEGER)
+    if(elem->skip)
+    {
+        luaL_error(l, "wrong format: projected bitmatch can not be packed");
+    }
+    else if(elem->constant)
+    {
+        basic_pack_int(l, elem, elem->value, state);
+        ++state->constant_count;
+        return;
+    }
+
+    arg_index -= state->constant_count;
+    if(elem->size == (size_t)VAR || elem->type >= ET_ULEB128)
+    {
+        pack_var(l, elem, arg_index, state);
+    }
+    else if(elem->type == ET_INTEGER)
     {
         pack_int(l, elem, arg_index, state);
     }
@@ -817,7 +1243,7 @@ static lua_Integer toint(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index,
         for(i = buffer_len - 1; i >= 0; --i)
         {
             size_t shift = (buffer_len - i - 1) * CHAR_BIT;
-            result |= buffer[i] << shift;
+            result |= (lua_Integer)buffer[i] << shift;
         }
     }
     else if(elem->endianess == EE_LITTLE)
@@ -826,7 +1252,7 @@ static lua_Integer toint(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index,
         for(i = 0; i < buffer_len; ++i)
         {
             size_t shift = i * CHAR_BIT;
-            result |= buffer[i] << shift; 
+            result |= (lua_Integer)buffer[i] << shift; 
         }
     }
     else
@@ -922,7 +1348,8 @@ static lua_Integer unpack_int_no_push(lua_State *l, ELEMENT_DESCRIPTION *elem, i
         int i;
         for(i = bytes_to_copy - 1; i >= 0 && end_byte > current_byte; --i)
         {
-            result_buffer[i] = (*end_byte >> right_shift) & 0xff; 
+            /* end_byte is past the input when the element ends on byte bounds */
+            result_buffer[i] = right_shift < CHAR_BIT ? (*end_byte >> right_shift) & 0xff : 0;
             --end_byte;
             result_buffer[i] |= (*end_byte << left_shift) & 0xff;
         }
@@ -1006,25 +1433,24 @@ static void unpack_int(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, U
  *      size error - requested length is greater then remaining part of input
  *
  * rationale
- *      the function unpacks stream of bytes as array of integers 
- *      packed at arbitrary bit positions.
- *
- * future work
- *      optimize for most common usage pattern
+ *      the bytes may start at arbitrary bit position. copy_bits shifts
+ *      them into place a word at a time
  */
 static void unpack_bin(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, UNPACK_STATE *state)
 {
-    if(elem->size == REST)
+    /* the element of a compiled bitmatch is shared between calls */
+    size_t size = elem->size;
+    if(size == (size_t)REST)
     {
         if(state->current_bit % CHAR_BIT != 0)
         {
             luaL_error(l, "wrong format: using rest length specifier for incomplete bytes at element %d", arg_index);
         }
 
-        elem->size = (state->source_end - state->source) - state->current_bit / CHAR_BIT;
+        size = (state->source_end - state->source) - state->current_bit / CHAR_BIT;
     }
 
-    if(elem->size > state->source_bits / CHAR_BIT)
+    if(size > state->source_bits / CHAR_BIT)
     {
         luaL_error(l, "size error: requested length for element %d is greater then remaining part of input", arg_index);
     }
@@ -1033,25 +1459,21 @@ static void unpack_bin(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, U
     luaL_buffinit(l, &b);
 
     size_t i = 0;
-    while(i < elem->size)
+    while(i < size)
     {
         unsigned char *result = (unsigned char *)luaL_prepbuffer(&b);
-        size_t j = 0;
-        while(i < elem->size && j < LUAL_BUFFERSIZE)
-        {
-            ELEMENT_DESCRIPTION tmp_elem;
-            tmp_elem.size = CHAR_BIT;
-            tmp_elem.endianess = EE_BIG;
-            tmp_elem.type = ET_INTEGER; 
-            result[j] = unpack_int_no_push(l, &tmp_elem, arg_index, state);
-            ++i;
-            ++j;
-        }
-        luaL_addsize(&b, j);
+        size_t chunk = size - i < LUAL_BUFFERSIZE ? size - i : LUAL_BUFFERSIZE;
+        copy_bits(result, state->source, state->source_end - state->source, 
+                state->current_bit, chunk * CHAR_BIT);
+        state->current_bit += chunk * CHAR_BIT;
+        state->source_bits -= chunk * CHAR_BIT;
+        i += chunk;
+        luaL_addsize(&b, chunk);
     }
     ++state->return_count;
     grow_unpack_stack(l, state);
     luaL_pushresult(&b);
+    STATS_ALLOC(size);
 }
 
 /*
@@ -1105,12 +1527,98 @@ static void unpack_float(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index,
     }
     else
     {
-        luaL_error(l, "size error: unsupported float size %d", elem->size);
+        luaL_error(l, "size error: unsupported float size %d", (int)elem->size);
     }
     ++state->return_count;
 }
 
 
+/*
+ * name
+ *      match_constant
+ *
+ * description
+ *      unpack constant int element and compare it with the expected value
+ *
+ * paramenters
+ *      l - lua state
+ *      elem - element description
+ *      arg_index - number of element in format string. starts from 2
+ *      state - unpack state passed between invocations
+ *
+ * returns
+ *      1 if the value matches, 0 otherwise
+ *
+ * throws
+ *      size error - element size is greater then remaining part of input
+ */
+static int match_constant(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, UNPACK_STATE *state)
+{
+    lua_Integer value = unpack_int_no_push(l, elem, arg_index, state);
+    if(elem->size < sizeof(lua_Integer) * CHAR_BIT)
+    {
+        value &= ((lua_Integer)1 << elem->size) - 1;
+    }
+    return value == elem->value;
+}
+
+/*
+ * name
+ *      skip_elem
+ *
+ * description
+ *      check that element that is not selected by projection fits the 
+ *      input and move current bit after it
+ *
+ * paramenters
+ *      l - lua state
+ *      elem - element description
+ *      arg_index - number of element in bitmatch. starts from 2
+ *      state - unpack state passed between invocations
+ *
+ * throws
+ *      size error - requested length is greater then remaining part of input
+ *      wrong format - using rest length specifier for incomplete bytes
+ */
+static void skip_elem(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, UNPACK_STATE *state)
+{
+    size_t bits = elem->size;
+    if(elem->size == (size_t)VAR || elem->type >= ET_ULEB128)
+    {
+        if(!skip_var(l, elem, arg_index, state))
+        {
+            luaL_error(l, "size error: element %d does not fit remaining part of input", arg_index);
+        }
+        return;
+    }
+    else if(elem->type == ET_BINARY)
+    {
+        if(elem->size == (size_t)REST)
+        {
+            if(state->current_bit % CHAR_BIT != 0)
+            {
+                luaL_error(l, "wrong format: using rest length specifier for incomplete bytes at element %d", arg_index);
+            }
+            bits = state->source_bits;
+        }
+        else if(elem->size == (size_t)ALL)
+        {
+            luaL_error(l, "wrong format: all length specifier can not be unpacked");
+        }
+        else
+        {
+            bits = elem->size * CHAR_BIT;
+        }
+    }
+
+    if(bits > state->source_bits)
+    {
+        luaL_error(l, "size error: requested length for element %d is greater then remaining part of input", arg_index);
+    }
+    state->current_bit += bits;
+    state->source_bits -= bits;
+}
+
 /*
  * name
  *      unpack_elem
@@ -1133,7 +1641,22 @@ static void unpack_float(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index,
 static void unpack_elem(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, void *arg)
 {
     UNPACK_STATE *state = (UNPACK_STATE *)arg;
-    if(elem->type == ET_INTEGER)
+    if(elem->skip)
+    {
+        skip_elem(l, elem, arg_index, state);
+    }
+    else if(elem->constant)
+    {
+        if(!match_constant(l, elem, arg_index, state))
+        {
+            luaL_error(l, "match error: element %d does not match the constant value", arg_index - 1);
+        }
+    }
+    else if(elem->size == (size_t)VAR || elem->type >= ET_ULEB128)
+    {
+        unpack_var(l, elem, arg_index, state);
+    }
+    else if(elem->type == ET_INTEGER)
     {
         unpack_int(l, elem, arg_index, state);
     }
@@ -1181,11 +1704,13 @@ static int compare_token(const char *keyword, const char *token, size_t len)
  *      convert type token to type enum value
  *
  * paramenters
- *      l - lua state
  *      token - token obtained from parsing the format string
  *      token_len - length of the token
+ *
+ * returns
+ *      the type or ET_UNDEFINED if token is not a type token
  */
-static ELEMENT_TYPE totype(lua_State *l, const char *token, size_t token_len)
+static ELEMENT_TYPE totype(const char *token, size_t token_len)
 {
     int i = 1;
     while(TYPES[i])
@@ -1196,7 +1721,7 @@ static ELEMENT_TYPE totype(lua_State *l, const char *token, size_t token_len)
         } 
         ++i;
     }
-    return (ELEMENT_TYPE)luaL_error(l, "wrong format: unexpected type token (%s)", token); 
+    return ET_UNDEFINED;
 }
 
 /*
@@ -1207,11 +1732,13 @@ static ELEMENT_TYPE totype(lua_State *l, const char *token, size_t token_len)
  *      convert endianess token to endianess enum value
  *
  * paramenters
- *      l - lua state
  *      token - token obtained from parsing the format string
  *      token_len - length of the token
+ *
+ * returns
+ *      the endianess or EE_DEFAULT if token is not an endianess token
  */
-static ELEMENT_ENDIANESS toendianess(lua_State *l, const char *token, size_t token_len)
+static ELEMENT_ENDIANESS toendianess(const char *token, size_t token_len)
 {
     int i = 1;
     while(ENDIANESSES[i])
@@ -1222,7 +1749,7 @@ static ELEMENT_ENDIANESS toendianess(lua_State *l, const char *token, size_t tok
         } 
         ++i;
     }
-    return (ELEMENT_ENDIANESS)luaL_error(l, "wrong format: unexpected endianess token (%s)", token); 
+    return EE_DEFAULT;
 }
 
 /*
@@ -1233,11 +1760,10 @@ static ELEMENT_ENDIANESS toendianess(lua_State *l, const char *token, size_t tok
  *      convert size token to size value
  *
  * paramenters
- *      l - lua state
  *      token - token obtained from parsing the format string
  *      token_len - length of the token
  */
-static size_t tosize(lua_State *l, const char *token, size_t token_len)
+static size_t tosize(const char *token, size_t token_len)
 {
     size_t size = -1;
     if(compare_token(ALL_SPECIFIER, token, token_len))
@@ -1248,6 +1774,10 @@ static size_t tosize(lua_State *l, const char *token, size_t token_len)
     {
         size = REST;
     }
+    else if(compare_token(VAR_SPECIFIER, token, token_len))
+    {
+        size = VAR;
+    }
     else
     {
         // strtol
@@ -1258,66 +1788,174 @@ static size_t tosize(lua_State *l, const char *token, size_t token_len)
 
 /*
  * name
- *      parse_format
+ *      format_error
  *
  * description
- *      parse format string and call handler function for
- *      each parsed element. 
- *      function implemented as a simple state machine
- *      with following states
- *          SIZE_STATE - parsing size part of the element
- *          TYPE_STATE - parsing type part of the element
- *          ENDIANESS_STATE - parsing optional endianess part of the element
- *          SPACE_STATE - parsing delimiter between elements
- *      state transitions are 
- *      SIZE_STATE -> TYPE_STATE -> ENDIANESS_STATE -> SPACE_STATE -> SIZE_STATE
- *      SIZE_STATE -> TYPE_STATE -> SPACE_STATE -> SIZE_STATE
- *      SIZE_STATE -> TYPE_STATE -> ENDIANESS_STATE -> SPACE_STATE -> END
- *      SIZE_STATE -> TYPE_STATE -> SPACE_STATE -> END
- *      SIZE_STATE -> TYPE_STATE -> ENDIANESS_STATE -> END
- *      SIZE_STATE -> TYPE_STATE -> END
+ *      format an error message detected while parsing format string
  *
  * paramenters
- *      l - lua state
- *      handler - callback to handle the element
- *      arg - opaque parameter that is passed to handler between invocations
- *
- * rationale
- *      the function separates parsing logic from logic that moves bits
- *      both may evolve independently
+ *      message - out parameter. buffer for the error message
+ *      message_len - size of the message buffer
+ *      fmt - printf style format of the message
  *
- * future work
- *      check for performance
+ * returns
+ *      -1 so that the caller may return it as is
  */
-static void parse_format(lua_State *l, ELEM_HANDLER handler, void *arg)
+static int format_error(char *message, size_t message_len, const char *fmt, ...)
 {
-    size_t len = 0;
-    const char *format = luaL_checklstring(l, 1, &len);
+    va_list args;
+    va_start(args, fmt);
+#ifdef WIN32
+    _vsnprintf(
+#else
+    vsnprintf(
+#endif
+        message, message_len, fmt, args);
+    va_end(args);
+    message[message_len - 1] = '\0';
+    return -1;
+}
 
-    const char *token = format;
-    size_t token_len = 0;
-    ELEMENT_DESCRIPTION elem;
-    memset(&elem, 0, sizeof(elem));
-    /* allow leading space */
-    PARSE_STATE state = SPACE_STATE;
-    int argnum = 2;
-    size_t i = 0;
-    while(i < len)
-    {
+/*
+ * name
+ *      tovalue
+ *
+ * description
+ *      convert constant value token and store it in the element
+ *
+ * paramenters
+ *      elem - element with parsed size and type
+ *      token - token obtained from parsing the format string
+ *      token_len - length of the token
+ *      message - out parameter. buffer for error message
+ *      message_len - size of the message buffer
+ *
+ * returns
+ *      0 on success, -1 on wrong format
+ */
+static int tovalue(ELEMENT_DESCRIPTION *elem, const char *token, size_t token_len, char *message, size_t message_len)
+{
+    size_t max_bits = sizeof(lua_Integer) * CHAR_BIT;
+    if(elem->type != ET_INTEGER || elem->size == 0 || elem->size > max_bits)
+    {
+        return format_error(message, message_len, 
+                "wrong format: constant value (%.*s) is supported with int elements of 1 to %d bits only", 
+                (int)token_len, token, (int)max_bits);
+    }
+
+    char buffer[32];
+    if(token_len == 0 || token_len >= sizeof(buffer))
+    {
+        return format_error(message, message_len, 
+                "wrong format: unexpected constant value (%.*s)", (int)token_len, token);
+    }
+    memcpy(buffer, token, token_len);
+    buffer[token_len] = '\0';
+
+    char *end = NULL;
+    int negative = buffer[0] == '-';
+    unsigned long long magnitude = strtoull(negative ? buffer + 1 : buffer, &end, 0);
+    if(*end != '\0' || !isalnum(negative ? buffer[1] : buffer[0]))
+    {
+        return format_error(message, message_len, 
+                "wrong format: unexpected constant value (%.*s)", (int)token_len, token);
+    }
+
+    /* unsigned values must fit size bits, negative values must fit size bits as two's complement */
+    unsigned long long max_value = elem->size < 64 ? (1ULL << elem->size) - 1 : ~0ULL;
+    if((!negative && magnitude > max_value) || (negative && magnitude > max_value / 2 + 1) || 
+            elem->size > 64)
+    {
+        return format_error(message, message_len, 
+                "wrong format: constant value (%.*s) does not fit %d bits", 
+                (int)token_len, token, (int)elem->size);
+    }
+
+    unsigned long long value = negative ? (~magnitude + 1) & max_value : magnitude;
+    elem->value = (lua_Integer)value;
+    elem->constant = 1;
+    return 0;
+}
+
+/*
+ * name
+ *      parse_format
+ *
+ * description
+ *      parse format string and call handler function for
+ *      each parsed element. 
+ *      function implemented as a simple state machine
+ *      with following states
+ *          SIZE_STATE - parsing size part of the element
+ *          TYPE_STATE - parsing type part of the element
+ *          ENDIANESS_STATE - parsing optional endianess part of the element
+ *          VALUE_STATE - parsing optional constant value of the element
+ *          SPACE_STATE - parsing delimiter between elements
+ *      state transitions are 
+ *      SIZE_STATE -> TYPE_STATE -> ENDIANESS_STATE -> SPACE_STATE -> SIZE_STATE
+ *      SIZE_STATE -> TYPE_STATE -> SPACE_STATE -> SIZE_STATE
+ *      SIZE_STATE -> TYPE_STATE -> ENDIANESS_STATE -> SPACE_STATE -> END
+ *      SIZE_STATE -> TYPE_STATE -> SPACE_STATE -> END
+ *      SIZE_STATE -> TYPE_STATE -> ENDIANESS_STATE -> END
+ *      SIZE_STATE -> TYPE_STATE -> END
+ *      TYPE_STATE and ENDIANESS_STATE may be followed by VALUE_STATE 
+ *      that is followed by SPACE_STATE or END
+ *
+ * paramenters
+ *      l - lua state. passed as is to the handler, may be NULL
+ *      format - the format string
+ *      len - length of the format string
+ *      handler - callback to handle the element
+ *      arg - opaque parameter that is passed to handler between invocations
+ *      message - out parameter. buffer for error message
+ *      message_len - size of the message buffer
+ *
+ * returns
+ *      0 on success, -1 on wrong format. the reason is stored in message
+ *
+ * rationale
+ *      the function separates parsing logic from logic that moves bits
+ *      both may evolve independently.
+ *      the function does not raise lua errors so that it can be used
+ *      by the C API where there is no lua state. 
+ *
+ * future work
+ *      check for performance
+ */
+static int parse_format(
+        lua_State *l, 
+        const char *format, 
+        size_t len, 
+        ELEM_HANDLER handler, 
+        void *arg,
+        char *message,
+        size_t message_len)
+{
+    const char *token = format;
+    size_t token_len = 0;
+    ELEMENT_DESCRIPTION elem;
+    memset(&elem, 0, sizeof(elem));
+    /* allow leading space */
+    PARSE_STATE state = SPACE_STATE;
+    int argnum = 2;
+    size_t i = 0;
+    while(i < len)
+    {
         switch(state)
         {
             case SIZE_STATE:
                 if(format[i] == PART_DELIMITER && token_len > 0)
                 {
                     state = TYPE_STATE;
-                    elem.size = tosize(l, token, token_len);
+                    elem.size = tosize(token, token_len);
                     token = token + token_len + 1;
                     token_len = 0;
                 }
                 else if(!isalnum(format[i]))
                 {
-                    luaL_error(l, "wrong format: not a digit (%c at %d) where digit is expected", 
-                            format[i], i + 1);
+                    return format_error(message, message_len, 
+                            "wrong format: not a digit (%c at %d) where digit is expected", 
+                            format[i], (int)i + 1);
                 }
                 else
                 {
@@ -1329,24 +1967,48 @@ static void parse_format(lua_State *l, ELEM_HANDLER handler, void *arg)
                 if(format[i] == PART_DELIMITER && token_len > 0)
                 {
                     state = ENDIANESS_STATE;
-                    elem.type = totype(l, token, token_len);
+                    elem.type = totype(token, token_len);
+                    if(elem.type == ET_UNDEFINED)
+                    {
+                        return format_error(message, message_len, 
+                                "wrong format: unexpected type token (%.*s)", (int)token_len, token); 
+                    }
+                    token = token + token_len + 1;
+                    token_len = 0;
+                }
+                else if(format[i] == VALUE_DELIMITER && token_len > 0)
+                {
+                    state = VALUE_STATE;
+                    elem.type = totype(token, token_len);
+                    if(elem.type == ET_UNDEFINED)
+                    {
+                        return format_error(message, message_len, 
+                                "wrong format: unexpected type token (%.*s)", (int)token_len, token); 
+                    }
                     token = token + token_len + 1;
                     token_len = 0;
                 }
                 else if(strchr(ELEMENT_DELIMITERS, format[i]))
                 {
                     state = SPACE_STATE;
-                    elem.type = totype(l, token, token_len);
+                    elem.type = totype(token, token_len);
+                    if(elem.type == ET_UNDEFINED)
+                    {
+                        return format_error(message, message_len, 
+                                "wrong format: unexpected type token (%.*s)", (int)token_len, token); 
+                    }
                     token = token + token_len + 1;
                     token_len = 0;
                     handler(l, &elem, argnum, arg); 
                     ++argnum;
                     memset(&elem, 0, sizeof(elem));
                 }
-                else if(!isalpha(format[i]))
+                else if(!isalpha(format[i]) && !(token_len > 0 && isdigit(format[i])))
                 {
-                    luaL_error(l, "wrong format: not a letter (%c at %d) where letter is expected", 
-                            format[i], i + 1);
+                    /* type tokens may have digits after the first letter (uleb128) */
+                    return format_error(message, message_len, 
+                            "wrong format: not a letter (%c at %d) where letter is expected", 
+                            format[i], (int)i + 1);
                 }
                 else
                 {
@@ -1355,10 +2017,27 @@ static void parse_format(lua_State *l, ELEM_HANDLER handler, void *arg)
                 break;
 
             case ENDIANESS_STATE:
-                if(strchr(ELEMENT_DELIMITERS, format[i]))
+                if(format[i] == VALUE_DELIMITER && token_len > 0)
+                {
+                    state = VALUE_STATE;
+                    elem.endianess = toendianess(token, token_len);
+                    if(elem.endianess == EE_DEFAULT)
+                    {
+                        return format_error(message, message_len, 
+                                "wrong format: unexpected endianess token (%.*s)", (int)token_len, token); 
+                    }
+                    token = token + token_len + 1;
+                    token_len = 0;
+                }
+                else if(strchr(ELEMENT_DELIMITERS, format[i]))
                 {
                     state = SPACE_STATE;
-                    elem.endianess = toendianess(l, token, token_len);
+                    elem.endianess = toendianess(token, token_len);
+                    if(elem.endianess == EE_DEFAULT)
+                    {
+                        return format_error(message, message_len, 
+                                "wrong format: unexpected endianess token (%.*s)", (int)token_len, token); 
+                    }
                     token = token + token_len + 1;
                     token_len = 0;
                     handler(l, &elem, argnum, arg); 
@@ -1367,8 +2046,35 @@ static void parse_format(lua_State *l, ELEM_HANDLER handler, void *arg)
                 }
                 else if(!isalpha(format[i]))
                 {
-                    luaL_error(l, "wrong format: not a letter (%c at %d) where letter is expected", 
-                            format[i], i + 1);
+                    return format_error(message, message_len, 
+                            "wrong format: not a letter (%c at %d) where letter is expected", 
+                            format[i], (int)i + 1);
+                }
+                else
+                {
+                    ++token_len;
+                }
+                break;
+
+            case VALUE_STATE:
+                if(strchr(ELEMENT_DELIMITERS, format[i]))
+                {
+                    state = SPACE_STATE;
+                    if(tovalue(&elem, token, token_len, message, message_len) != 0)
+                    {
+                        return -1;
+                    }
+                    token = token + token_len + 1;
+                    token_len = 0;
+                    handler(l, &elem, argnum, arg); 
+                    ++argnum;
+                    memset(&elem, 0, sizeof(elem));
+                }
+                else if(!isalnum(format[i]) && !(token_len == 0 && format[i] == '-'))
+                {
+                    return format_error(message, message_len, 
+                            "wrong format: not a digit (%c at %d) where constant value is expected", 
+                            format[i], (int)i + 1);
                 }
                 else
                 {
@@ -1390,8 +2096,8 @@ static void parse_format(lua_State *l, ELEM_HANDLER handler, void *arg)
                 break;
 
             default:
-                luaL_error(l, "wrong format: unexpected state (%02x at %d)", format[i], i + 1);
-                break;
+                return format_error(message, message_len, 
+                        "wrong format: unexpected state (%02x at %d)", format[i], (int)i + 1);
         }
         ++i;
     }
@@ -1399,29 +2105,44 @@ static void parse_format(lua_State *l, ELEM_HANDLER handler, void *arg)
     switch(state)
     {
         case SIZE_STATE:
-            luaL_error(l, "wrong format: incomplete format string %s", format); 
-            break;
+            return format_error(message, message_len, 
+                    "wrong format: incomplete format string %.*s", (int)len, format); 
 
         case TYPE_STATE:
+            elem.type = totype(token, token_len);
+            if(elem.type == ET_UNDEFINED)
             {
-                elem.type = totype(l, token, token_len);
-                handler(l, &elem, argnum, arg); 
+                return format_error(message, message_len, 
+                        "wrong format: unexpected type token (%.*s)", (int)token_len, token); 
             }
+            handler(l, &elem, argnum, arg); 
             break;
 
         case ENDIANESS_STATE:
+            elem.endianess = toendianess(token, token_len);
+            if(elem.endianess == EE_DEFAULT)
             {
-                elem.endianess = toendianess(l, token, token_len);
-                handler(l, &elem, argnum, arg); 
+                return format_error(message, message_len, 
+                        "wrong format: unexpected endianess token (%.*s)", (int)token_len, token); 
             }
+            handler(l, &elem, argnum, arg); 
+            break;
+
+        case VALUE_STATE:
+            if(tovalue(&elem, token, token_len, message, message_len) != 0)
+            {
+                return -1;
+            }
+            handler(l, &elem, argnum, arg); 
+            break;
 
         case SPACE_STATE:
             break;
 
         default:
-            luaL_error(l, "unexpected state at %d", i + 1);
-            break;
+            return format_error(message, message_len, "unexpected state at %d", (int)i + 1);
     }
+    return 0;
 }
  
 /*
@@ -1465,7 +2186,13 @@ static void parse(lua_State *l, ELEM_HANDLER handler, void *arg)
 {
     if(lua_isstring(l, 1))
     {
-        parse_format(l, handler, arg);
+        size_t len = 0;
+        const char *format = luaL_checklstring(l, 1, &len);
+        char message[255];
+        if(parse_format(l, format, len, handler, arg, message, sizeof(message)) != 0)
+        {
+            luaL_error(l, "%s", message);
+        }
     }
     else if(lua_isuserdata(l, 1) && get_bitmatch(l, 1) != NULL)
     {
@@ -1490,43 +2217,34 @@ static void parse(lua_State *l, ELEM_HANDLER handler, void *arg)
 
 /*
  * name
- *      get_substring
+ *      find_substring
  *
  * description
- *      get substring based on parameters that specify substring in Lua style 
- *      as C style pointer/length substring
- *
- * paramenters
- *      l - lua state
- *      len - out parameter for requested length
- *      string_param - location of string parameter on stack
- *      start_param - location of start parameter on stack
- *      end_param - location of end parameter on stack
+ *      get_substring that does not raise on out of bounds positions
  *
  * returns
- *      pointer to relevant part of input string
- *      
- * throws
- *      invalid parameter - when start or stop are out of bounds
+ *      pointer to relevant part of input string or NULL when start or 
+ *      stop are out of bounds. start and stop positions are stored in
+ *      start_position and end_position
  *
- * rationale
- *      using string.sub in user code whould have the same effect 
- *      but it would be slightly less efficient and without
- *      bounds checking
+ * throws
+ *      argcheck error - when parameters have wrong types
  */
-static const unsigned char *get_substring(
+static const unsigned char *find_substring(
         lua_State *l, 
         size_t *len,
         int string_param,
         int start_param,
-        int end_param)
+        int end_param,
+        int *start_position,
+        int *end_position)
 {
     size_t original_length = 0;
-    const unsigned char *original_start = (const unsigned char *)luaL_checklstring(l, string_param, &original_length); 
+    const unsigned char *original_start = check_bytes(l, string_param, &original_length); 
 
     /* Lua style */
-    int start_position = 1;
-    int end_position = original_length;
+    *start_position = 1;
+    *end_position = original_length;
 
     /* C style */
     size_t start_offset = 0;
@@ -1534,42 +2252,136 @@ static const unsigned char *get_substring(
 
     if(lua_gettop(l) >= start_param)
     {
-        start_position = luaL_checkinteger(l, start_param);
-        if(start_position < 0)
+        *start_position = luaL_checkinteger(l, start_param);
+        if(*start_position < 0)
         {
-            start_offset = original_length + start_position;
+            start_offset = original_length + *start_position;
         }
         else
         {
-            start_offset = start_position - 1;
+            start_offset = *start_position - 1;
         }
     }
     if(lua_gettop(l) >= end_param)
     {
-        end_position = luaL_checkinteger(l, end_param);
-        if(end_position < 0)
+        *end_position = luaL_checkinteger(l, end_param);
+        if(*end_position < 0)
         {
-            end_offset = original_length + end_position + 1;
+            end_offset = original_length + *end_position + 1;
         }
         else
         {
-            end_offset = end_position;
+            end_offset = *end_position;
         }
     }
 
-    if(start_offset >= end_offset)
+    if(start_offset >= end_offset || end_offset > original_length)
     {
-        luaL_error(l, "invalid parameter: start position %d, end position %d", 
-                start_position, end_position);
+        return NULL;
     }
+    *len = end_offset - start_offset;
+    return original_start + start_offset;
+}
 
-    if(end_offset > original_length)
+/*
+ * name
+ *      get_substring
+ *
+ * description
+ *      get substring based on parameters that specify substring in Lua style 
+ *      as C style pointer/length substring
+ *
+ * paramenters
+ *      l - lua state
+ *      len - out parameter for requested length
+ *      string_param - location of string parameter on stack
+ *      start_param - location of start parameter on stack
+ *      end_param - location of end parameter on stack
+ *
+ * returns
+ *      pointer to relevant part of input string
+ *      
+ * throws
+ *      invalid parameter - when start or stop are out of bounds
+ *
+ * rationale
+ *      using string.sub in user code whould have the same effect 
+ *      but it would be slightly less efficient and without
+ *      bounds checking
+ */
+static const unsigned char *get_substring(
+        lua_State *l, 
+        size_t *len,
+        int string_param,
+        int start_param,
+        int end_param)
+{
+    int start_position = 0;
+    int end_position = 0;
+    const unsigned char *substring = find_substring(l, len, string_param, start_param, end_param, 
+            &start_position, &end_position);
+    if(substring == NULL)
     {
         luaL_error(l, "invalid parameter: start position %d, end position %d", 
                 start_position, end_position);
     }
-    *len = end_offset - start_offset;
-    return original_start + start_offset;
+    return substring;
+}
+
+/*
+ * name
+ *      pack_size
+ *
+ * description
+ *      calculate the size of packed bitmatch from the elements and the
+ *      lengths of all:bin arguments
+ *
+ * paramenters
+ *      l - lua state
+ *      bitmatch - the compiled layout
+ *      bits - out parameter. number of packed bits
+ *
+ * returns
+ *      1 if the size is known before packing, 0 otherwise. the size of
+ *      variable length integers depends on the values
+ */
+static int pack_size(lua_State *l, const BITMATCH *bitmatch, size_t *bits)
+{
+    int constant_count = 0;
+    *bits = 0;
+    size_t i;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        const ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        if(elem->skip || elem->size == (size_t)VAR || elem->size == (size_t)REST ||
+                elem->type >= ET_ULEB128)
+        {
+            return 0;
+        }
+        if(elem->constant)
+        {
+            ++constant_count;
+            *bits += elem->size;
+        }
+        else if(elem->type == ET_BINARY && elem->size == (size_t)ALL)
+        {
+            int arg_index = (int)i + 2 - constant_count;
+            if(lua_type(l, arg_index) != LUA_TSTRING)
+            {
+                return 0;
+            }
+            *bits += lua_objlen(l, arg_index) * CHAR_BIT;
+        }
+        else if(elem->type == ET_BINARY)
+        {
+            *bits += elem->size * CHAR_BIT;
+        }
+        else
+        {
+            *bits += elem->size;
+        }
+    }
+    return 1;
 }
 
 /*
@@ -1585,9 +2397,40 @@ static const unsigned char *get_substring(
  * returns
  *      pushes the result string onto lua stack and
  *      returns 1
+ *
+ * rationale
+ *      when a bitmatch packs more than LUAL_BUFFERSIZE bytes and the size
+ *      is known ahead, the result is packed at once into a scratch buffer
+ *      of the lua state and copied once into the result string. otherwise
+ *      the result is collected in luaL_Buffer chunks
  */
 static int l_pack(lua_State *l)
 {
+    PROBE_PROTECT(pack, l_pack);
+    STATS_BEGIN(l);
+    PROBE_ENTRY(pack, probe_layout(l), lua_gettop(l) - 1);
+    size_t bits = 0;
+    if(lua_type(l, 1) == LUA_TUSERDATA && pack_size(l, get_bitmatch(l, 1), &bits) &&
+            bits / CHAR_BIT > LUAL_BUFFERSIZE)
+    {
+        /* spare bytes for code that zeroes a byte ahead, so the buffer is never flushed */
+        size_t len = bits_to_bytes(bits) + sizeof(lua_Integer) + 1;
+        PACK_STATE state;
+        state.buffer = NULL;
+        state.prep_buffer = pack_scratch(l, len);
+        state.current_bit = 0;
+        state.result_bits = len * CHAR_BIT;
+        state.constant_count = 0;
+
+        parse(l, pack_elem, (void *)&state);
+        lua_pushlstring(l, (const char *)state.prep_buffer, state.current_bit / CHAR_BIT);
+        STATS_ALLOC(state.current_bit / CHAR_BIT);
+        release_pack_scratch(l);
+        STATS_END(0, state.current_bit / CHAR_BIT);
+        PROBE_RETURN(pack, probe_layout(l), probe_element_count(l), lua_gettop(l) - 2, state.current_bit / CHAR_BIT, 0);
+        return 1;
+    }
+
     luaL_Buffer b; 
     luaL_buffinit(l, &b);
 
@@ -1596,10 +2439,14 @@ static int l_pack(lua_State *l)
     state.prep_buffer = (unsigned char *)luaL_prepbuffer(&b);
     state.current_bit = 0;
     state.result_bits = LUAL_BUFFERSIZE * CHAR_BIT;
+    state.constant_count = 0;
 
     parse(l, pack_elem, (void *)&state);
     luaL_addsize(&b, state.current_bit / CHAR_BIT);
     luaL_pushresult(&b);
+    STATS_ALLOC(lua_objlen(l, -1));
+    STATS_END(0, lua_objlen(l, -1));
+    PROBE_RETURN(pack, probe_layout(l), probe_element_count(l), lua_gettop(l) - 2, lua_objlen(l, -1), 0);
     return 1;
 }
 
@@ -1618,8 +2465,11 @@ static int l_pack(lua_State *l)
  */
 static int l_unpack(lua_State *l)
 {
+    PROBE_PROTECT(unpack, l_unpack);
+    STATS_BEGIN(l);
     size_t source_len = 0;
     const unsigned char *source = get_substring(l, &source_len, 2, 3, 4);
+    PROBE_ENTRY(unpack, probe_layout(l), source_len);
 
     UNPACK_STATE state;
     state.return_count = 0;
@@ -1628,9 +2478,193 @@ static int l_unpack(lua_State *l)
     state.source = source;
     state.source_end = source + source_len;
     parse(l, unpack_elem, (void *)&state);
+    STATS_END(bits_to_bytes(state.current_bit), 0);
+    PROBE_RETURN(unpack, probe_layout(l), probe_element_count(l), source_len, state.return_count, 0);
     return state.return_count;
 }
 
+/*
+ * match state data that is passed between match_elem invocations
+ */
+typedef struct
+{
+    UNPACK_STATE unpack;
+    /* number of the first element that does not fit. 0 if all fit */
+    int failed_element;
+    /* reason of the failure and bit offset of the element */
+    TRY_ERROR failure;
+    size_t failed_bit;
+} MATCH_STATE;
+
+/*
+ * name
+ *      fail_match
+ *
+ * description
+ *      record the first element that does not fit
+ */
+static void fail_match(MATCH_STATE *match, int arg_index, TRY_ERROR failure)
+{
+    match->failed_element = arg_index - 1;
+    match->failure = failure;
+    match->failed_bit = match->unpack.current_bit;
+}
+
+/*
+ * name
+ *      match_elem
+ *
+ * description
+ *      check that element fits the rest of input and skip it without
+ *      creating a value. after the first element that does not fit the
+ *      rest of elements are ignored
+ *
+ * paramenters
+ *      l - lua state
+ *      elem - element description
+ *      arg_index - number of element in format string. starts from 2
+ *      arg - match state passed between invocations
+ *
+ * throws
+ *      wrong format - the element can not be unpacked with any input
+ *      size error - element size is zero or unsupported
+ */
+static void match_elem(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, void *arg)
+{
+    MATCH_STATE *match = (MATCH_STATE *)arg;
+    UNPACK_STATE *state = &match->unpack;
+    if(match->failed_element != 0)
+    {
+        return;
+    }
+
+    size_t bits = 0;
+    if(elem->skip && elem->type == ET_UNDEFINED)
+    {
+        bits = elem->size;
+    }
+    else if(elem->size == (size_t)VAR || elem->type >= ET_ULEB128)
+    {
+        if(!skip_var(l, elem, arg_index, state))
+        {
+            fail_match(match, arg_index, TE_SIZE);
+        }
+        return;
+    }
+    else if(elem->type == ET_INTEGER)
+    {
+        if(elem->size == 0 || elem->size > sizeof(lua_Integer) * CHAR_BIT)
+        {
+            luaL_error(l, "size error: argument %d size (%d bits) is not supported", arg_index, (int)elem->size);
+        }
+        if(elem->size % CHAR_BIT != 0 && elem->endianess == EE_LITTLE)
+        {
+            luaL_error(l, "wrong format: argument %d: little endianess supported for %d bit bounds only", arg_index, CHAR_BIT);
+        }
+        bits = elem->size;
+        if(elem->constant && bits <= state->source_bits)
+        {
+            size_t bit = state->current_bit;
+            if(!match_constant(l, elem, arg_index, state))
+            {
+                state->current_bit = bit;
+                fail_match(match, arg_index, TE_VALUE);
+            }
+            return;
+        }
+    }
+    else if(elem->type == ET_BINARY)
+    {
+        if(elem->size == (size_t)ALL)
+        {
+            luaL_error(l, "wrong format: all length specifier can not be unpacked");
+        }
+        if(elem->size == (size_t)REST)
+        {
+            if(state->current_bit % CHAR_BIT != 0)
+            {
+                fail_match(match, arg_index, TE_ALIGN);
+                return;
+            }
+            bits = state->source_bits;
+        }
+        else
+        {
+            bits = elem->size * CHAR_BIT;
+        }
+    }
+    else if(elem->type == ET_FLOAT)
+    {
+        if(elem->size != sizeof(float) * CHAR_BIT && elem->size != sizeof(double) * CHAR_BIT)
+        {
+            luaL_error(l, "size error: unsupported float size %d", (int)elem->size);
+        }
+        bits = elem->size;
+    }
+    else
+    {
+        luaL_error(l, "wrong format: unexpected type %d", elem->type);
+    }
+
+    if(bits > state->source_bits)
+    {
+        fail_match(match, arg_index, TE_SIZE);
+        return;
+    }
+    state->current_bit += bits;
+    state->source_bits -= bits;
+}
+
+/*
+ * name
+ *      l_match
+ *
+ * description
+ *      lua_CFunction that checks if input fits a format without 
+ *      creating the values. the size checks of unpack are performed
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - format string or bitmatch
+ *          2 - input string or bitstring.buffer
+ *          3, 4 - optional start and end positions as in get_substring
+ *
+ * returns
+ *      true and number of bits the format consumes, or false and the 
+ *      number of the first element that does not fit
+ *
+ * throws
+ *      wrong format - the format can not be unpacked with any input
+ */
+static int l_match(lua_State *l)
+{
+    size_t source_len = 0;
+    const unsigned char *source = get_substring(l, &source_len, 2, 3, 4);
+
+    MATCH_STATE match;
+    match.failed_element = 0;
+    match.failure = TE_NONE;
+    match.failed_bit = 0;
+    match.unpack.return_count = 0;
+    match.unpack.current_bit = 0;
+    match.unpack.source_bits = source_len * CHAR_BIT;
+    match.unpack.source = source;
+    match.unpack.source_end = source + source_len;
+    parse(l, match_elem, (void *)&match);
+
+    if(match.failed_element != 0)
+    {
+        lua_pushboolean(l, 0);
+        lua_pushinteger(l, match.failed_element);
+    }
+    else
+    {
+        lua_pushboolean(l, 1);
+        lua_pushinteger(l, (lua_Integer)match.unpack.current_bit);
+    }
+    return 2;
+}
+
 /*
  * name
  *      get_bitmatch
@@ -1643,12 +2677,12 @@ static int l_unpack(lua_State *l)
  *      index - parameter index
  *
  * returns
- *      pointer to BITMATCH or NULL
+ *      pointer to the shared BITMATCH
  */
 static BITMATCH *get_bitmatch(lua_State *l, int index)
 {
-    BITMATCH *bitmatch = (BITMATCH *)luaL_checkudata(l, index, "bitstring.bitmatch");
-    return bitmatch;
+    BITMATCH_HANDLE *handle = (BITMATCH_HANDLE *)luaL_checkudata(l, index, "bitstring.bitmatch");
+    return handle->bitmatch;
 }
 
 /*
@@ -1657,7 +2691,9 @@ static BITMATCH *get_bitmatch(lua_State *l, int index)
  *
  * description
  *      allocate a new buffer for bitmatch and copy to it
- *      contents of previous bitmatch if not NULL
+ *      contents of previous bitmatch if not NULL.
+ *      the buffer is a temporary userdata that is shared by 
+ *      push_shared_bitmatch when compiling is done
  *
  * paramenters
  *      l - lua state
@@ -1677,8 +2713,6 @@ static BITMATCH *realloc_bitmatch(
         current_element_count * 2 : current_element_count;
     size_t udata_size = sizeof(BITMATCH) + sizeof(ELEMENT_DESCRIPTION) * (new_element_count - 1);
     BITMATCH *new_bitmatch = (BITMATCH *)lua_newuserdata(l, udata_size);
-    luaL_getmetatable(l, "bitstring.bitmatch");
-    lua_setmetatable(l, -2);
 
     if(current_bitmatch != NULL)
     {
@@ -1719,6 +2753,123 @@ static void compile_elem(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index,
     ++state->current;
 }
 
+/*
+ * name
+ *      fixed_bits
+ *
+ * returns
+ *      size of element in bits or 0 if the size depends on input
+ *
+ * throws
+ *      size error - unsupported size of int or float element
+ */
+static size_t fixed_bits(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index)
+{
+    if(elem->size == (size_t)VAR || elem->type >= ET_ULEB128)
+    {
+        return 0;
+    }
+    if(elem->type == ET_BINARY)
+    {
+        return elem->size == (size_t)ALL || elem->size == (size_t)REST ? 0 : elem->size * CHAR_BIT;
+    }
+    if(elem->size == 0 || elem->size > sizeof(lua_Integer) * CHAR_BIT)
+    {
+        luaL_error(l, "size error: argument %d size (%d bits) is not supported", arg_index, (int)elem->size);
+    }
+    return elem->size;
+}
+
+/*
+ * name
+ *      project_bitmatch
+ *
+ * description
+ *      create bitmatch that unpacks selected elements of another bitmatch.
+ *      runs of fixed size elements that are not selected are merged into
+ *      one element that moves current bit without creating values. other
+ *      elements that are not selected are marked as skipped. element 
+ *      numbers of a projected source count each merged run as one 
+ *      element, which stays skipped
+ *
+ * paramenters
+ *      l - lua state
+ *      bitmatch_index - location of the bitmatch
+ *      fields_index - location of array of selected element numbers
+ *
+ * returns
+ *      the function pushes the projected bitmatch
+ *
+ * throws
+ *      wrong format - element number is not in the bitmatch
+ */
+static void project_bitmatch(lua_State *l, int bitmatch_index, int fields_index)
+{
+    BITMATCH *source = get_bitmatch(l, bitmatch_index);
+    luaL_checktype(l, fields_index, LUA_TTABLE);
+    size_t count = source->element_count;
+
+    unsigned char *selected = (unsigned char *)lua_newuserdata(l, count + 1);
+    memset(selected, 0, count + 1);
+    size_t field_count = lua_objlen(l, fields_index);
+    size_t i;
+    for(i = 1; i <= field_count; ++i)
+    {
+        lua_rawgeti(l, fields_index, (int)i);
+        lua_Integer field = lua_tointeger(l, -1);
+        if(!lua_isnumber(l, -1) || field < 1 || (size_t)field > count)
+        {
+            luaL_error(l, "wrong format: field %d is not an element of the bitmatch (1..%d)", 
+                    (int)field, (int)count);
+        }
+        selected[field - 1] = 1;
+        lua_pop(l, 1);
+    }
+
+    size_t udata_size = sizeof(BITMATCH) + sizeof(ELEMENT_DESCRIPTION) * (count > 0 ? count - 1 : 0);
+    BITMATCH *projected = (BITMATCH *)lua_newuserdata(l, udata_size);
+
+    size_t current = 0;
+    for(i = 0; i < count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &source->elements[i];
+        ELEMENT_DESCRIPTION *last = current > 0 ? &projected->elements[current - 1] : NULL;
+        /* merged skip of a projected source creates no value even when selected */
+        int merged = elem->skip && elem->type == ET_UNDEFINED;
+        size_t bits = merged ? elem->size : fixed_bits(l, elem, (int)i + 2);
+        if((selected[i] && !merged) || elem->constant)
+        {
+            /* constants are checked by unpack and do not create values */
+            projected->elements[current] = *elem;
+            projected->elements[current].skip = 0;
+            ++current;
+        }
+        else if(bits > 0 && last != NULL && last->skip && last->type == ET_UNDEFINED)
+        {
+            last->size += bits;
+        }
+        else if(bits > 0)
+        {
+            memset(&projected->elements[current], 0, sizeof(ELEMENT_DESCRIPTION));
+            projected->elements[current].type = ET_UNDEFINED;
+            projected->elements[current].size = bits;
+            projected->elements[current].skip = 1;
+            ++current;
+        }
+        else
+        {
+            projected->elements[current] = *elem;
+            projected->elements[current].skip = 1;
+            ++current;
+        }
+    }
+    projected->element_count = current;
+    push_shared_bitmatch(l, projected);
+    /* remove the temporary bitmatch and selected flags */
+    lua_remove(l, -2);
+    lua_remove(l, -2);
+}
+
 /*
  * name
  *      l_compile
@@ -1728,12 +2879,24 @@ static void compile_elem(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index,
  *
  * paramenters
  *      l - lua state
+ *          1 - format string
+ *          2 - optional table of options. fields - array of element
+ *              numbers to unpack, see bitstring.project
  *
  * returns
  *      1
  */
 static int l_compile(lua_State *l)
 {
+    PROBE_PROTECT(compile, l_compile);
+    /* the bitmatch is pushed after the arguments */
+    int has_options = !lua_isnoneornil(l, 2);
+    if(has_options)
+    {
+        luaL_checktype(l, 2, LUA_TTABLE);
+    }
+
+    PROBE_ENTRY(compile, probe_layout(l), lua_objlen(l, 1));
     size_t default_element_count = 32;
     COMPILE_STATE state;
     state.current = 0;
@@ -1742,32 +2905,127 @@ static int l_compile(lua_State *l)
     realloc_bitmatch(l, &state);
     parse(l, compile_elem, (void *)&state);
     state.bitmatch->element_count = state.current;
+    push_shared_bitmatch(l, state.bitmatch);
+    lua_remove(l, -2);
+
+    if(has_options)
+    {
+        int bitmatch_index = lua_gettop(l);
+        lua_getfield(l, 2, "fields");
+        if(lua_isnil(l, -1))
+        {
+            lua_pop(l, 1);
+        }
+        else
+        {
+            project_bitmatch(l, bitmatch_index, lua_gettop(l));
+        }
+    }
+    PROBE_RETURN(compile, probe_layout(l), get_bitmatch(l, -1)->element_count, lua_objlen(l, 1), 0, 0);
+    return 1;
+}
+
+/*
+ * name
+ *      l_project
+ *
+ * description
+ *      lua_CFunction that creates bitmatch which unpacks selected
+ *      elements only
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - format string or bitmatch
+ *          2 - array of numbers of the selected elements. starts from 1
+ *
+ * returns
+ *      the projected bitmatch
+ */
+static int l_project(lua_State *l)
+{
+    luaL_checktype(l, 2, LUA_TTABLE);
+    int bitmatch_index = 1;
+    if(lua_isstring(l, 1))
+    {
+        lua_pushcfunction(l, l_compile);
+        lua_pushvalue(l, 1);
+        lua_call(l, 1, 1);
+        bitmatch_index = lua_gettop(l);
+    }
+    project_bitmatch(l, bitmatch_index, 2);
     return 1;
 }
 
 #include "bitstring/lhexdump.c"
 #include "bitstring/lbindump.c"
+#include "bitstring/bitstring.c"
+#include "bitstring/lcodegen.c"
+#include "bitstring/ljit.c"
+#include "bitstring/lchecksum.c"
+#include "bitstring/lbuffer.c"
+#include "bitstring/lbitops.c"
+#include "bitstring/lvarint.c"
+#include "bitstring/lvlc.c"
+#include "bitstring/lswitch.c"
+#include "bitstring/ltry.c"
+#include "bitstring/lcolumns.c"
+#include "bitstring/lplans.c"
+#include "bitstring/lwritev.c"
+#include "bitstring/lpcap.c"
+#include "bitstring/lstats.c"
 
 static const struct luaL_reg bitstring [] = 
 {
     {"pack", l_pack},
     {"unpack", l_unpack},
+    {"match", l_match},
     {"compile", l_compile},
+    {"project", l_project},
     {"hexdump", l_hexdump},
     {"hexstream", l_hexstream},
     {"fromhexstream", l_fromhexstream},
     {"bindump", l_bindump},
     {"binstream", l_binstream},
     {"frombinstream", l_frombinstream},
+    {"codegen", l_codegen},
+    {"crc", l_crc},
+    {"inet_checksum", l_inet_checksum},
+    {"findbits", l_findbits},
+    {"buffer", l_buffer},
+    {"band", l_band},
+    {"bor", l_bor},
+    {"bxor", l_bxor},
+    {"bnot", l_bnot},
+    {"popcount", l_popcount},
+    {"subbits", l_subbits},
+    {"shift", l_shift},
+    {"vlc_table", l_vlc_table},
+    {"vlc_decode", l_vlc_decode},
+    {"switch", l_switch},
+    {"switch_unpack", l_switch_unpack},
+    {"tryunpack", l_tryunpack},
+    {"trypack", l_trypack},
+    {"strerror", l_strerror},
+    {"decode_columns", l_decode_columns},
+    {"plans", l_plans},
+    {"writev", l_writev},
+    {"pcap_reader", l_pcap_reader},
+    {"pcap_writer", l_pcap_writer},
+    {"stats", l_stats},
     {NULL, NULL}  /* sentinel */
 };
 
 static int bitmatch_gc(lua_State *l)
 {
-    BITMATCH *bitmatch = (BITMATCH *)lua_touserdata(l, 1);
+    BITMATCH_HANDLE *handle = (BITMATCH_HANDLE *)lua_touserdata(l, 1);
     /*
-    printf("deleting bitmatch with %d elements\n", bitmatch->element_count);
+    printf("deleting bitmatch with %d elements\n", handle->bitmatch->element_count);
     */
+    if(handle->bitmatch != NULL)
+    {
+        release_bitmatch(handle->bitmatch);
+        handle->bitmatch = NULL;
+    }
     return 0;
 }
 
@@ -1800,7 +3058,13 @@ int luaopen_bitstring(lua_State *l)
 #endif
 {
     init_bitmatch_type(l);
+    init_buffer_type(l);
+    init_vlc_type(l);
+    init_switch_type(l);
+    init_column_type(l);
+    init_pcap_types(l);
     luaL_openlib(l, "bitstring", bitstring, 0);
+    init_luajit_backend(l);
     return 1;
 }
 
@@ -0,0 +1,474 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * mutable byte buffer.
+ * bitstring.buffer is a userdata that owns a byte array allocated with 
+ * the lua allocator. functions that produce bytes may write into a buffer 
+ * instead of creating a new string, so the same memory is reused between
+ * calls.
+ */
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif // WIN32
+
+#define BUFFER_TYPE "bitstring.buffer"
+/* default number of bytes that buf:readfrom requests */
+#define BUFFER_READ_SIZE 65536
+/* bytes of the pack scratch buffer that are kept between calls */
+#define PACK_SCRATCH_KEEP (1024 * 1024)
+
+/*
+ * buffer userdata
+ */
+typedef struct
+{
+    /* number of bytes in use */
+    size_t len;
+    /* number of allocated bytes */
+    size_t capacity;
+    /* the bytes. NULL when capacity is 0 */
+    unsigned char *data;
+} BUFFER;
+
+/*
+ * name
+ *      check_buffer
+ *
+ * description
+ *      get a userdata from index and verify that it is bitstring.buffer
+ */
+static BUFFER *check_buffer(lua_State *l, int index)
+{
+    return (BUFFER *)luaL_checkudata(l, index, BUFFER_TYPE);
+}
+
+/*
+ * name
+ *      to_buffer
+ *
+ * returns
+ *      the buffer at index or NULL if the value is not bitstring.buffer
+ */
+static BUFFER *to_buffer(lua_State *l, int index)
+{
+    if(lua_type(l, index) != LUA_TUSERDATA)
+    {
+        return NULL;
+    }
+    BUFFER *buffer = (BUFFER *)lua_touserdata(l, index);
+    if(!lua_getmetatable(l, index))
+    {
+        return NULL;
+    }
+    luaL_getmetatable(l, BUFFER_TYPE);
+    int is_buffer = lua_rawequal(l, -1, -2);
+    lua_pop(l, 2);
+    return is_buffer ? buffer : NULL;
+}
+
+/*
+ * name
+ *      reserve_buffer
+ *
+ * description
+ *      grow capacity of buffer to at least capacity bytes. contents are kept
+ *
+ * throws
+ *      memory error
+ */
+static void reserve_buffer(lua_State *l, BUFFER *buffer, size_t capacity)
+{
+    if(capacity <= buffer->capacity)
+    {
+        return;
+    }
+
+    size_t new_capacity = buffer->capacity * 2;
+    if(new_capacity < capacity)
+    {
+        new_capacity = capacity;
+    }
+
+    void *ud = NULL;
+    lua_Alloc alloc = lua_getallocf(l, &ud);
+    unsigned char *data = (unsigned char *)alloc(ud, buffer->data, buffer->capacity, new_capacity);
+    if(data == NULL)
+    {
+        luaL_error(l, "not enough memory for buffer of %d bytes", (int)new_capacity);
+    }
+    buffer->data = data;
+    buffer->capacity = new_capacity;
+}
+
+/*
+ * name
+ *      resize_buffer
+ *
+ * description
+ *      set length of buffer. new bytes are zero
+ */
+static void resize_buffer(lua_State *l, BUFFER *buffer, size_t len)
+{
+    reserve_buffer(l, buffer, len);
+    if(len > buffer->len)
+    {
+        memset(buffer->data + buffer->len, 0, len - buffer->len);
+    }
+    buffer->len = len;
+}
+
+/*
+ * name
+ *      check_bytes
+ *
+ * description
+ *      get bytes of string or bitstring.buffer argument
+ *
+ * paramenters
+ *      l - lua state
+ *      index - argument index
+ *      len - out parameter. length of the bytes
+ *
+ * returns
+ *      pointer to the bytes
+ */
+static const unsigned char *check_bytes(lua_State *l, int index, size_t *len)
+{
+    BUFFER *buffer = to_buffer(l, index);
+    if(buffer != NULL)
+    {
+        *len = buffer->len;
+        return buffer->data;
+    }
+    return (const unsigned char *)luaL_checklstring(l, index, len);
+}
+
+/*
+ * name
+ *      l_buffer
+ *
+ * description
+ *      lua_CFunction that creates a buffer
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - optional initial contents string or length in bytes of
+ *              zero filled buffer. default is empty buffer
+ *
+ * returns
+ *      the buffer
+ */
+static int l_buffer(lua_State *l)
+{
+    size_t len = 0;
+    const char *init = NULL;
+    if(lua_type(l, 1) == LUA_TSTRING)
+    {
+        init = lua_tolstring(l, 1, &len);
+    }
+    else if(!lua_isnoneornil(l, 1))
+    {
+        lua_Integer size = luaL_checkinteger(l, 1);
+        luaL_argcheck(l, size >= 0, 1, "negative length");
+        len = (size_t)size;
+    }
+
+    BUFFER *buffer = (BUFFER *)lua_newuserdata(l, sizeof(BUFFER));
+    buffer->len = 0;
+    buffer->capacity = 0;
+    buffer->data = NULL;
+    luaL_getmetatable(l, BUFFER_TYPE);
+    lua_setmetatable(l, -2);
+
+    resize_buffer(l, buffer, len);
+    if(init != NULL)
+    {
+        memcpy(buffer->data, init, len);
+    }
+    return 1;
+}
+
+/*
+ * name
+ *      buffer_tostring
+ *
+ * description
+ *      lua_CFunction that copies contents of buffer into a string
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - buffer
+ *          2, 3 - optional start and end positions as in get_substring
+ *
+ * returns
+ *      the string
+ */
+static int buffer_tostring(lua_State *l)
+{
+    BUFFER *buffer = check_buffer(l, 1);
+    if(buffer->len == 0)
+    {
+        lua_pushliteral(l, "");
+        return 1;
+    }
+    size_t len = 0;
+    const unsigned char *start = get_substring(l, &len, 1, 2, 3);
+    lua_pushlstring(l, (const char *)start, len);
+    return 1;
+}
+
+/*
+ * name
+ *      buffer_readfrom
+ *
+ * description
+ *      lua_CFunction that reads from file descriptor into spare capacity
+ *      of buffer. the bytes are appended to contents of the buffer
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - buffer
+ *          2 - file descriptor or lua file
+ *          3 - optional maximal number of bytes to read
+ *
+ * returns
+ *      number of bytes read, 0 at the end of file, or nil, error message
+ *      and error number if the read failed
+ *
+ * rationale
+ *      one read system call per invocation. the buffer is passed to
+ *      unpack and other functions as is, so received bytes are never
+ *      interned as a lua string
+ */
+static int buffer_readfrom(lua_State *l)
+{
+    BUFFER *buffer = check_buffer(l, 1);
+    int fd = check_fd(l, 2);
+    lua_Integer max = luaL_optinteger(l, 3, BUFFER_READ_SIZE);
+    luaL_argcheck(l, max > 0, 3, "positive length expected");
+
+    reserve_buffer(l, buffer, buffer->len + (size_t)max);
+#ifdef WIN32
+    int result;
+    do
+    {
+        result = _read(fd, buffer->data + buffer->len, (unsigned int)max);
+    } while(result < 0 && errno == EINTR);
+#else
+    ssize_t result;
+    do
+    {
+        result = read(fd, buffer->data + buffer->len, (size_t)max);
+    } while(result < 0 && errno == EINTR);
+#endif // WIN32
+
+    if(result < 0)
+    {
+        int error = errno;
+        lua_pushnil(l);
+        lua_pushstring(l, strerror(error));
+        lua_pushinteger(l, error);
+        return 3;
+    }
+    buffer->len += (size_t)result;
+    lua_pushinteger(l, (lua_Integer)result);
+    return 1;
+}
+
+/*
+ * name
+ *      buffer_discard
+ *
+ * description
+ *      lua_CFunction that removes bytes from the start of buffer. the 
+ *      capacity is kept
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - buffer
+ *          2 - optional number of bytes. default is the whole buffer
+ *
+ * returns
+ *      the buffer
+ */
+static int buffer_discard(lua_State *l)
+{
+    BUFFER *buffer = check_buffer(l, 1);
+    lua_Integer count = luaL_optinteger(l, 2, (lua_Integer)buffer->len);
+    luaL_argcheck(l, count >= 0 && (size_t)count <= buffer->len, 2, "out of range");
+
+    if(count > 0)
+    {
+        memmove(buffer->data, buffer->data + count, buffer->len - (size_t)count);
+        buffer->len -= (size_t)count;
+    }
+    lua_settop(l, 1);
+    return 1;
+}
+
+/*
+ * name
+ *      get_pack_scratch
+ *
+ * description
+ *      get scratch buffer of the lua state that is kept in the registry
+ */
+static BUFFER *get_pack_scratch(lua_State *l)
+{
+    lua_getfield(l, LUA_REGISTRYINDEX, "bitstring.pack_scratch");
+    BUFFER *buffer = to_buffer(l, -1);
+    if(buffer == NULL)
+    {
+        lua_pop(l, 1);
+        lua_pushcfunction(l, l_buffer);
+        lua_call(l, 0, 1);
+        buffer = check_buffer(l, -1);
+        STATS_ALLOC(sizeof(BUFFER));
+        lua_pushvalue(l, -1);
+        lua_setfield(l, LUA_REGISTRYINDEX, "bitstring.pack_scratch");
+    }
+    lua_pop(l, 1);
+    return buffer;
+}
+
+/*
+ * name
+ *      pack_scratch
+ *
+ * description
+ *      get scratch buffer of the lua state for packing results of known 
+ *      size. the buffer grows to the requested length. bytes above 
+ *      PACK_SCRATCH_KEEP are released by release_pack_scratch
+ *
+ * returns
+ *      at least len bytes
+ */
+static unsigned char *pack_scratch(lua_State *l, size_t len)
+{
+    BUFFER *buffer = get_pack_scratch(l);
+    if(len <= PACK_SCRATCH_KEEP && buffer->capacity > PACK_SCRATCH_KEEP)
+    {
+        /* left by a call that raised an error */
+        release_pack_scratch(l);
+    }
+    reserve_buffer(l, buffer, len);
+    return buffer->data;
+}
+
+/*
+ * name
+ *      release_pack_scratch
+ *
+ * description
+ *      release the scratch buffer when it is larger than PACK_SCRATCH_KEEP.
+ *      called when the packed bytes are no longer used
+ *
+ * rationale
+ *      a single large pack would otherwise hold its memory for the life 
+ *      of the lua state
+ */
+static void release_pack_scratch(lua_State *l)
+{
+    BUFFER *buffer = get_pack_scratch(l);
+    if(buffer->capacity > PACK_SCRATCH_KEEP)
+    {
+        void *ud = NULL;
+        lua_Alloc alloc = lua_getallocf(l, &ud);
+        alloc(ud, buffer->data, buffer->capacity, 0);
+        buffer->data = NULL;
+        buffer->capacity = 0;
+        buffer->len = 0;
+    }
+}
+
+/*
+ * name
+ *      buffer_len
+ *
+ * description
+ *      __len metamethod
+ *
+ * returns
+ *      number of bytes in use
+ */
+static int buffer_len(lua_State *l)
+{
+    BUFFER *buffer = check_buffer(l, 1);
+    lua_pushinteger(l, (lua_Integer)buffer->len);
+    return 1;
+}
+
+/*
+ * name
+ *      buffer_gc
+ *
+ * description
+ *      __gc metamethod. release the bytes
+ */
+static int buffer_gc(lua_State *l)
+{
+    BUFFER *buffer = check_buffer(l, 1);
+    void *ud = NULL;
+    lua_Alloc alloc = lua_getallocf(l, &ud);
+    alloc(ud, buffer->data, buffer->capacity, 0);
+    buffer->data = NULL;
+    buffer->capacity = 0;
+    buffer->len = 0;
+    return 0;
+}
+
+static const struct luaL_reg buffer_methods [] = 
+{
+    {"tostring", buffer_tostring},
+    {"readfrom", buffer_readfrom},
+    {"discard", buffer_discard},
+    {NULL, NULL}  /* sentinel */
+};
+
+/*
+ * name
+ *      init_buffer_type
+ *
+ * description
+ *      register metatable of bitstring.buffer
+ */
+static void init_buffer_type(lua_State *l)
+{
+    luaL_newmetatable(l, BUFFER_TYPE);
+    lua_pushcfunction(l, buffer_gc);
+    lua_setfield(l, -2, "__gc");
+    lua_pushcfunction(l, buffer_len);
+    lua_setfield(l, -2, "__len");
+    lua_newtable(l);
+    luaL_register(l, NULL, buffer_methods);
+    lua_setfield(l, -2, "__index");
+    lua_pop(l, 1);
+}
@@ -0,0 +1,370 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * checksums of byte strings.
+ * crc kinds
+ *      crc16 - CRC-16/CCITT-FALSE. polynomial 0x1021, initial value 0xffff,
+ *              not reflected, no final xor. check value 0x29b1
+ *      crc32 - CRC-32 (IEEE 802.3). reflected polynomial 0xedb88320, initial
+ *              value and final xor 0xffffffff. check value 0xcbf43926
+ *      crc32c - CRC-32C (Castagnoli). reflected polynomial 0x82f63b78, 
+ *              initial value and final xor 0xffffffff. check value 0xe3069283
+ *
+ * the crc tables are computed once for slicing by 8 bytes. crc32c uses 
+ * the SSE4.2 crc32 instruction when the cpu supports it.
+ */
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif // HAVE_PTHREAD
+
+#define CRC_SLICES 8
+
+/*
+ * crc kinds
+ */
+typedef enum
+{
+    CRC_16 = 0,
+    CRC_32,
+    CRC_32C,
+} CRC_KIND;
+
+/*
+ * crc kind tokens
+ */
+static const char *CRC_KINDS[] =
+{
+    "crc16",
+    "crc32",
+    "crc32c",
+    NULL
+};
+
+static uint16_t CRC16_TABLE[CRC_SLICES][256];
+static uint32_t CRC32_TABLE[CRC_SLICES][256];
+static uint32_t CRC32C_TABLE[CRC_SLICES][256];
+#ifdef HAVE_PTHREAD
+static pthread_once_t CRC_TABLES_ONCE = PTHREAD_ONCE_INIT;
+#else
+static int crc_tables_ready = 0;
+#endif // HAVE_PTHREAD
+
+/*
+ * name
+ *      init_reflected_table
+ *
+ * description
+ *      compute slicing tables of reflected 32 bit crc. 
+ *      table[k][b] is crc of byte b followed by k zero bytes
+ */
+static void init_reflected_table(uint32_t table[CRC_SLICES][256], uint32_t polynomial)
+{
+    uint32_t b;
+    for(b = 0; b < 256; ++b)
+    {
+        uint32_t crc = b;
+        int k;
+        for(k = 0; k < CHAR_BIT; ++k)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ polynomial : crc >> 1;
+        }
+        table[0][b] = crc;
+    }
+
+    int slice;
+    for(slice = 1; slice < CRC_SLICES; ++slice)
+    {
+        for(b = 0; b < 256; ++b)
+        {
+            uint32_t crc = table[slice - 1][b];
+            table[slice][b] = (crc >> 8) ^ table[0][crc & 0xff];
+        }
+    }
+}
+
+/*
+ * name
+ *      compute_crc_tables
+ *
+ * description
+ *      compute the crc tables
+ */
+static void compute_crc_tables()
+{
+    uint32_t b;
+    for(b = 0; b < 256; ++b)
+    {
+        uint16_t crc = (uint16_t)(b << 8);
+        int k;
+        for(k = 0; k < CHAR_BIT; ++k)
+        {
+            crc = crc & 0x8000 ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+        CRC16_TABLE[0][b] = crc;
+    }
+
+    int slice;
+    for(slice = 1; slice < CRC_SLICES; ++slice)
+    {
+        for(b = 0; b < 256; ++b)
+        {
+            uint16_t crc = CRC16_TABLE[slice - 1][b];
+            CRC16_TABLE[slice][b] = (uint16_t)((crc << 8) ^ CRC16_TABLE[0][crc >> 8]);
+        }
+    }
+
+    init_reflected_table(CRC32_TABLE, 0xedb88320);
+    init_reflected_table(CRC32C_TABLE, 0x82f63b78);
+}
+
+/*
+ * name
+ *      init_crc_tables
+ *
+ * description
+ *      compute the crc tables on first use. lua states of other threads
+ *      may use them at the same time
+ */
+static void init_crc_tables()
+{
+#ifdef HAVE_PTHREAD
+    pthread_once(&CRC_TABLES_ONCE, compute_crc_tables);
+#else
+    if(!crc_tables_ready)
+    {
+        compute_crc_tables();
+        crc_tables_ready = 1;
+    }
+#endif // HAVE_PTHREAD
+}
+
+/*
+ * name
+ *      crc16
+ *
+ * description
+ *      update not reflected 16 bit crc with len bytes of input
+ */
+static uint16_t crc16(uint16_t crc, const unsigned char *input, size_t len)
+{
+    while(len >= CRC_SLICES)
+    {
+        uint16_t x = crc ^ (uint16_t)((input[0] << 8) | input[1]);
+        crc = CRC16_TABLE[7][x >> 8] ^ CRC16_TABLE[6][x & 0xff] ^
+            CRC16_TABLE[5][input[2]] ^ CRC16_TABLE[4][input[3]] ^
+            CRC16_TABLE[3][input[4]] ^ CRC16_TABLE[2][input[5]] ^
+            CRC16_TABLE[1][input[6]] ^ CRC16_TABLE[0][input[7]];
+        input += CRC_SLICES;
+        len -= CRC_SLICES;
+    }
+    while(len > 0)
+    {
+        crc = (uint16_t)(crc << 8) ^ CRC16_TABLE[0][(crc >> 8) ^ *input];
+        ++input;
+        --len;
+    }
+    return crc;
+}
+
+/*
+ * name
+ *      crc32_reflected
+ *
+ * description
+ *      update reflected 32 bit crc with len bytes of input
+ */
+static uint32_t crc32_reflected(uint32_t table[CRC_SLICES][256], uint32_t crc, const unsigned char *input, size_t len)
+{
+    while(len >= CRC_SLICES)
+    {
+        uint32_t low = crc ^ ((uint32_t)input[0] | ((uint32_t)input[1] << 8) | 
+                ((uint32_t)input[2] << 16) | ((uint32_t)input[3] << 24));
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+            table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+            table[3][input[4]] ^ table[2][input[5]] ^
+            table[1][input[6]] ^ table[0][input[7]];
+        input += CRC_SLICES;
+        len -= CRC_SLICES;
+    }
+    while(len > 0)
+    {
+        crc = (crc >> 8) ^ table[0][(crc ^ *input) & 0xff];
+        ++input;
+        --len;
+    }
+    return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32C_HARDWARE 1
+
+/*
+ * name
+ *      crc32c_hardware
+ *
+ * description
+ *      update crc32c with len bytes of input using SSE4.2 crc32 instruction
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char *input, size_t len)
+{
+    uint64_t crc64 = crc;
+    while(len >= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, input, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        input += sizeof(word);
+        len -= sizeof(word);
+    }
+    crc = (uint32_t)crc64;
+    while(len > 0)
+    {
+        crc = __builtin_ia32_crc32qi(crc, *input);
+        ++input;
+        --len;
+    }
+    return crc;
+}
+#endif // __GNUC__ && __x86_64__
+
+/*
+ * name
+ *      l_crc
+ *
+ * description
+ *      lua_CFunction for computing crc of a string
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - crc kind. "crc16", "crc32" or "crc32c"
+ *          2 - input string
+ *          3, 4 - optional start and end positions. see get_substring
+ *
+ * returns
+ *      the crc as number. the crc of empty input is the crc of no data
+ */
+static int l_crc(lua_State *l)
+{
+    CRC_KIND kind = (CRC_KIND)luaL_checkoption(l, 1, NULL, CRC_KINDS);
+    size_t len = 0;
+    const unsigned char *input = check_bytes(l, 2, &len);
+    if(len != 0)
+    {
+        input = get_substring(l, &len, 2, 3, 4);
+    }
+    init_crc_tables();
+
+    uint32_t crc = 0;
+    if(kind == CRC_16)
+    {
+        crc = crc16(0xffff, input, len);
+    }
+    else if(kind == CRC_32)
+    {
+        crc = crc32_reflected(CRC32_TABLE, 0xffffffff, input, len) ^ 0xffffffff;
+    }
+    else
+    {
+#ifdef CRC32C_HARDWARE
+        if(__builtin_cpu_supports("sse4.2"))
+        {
+            crc = crc32c_hardware(0xffffffff, input, len) ^ 0xffffffff;
+        }
+        else
+#endif // CRC32C_HARDWARE
+        {
+            crc = crc32_reflected(CRC32C_TABLE, 0xffffffff, input, len) ^ 0xffffffff;
+        }
+    }
+    lua_pushnumber(l, crc);
+    return 1;
+}
+
+/*
+ * name
+ *      l_inet_checksum
+ *
+ * description
+ *      lua_CFunction for computing RFC 1071 internet checksum of a string.
+ *      16 bit big endian words are summed in 64 bit accumulator eight bytes
+ *      at a time and folded to 16 bits. odd length is padded with zero byte
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - input string
+ *          2, 3 - optional start and end positions. see get_substring
+ *
+ * returns
+ *      one's complement of the one's complement sum as number
+ */
+static int l_inet_checksum(lua_State *l)
+{
+    size_t len = 0;
+    const unsigned char *input = check_bytes(l, 1, &len);
+    if(len != 0)
+    {
+        input = get_substring(l, &len, 1, 2, 3);
+    }
+
+    /* 
+     * the one's complement sum does not depend on byte order of the words,
+     * so words are summed in native order and swapped after folding
+     */
+    uint64_t sum = 0;
+    while(len >= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, input, sizeof(word));
+        sum += word & 0xffffffff;
+        sum += word >> 32;
+        input += sizeof(word);
+        len -= sizeof(word);
+    }
+
+    unsigned char tail[sizeof(uint64_t)] = {0};
+    memcpy(tail, input, len);
+    uint64_t word;
+    memcpy(&word, tail, sizeof(word));
+    sum += word & 0xffffffff;
+    sum += word >> 32;
+
+    while(sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    /* bytes of the folded sum are in native order */
+    unsigned char folded[2];
+    uint16_t native = (uint16_t)sum;
+    memcpy(folded, &native, sizeof(native));
+    uint16_t checksum = (uint16_t)((folded[0] << 8) | folded[1]);
+    lua_pushnumber(l, (uint16_t)~checksum);
+    return 1;
+}
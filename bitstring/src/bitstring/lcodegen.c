@@ -0,0 +1,1870 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * code generator for compiled bitmatch objects.
+ * emits C or Lua source of a module with pack and unpack functions
+ * for a single layout. the generated functions behave as bitstring.pack
+ * and bitstring.unpack called with the bitmatch, without the element
+ * dispatch. offsets, shifts and masks are emitted as constants.
+ *
+ * the elements are split into segments. a segment starts at the beginning
+ * of the output and after every all or rest binary string. offsets of
+ * elements are known at generation time relative to the start of their
+ * segment. all and rest binary strings must start on byte bounds.
+ */
+
+#define CODEGEN_LINE_LENGTH 512
+
+/*
+ * the generated lua module uses lua numbers for integers
+ */
+#define CODEGEN_LUA_MAX_INT_BITS 53
+
+/*
+ * maximal number of arguments of a generated lua function call or
+ * parameter list
+ */
+#define CODEGEN_LUA_MAX_ARGS 50
+
+/*
+ * maximal number of elements of a bitmatch for the generated luajit module
+ */
+#define CODEGEN_LUAJIT_MAX_ELEMENTS 64
+
+/*
+ * maximal size in bytes of unaligned binary string for the generated 
+ * luajit module
+ */
+#define CODEGEN_LUAJIT_MAX_UNALIGNED_BYTES 64
+
+/*
+ * languages of the generated code
+ */
+typedef enum
+{
+    CL_C = 0,
+    CL_LUA,
+    CL_LUAJIT,
+} CODEGEN_LANGUAGE;
+
+/*
+ * language tokens
+ */
+static const char *CODEGEN_LANGUAGES[] =
+{
+    "c",
+    "lua",
+    "luajit",
+    NULL
+};
+
+/*
+ * location of an element in the generated code
+ */
+typedef struct
+{
+    /* segment of the element */
+    size_t segment;
+    /* offset in bits from the start of the segment */
+    size_t offset;
+    /* size in bits of fixed size elements. 0 for all and rest */
+    size_t bits;
+} CODEGEN_ELEMENT;
+
+/*
+ * code generation state
+ */
+typedef struct
+{
+    /* the generated source */
+    luaL_Buffer *buffer;
+    BITMATCH *bitmatch;
+    /* array of bitmatch->element_count locations */
+    CODEGEN_ELEMENT *elements;
+    /* number of segments */
+    size_t segment_count;
+    /* bits in fixed size elements */
+    size_t fixed_bits;
+    /* name of the generated module */
+    const char *name;
+    /* error message for pack or NULL if bitmatch can be packed */
+    const char *pack_error;
+    /* error message for unpack or NULL if bitmatch can be unpacked */
+    const char *unpack_error;
+} CODEGEN_STATE;
+
+/*
+ * name
+ *      emit
+ *
+ * description
+ *      append formatted text to generated source
+ */
+static void emit(CODEGEN_STATE *state, const char *fmt, ...)
+{
+    char line[CODEGEN_LINE_LENGTH];
+    va_list args;
+    va_start(args, fmt);
+#ifdef WIN32
+    _vsnprintf(
+#else
+    vsnprintf(
+#endif
+        line, sizeof(line), fmt, args);
+    va_end(args);
+    line[sizeof(line) - 1] = '\0';
+    luaL_addstring(state->buffer, line);
+}
+
+/*
+ * name
+ *      is_dynamic
+ *
+ * description
+ *      check if element is a binary string with all or rest size
+ */
+static int is_dynamic(ELEMENT_DESCRIPTION *elem)
+{
+    return elem->type == ET_BINARY && (elem->size == (size_t)ALL || elem->size == (size_t)REST);
+}
+
+/*
+ * name
+ *      layout_elements
+ *
+ * description
+ *      validate elements and calculate segment and offset of each element
+ *
+ * paramenters
+ *      l - lua state
+ *      state - code generation state
+ *      max_int_bits - maximal size of integer supported by the generated code
+ *      allow_float - floating point elements are supported by the generated code
+ *
+ * throws
+ *      wrong format - element can not be generated
+ *      size error - size of element is not supported
+ */
+static void layout_elements(lua_State *l, CODEGEN_STATE *state, size_t max_int_bits, int allow_float)
+{
+    size_t segment = 0;
+    size_t offset = 0;
+    state->fixed_bits = 0;
+    state->pack_error = NULL;
+    state->unpack_error = NULL;
+
+    size_t i;
+    for(i = 0; i < state->bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &state->bitmatch->elements[i];
+        CODEGEN_ELEMENT *location = &state->elements[i];
+        int arg_index = i + 1;
+
+        if(elem->size == 0)
+        {
+            luaL_error(l, "size error: argument %d", arg_index);
+        }
+
+        if(state->unpack_error == NULL && segment > 0)
+        {
+            state->unpack_error = "size error: no input left after rest element";
+        }
+
+        location->segment = segment;
+        location->offset = offset;
+        if(elem->skip)
+        {
+            luaL_error(l, "wrong format: projected bitmatch is not supported by the generated code");
+        }
+        else if(elem->constant)
+        {
+            luaL_error(l, "wrong format: argument %d: constant values are not supported by the generated code", 
+                    arg_index);
+        }
+        else if(elem->size == (size_t)VAR || elem->type >= ET_ULEB128)
+        {
+            luaL_error(l, "wrong format: argument %d: variable length integers are not supported by the generated code", 
+                    arg_index);
+        }
+        else if(elem->type == ET_INTEGER)
+        {
+            if(elem->size > max_int_bits)
+            {
+                luaL_error(l, "size error: argument %d size (%d bits) exceeds the generated integer size (%d bits)",
+                        arg_index, (int)elem->size, (int)max_int_bits);
+            }
+            if(elem->size % CHAR_BIT != 0 && elem->endianess == EE_LITTLE)
+            {
+                luaL_error(l, "wrong format: argument %d: little endianess supported for %d bit bounds only", 
+                        arg_index, CHAR_BIT);
+            }
+            location->bits = elem->size;
+        }
+        else if(elem->type == ET_FLOAT)
+        {
+            if(!allow_float)
+            {
+                luaL_error(l, "wrong format: argument %d: float is not supported by the generated code", arg_index);
+            }
+            if(elem->size != sizeof(float) * CHAR_BIT && elem->size != sizeof(double) * CHAR_BIT)
+            {
+                luaL_error(l, "size error: unsupported size %d for argument %d", (int)elem->size, arg_index);
+            }
+            if(elem->endianess != EE_DEFAULT)
+            {
+                luaL_error(l, "wrong format: unsupported endianess in argument %d", arg_index);
+            }
+            location->bits = elem->size;
+        }
+        else if(is_dynamic(elem))
+        {
+            if(offset % CHAR_BIT != 0)
+            {
+                luaL_error(l, "wrong format: argument %d: all and rest are supported on byte bounds only", arg_index);
+            }
+            if(elem->size == (size_t)ALL && state->unpack_error == NULL)
+            {
+                state->unpack_error = "wrong format: all length specifier can not be unpacked";
+            }
+            if(elem->size == (size_t)REST && state->pack_error == NULL)
+            {
+                state->pack_error = "wrong format: rest length specifier can not be packed";
+            }
+            location->bits = 0;
+            ++segment;
+            offset = 0;
+            continue;
+        }
+        else if(elem->type == ET_BINARY)
+        {
+            location->bits = elem->size * CHAR_BIT;
+        }
+        else
+        {
+            luaL_error(l, "wrong format: unexpected type %d", elem->type);
+        }
+        offset += location->bits;
+        state->fixed_bits += location->bits;
+    }
+    state->segment_count = segment + 1;
+}
+
+/*
+ * name
+ *      emit_c_comment
+ *
+ * description
+ *      emit C comment that describes the element
+ */
+static void emit_c_comment(CODEGEN_STATE *state, ELEMENT_DESCRIPTION *elem, int arg_index)
+{
+    if(elem->size == (size_t)ALL && elem->type == ET_BINARY)
+    {
+        emit(state, "    /* element %d: %s:%s */\n", arg_index, ALL_SPECIFIER, TYPES[elem->type]);
+    }
+    else if(elem->size == (size_t)REST && elem->type == ET_BINARY)
+    {
+        emit(state, "    /* element %d: %s:%s */\n", arg_index, REST_SPECIFIER, TYPES[elem->type]);
+    }
+    else
+    {
+        emit(state, "    /* element %d: %d:%s:%s */\n", arg_index, 
+                (int)elem->size, TYPES[elem->type], ENDIANESSES[elem->endianess]);
+    }
+}
+
+/*
+ * name
+ *      emit_c_read
+ *
+ * description
+ *      emit C expression that reads size bits at bit offset of segment pointer p
+ *      as big endian unsigned integer
+ */
+static void emit_c_read(CODEGEN_STATE *state, size_t offset, size_t size)
+{
+    size_t first = offset / CHAR_BIT;
+    size_t last = (offset + size - 1) / CHAR_BIT;
+    size_t bit_offset = offset % CHAR_BIT;
+    size_t i;
+    emit(state, "(");
+    for(i = first; i <= last; ++i)
+    {
+        long shift = (long)(offset + size) - (long)((i + 1) * CHAR_BIT);
+        if(i != first)
+        {
+            emit(state, " | ");
+        }
+        if(i == first && bit_offset != 0)
+        {
+            emit(state, "((uint64_t)(p[%d] & 0x%02x)", (int)i, 0xff >> bit_offset);
+        }
+        else
+        {
+            emit(state, "((uint64_t)p[%d]", (int)i);
+        }
+
+        if(shift > 0)
+        {
+            emit(state, " << %ld)", shift);
+        }
+        else if(shift < 0)
+        {
+            emit(state, " >> %ld)", -shift);
+        }
+        else
+        {
+            emit(state, ")");
+        }
+    }
+    emit(state, ")");
+}
+
+/*
+ * name
+ *      emit_c_swap
+ *
+ * description
+ *      emit C expression that reverses the order of bytes of variable t
+ */
+static void emit_c_swap(CODEGEN_STATE *state, size_t size)
+{
+    size_t count = size / CHAR_BIT;
+    size_t i;
+    emit(state, "(");
+    for(i = 0; i < count; ++i)
+    {
+        if(i != 0)
+        {
+            emit(state, " | ");
+        }
+        emit(state, "(((t >> %d) & 0xff) << %d)", (int)(i * CHAR_BIT), (int)((count - i - 1) * CHAR_BIT));
+    }
+    emit(state, ")");
+}
+
+/*
+ * name
+ *      emit_c_write
+ *
+ * description
+ *      emit C statements that write size least significant bits of
+ *      variable v at bit offset of segment pointer p
+ */
+static void emit_c_write(CODEGEN_STATE *state, size_t offset, size_t size, const char *v)
+{
+    size_t first = offset / CHAR_BIT;
+    size_t last = (offset + size - 1) / CHAR_BIT;
+    size_t i;
+    for(i = first; i <= last; ++i)
+    {
+        long shift = (long)(offset + size) - (long)((i + 1) * CHAR_BIT);
+        if(shift > 0)
+        {
+            emit(state, "    p[%d] |= (unsigned char)(%s >> %ld);\n", (int)i, v, shift);
+        }
+        else if(shift < 0)
+        {
+            emit(state, "    p[%d] |= (unsigned char)(%s << %ld);\n", (int)i, v, -shift);
+        }
+        else
+        {
+            emit(state, "    p[%d] |= (unsigned char)%s;\n", (int)i, v);
+        }
+    }
+}
+
+/*
+ * name
+ *      emit_c_write_bytes
+ *
+ * description
+ *      emit C statements that write count bytes of array v at bit
+ *      offset of segment pointer p
+ */
+static void emit_c_write_bytes(CODEGEN_STATE *state, size_t offset, size_t count, const char *v)
+{
+    size_t first = offset / CHAR_BIT;
+    size_t bit_offset = offset % CHAR_BIT;
+    if(bit_offset == 0)
+    {
+        emit(state, "    memcpy(p + %d, %s, %d);\n", (int)first, v, (int)count);
+    }
+    else
+    {
+        emit(state, "    for(k = 0; k < %d; ++k)\n", (int)count);
+        emit(state, "    {\n");
+        emit(state, "        p[%d + k] |= (unsigned char)(%s[k] >> %d);\n", (int)first, v, (int)bit_offset);
+        emit(state, "        p[%d + k] |= (unsigned char)(%s[k] << %d);\n", (int)first + 1, v, (int)(CHAR_BIT - bit_offset));
+        emit(state, "    }\n");
+    }
+}
+
+/*
+ * name
+ *      emit_c_read_bytes
+ *
+ * description
+ *      emit C statements that read count bytes at bit offset of segment 
+ *      pointer p into array v
+ */
+static void emit_c_read_bytes(CODEGEN_STATE *state, size_t offset, size_t count, const char *v)
+{
+    size_t first = offset / CHAR_BIT;
+    size_t bit_offset = offset % CHAR_BIT;
+    if(bit_offset == 0)
+    {
+        emit(state, "    memcpy(%s, p + %d, %d);\n", v, (int)first, (int)count);
+    }
+    else
+    {
+        emit(state, "    for(k = 0; k < %d; ++k)\n", (int)count);
+        emit(state, "    {\n");
+        emit(state, "        %s[k] = (unsigned char)((p[%d + k] << %d) | (p[%d + k] >> %d));\n", 
+                v, (int)first, (int)bit_offset, (int)first + 1, (int)(CHAR_BIT - bit_offset));
+        emit(state, "    }\n");
+    }
+}
+
+/*
+ * name
+ *      emit_c_pack
+ *
+ * description
+ *      emit C pack function
+ */
+static void emit_c_pack(CODEGEN_STATE *state)
+{
+    emit(state, "static int l_pack(lua_State *l)\n{\n");
+    if(state->pack_error != NULL)
+    {
+        emit(state, "    return luaL_error(l, \"%s\");\n}\n\n", state->pack_error);
+        return;
+    }
+
+    BITMATCH *bitmatch = state->bitmatch;
+    size_t i;
+    int has_dynamic = 0;
+    int has_unaligned_bytes = 0;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        CODEGEN_ELEMENT *location = &state->elements[i];
+        int arg_index = i + 1;
+        if(elem->type == ET_INTEGER)
+        {
+            emit(state, "    uint64_t v%d = (uint64_t)luaL_checkinteger(l, %d);\n", arg_index, arg_index);
+        }
+        else if(elem->type == ET_FLOAT)
+        {
+            const char *type = elem->size == sizeof(float) * CHAR_BIT ? "float" : "double";
+            emit(state, "    %s f%d = (%s)luaL_checknumber(l, %d);\n", type, arg_index, type, arg_index);
+            emit(state, "    unsigned char v%d[sizeof(%s)];\n", arg_index, type);
+            emit(state, "    memcpy(v%d, &f%d, sizeof(%s));\n", arg_index, arg_index, type);
+            has_unaligned_bytes |= location->offset % CHAR_BIT != 0;
+        }
+        else
+        {
+            emit(state, "    size_t len%d = 0;\n", arg_index);
+            emit(state, "    const unsigned char *v%d = (const unsigned char *)luaL_checklstring(l, %d, &len%d);\n",
+                    arg_index, arg_index, arg_index);
+            if(is_dynamic(elem))
+            {
+                has_dynamic = 1;
+            }
+            else
+            {
+                emit(state, "    if(len%d < %d)\n", arg_index, (int)elem->size);
+                emit(state, "    {\n");
+                emit(state, "        return luaL_error(l, \"size error: argument %d size (%d bytes) exceeds the length of input string (%%d bytes)\", (int)len%d);\n",
+                        arg_index, (int)elem->size, arg_index);
+                emit(state, "    }\n");
+                has_unaligned_bytes |= location->offset % CHAR_BIT != 0;
+            }
+        }
+    }
+
+    /* the engine drops incomplete last byte */
+    emit(state, "    size_t size = %d", (int)(state->fixed_bits / CHAR_BIT));
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        if(is_dynamic(&bitmatch->elements[i]))
+        {
+            emit(state, " + len%d", (int)i + 1);
+        }
+    }
+    emit(state, ";\n");
+
+    size_t buffer_size = bits_to_bytes(state->fixed_bits);
+    if(has_dynamic)
+    {
+        emit(state, "    unsigned char *d = (unsigned char *)lua_newuserdata(l, size + 1);\n");
+        emit(state, "    memset(d, 0, size + 1);\n");
+    }
+    else
+    {
+        emit(state, "    unsigned char d[%d];\n", (int)buffer_size);
+        emit(state, "    memset(d, 0, sizeof(d));\n");
+    }
+    emit(state, "    unsigned char *p = d;\n");
+    if(has_unaligned_bytes)
+    {
+        emit(state, "    size_t k = 0;\n");
+    }
+
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        CODEGEN_ELEMENT *location = &state->elements[i];
+        int arg_index = i + 1;
+        char v[32];
+        sprintf(v, "v%d", arg_index);
+        emit_c_comment(state, elem, arg_index);
+        if(elem->type == ET_INTEGER)
+        {
+            if(elem->size < 64)
+            {
+                emit(state, "    %s &= 0x%llxull;\n", v, (unsigned long long)((1ull << elem->size) - 1));
+            }
+            if(elem->endianess == EE_LITTLE)
+            {
+                emit(state, "    {\n");
+                emit(state, "    uint64_t t = %s;\n", v);
+                emit(state, "    %s = ", v);
+                emit_c_swap(state, elem->size);
+                emit(state, ";\n");
+                emit(state, "    }\n");
+            }
+            emit_c_write(state, location->offset, elem->size, v);
+        }
+        else if(elem->type == ET_FLOAT)
+        {
+            emit_c_write_bytes(state, location->offset, elem->size / CHAR_BIT, v);
+        }
+        else if(is_dynamic(elem))
+        {
+            size_t segment_bytes = location->offset / CHAR_BIT;
+            emit(state, "    memcpy(p + %d, %s, len%d);\n", (int)segment_bytes, v, arg_index);
+            emit(state, "    p += %d + len%d;\n", (int)segment_bytes, arg_index);
+        }
+        else
+        {
+            emit_c_write_bytes(state, location->offset, elem->size, v);
+        }
+    }
+    emit(state, "    lua_pushlstring(l, (const char *)d, size);\n");
+    emit(state, "    return 1;\n}\n\n");
+}
+
+/*
+ * name
+ *      emit_c_unpack
+ *
+ * description
+ *      emit C unpack function
+ */
+static void emit_c_unpack(CODEGEN_STATE *state)
+{
+    emit(state, "static int l_unpack(lua_State *l)\n{\n");
+    if(state->unpack_error != NULL)
+    {
+        emit(state, "    return luaL_error(l, \"%s\");\n}\n\n", state->unpack_error);
+        return;
+    }
+
+    BITMATCH *bitmatch = state->bitmatch;
+    emit(state, "    size_t len = 0;\n");
+    emit(state, "    const unsigned char *p = get_substring(l, &len, 1, 2, 3);\n");
+    emit(state, "    if(len * CHAR_BIT < %d)\n", (int)state->fixed_bits);
+    emit(state, "    {\n");
+    emit(state, "        return luaL_error(l, \"size error: layout size (%d bits) exceeds the size of input (%%d bits)\", (int)(len * CHAR_BIT));\n",
+            (int)state->fixed_bits);
+    emit(state, "    }\n");
+    emit(state, "    luaL_checkstack(l, %d, \"too many elements to unpack\");\n", (int)bitmatch->element_count);
+    emit(state, "    unsigned char b[%d];\n", (int)(state->fixed_bits / CHAR_BIT + 1));
+    emit(state, "    size_t k = 0;\n");
+    emit(state, "    uint64_t t = 0;\n");
+    emit(state, "    (void)b; (void)k; (void)t;\n");
+
+    size_t i;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        CODEGEN_ELEMENT *location = &state->elements[i];
+        int arg_index = i + 1;
+        emit_c_comment(state, elem, arg_index);
+        if(elem->type == ET_INTEGER)
+        {
+            if(elem->endianess == EE_LITTLE && location->offset % CHAR_BIT == 0)
+            {
+                size_t first = location->offset / CHAR_BIT;
+                size_t count = elem->size / CHAR_BIT;
+                size_t k;
+                emit(state, "    lua_pushinteger(l, (lua_Integer)(");
+                for(k = 0; k < count; ++k)
+                {
+                    emit(state, "%s((uint64_t)p[%d] << %d)", k == 0 ? "" : " | ", (int)(first + k), (int)(k * CHAR_BIT));
+                }
+                emit(state, "));\n");
+            }
+            else if(elem->endianess == EE_LITTLE)
+            {
+                emit(state, "    t = ");
+                emit_c_read(state, location->offset, elem->size);
+                emit(state, ";\n");
+                emit(state, "    lua_pushinteger(l, (lua_Integer)");
+                emit_c_swap(state, elem->size);
+                emit(state, ");\n");
+            }
+            else
+            {
+                emit(state, "    lua_pushinteger(l, (lua_Integer)");
+                emit_c_read(state, location->offset, elem->size);
+                emit(state, ");\n");
+            }
+        }
+        else if(elem->type == ET_FLOAT)
+        {
+            const char *type = elem->size == sizeof(float) * CHAR_BIT ? "float" : "double";
+            emit_c_read_bytes(state, location->offset, elem->size / CHAR_BIT, "b");
+            emit(state, "    {\n");
+            emit(state, "    %s f = 0;\n", type);
+            emit(state, "    memcpy(&f, b, sizeof(f));\n");
+            emit(state, "    lua_pushnumber(l, f);\n");
+            emit(state, "    }\n");
+        }
+        else if(is_dynamic(elem))
+        {
+            size_t first = location->offset / CHAR_BIT;
+            emit(state, "    lua_pushlstring(l, (const char *)p + %d, len - %d);\n", (int)first, (int)first);
+        }
+        else if(location->offset % CHAR_BIT == 0)
+        {
+            emit(state, "    lua_pushlstring(l, (const char *)p + %d, %d);\n", (int)(location->offset / CHAR_BIT), (int)elem->size);
+        }
+        else
+        {
+            emit_c_read_bytes(state, location->offset, elem->size, "b");
+            emit(state, "    lua_pushlstring(l, (const char *)b, %d);\n", (int)elem->size);
+        }
+    }
+    emit(state, "    return %d;\n}\n\n", (int)bitmatch->element_count);
+}
+
+/*
+ * name
+ *      emit_c
+ *
+ * description
+ *      emit C module
+ */
+static void emit_c(CODEGEN_STATE *state)
+{
+    emit(state, "/* generated by bitstring.codegen. do not edit */\n\n");
+    emit(state, "#include <limits.h>\n");
+    emit(state, "#include <stdint.h>\n");
+    emit(state, "#include <string.h>\n\n");
+    emit(state, "#include <lua.h>\n");
+    emit(state, "#include <lauxlib.h>\n\n");
+
+    /* same as get_substring in lbitstring.c */
+    if(state->unpack_error == NULL)
+    {
+        emit(state, "static const unsigned char *get_substring(lua_State *l, size_t *len, int string_param, int start_param, int end_param)\n{\n");
+        emit(state, "    size_t original_length = 0;\n");
+        emit(state, "    const unsigned char *original_start = (const unsigned char *)luaL_checklstring(l, string_param, &original_length);\n");
+        emit(state, "    int start_position = 1;\n");
+        emit(state, "    int end_position = original_length;\n");
+        emit(state, "    size_t start_offset = 0;\n");
+        emit(state, "    size_t end_offset = original_length;\n");
+        emit(state, "    if(lua_gettop(l) >= start_param)\n    {\n");
+        emit(state, "        start_position = luaL_checkinteger(l, start_param);\n");
+        emit(state, "        start_offset = start_position < 0 ? original_length + start_position : (size_t)(start_position - 1);\n");
+        emit(state, "    }\n");
+        emit(state, "    if(lua_gettop(l) >= end_param)\n    {\n");
+        emit(state, "        end_position = luaL_checkinteger(l, end_param);\n");
+        emit(state, "        end_offset = end_position < 0 ? original_length + end_position + 1 : (size_t)end_position;\n");
+        emit(state, "    }\n");
+        emit(state, "    if(start_offset >= end_offset || end_offset > original_length)\n    {\n");
+        emit(state, "        luaL_error(l, \"invalid parameter: start position %%d, end position %%d\", start_position, end_position);\n");
+        emit(state, "    }\n");
+        emit(state, "    *len = end_offset - start_offset;\n");
+        emit(state, "    return original_start + start_offset;\n");
+        emit(state, "}\n\n");
+    }
+
+    emit_c_pack(state);
+    emit_c_unpack(state);
+
+    emit(state, "static const struct luaL_reg %s [] =\n{\n", state->name);
+    emit(state, "    {\"pack\", l_pack},\n");
+    emit(state, "    {\"unpack\", l_unpack},\n");
+    emit(state, "    {NULL, NULL}\n");
+    emit(state, "};\n\n");
+    emit(state, "int luaopen_%s(lua_State *l)\n{\n", state->name);
+    emit(state, "    luaL_openlib(l, \"%s\", %s, 0);\n", state->name, state->name);
+    emit(state, "    return 1;\n");
+    emit(state, "}\n");
+}
+
+/*
+ * name
+ *      emit_lua_power
+ *
+ * description
+ *      emit 2 ^ exponent as lua number literal
+ */
+static void emit_lua_power(CODEGEN_STATE *state, size_t exponent)
+{
+    emit(state, "%.0f", ldexp(1.0, (int)exponent));
+}
+
+/*
+ * name
+ *      emit_lua_read
+ *
+ * description
+ *      emit Lua expression that reads size bits at bit offset of the
+ *      current segment as big endian unsigned integer. byte k of the
+ *      segment is byte(s, o + k + 1)
+ */
+static void emit_lua_read(CODEGEN_STATE *state, size_t offset, size_t size)
+{
+    size_t first = offset / CHAR_BIT;
+    size_t last = (offset + size - 1) / CHAR_BIT;
+    size_t bit_offset = offset % CHAR_BIT;
+    size_t i;
+    emit(state, "(");
+    for(i = first; i <= last; ++i)
+    {
+        long shift = (long)(offset + size) - (long)((i + 1) * CHAR_BIT);
+        if(i != first)
+        {
+            emit(state, " + ");
+        }
+
+        char term[64];
+        if(i == first && bit_offset != 0)
+        {
+            sprintf(term, "byte(s, o + %d) %% %d", (int)i + 1, 1 << (CHAR_BIT - bit_offset));
+        }
+        else
+        {
+            sprintf(term, "byte(s, o + %d)", (int)i + 1);
+        }
+
+        if(shift > 0)
+        {
+            emit(state, "(%s) * ", term);
+            emit_lua_power(state, shift);
+        }
+        else if(shift < 0)
+        {
+            emit(state, "floor((%s) / %d)", term, 1 << -shift);
+        }
+        else
+        {
+            emit(state, "(%s)", term);
+        }
+    }
+    emit(state, ")");
+}
+
+/*
+ * name
+ *      emit_lua_unpack
+ *
+ * description
+ *      emit Lua unpack function
+ */
+static void emit_lua_unpack(CODEGEN_STATE *state)
+{
+    emit(state, "function M.unpack(s, i, j)\n");
+    if(state->unpack_error != NULL)
+    {
+        emit(state, "    error(\"%s\", 2)\n", state->unpack_error);
+        emit(state, "end\n\n");
+        return;
+    }
+
+    BITMATCH *bitmatch = state->bitmatch;
+    /* return list would exceed the lua register limit */
+    int use_table = bitmatch->element_count > CODEGEN_LUA_MAX_ARGS;
+    emit(state, "    local o, len = substring(s, i, j)\n");
+    emit(state, "    if len * 8 < %d then\n", (int)state->fixed_bits);
+    emit(state, "        error(\"size error: layout size (%d bits) exceeds the size of input (\" .. len * 8 .. \" bits)\", 2)\n", 
+            (int)state->fixed_bits);
+    emit(state, "    end\n");
+    emit(state, use_table ? "    return unpack({\n" : "    return\n");
+
+    size_t i;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        CODEGEN_ELEMENT *location = &state->elements[i];
+        size_t first = location->offset / CHAR_BIT;
+        emit(state, "        ");
+        if(elem->type == ET_INTEGER)
+        {
+            if(elem->endianess == EE_LITTLE && location->offset % CHAR_BIT == 0)
+            {
+                size_t count = elem->size / CHAR_BIT;
+                size_t k;
+                for(k = 0; k < count; ++k)
+                {
+                    emit(state, "%sbyte(s, o + %d) * ", k == 0 ? "" : " + ", (int)(first + k + 1));
+                    emit_lua_power(state, k * CHAR_BIT);
+                }
+            }
+            else if(elem->endianess == EE_LITTLE)
+            {
+                emit(state, "swap(");
+                emit_lua_read(state, location->offset, elem->size);
+                emit(state, ", %d)", (int)(elem->size / CHAR_BIT));
+            }
+            else
+            {
+                emit_lua_read(state, location->offset, elem->size);
+            }
+        }
+        else if(is_dynamic(elem))
+        {
+            emit(state, "sub(s, o + %d, o + len)", (int)first + 1);
+        }
+        else if(location->offset % CHAR_BIT == 0)
+        {
+            emit(state, "sub(s, o + %d, o + %d)", (int)first + 1, (int)(first + elem->size));
+        }
+        else
+        {
+            emit(state, "bytes(s, o + %d, %d, %d)", (int)first + 1, (int)(location->offset % CHAR_BIT), (int)elem->size);
+        }
+        emit(state, i + 1 < bitmatch->element_count ? ",\n" : "\n");
+    }
+    emit(state, use_table ? "    })\nend\n\n" : "end\n\n");
+}
+
+/*
+ * name
+ *      emit_lua_arg
+ *
+ * description
+ *      emit reference to pack argument
+ */
+static void emit_lua_arg(CODEGEN_STATE *state, int arg_index)
+{
+    if(state->bitmatch->element_count > CODEGEN_LUA_MAX_ARGS)
+    {
+        emit(state, "a[%d]", arg_index);
+    }
+    else
+    {
+        emit(state, "a%d", arg_index);
+    }
+}
+
+/*
+ * name
+ *      emit_lua_value
+ *
+ * description
+ *      emit Lua expression of pack argument as big endian unsigned integer 
+ *      of size bits. byte_index is 1 based index of the byte in binary 
+ *      string argument or 0 for integers
+ */
+static void emit_lua_value(CODEGEN_STATE *state, ELEMENT_DESCRIPTION *elem, int arg_index, size_t byte_index)
+{
+    if(byte_index > 0)
+    {
+        emit(state, "byte(");
+        emit_lua_arg(state, arg_index);
+        emit(state, ", %d)", (int)byte_index);
+    }
+    else if(elem->endianess == EE_LITTLE)
+    {
+        emit(state, "swap(");
+        emit_lua_arg(state, arg_index);
+        emit(state, " %% ");
+        emit_lua_power(state, elem->size);
+        emit(state, ", %d)", (int)(elem->size / CHAR_BIT));
+    }
+    else
+    {
+        emit(state, "(");
+        emit_lua_arg(state, arg_index);
+        emit(state, " %% ");
+        emit_lua_power(state, elem->size);
+        emit(state, ")");
+    }
+}
+
+/*
+ * name
+ *      emit_lua_byte
+ *
+ * description
+ *      emit Lua expression of byte index of the segment that starts at
+ *      element segment_start. the expression sums the contributions of
+ *      all elements that overlap the byte
+ */
+static void emit_lua_byte(CODEGEN_STATE *state, size_t segment_start, size_t index)
+{
+    BITMATCH *bitmatch = state->bitmatch;
+    int terms = 0;
+    size_t i;
+    for(i = segment_start; i < bitmatch->element_count && !is_dynamic(&bitmatch->elements[i]); ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        CODEGEN_ELEMENT *location = &state->elements[i];
+        /* binary strings are packed as sequence of 8 bit integers */
+        size_t size = elem->type == ET_BINARY ? CHAR_BIT : location->bits;
+        size_t count = elem->type == ET_BINARY ? elem->size : 1;
+        size_t k;
+        for(k = 0; k < count; ++k)
+        {
+            size_t offset = location->offset + k * size;
+            size_t first = offset / CHAR_BIT;
+            size_t last = (offset + size - 1) / CHAR_BIT;
+            if(index < first || index > last)
+            {
+                continue;
+            }
+
+            long shift = (long)(offset + size) - (long)((index + 1) * CHAR_BIT);
+            emit(state, terms == 0 ? "" : " + ");
+            ++terms;
+            if(shift > 0)
+            {
+                emit(state, "floor(");
+                emit_lua_value(state, elem, i + 1, elem->type == ET_BINARY ? k + 1 : 0);
+                emit(state, " / ");
+                emit_lua_power(state, shift);
+                emit(state, ")");
+            }
+            else if(shift < 0)
+            {
+                emit_lua_value(state, elem, i + 1, elem->type == ET_BINARY ? k + 1 : 0);
+                emit(state, " * %d", 1 << -shift);
+            }
+            else
+            {
+                emit_lua_value(state, elem, i + 1, elem->type == ET_BINARY ? k + 1 : 0);
+            }
+
+            if(index != first)
+            {
+                emit(state, " %% 256");
+            }
+        }
+    }
+    if(terms == 0)
+    {
+        emit(state, "0");
+    }
+}
+
+/*
+ * name
+ *      emit_lua_pack
+ *
+ * description
+ *      emit Lua pack function
+ */
+static void emit_lua_pack(CODEGEN_STATE *state)
+{
+    BITMATCH *bitmatch = state->bitmatch;
+    int use_table = bitmatch->element_count > CODEGEN_LUA_MAX_ARGS;
+    size_t i;
+
+    emit(state, "function M.pack(");
+    if(use_table)
+    {
+        emit(state, "...");
+    }
+    else
+    {
+        for(i = 0; i < bitmatch->element_count; ++i)
+        {
+            emit(state, i == 0 ? "a%d" : ", a%d", (int)i + 1);
+        }
+    }
+    emit(state, ")\n");
+
+    if(state->pack_error != NULL)
+    {
+        emit(state, "    error(\"%s\", 2)\n", state->pack_error);
+        emit(state, "end\n\n");
+        return;
+    }
+
+    if(use_table)
+    {
+        emit(state, "    local a = {...}\n");
+    }
+
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        if(elem->type == ET_BINARY && !is_dynamic(elem))
+        {
+            emit(state, "    if #");
+            emit_lua_arg(state, i + 1);
+            emit(state, " < %d then\n", (int)elem->size);
+            emit(state, "        error(\"size error: argument %d size (%d bytes) exceeds the length of input string\", 2)\n",
+                    (int)i + 1, (int)elem->size);
+            emit(state, "    end\n");
+        }
+    }
+
+    /* 
+     * each segment is emitted as pieces of char() calls and byte aligned
+     * binary strings. the engine drops incomplete last byte 
+     */
+    emit(state, "    return concat({\n");
+    size_t segment_start = 0;
+    size_t segment_bits = 0;
+    size_t index = 0;
+    int open = 0;
+    int args = 0;
+    for(i = 0; i <= bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = i < bitmatch->element_count ? &bitmatch->elements[i] : NULL;
+        int aligned_bin = elem != NULL && elem->type == ET_BINARY && 
+            (is_dynamic(elem) || state->elements[i].offset % CHAR_BIT == 0);
+        size_t end = elem == NULL || is_dynamic(elem) ? 
+            segment_bits / CHAR_BIT : state->elements[i].offset / CHAR_BIT;
+        if(elem != NULL && !aligned_bin)
+        {
+            segment_bits = state->elements[i].offset + state->elements[i].bits;
+            continue;
+        }
+
+        /* emit bytes up to the aligned binary string or segment end */
+        for(; index < end; ++index)
+        {
+            if(!open || args == CODEGEN_LUA_MAX_ARGS)
+            {
+                emit(state, open ? "),\n        char(" : "        char(");
+                open = 1;
+                args = 0;
+            }
+            emit(state, args == 0 ? "" : ", ");
+            emit_lua_byte(state, segment_start, index);
+            ++args;
+        }
+        if(open)
+        {
+            emit(state, "),\n");
+            open = 0;
+        }
+
+        if(elem == NULL)
+        {
+            break;
+        }
+
+        emit(state, "        ");
+        if(is_dynamic(elem))
+        {
+            emit_lua_arg(state, i + 1);
+            segment_start = i + 1;
+            segment_bits = 0;
+            index = 0;
+        }
+        else
+        {
+            emit(state, "sub(");
+            emit_lua_arg(state, i + 1);
+            emit(state, ", 1, %d)", (int)elem->size);
+            index += elem->size;
+            segment_bits = state->elements[i].offset + state->elements[i].bits;
+        }
+        emit(state, ",\n");
+    }
+    emit(state, "    })\nend\n\n");
+}
+
+/*
+ * name
+ *      emit_lua
+ *
+ * description
+ *      emit Lua module
+ */
+static void emit_lua(CODEGEN_STATE *state)
+{
+    emit(state, "-- generated by bitstring.codegen. do not edit\n\n");
+    emit(state, "local byte, char, sub, floor, concat, unpack = string.byte, string.char, string.sub, math.floor, table.concat, unpack\n");
+    emit(state, "local error, tostring = error, tostring\n\n");
+    emit(state, "local M = {}\n\n");
+
+    /* same as get_substring in lbitstring.c */
+    emit(state, "local function substring(s, i, j)\n");
+    emit(state, "    local len = #s\n");
+    emit(state, "    local first, last = 0, len\n");
+    emit(state, "    if i then if i < 0 then first = len + i else first = i - 1 end end\n");
+    emit(state, "    if j then if j < 0 then last = len + j + 1 else last = j end end\n");
+    emit(state, "    if first >= last or last > len then\n");
+    emit(state, "        error(\"invalid parameter: start position \" .. tostring(i) .. \", end position \" .. tostring(j), 3)\n");
+    emit(state, "    end\n");
+    emit(state, "    return first, last - first\n");
+    emit(state, "end\n\n");
+
+    emit(state, "local function swap(v, count)\n");
+    emit(state, "    local result = 0\n");
+    emit(state, "    for k = 1, count do\n");
+    emit(state, "        result = result * 256 + v %% 256\n");
+    emit(state, "        v = floor(v / 256)\n");
+    emit(state, "    end\n");
+    emit(state, "    return result\n");
+    emit(state, "end\n\n");
+
+    emit(state, "local function bytes(s, first, bit_offset, count)\n");
+    emit(state, "    local result = {}\n");
+    emit(state, "    local left, right = 2 ^ bit_offset, 2 ^ (8 - bit_offset)\n");
+    emit(state, "    for k = 0, count - 1 do\n");
+    emit(state, "        local high, low = byte(s, first + k, first + k + 1)\n");
+    emit(state, "        result[k + 1] = char((high * left) %% 256 + floor(low / right))\n");
+    emit(state, "    end\n");
+    emit(state, "    return concat(result)\n");
+    emit(state, "end\n\n");
+
+    emit_lua_pack(state);
+    emit_lua_unpack(state);
+    emit(state, "%s = M\n", state->name);
+    emit(state, "return M\n");
+}
+
+/*
+ * name
+ *      check_luajit_limits
+ *
+ * description
+ *      the luajit module keeps each element in a local variable and packs
+ *      unaligned binary strings byte by byte in straight-line code
+ *
+ * throws
+ *      wrong format - too many elements or too long unaligned binary string
+ */
+static void check_luajit_limits(lua_State *l, CODEGEN_STATE *state)
+{
+    if(state->bitmatch->element_count > CODEGEN_LUAJIT_MAX_ELEMENTS)
+    {
+        luaL_error(l, "wrong format: %d elements exceed the generated code limit (%d elements)",
+                (int)state->bitmatch->element_count, CODEGEN_LUAJIT_MAX_ELEMENTS);
+    }
+
+    size_t i;
+    for(i = 0; i < state->bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &state->bitmatch->elements[i];
+        if(elem->type == ET_BINARY && !is_dynamic(elem) && 
+                state->elements[i].offset % CHAR_BIT != 0 && elem->size > CODEGEN_LUAJIT_MAX_UNALIGNED_BYTES)
+        {
+            luaL_error(l, "wrong format: argument %d: unaligned binary string exceeds the generated code limit (%d bytes)",
+                    (int)i + 1, CODEGEN_LUAJIT_MAX_UNALIGNED_BYTES);
+        }
+    }
+}
+
+/*
+ * name
+ *      emit_luajit_format
+ *
+ * description
+ *      emit the format string of the bitmatch as Lua string literal.
+ *      the generated luajit module passes it to bitstring.pack and
+ *      bitstring.unpack when the input has to be checked by the engine
+ */
+static void emit_luajit_format(CODEGEN_STATE *state)
+{
+    BITMATCH *bitmatch = state->bitmatch;
+    size_t i;
+    emit(state, "\"");
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        emit(state, i == 0 ? "" : ", ");
+        if(elem->size == (size_t)ALL && elem->type == ET_BINARY)
+        {
+            emit(state, "%s:%s", ALL_SPECIFIER, TYPES[elem->type]);
+        }
+        else if(elem->size == (size_t)REST && elem->type == ET_BINARY)
+        {
+            emit(state, "%s:%s", REST_SPECIFIER, TYPES[elem->type]);
+        }
+        else
+        {
+            emit(state, "%d:%s", (int)elem->size, TYPES[elem->type]);
+        }
+        if(elem->endianess != EE_DEFAULT)
+        {
+            emit(state, ":%s", ENDIANESSES[elem->endianess]);
+        }
+    }
+    emit(state, "\"");
+}
+
+/*
+ * name
+ *      emit_luajit_term
+ *
+ * description
+ *      emit the contribution of a piece of size bits at bit offset to
+ *      byte index of the segment. value is an int32 number or int64 cdata
+ *      expression that holds the piece in its least significant bits
+ */
+static void emit_luajit_term(CODEGEN_STATE *state, size_t index, size_t offset, size_t size, const char *value)
+{
+    size_t first = offset / CHAR_BIT;
+    long shift = (long)(offset + size) - (long)((index + 1) * CHAR_BIT);
+    unsigned int mask = index == first ? 0xff >> (offset % CHAR_BIT) : 0xff;
+    emit(state, "band(");
+    if(shift > 0)
+    {
+        emit(state, "rshift(%s, %ld)", value, shift);
+    }
+    else if(shift < 0)
+    {
+        emit(state, "lshift(%s, %ld)", value, -shift);
+    }
+    else
+    {
+        emit(state, "%s", value);
+    }
+    emit(state, ", 0x%02x)", mask);
+}
+
+/*
+ * name
+ *      emit_luajit_element_terms
+ *
+ * description
+ *      emit contributions of element to byte index of the segment 
+ *      separated by comma. elements packed with copy are skipped
+ *
+ * returns
+ *      number of emitted terms
+ */
+static int emit_luajit_element_terms(CODEGEN_STATE *state, size_t i, size_t index, int terms)
+{
+    ELEMENT_DESCRIPTION *elem = &state->bitmatch->elements[i];
+    CODEGEN_ELEMENT *location = &state->elements[i];
+    int arg_index = i + 1;
+    size_t first = location->offset / CHAR_BIT;
+    size_t last = (location->offset + location->bits - 1) / CHAR_BIT;
+    char value[64];
+    if(index < first || index > last)
+    {
+        return terms;
+    }
+
+    if(elem->type == ET_INTEGER && elem->endianess != EE_LITTLE)
+    {
+        sprintf(value, "v%d", arg_index);
+        emit(state, terms == 0 ? "" : ", ");
+        emit_luajit_term(state, index, location->offset, elem->size, value);
+        return terms + 1;
+    }
+
+    if(location->offset % CHAR_BIT == 0 && elem->type != ET_INTEGER)
+    {
+        /* aligned binary strings and floats are copied */
+        return terms;
+    }
+
+    /* little endian integers, binary strings and floats are packed byte by byte */
+    size_t k;
+    for(k = 0; k < location->bits / CHAR_BIT; ++k)
+    {
+        size_t offset = location->offset + k * CHAR_BIT;
+        if(index < offset / CHAR_BIT || index > (offset + CHAR_BIT - 1) / CHAR_BIT)
+        {
+            continue;
+        }
+        if(elem->type == ET_INTEGER && k == 0)
+        {
+            sprintf(value, "v%d", arg_index);
+        }
+        else if(elem->type == ET_INTEGER)
+        {
+            sprintf(value, "rshift(v%d, %d)", arg_index, (int)(k * CHAR_BIT));
+        }
+        else if(elem->type == ET_FLOAT)
+        {
+            sprintf(value, "u%d.b[%d]", arg_index, (int)k);
+        }
+        else
+        {
+            sprintf(value, "b%d[%d]", arg_index, (int)k);
+        }
+        emit(state, terms == 0 ? "" : ", ");
+        emit_luajit_term(state, index, offset, CHAR_BIT, value);
+        ++terms;
+    }
+    return terms;
+}
+
+/*
+ * name
+ *      is_luajit_copied
+ *
+ * description
+ *      check if byte index of the segment that starts at element start
+ *      belongs to an aligned binary string or float that is packed with copy
+ */
+static int is_luajit_copied(CODEGEN_STATE *state, size_t start, size_t end, size_t index)
+{
+    size_t i;
+    for(i = start; i < end; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &state->bitmatch->elements[i];
+        CODEGEN_ELEMENT *location = &state->elements[i];
+        if(elem->type != ET_INTEGER && location->offset % CHAR_BIT == 0 &&
+                index >= location->offset / CHAR_BIT && 
+                index < (location->offset + location->bits) / CHAR_BIT)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * name
+ *      emit_luajit_pack
+ *
+ * description
+ *      emit LuaJIT pack function
+ */
+static void emit_luajit_pack(CODEGEN_STATE *state)
+{
+    BITMATCH *bitmatch = state->bitmatch;
+    size_t i;
+
+    emit(state, "function M.pack(...)\n");
+    if(state->pack_error != NULL)
+    {
+        emit(state, "    return (pack(FORMAT, ...))\n");
+        emit(state, "end\n\n");
+        return;
+    }
+
+    emit(state, "    local ");
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        emit(state, i == 0 ? "a%d" : ", a%d", (int)i + 1);
+    }
+    emit(state, " = ...\n");
+
+    /* let the engine raise errors for unexpected input */
+    emit(state, "    if ");
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        int arg_index = i + 1;
+        emit(state, i == 0 ? "" : " or\n        ");
+        if(elem->type == ET_INTEGER)
+        {
+            emit(state, "type(a%d) ~= \"number\" or a%d %% 1 ~= 0", arg_index, arg_index);
+        }
+        else if(elem->type == ET_FLOAT)
+        {
+            emit(state, "type(a%d) ~= \"number\"", arg_index);
+        }
+        else if(is_dynamic(elem))
+        {
+            emit(state, "type(a%d) ~= \"string\"", arg_index);
+        }
+        else
+        {
+            emit(state, "type(a%d) ~= \"string\" or #a%d < %d", arg_index, arg_index, (int)elem->size);
+        }
+    }
+    emit(state, " then\n");
+    emit(state, "        return (pack(FORMAT, ...))\n");
+    emit(state, "    end\n");
+
+    int has_dynamic = 0;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        CODEGEN_ELEMENT *location = &state->elements[i];
+        int arg_index = i + 1;
+        if(elem->type == ET_INTEGER && elem->size <= 32)
+        {
+            emit(state, "    local v%d = tobit(a%d %% 4294967296)\n", arg_index, arg_index);
+        }
+        else if(elem->type == ET_INTEGER)
+        {
+            emit(state, "    local v%d = cast(int64_t, a%d)\n", arg_index, arg_index);
+        }
+        else if(elem->type == ET_FLOAT)
+        {
+            emit(state, "    u%d.f = a%d\n", arg_index, arg_index);
+        }
+        else if(is_dynamic(elem))
+        {
+            emit(state, "    local n%d = #a%d\n", arg_index, arg_index);
+            has_dynamic = 1;
+        }
+        else if(location->offset % CHAR_BIT != 0)
+        {
+            emit(state, "    local b%d = cast(uint8_p, a%d)\n", arg_index, arg_index);
+        }
+    }
+
+    /* the engine drops incomplete last byte */
+    emit(state, "    local size = %d", (int)(state->fixed_bits / CHAR_BIT));
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        if(is_dynamic(&bitmatch->elements[i]))
+        {
+            emit(state, " + n%d", (int)i + 1);
+        }
+    }
+    emit(state, "\n");
+    if(has_dynamic)
+    {
+        emit(state, "    if size > capacity then\n");
+        emit(state, "        capacity = size * 2\n");
+        emit(state, "        buffer = uint8_array(capacity)\n");
+        emit(state, "    end\n");
+    }
+    emit(state, "    local p = buffer + 0\n");
+
+    size_t segment_start = 0;
+    size_t segment_bits = 0;
+    for(i = 0; i <= bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = i < bitmatch->element_count ? &bitmatch->elements[i] : NULL;
+        CODEGEN_ELEMENT *location = i < bitmatch->element_count ? &state->elements[i] : NULL;
+        if(elem != NULL && !is_dynamic(elem))
+        {
+            int arg_index = i + 1;
+            if(elem->type == ET_BINARY && location->offset % CHAR_BIT == 0)
+            {
+                emit(state, "    copy(p + %d, a%d, %d)\n", (int)(location->offset / CHAR_BIT), arg_index, (int)elem->size);
+            }
+            else if(elem->type == ET_FLOAT && location->offset % CHAR_BIT == 0)
+            {
+                emit(state, "    copy(p + %d, u%d.b, %d)\n", 
+                        (int)(location->offset / CHAR_BIT), arg_index, (int)(elem->size / CHAR_BIT));
+            }
+            segment_bits = location->offset + location->bits;
+            continue;
+        }
+
+        /* write the bytes of the segment that are not copied */
+        size_t index;
+        for(index = 0; index < segment_bits / CHAR_BIT; ++index)
+        {
+            if(is_luajit_copied(state, segment_start, i, index))
+            {
+                continue;
+            }
+            emit(state, "    p[%d] = bor(", (int)index);
+            size_t k;
+            int terms = 0;
+            for(k = segment_start; k < i; ++k)
+            {
+                terms = emit_luajit_element_terms(state, k, index, terms);
+            }
+            emit(state, ")\n");
+        }
+
+        if(elem == NULL)
+        {
+            break;
+        }
+
+        int arg_index = i + 1;
+        emit(state, "    copy(p + %d, a%d, n%d)\n", (int)(segment_bits / CHAR_BIT), arg_index, arg_index);
+        emit(state, "    p = p + %d + n%d\n", (int)(segment_bits / CHAR_BIT), arg_index);
+        segment_start = i + 1;
+        segment_bits = 0;
+    }
+    emit(state, "    return ffi_string(buffer, size)\n");
+    emit(state, "end\n\n");
+}
+
+/*
+ * name
+ *      emit_luajit_read
+ *
+ * description
+ *      emit LuaJIT expression that reads size bits at bit offset of the
+ *      segment pointer p as big endian unsigned integer. the expression is
+ *      a number when wide is 0 and uint64 cdata otherwise
+ */
+static void emit_luajit_read(CODEGEN_STATE *state, size_t offset, size_t size, int wide)
+{
+    size_t first = offset / CHAR_BIT;
+    size_t last = (offset + size - 1) / CHAR_BIT;
+    size_t bit_offset = offset % CHAR_BIT;
+    size_t i;
+    emit(state, wide ? "bor(" : "(");
+    for(i = first; i <= last; ++i)
+    {
+        long shift = (long)(offset + size) - (long)((i + 1) * CHAR_BIT);
+        char term[64];
+        if(i == first && bit_offset != 0)
+        {
+            sprintf(term, "band(p[%d], 0x%02x)", (int)i, 0xff >> bit_offset);
+        }
+        else
+        {
+            sprintf(term, "p[%d]", (int)i);
+        }
+
+        emit(state, i == first ? "" : (wide ? ", " : " + "));
+        if(shift > 0 && wide)
+        {
+            emit(state, "lshift(uint64_t(%s), %ld)", term, shift);
+        }
+        else if(shift > 0)
+        {
+            emit(state, "%s * ", term);
+            emit_lua_power(state, shift);
+        }
+        else if(shift < 0)
+        {
+            emit(state, "rshift(%s, %ld)", term, -shift);
+        }
+        else
+        {
+            emit(state, "%s", term);
+        }
+    }
+    emit(state, ")");
+}
+
+/*
+ * name
+ *      emit_luajit_int
+ *
+ * description
+ *      emit LuaJIT expression of unpacked integer element
+ */
+static void emit_luajit_int(CODEGEN_STATE *state, ELEMENT_DESCRIPTION *elem, CODEGEN_ELEMENT *location)
+{
+    int wide = elem->size > CODEGEN_LUA_MAX_INT_BITS;
+    if(wide)
+    {
+        /* same conversion as lua_pushinteger of lua_Integer */
+        emit(state, elem->size == 64 ? "tonumber(cast(int64_t, " : "tonumber(");
+    }
+
+    if(elem->endianess != EE_LITTLE)
+    {
+        emit_luajit_read(state, location->offset, elem->size, wide);
+    }
+    else
+    {
+        size_t k;
+        emit(state, wide ? "bor(" : "(");
+        for(k = 0; k < elem->size / CHAR_BIT; ++k)
+        {
+            emit(state, k == 0 ? "" : (wide ? ", " : " + "));
+            if(k == 0)
+            {
+                emit_luajit_read(state, location->offset, CHAR_BIT, 0);
+            }
+            else if(wide)
+            {
+                emit(state, "lshift(uint64_t");
+                emit_luajit_read(state, location->offset + k * CHAR_BIT, CHAR_BIT, 0);
+                emit(state, ", %d)", (int)(k * CHAR_BIT));
+            }
+            else
+            {
+                emit_luajit_read(state, location->offset + k * CHAR_BIT, CHAR_BIT, 0);
+                emit(state, " * ");
+                emit_lua_power(state, k * CHAR_BIT);
+            }
+        }
+        emit(state, ")");
+    }
+
+    if(wide)
+    {
+        emit(state, elem->size == 64 ? "))" : ")");
+    }
+}
+
+/*
+ * name
+ *      emit_luajit_unpack
+ *
+ * description
+ *      emit LuaJIT unpack function
+ */
+static void emit_luajit_unpack(CODEGEN_STATE *state)
+{
+    emit(state, "function M.unpack(...)\n");
+    if(state->unpack_error != NULL)
+    {
+        emit(state, "    return unpack(FORMAT, ...)\n");
+        emit(state, "end\n\n");
+        return;
+    }
+
+    /* let the engine raise errors for unexpected input */
+    BITMATCH *bitmatch = state->bitmatch;
+    emit(state, "    local s, i, j = ...\n");
+    emit(state, "    if type(s) ~= \"string\" then\n");
+    emit(state, "        return unpack(FORMAT, ...)\n");
+    emit(state, "    end\n");
+    emit(state, "    local o, len = 0, #s\n");
+    emit(state, "    local n = select(\"#\", ...)\n");
+    emit(state, "    if n > 1 then\n");
+    emit(state, "        o, len = substring(len, n, i, j)\n");
+    emit(state, "    end\n");
+    emit(state, "    if o == nil or len * 8 < %d then\n", (int)state->fixed_bits);
+    emit(state, "        return unpack(FORMAT, ...)\n");
+    emit(state, "    end\n");
+    emit(state, "    local p = cast(uint8_p, s) + o\n");
+
+    size_t i;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        CODEGEN_ELEMENT *location = &state->elements[i];
+        int arg_index = i + 1;
+        size_t first = location->offset / CHAR_BIT;
+        size_t k;
+        if(elem->type == ET_INTEGER)
+        {
+            emit(state, "    local r%d = ", arg_index);
+            emit_luajit_int(state, elem, location);
+            emit(state, "\n");
+        }
+        else if(is_dynamic(elem))
+        {
+            emit(state, "    local r%d = ffi_string(p + %d, len - %d)\n", arg_index, (int)first, (int)first);
+        }
+        else if(location->offset % CHAR_BIT == 0 && elem->type == ET_BINARY)
+        {
+            emit(state, "    local r%d = ffi_string(p + %d, %d)\n", arg_index, (int)first, (int)elem->size);
+        }
+        else if(location->offset % CHAR_BIT == 0)
+        {
+            emit(state, "    copy(u%d.b, p + %d, %d)\n", arg_index, (int)first, (int)(elem->size / CHAR_BIT));
+            emit(state, "    local r%d = u%d.f\n", arg_index, arg_index);
+        }
+        else
+        {
+            const char *bytes = elem->type == ET_FLOAT ? "u%d.b[%d] = " : "scratch[%d] = ";
+            for(k = 0; k < location->bits / CHAR_BIT; ++k)
+            {
+                emit(state, "    ");
+                if(elem->type == ET_FLOAT)
+                {
+                    emit(state, bytes, arg_index, (int)k);
+                }
+                else
+                {
+                    emit(state, bytes, (int)k);
+                }
+                emit_luajit_read(state, location->offset + k * CHAR_BIT, CHAR_BIT, 0);
+                emit(state, "\n");
+            }
+            if(elem->type == ET_FLOAT)
+            {
+                emit(state, "    local r%d = u%d.f\n", arg_index, arg_index);
+            }
+            else
+            {
+                emit(state, "    local r%d = ffi_string(scratch, %d)\n", arg_index, (int)elem->size);
+            }
+        }
+    }
+
+    emit(state, "    return ");
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        emit(state, i == 0 ? "r%d" : ", r%d", (int)i + 1);
+    }
+    emit(state, "\nend\n\n");
+}
+
+/*
+ * name
+ *      emit_luajit
+ *
+ * description
+ *      emit LuaJIT module. the module reads and writes the bytes through
+ *      FFI pointers and bit operations and has no calls to lua_CFunctions,
+ *      so loops that call it are compiled by the JIT. the module calls
+ *      bitstring.pack and bitstring.unpack for input that must be rejected
+ *      by the engine. these functions may be passed as chunk arguments
+ */
+static void emit_luajit(CODEGEN_STATE *state)
+{
+    BITMATCH *bitmatch = state->bitmatch;
+    size_t i;
+
+    emit(state, "-- generated by bitstring.codegen. do not edit\n\n");
+    emit(state, "local ffi = require \"ffi\"\n");
+    emit(state, "local bit = require \"bit\"\n\n");
+    emit(state, "local cast, copy, ffi_string = ffi.cast, ffi.copy, ffi.string\n");
+    emit(state, "local band, bor, lshift, rshift, tobit = bit.band, bit.bor, bit.lshift, bit.rshift, bit.tobit\n");
+    emit(state, "local type, select, tonumber = type, select, tonumber\n");
+    emit(state, "local uint8_p = ffi.typeof(\"const uint8_t *\")\n");
+    emit(state, "local uint8_array = ffi.typeof(\"uint8_t[?]\")\n");
+    emit(state, "local int64_t, uint64_t = ffi.typeof(\"int64_t\"), ffi.typeof(\"uint64_t\")\n\n");
+    emit(state, "local pack, unpack = ...\n");
+    emit(state, "if pack == nil then\n");
+    emit(state, "    local bitstring = require \"bitstring\"\n");
+    emit(state, "    pack, unpack = bitstring.pack, bitstring.unpack\n");
+    emit(state, "end\n\n");
+    emit(state, "local FORMAT = ");
+    emit_luajit_format(state);
+    emit(state, "\n\n");
+
+    /* pack buffer with the spare byte of the engine */
+    emit(state, "local capacity = %d\n", (int)(state->fixed_bits / CHAR_BIT + 1));
+    emit(state, "local buffer = uint8_array(capacity)\n");
+    size_t scratch = 0;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        if(elem->type == ET_FLOAT)
+        {
+            emit(state, "local u%d = ffi.new(\"union { %s f; uint8_t b[%d]; }\")\n", (int)i + 1, 
+                    elem->size == sizeof(float) * CHAR_BIT ? "float" : "double", (int)(elem->size / CHAR_BIT));
+        }
+        else if(elem->type == ET_BINARY && state->elements[i].offset % CHAR_BIT != 0 && elem->size > scratch)
+        {
+            scratch = elem->size;
+        }
+    }
+    if(scratch > 0)
+    {
+        emit(state, "local scratch = uint8_array(%d)\n", (int)scratch);
+    }
+    emit(state, "\n");
+
+    /* same as get_substring in lbitstring.c. nil if the engine raises an error */
+    emit(state, "local function substring(len, n, i, j)\n");
+    emit(state, "    local first, last = 0, len\n");
+    emit(state, "    if type(i) ~= \"number\" or i %% 1 ~= 0 then return nil end\n");
+    emit(state, "    if i < 0 then first = len + i else first = i - 1 end\n");
+    emit(state, "    if n > 2 then\n");
+    emit(state, "        if type(j) ~= \"number\" or j %% 1 ~= 0 then return nil end\n");
+    emit(state, "        if j < 0 then last = len + j + 1 else last = j end\n");
+    emit(state, "    end\n");
+    emit(state, "    if first < 0 or first >= last or last > len then return nil end\n");
+    emit(state, "    return first, last - first\n");
+    emit(state, "end\n\n");
+
+    emit(state, "local M = {}\n\n");
+    emit_luajit_pack(state);
+    emit_luajit_unpack(state);
+    emit(state, "return M\n");
+}
+
+/*
+ * name
+ *      l_codegen
+ *
+ * description
+ *      lua_CFunction for generating source code of pack and unpack
+ *      functions for a bitmatch
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - bitmatch or format string
+ *          2 - language, "c", "lua" or "luajit"
+ *          3 - optional name of the generated module. default is bitmatch
+ *
+ * returns
+ *      the generated source
+ *
+ * throws
+ *      wrong format - unsupported language or element
+ */
+static int l_codegen(lua_State *l)
+{
+    CODEGEN_LANGUAGE language = (CODEGEN_LANGUAGE)luaL_checkoption(l, 2, NULL, CODEGEN_LANGUAGES);
+    const char *name = luaL_optstring(l, 3, "bitmatch");
+
+    const char *c;
+    for(c = name; *c; ++c)
+    {
+        if(!isalnum(*c) && *c != '_')
+        {
+            luaL_argerror(l, 3, "module name must be a C identifier");
+        }
+    }
+
+    if(lua_isstring(l, 1))
+    {
+        lua_pushcfunction(l, l_compile);
+        lua_pushvalue(l, 1);
+        lua_call(l, 1, 1);
+        lua_replace(l, 1);
+    }
+
+    CODEGEN_STATE state;
+    state.bitmatch = get_bitmatch(l, 1);
+    state.name = name;
+    state.elements = (CODEGEN_ELEMENT *)lua_newuserdata(l, 
+            sizeof(CODEGEN_ELEMENT) * (state.bitmatch->element_count + 1));
+    if(language == CL_LUA)
+    {
+        layout_elements(l, &state, CODEGEN_LUA_MAX_INT_BITS, 0);
+    }
+    else
+    {
+        layout_elements(l, &state, sizeof(lua_Integer) * CHAR_BIT, 1);
+    }
+
+    if(language == CL_LUAJIT)
+    {
+        check_luajit_limits(l, &state);
+    }
+
+    luaL_Buffer b; 
+    luaL_buffinit(l, &b);
+    state.buffer = &b;
+    if(language == CL_C)
+    {
+        emit_c(&state);
+    }
+    else if(language == CL_LUA)
+    {
+        emit_lua(&state);
+    }
+    else
+    {
+        emit_luajit(&state);
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
@@ -0,0 +1,436 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * multi-threaded columnar decode of fixed size records.
+ * bitstring.decode_columns splits a buffer of records between worker
+ * threads. every record starts at a byte boundary and is unpacked with
+ * the same bitmatch of int elements. the workers write plain arrays, one
+ * for each element, and do not access the lua state. the arrays are
+ * allocated as bitstring.column userdata before the workers start and
+ * are returned to lua after all workers finish.
+ *
+ * constant elements are checked and do not have a column. elements that
+ * are skipped by bitstring.project do not have a column either, so a
+ * projected bitmatch decodes the selected columns only.
+ */
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif // HAVE_PTHREAD
+
+#define COLUMN_TYPE "bitstring.column"
+#define COLUMNS_MAX_THREADS 64
+/* records per worker below which starting a thread costs more than it saves */
+#define COLUMNS_MIN_RECORDS 16384
+
+/*
+ * column userdata
+ */
+typedef struct
+{
+    size_t count;
+    lua_Integer values[1];
+} COLUMN;
+
+/*
+ * part of the input that is decoded by one worker
+ */
+typedef struct
+{
+    const BITMATCH *bitmatch;
+    const unsigned char *input;
+    size_t record_bytes;
+    size_t first_record;
+    size_t record_count;
+    /* array for each element, NULL for elements without a column */
+    lua_Integer **columns;
+    /* first record with a constant mismatch and its element. 0 if none */
+    size_t failed_record;
+    int failed_element;
+} COLUMNS_TASK;
+
+/*
+ * name
+ *      decode_columns_task
+ *
+ * description
+ *      decode the records of a task. runs in a worker thread, must not
+ *      use the lua state. the input is checked before the task starts
+ *
+ * paramenters
+ *      arg - COLUMNS_TASK
+ */
+static void *decode_columns_task(void *arg)
+{
+    COLUMNS_TASK *task = (COLUMNS_TASK *)arg;
+    const BITMATCH *bitmatch = task->bitmatch;
+    size_t record;
+    for(record = task->first_record; record < task->first_record + task->record_count; ++record)
+    {
+        UNPACK_STATE state;
+        state.return_count = 0;
+        state.current_bit = 0;
+        state.source_bits = task->record_bytes * CHAR_BIT;
+        state.source = task->input + record * task->record_bytes;
+        state.source_end = state.source + task->record_bytes;
+
+        size_t i;
+        for(i = 0; i < bitmatch->element_count; ++i)
+        {
+            /* the engine does not modify the element */
+            ELEMENT_DESCRIPTION *elem = (ELEMENT_DESCRIPTION *)&bitmatch->elements[i];
+            if(elem->skip)
+            {
+                state.current_bit += elem->size;
+                state.source_bits -= elem->size;
+            }
+            else if(elem->constant)
+            {
+                if(!match_constant(NULL, elem, (int)i + 2, &state) && task->failed_element == 0)
+                {
+                    task->failed_record = record + 1;
+                    task->failed_element = (int)i + 1;
+                }
+            }
+            else
+            {
+                task->columns[i][record] = unpack_int_no_push(NULL, elem, (int)i + 2, &state);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * name
+ *      check_columns_bitmatch
+ *
+ * description
+ *      verify that the bitmatch can be decoded by the workers
+ *
+ * returns
+ *      number of bits of a record
+ *
+ * throws
+ *      wrong format - element is not an int of fixed size
+ *      size error - unsupported size of int element
+ */
+static size_t check_columns_bitmatch(lua_State *l, const BITMATCH *bitmatch)
+{
+    size_t bits = 0;
+    size_t i;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        const ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        if(elem->skip && elem->type == ET_UNDEFINED)
+        {
+            bits += elem->size;
+            continue;
+        }
+        if(elem->type != ET_INTEGER || elem->skip || elem->size == (size_t)VAR)
+        {
+            luaL_error(l, "wrong format: element %d: only int elements of fixed size are supported", (int)i + 1);
+        }
+        if(elem->size == 0 || elem->size > sizeof(lua_Integer) * CHAR_BIT)
+        {
+            luaL_error(l, "size error: element %d size (%d bits) is not supported", (int)i + 1, (int)elem->size);
+        }
+        if(elem->size % CHAR_BIT != 0 && elem->endianess == EE_LITTLE)
+        {
+            luaL_error(l, "wrong format: element %d: little endianess supported for %d bit bounds only",
+                    (int)i + 1, CHAR_BIT);
+        }
+        bits += elem->size;
+    }
+    if(bits == 0)
+    {
+        luaL_error(l, "size error: record size must be greater then 0 bits");
+    }
+    return bits;
+}
+
+/*
+ * name
+ *      default_thread_count
+ *
+ * returns
+ *      number of online processors
+ */
+static int default_thread_count()
+{
+#if defined(HAVE_PTHREAD) && defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * name
+ *      l_decode_columns
+ *
+ * description
+ *      lua_CFunction that decodes a buffer of fixed size records into 
+ *      columns using worker threads
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - format string or bitmatch of int elements
+ *          2 - input string or bitstring.buffer. records start at byte
+ *              boundaries
+ *          3 - optional number of threads. the default is the number of
+ *              online processors
+ *
+ * returns
+ *      array of bitstring.column, one for each element that has a value,
+ *      and the number of records
+ *
+ * throws
+ *      wrong format - element is not an int of fixed size
+ *      size error - input length is not a multiple of record size
+ *      match error - record does not match a constant value
+ */
+static int l_decode_columns(lua_State *l)
+{
+    if(lua_isstring(l, 1))
+    {
+        lua_pushcfunction(l, l_compile);
+        lua_pushvalue(l, 1);
+        lua_call(l, 1, 1);
+        lua_replace(l, 1);
+    }
+    const BITMATCH *bitmatch = get_bitmatch(l, 1);
+    size_t len = 0;
+    const unsigned char *input = check_bytes(l, 2, &len);
+    int thread_count = (int)luaL_optinteger(l, 3, default_thread_count());
+    luaL_argcheck(l, thread_count > 0, 3, "number of threads must be positive");
+
+    size_t record_bytes = bits_to_bytes(check_columns_bitmatch(l, bitmatch));
+    if(len % record_bytes != 0)
+    {
+        luaL_error(l, "size error: input length (%d bytes) is not a multiple of record size (%d bytes)", 
+                (int)len, (int)record_bytes);
+    }
+    size_t record_count = len / record_bytes;
+
+    /* columns are allocated before the workers start */
+    lua_Integer **columns = (lua_Integer **)lua_newuserdata(l, 
+            (bitmatch->element_count + 1) * sizeof(lua_Integer *));
+    lua_newtable(l);
+    int column_number = 0;
+    size_t i;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        const ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        columns[i] = NULL;
+        if(elem->skip || elem->constant)
+        {
+            continue;
+        }
+        COLUMN *column = (COLUMN *)lua_newuserdata(l, 
+                sizeof(COLUMN) + (record_count > 0 ? record_count - 1 : 0) * sizeof(lua_Integer));
+        column->count = record_count;
+        luaL_getmetatable(l, COLUMN_TYPE);
+        lua_setmetatable(l, -2);
+        columns[i] = column->values;
+        lua_rawseti(l, -2, ++column_number);
+    }
+
+    if(thread_count > COLUMNS_MAX_THREADS)
+    {
+        thread_count = COLUMNS_MAX_THREADS;
+    }
+    if((size_t)thread_count > record_count / COLUMNS_MIN_RECORDS)
+    {
+        thread_count = record_count / COLUMNS_MIN_RECORDS > 0 ? (int)(record_count / COLUMNS_MIN_RECORDS) : 1;
+    }
+
+    COLUMNS_TASK tasks[COLUMNS_MAX_THREADS];
+    int t;
+    for(t = 0; t < thread_count; ++t)
+    {
+        tasks[t].bitmatch = bitmatch;
+        tasks[t].input = input;
+        tasks[t].record_bytes = record_bytes;
+        tasks[t].first_record = record_count * t / thread_count;
+        tasks[t].record_count = record_count * (t + 1) / thread_count - tasks[t].first_record;
+        tasks[t].columns = columns;
+        tasks[t].failed_record = 0;
+        tasks[t].failed_element = 0;
+    }
+
+#ifdef HAVE_PTHREAD
+    pthread_t threads[COLUMNS_MAX_THREADS];
+    int started[COLUMNS_MAX_THREADS];
+    /* the calling thread decodes the first part */
+    for(t = 1; t < thread_count; ++t)
+    {
+        started[t] = pthread_create(&threads[t], NULL, decode_columns_task, &tasks[t]) == 0;
+    }
+    decode_columns_task(&tasks[0]);
+    for(t = 1; t < thread_count; ++t)
+    {
+        if(started[t])
+        {
+            pthread_join(threads[t], NULL);
+        }
+        else
+        {
+            decode_columns_task(&tasks[t]);
+        }
+    }
+#else
+    for(t = 0; t < thread_count; ++t)
+    {
+        decode_columns_task(&tasks[t]);
+    }
+#endif // HAVE_PTHREAD
+
+    for(t = 0; t < thread_count; ++t)
+    {
+        if(tasks[t].failed_element != 0)
+        {
+            luaL_error(l, "match error: record %d element %d does not match the constant value", 
+                    (int)tasks[t].failed_record, tasks[t].failed_element);
+        }
+    }
+    lua_pushinteger(l, (lua_Integer)record_count);
+    return 2;
+}
+
+/*
+ * name
+ *      check_column
+ *
+ * description
+ *      get a userdata from index and verify that it is bitstring.column
+ */
+static COLUMN *check_column(lua_State *l, int index)
+{
+    return (COLUMN *)luaL_checkudata(l, index, COLUMN_TYPE);
+}
+
+/*
+ * name
+ *      column_index
+ *
+ * description
+ *      __index metamethod. numbers from 1 to #column return values, 
+ *      other keys are looked up in the methods
+ */
+static int column_index(lua_State *l)
+{
+    COLUMN *column = check_column(l, 1);
+    if(lua_type(l, 2) == LUA_TNUMBER)
+    {
+        lua_Integer index = lua_tointeger(l, 2);
+        if(index >= 1 && (size_t)index <= column->count)
+        {
+            lua_pushinteger(l, column->values[index - 1]);
+        }
+        else
+        {
+            lua_pushnil(l);
+        }
+        return 1;
+    }
+    lua_getmetatable(l, 1);
+    lua_getfield(l, -1, "methods");
+    lua_pushvalue(l, 2);
+    lua_rawget(l, -2);
+    return 1;
+}
+
+/*
+ * name
+ *      column_len
+ *
+ * description
+ *      __len metamethod
+ *
+ * returns
+ *      number of values
+ */
+static int column_len(lua_State *l)
+{
+    COLUMN *column = check_column(l, 1);
+    lua_pushinteger(l, (lua_Integer)column->count);
+    return 1;
+}
+
+/*
+ * name
+ *      column_totable
+ *
+ * description
+ *      copy values i to j of the column into a lua array
+ */
+static int column_totable(lua_State *l)
+{
+    COLUMN *column = check_column(l, 1);
+    lua_Integer first = luaL_optinteger(l, 2, 1);
+    lua_Integer last = luaL_optinteger(l, 3, (lua_Integer)column->count);
+    luaL_argcheck(l, first >= 1, 2, "out of range");
+    luaL_argcheck(l, last <= (lua_Integer)column->count, 3, "out of range");
+    lua_createtable(l, last >= first ? (int)(last - first + 1) : 0, 0);
+    lua_Integer i;
+    for(i = first; i <= last; ++i)
+    {
+        lua_pushinteger(l, column->values[i - 1]);
+        lua_rawseti(l, -2, (int)(i - first + 1));
+    }
+    return 1;
+}
+
+static const struct luaL_reg column_methods [] = 
+{
+    {"totable", column_totable},
+    {NULL, NULL}  /* sentinel */
+};
+
+/*
+ * name
+ *      init_column_type
+ *
+ * description
+ *      register metatable of bitstring.column
+ */
+static void init_column_type(lua_State *l)
+{
+    luaL_newmetatable(l, COLUMN_TYPE);
+    lua_pushcfunction(l, column_index);
+    lua_setfield(l, -2, "__index");
+    lua_pushcfunction(l, column_len);
+    lua_setfield(l, -2, "__len");
+    lua_newtable(l);
+    luaL_register(l, NULL, column_methods);
+    lua_setfield(l, -2, "methods");
+    lua_pop(l, 1);
+}
@@ -75,6 +75,7 @@ static int l_hexdump(lua_State *l)
 {
     size_t len = 0;
     const unsigned char *input = get_substring(l, &len, 1, 2, 3);
+    PROBE_ENTRY(dump, "hexdump", len);
 
     luaL_Buffer b; 
     luaL_buffinit(l, &b);
@@ -125,6 +126,7 @@ static int l_hexdump(lua_State *l)
         luaL_addsize(&b, column);
     }
     luaL_pushresult(&b);
+    PROBE_RETURN(dump, "hexdump", 0, len, lua_objlen(l, -1), 0);
     return 1;
 }
 
@@ -132,6 +134,7 @@ static int l_hexstream(lua_State *l)
 {
     size_t len = 0;
     const unsigned char *input = get_substring(l, &len, 1, 2, 3);
+    PROBE_ENTRY(dump, "hexstream", len);
 
     luaL_Buffer b; 
     luaL_buffinit(l, &b);
@@ -150,6 +153,7 @@ static int l_hexstream(lua_State *l)
         luaL_addsize(&b, column);
     }
     luaL_pushresult(&b);
+    PROBE_RETURN(dump, "hexstream", 0, len, lua_objlen(l, -1), 0);
     return 1;
 }
 
@@ -157,6 +161,7 @@ static int l_fromhexstream(lua_State *l)
 {
     size_t len = 0;
     const unsigned char *input = get_substring(l, &len, 1, 2, 3);
+    PROBE_ENTRY(dump, "fromhexstream", len);
 
     luaL_Buffer b; 
     luaL_buffinit(l, &b);
@@ -188,6 +193,7 @@ static int l_fromhexstream(lua_State *l)
         luaL_addsize(&b, current_byte - result);
     }
     luaL_pushresult(&b);
+    PROBE_RETURN(dump, "fromhexstream", 0, len, lua_objlen(l, -1), 0);
     return 1;
 }
 
@@ -0,0 +1,125 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * LuaJIT backend.
+ * under LuaJIT every call to a lua_CFunction aborts the trace that is
+ * being recorded, so loops that call bitstring.pack and bitstring.unpack 
+ * run in the interpreter. when the library is loaded by LuaJIT with FFI
+ * support, pack and unpack are replaced by Lua functions that call
+ * modules generated by bitstring.codegen(format, "luajit"). the generated
+ * modules are cached by format string or bitmatch. formats that can not be
+ * generated and input that must be rejected are passed to the engine.
+ * builds with stats keep the engine, because the counters are in the 
+ * engine functions that the backend bypasses. the USDT probes fire only
+ * for calls that the backend passes to the engine.
+ */
+
+/*
+ * maximal number of cached format strings. formats that are built at
+ * runtime are not collected from the cache
+ */
+#define LUAJIT_MAX_FORMATS 256
+
+#define LUAJIT_STRINGIFY(x) #x
+#define LUAJIT_TOSTRING(x) LUAJIT_STRINGIFY(x)
+
+/*
+ * the backend chunk. called with bitstring table as argument
+ */
+static const char *LUAJIT_BACKEND =
+    "local bitstring = ...\n"
+    "if type(jit) ~= 'table' or not pcall(require, 'ffi') then\n"
+    "    return\n"
+    "end\n"
+    "local pack, unpack, codegen = bitstring.pack, bitstring.unpack, bitstring.codegen\n"
+    "local type, select, pcall, loadstring = type, select, pcall, loadstring\n"
+    "local generated = setmetatable({}, {__mode = 'k'})\n"
+    "local formats = 0\n"
+    "local lookup = function(format)\n"
+    "    local module = generated[format]\n"
+    "    if module ~= nil then\n"
+    "        return module\n"
+    "    end\n"
+    "    local format_type = type(format)\n"
+    "    if format_type ~= 'userdata' and format_type ~= 'string' then\n"
+    "        return false\n"
+    "    end\n"
+    "    if format_type == 'string' then\n"
+    "        if formats == " LUAJIT_TOSTRING(LUAJIT_MAX_FORMATS) " then\n"
+    "            return false\n"
+    "        end\n"
+    "        formats = formats + 1\n"
+    "    end\n"
+    "    local ok, source = pcall(codegen, format, 'luajit')\n"
+    "    module = ok and loadstring(source, '=bitstring')(pack, unpack)\n"
+    "    generated[format] = module\n"
+    "    return module\n"
+    "end\n"
+    "bitstring.pack = function(...)\n"
+    "    local module = lookup((...))\n"
+    "    if module then\n"
+    "        return module.pack(select(2, ...))\n"
+    "    end\n"
+    "    return (pack(...))\n"
+    "end\n"
+    "bitstring.unpack = function(...)\n"
+    "    local module = lookup((...))\n"
+    "    if module then\n"
+    "        return module.unpack(select(2, ...))\n"
+    "    end\n"
+    "    return unpack(...)\n"
+    "end\n"
+    "bitstring.backend = 'luajit'\n";
+
+/*
+ * name
+ *      init_luajit_backend
+ *
+ * description
+ *      replace pack and unpack functions of bitstring table when running 
+ *      under LuaJIT, unless stats are compiled in. the table is
+ *      expected on top of the stack
+ *
+ * paramenters
+ *      l - lua state
+ */
+static void init_luajit_backend(lua_State *l)
+{
+    lua_pushliteral(l, "c");
+    lua_setfield(l, -2, "backend");
+#ifndef BITSTRING_STATS
+    if(luaL_loadbuffer(l, LUAJIT_BACKEND, strlen(LUAJIT_BACKEND), "=bitstring") != 0)
+    {
+        lua_error(l);
+    }
+    lua_pushvalue(l, -2);
+    lua_call(l, 1, 0);
+#else
+    (void)LUAJIT_BACKEND;
+#endif // BITSTRING_STATS
+}
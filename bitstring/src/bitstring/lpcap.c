@@ -0,0 +1,825 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pcap and pcapng captures.
+ * bitstring.pcap_reader iterates records of a capture that is held in a 
+ * string or in a bitstring.buffer. a record is returned as timestamp, 
+ * captured length and first and last positions of the packet inside the
+ * capture, so the packet is unpacked with bitstring.unpack(format, 
+ * capture, first, last) without copying it. a capture that is read into 
+ * a buffer with buffer:readfrom is parsed while it grows. next returns 
+ * nil until a whole record is available and reader:discard drops records
+ * that were already returned.
+ *
+ * bitstring.pcap_writer collects pcap records in a buffer and writes them
+ * to a file descriptor in batches.
+ *
+ * header fields are converted with toint and basic_pack_int of the 
+ * engine, in the byte order of the capture.
+ */
+
+#define PCAP_READER_TYPE "bitstring.pcap_reader"
+#define PCAP_WRITER_TYPE "bitstring.pcap_writer"
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_HEADER_BYTES 24
+#define PCAP_RECORD_HEADER_BYTES 16
+/* records that claim more bytes are treated as corrupted */
+#define PCAP_MAX_CAPLEN 0x10000000
+
+#define PCAPNG_SECTION_HEADER 0x0a0d0d0a
+#define PCAPNG_INTERFACE_DESCRIPTION 1
+#define PCAPNG_SIMPLE_PACKET 3
+#define PCAPNG_ENHANCED_PACKET 6
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_BLOCK_BYTES 12
+#define PCAPNG_OPTION_END 0
+#define PCAPNG_OPTION_TSRESOL 9
+#define PCAPNG_MAX_INTERFACES 64
+
+/* size of the batch that the writer collects before writing */
+#define PCAP_WRITE_BATCH 65536
+#define PCAP_DEFAULT_SNAPLEN 262144
+#define PCAP_LINKTYPE_ETHERNET 1
+
+/*
+ * pcapng interface description
+ */
+typedef struct
+{
+    int linktype;
+    size_t snaplen;
+    /* timestamp units in one second */
+    lua_Number resolution;
+} PCAP_INTERFACE;
+
+/*
+ * reader userdata. the capture is kept in the environment table
+ */
+typedef struct
+{
+    int pcapng;
+    /* byte order of the capture or of the current pcapng section. EE_DEFAULT before the first section */
+    ELEMENT_ENDIANESS endianess;
+    /* offset of the next record */
+    size_t offset;
+    /* pcap global header */
+    PCAP_INTERFACE pcap;
+    size_t interface_count;
+    PCAP_INTERFACE interfaces[PCAPNG_MAX_INTERFACES];
+} PCAP_READER;
+
+/*
+ * writer userdata. the file and the batch buffer are kept in the 
+ * environment table
+ */
+typedef struct
+{
+    /* -1 after writer:close */
+    int fd;
+    size_t snaplen;
+    BUFFER *batch;
+} PCAP_WRITER;
+
+/*
+ * name
+ *      read_uint
+ *
+ * description
+ *      convert unsigned integer field of the capture
+ *
+ * paramenters
+ *      l - lua state
+ *      endianess - byte order of the capture
+ *      bytes - the field
+ *      len - size of the field in bytes
+ *
+ * returns
+ *      the value in host byte order
+ */
+static uint64_t read_uint(lua_State *l, ELEMENT_ENDIANESS endianess, const unsigned char *bytes, size_t len)
+{
+    ELEMENT_DESCRIPTION elem;
+    memset(&elem, 0, sizeof(elem));
+    elem.size = len * CHAR_BIT;
+    elem.type = ET_INTEGER;
+    elem.endianess = endianess;
+    /* clear sign extension of 32 bit values on 32 bit lua_Integer */
+    uint64_t mask = len < sizeof(uint64_t) ? (((uint64_t)1) << (len * CHAR_BIT)) - 1 : ~(uint64_t)0;
+    return (uint64_t)toint(l, &elem, 0, bytes, len) & mask;
+}
+
+/*
+ * name
+ *      write_uint32
+ *
+ * description
+ *      pack little endian 32 bit field
+ */
+static void write_uint32(lua_State *l, uint32_t value, PACK_STATE *state)
+{
+    ELEMENT_DESCRIPTION elem;
+    memset(&elem, 0, sizeof(elem));
+    elem.size = 32;
+    elem.type = ET_INTEGER;
+    elem.endianess = EE_LITTLE;
+    basic_pack_int(l, &elem, (lua_Integer)value, state);
+}
+
+/*
+ * name
+ *      check_pcap_reader
+ *
+ * description
+ *      get a userdata from index and verify that it is bitstring.pcap_reader
+ */
+static PCAP_READER *check_pcap_reader(lua_State *l, int index)
+{
+    return (PCAP_READER *)luaL_checkudata(l, index, PCAP_READER_TYPE);
+}
+
+/*
+ * name
+ *      push_capture
+ *
+ * description
+ *      push the capture of reader at index
+ *
+ * returns
+ *      the bytes of the capture
+ */
+static const unsigned char *push_capture(lua_State *l, int index, size_t *len)
+{
+    lua_getfenv(l, index);
+    lua_rawgeti(l, -1, 1);
+    lua_remove(l, -2);
+    return check_bytes(l, -1, len);
+}
+
+/*
+ * name
+ *      l_pcap_reader
+ *
+ * description
+ *      lua_CFunction that creates a reader of pcap or pcapng capture
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - the capture as a string or bitstring.buffer. the buffer
+ *              may contain the beginning of the capture only
+ *
+ * returns
+ *      bitstring.pcap_reader
+ *
+ * throws
+ *      wrong format - not a pcap or pcapng capture
+ *      size error - the capture is shorter then the pcap header
+ */
+static int l_pcap_reader(lua_State *l)
+{
+    size_t len = 0;
+    const unsigned char *capture = check_bytes(l, 1, &len);
+    if(len < sizeof(uint32_t))
+    {
+        luaL_error(l, "size error: capture is shorter then the header");
+    }
+
+    PCAP_READER *reader = (PCAP_READER *)lua_newuserdata(l, sizeof(PCAP_READER));
+    memset(reader, 0, sizeof(PCAP_READER));
+    reader->endianess = EE_DEFAULT;
+
+    uint64_t magic = read_uint(l, EE_LITTLE, capture, sizeof(uint32_t));
+    if(magic == PCAPNG_SECTION_HEADER)
+    {
+        reader->pcapng = 1;
+    }
+    else
+    {
+        if(magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC)
+        {
+            reader->endianess = EE_LITTLE;
+        }
+        else
+        {
+            magic = read_uint(l, EE_BIG, capture, sizeof(uint32_t));
+            if(magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC)
+            {
+                luaL_error(l, "wrong format: not a pcap or pcapng capture");
+            }
+            reader->endianess = EE_BIG;
+        }
+        if(len < PCAP_HEADER_BYTES)
+        {
+            luaL_error(l, "size error: capture is shorter then the header");
+        }
+        reader->pcap.resolution = magic == PCAP_MAGIC ? 1e6 : 1e9;
+        reader->pcap.snaplen = (size_t)read_uint(l, reader->endianess, capture + 16, 4);
+        reader->pcap.linktype = (int)read_uint(l, reader->endianess, capture + 20, 4);
+        reader->offset = PCAP_HEADER_BYTES;
+    }
+
+    luaL_getmetatable(l, PCAP_READER_TYPE);
+    lua_setmetatable(l, -2);
+    lua_createtable(l, 1, 0);
+    lua_pushvalue(l, 1);
+    lua_rawseti(l, -2, 1);
+    lua_setfenv(l, -2);
+    return 1;
+}
+
+/*
+ * name
+ *      push_record
+ *
+ * description
+ *      push values of a record
+ *
+ * returns
+ *      number of pushed values
+ */
+static int push_record(lua_State *l, lua_Number timestamp, size_t first, size_t caplen, size_t origlen, int linktype)
+{
+    lua_pushnumber(l, timestamp);
+    lua_pushinteger(l, (lua_Integer)caplen);
+    lua_pushinteger(l, (lua_Integer)first + 1);
+    lua_pushinteger(l, (lua_Integer)(first + caplen));
+    lua_pushinteger(l, (lua_Integer)origlen);
+    lua_pushinteger(l, (lua_Integer)linktype);
+    return 6;
+}
+
+/*
+ * name
+ *      add_interface
+ *
+ * description
+ *      read pcapng interface description block
+ *
+ * throws
+ *      wrong format - too many interfaces
+ */
+static void add_interface(lua_State *l, PCAP_READER *reader, const unsigned char *body, size_t body_len)
+{
+    if(body_len < 8)
+    {
+        luaL_error(l, "wrong format: interface description block at offset %d is too short", (int)reader->offset);
+    }
+    if(reader->interface_count == PCAPNG_MAX_INTERFACES)
+    {
+        luaL_error(l, "wrong format: more then %d interfaces", PCAPNG_MAX_INTERFACES);
+    }
+
+    PCAP_INTERFACE *description = &reader->interfaces[reader->interface_count++];
+    description->linktype = (int)read_uint(l, reader->endianess, body, 2);
+    description->snaplen = (size_t)read_uint(l, reader->endianess, body + 4, 4);
+    description->resolution = 1e6;
+
+    size_t i = 8;
+    while(i + 4 <= body_len)
+    {
+        uint64_t code = read_uint(l, reader->endianess, body + i, 2);
+        size_t len = (size_t)read_uint(l, reader->endianess, body + i + 2, 2);
+        i += 4;
+        if(code == PCAPNG_OPTION_END || i + len > body_len)
+        {
+            break;
+        }
+        if(code == PCAPNG_OPTION_TSRESOL && len == 1)
+        {
+            int value = body[i];
+            description->resolution = (value & 0x80) ? ldexp(1.0, value & 0x7f) : pow(10.0, value);
+        }
+        /* options are padded to 32 bits */
+        i += (len + 3) & ~(size_t)3;
+    }
+}
+
+/*
+ * name
+ *      l_pcap_next
+ *
+ * description
+ *      lua_CFunction that returns the next record of the capture
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - bitstring.pcap_reader
+ *
+ * returns
+ *      timestamp in seconds, captured length, first and last positions of
+ *      the packet in the capture, original length and link type. 
+ *      nil when the capture does not contain the whole next record
+ *
+ * throws
+ *      wrong format - corrupted record
+ */
+static int l_pcap_next(lua_State *l)
+{
+    PCAP_READER *reader = check_pcap_reader(l, 1);
+    size_t len = 0;
+    const unsigned char *capture = push_capture(l, 1, &len);
+
+    while(reader->offset < len)
+    {
+        const unsigned char *p = capture + reader->offset;
+        size_t remaining = len - reader->offset;
+        if(!reader->pcapng)
+        {
+            if(remaining < PCAP_RECORD_HEADER_BYTES)
+            {
+                break;
+            }
+            uint64_t seconds = read_uint(l, reader->endianess, p, 4);
+            uint64_t fraction = read_uint(l, reader->endianess, p + 4, 4);
+            size_t caplen = (size_t)read_uint(l, reader->endianess, p + 8, 4);
+            size_t origlen = (size_t)read_uint(l, reader->endianess, p + 12, 4);
+            if(caplen > PCAP_MAX_CAPLEN)
+            {
+                luaL_error(l, "wrong format: record at offset %d is too large", (int)reader->offset);
+            }
+            if(remaining - PCAP_RECORD_HEADER_BYTES < caplen)
+            {
+                break;
+            }
+            size_t first = reader->offset + PCAP_RECORD_HEADER_BYTES;
+            reader->offset = first + caplen;
+            return push_record(l, (lua_Number)seconds + (lua_Number)fraction / reader->pcap.resolution, 
+                    first, caplen, origlen, reader->pcap.linktype);
+        }
+
+        if(remaining < PCAPNG_BLOCK_BYTES)
+        {
+            break;
+        }
+        uint64_t type = read_uint(l, EE_LITTLE, p, 4);
+        if(type == PCAPNG_SECTION_HEADER)
+        {
+            /* each section has its own byte order */
+            if(read_uint(l, EE_LITTLE, p + 8, 4) == PCAPNG_BYTE_ORDER_MAGIC)
+            {
+                reader->endianess = EE_LITTLE;
+            }
+            else if(read_uint(l, EE_BIG, p + 8, 4) == PCAPNG_BYTE_ORDER_MAGIC)
+            {
+                reader->endianess = EE_BIG;
+            }
+            else
+            {
+                luaL_error(l, "wrong format: section header at offset %d has wrong byte order magic", (int)reader->offset);
+            }
+            reader->interface_count = 0;
+        }
+        else if(reader->endianess == EE_DEFAULT)
+        {
+            luaL_error(l, "wrong format: pcapng capture does not start with section header");
+        }
+        else
+        {
+            type = read_uint(l, reader->endianess, p, 4);
+        }
+
+        size_t block_len = (size_t)read_uint(l, reader->endianess, p + 4, 4);
+        if(block_len < PCAPNG_BLOCK_BYTES || block_len % 4 != 0 || block_len > PCAP_MAX_CAPLEN)
+        {
+            luaL_error(l, "wrong format: block at offset %d has wrong length %d", (int)reader->offset, (int)block_len);
+        }
+        if(remaining < block_len)
+        {
+            break;
+        }
+
+        const unsigned char *body = p + 8;
+        size_t body_len = block_len - PCAPNG_BLOCK_BYTES;
+        size_t body_offset = reader->offset + 8;
+        reader->offset += block_len;
+        if(type == PCAPNG_INTERFACE_DESCRIPTION)
+        {
+            add_interface(l, reader, body, body_len);
+        }
+        else if(type == PCAPNG_ENHANCED_PACKET)
+        {
+            size_t id = body_len >= 20 ? (size_t)read_uint(l, reader->endianess, body, 4) : 0;
+            size_t caplen = body_len >= 20 ? (size_t)read_uint(l, reader->endianess, body + 12, 4) : 0;
+            if(body_len < 20 || caplen > body_len - 20 || id >= reader->interface_count)
+            {
+                luaL_error(l, "wrong format: corrupted enhanced packet block at offset %d", (int)(body_offset - 8));
+            }
+            uint64_t timestamp = (read_uint(l, reader->endianess, body + 4, 4) << 32) |
+                read_uint(l, reader->endianess, body + 8, 4);
+            size_t origlen = (size_t)read_uint(l, reader->endianess, body + 16, 4);
+            PCAP_INTERFACE *description = &reader->interfaces[id];
+            return push_record(l, (lua_Number)timestamp / description->resolution, 
+                    body_offset + 20, caplen, origlen, description->linktype);
+        }
+        else if(type == PCAPNG_SIMPLE_PACKET)
+        {
+            if(body_len < 4 || reader->interface_count == 0)
+            {
+                luaL_error(l, "wrong format: corrupted simple packet block at offset %d", (int)(body_offset - 8));
+            }
+            size_t origlen = (size_t)read_uint(l, reader->endianess, body, 4);
+            size_t caplen = origlen < body_len - 4 ? origlen : body_len - 4;
+            PCAP_INTERFACE *description = &reader->interfaces[0];
+            if(description->snaplen != 0 && caplen > description->snaplen)
+            {
+                caplen = description->snaplen;
+            }
+            return push_record(l, 0, body_offset + 4, caplen, origlen, description->linktype);
+        }
+        /* other blocks are skipped */
+    }
+
+    lua_pushnil(l);
+    return 1;
+}
+
+/*
+ * name
+ *      l_pcap_records
+ *
+ * description
+ *      lua_CFunction for generic for loop over records
+ *
+ * returns
+ *      next function and the reader
+ */
+static int l_pcap_records(lua_State *l)
+{
+    check_pcap_reader(l, 1);
+    lua_pushcfunction(l, l_pcap_next);
+    lua_pushvalue(l, 1);
+    return 2;
+}
+
+/*
+ * name
+ *      l_pcap_discard
+ *
+ * description
+ *      lua_CFunction that removes records that were already returned from
+ *      the buffer of the reader
+ *
+ * returns
+ *      number of removed bytes
+ *
+ * throws
+ *      bad argument - the capture is not a bitstring.buffer
+ */
+static int l_pcap_discard(lua_State *l)
+{
+    PCAP_READER *reader = check_pcap_reader(l, 1);
+    size_t len = 0;
+    push_capture(l, 1, &len);
+    BUFFER *buffer = to_buffer(l, -1);
+    luaL_argcheck(l, buffer != NULL, 1, "capture of the reader is not a bitstring.buffer");
+
+    size_t count = reader->offset;
+    if(count > 0)
+    {
+        memmove(buffer->data, buffer->data + count, buffer->len - count);
+        buffer->len -= count;
+        reader->offset = 0;
+    }
+    lua_pushinteger(l, (lua_Integer)count);
+    return 1;
+}
+
+/*
+ * name
+ *      check_pcap_writer
+ *
+ * description
+ *      get a userdata from index and verify that it is bitstring.pcap_writer
+ */
+static PCAP_WRITER *check_pcap_writer(lua_State *l, int index)
+{
+    return (PCAP_WRITER *)luaL_checkudata(l, index, PCAP_WRITER_TYPE);
+}
+
+/*
+ * name
+ *      check_open_pcap_writer
+ *
+ * description
+ *      check_pcap_writer that raises error for a closed writer
+ */
+static PCAP_WRITER *check_open_pcap_writer(lua_State *l, int index)
+{
+    PCAP_WRITER *writer = check_pcap_writer(l, index);
+    if(writer->fd < 0)
+    {
+        luaL_error(l, "attempt to use a closed pcap writer");
+    }
+    return writer;
+}
+
+/*
+ * name
+ *      flush_pcap_writer
+ *
+ * description
+ *      write the batch of the writer
+ *
+ * returns
+ *      0 on success, otherwise pushes nil, error message and error number
+ *      and returns 3
+ */
+static int flush_pcap_writer(lua_State *l, PCAP_WRITER *writer)
+{
+    BUFFER *batch = writer->batch;
+    size_t written = 0;
+    while(written < batch->len)
+    {
+#ifdef WIN32
+        int result = _write(writer->fd, batch->data + written, (unsigned int)(batch->len - written));
+#else
+        ssize_t result = write(writer->fd, batch->data + written, batch->len - written);
+#endif // WIN32
+        if(result < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            int error = errno;
+            /* keep the part that was not written */
+            memmove(batch->data, batch->data + written, batch->len - written);
+            batch->len -= written;
+            lua_pushnil(l);
+            lua_pushstring(l, strerror(error));
+            lua_pushinteger(l, error);
+            return 3;
+        }
+        written += (size_t)result;
+    }
+    batch->len = 0;
+    return 0;
+}
+
+/*
+ * name
+ *      l_pcap_writer
+ *
+ * description
+ *      lua_CFunction that creates a pcap writer. the pcap header is
+ *      written with the first batch
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - file descriptor or lua file
+ *          2 - optional link type. default is ethernet
+ *          3 - optional snapshot length
+ *
+ * returns
+ *      bitstring.pcap_writer
+ */
+static int l_pcap_writer(lua_State *l)
+{
+    int fd = check_fd(l, 1);
+    lua_Integer linktype = luaL_optinteger(l, 2, PCAP_LINKTYPE_ETHERNET);
+    lua_Integer snaplen = luaL_optinteger(l, 3, PCAP_DEFAULT_SNAPLEN);
+    luaL_argcheck(l, snaplen > 0, 3, "positive length expected");
+
+    /* 
+     * finalizers run in reverse order of creation. the batch is created 
+     * first, so the writer flushes it before it is released
+     */
+    lua_pushcfunction(l, l_buffer);
+    lua_call(l, 0, 1);
+    BUFFER *batch = check_buffer(l, -1);
+
+    PCAP_WRITER *writer = (PCAP_WRITER *)lua_newuserdata(l, sizeof(PCAP_WRITER));
+    int writer_index = lua_gettop(l);
+    writer->fd = fd;
+    writer->snaplen = (size_t)snaplen;
+    writer->batch = batch;
+    luaL_getmetatable(l, PCAP_WRITER_TYPE);
+    lua_setmetatable(l, -2);
+
+    lua_createtable(l, 2, 0);
+    lua_pushvalue(l, 1);
+    lua_rawseti(l, -2, 1);
+    lua_pushvalue(l, writer_index - 1);
+    lua_rawseti(l, -2, 2);
+    lua_setfenv(l, writer_index);
+
+    reserve_buffer(l, batch, PCAP_WRITE_BATCH);
+    PACK_STATE state;
+    state.buffer = NULL;
+    state.prep_buffer = batch->data;
+    state.current_bit = 0;
+    state.result_bits = batch->capacity * CHAR_BIT;
+    state.constant_count = 0;
+    write_uint32(l, PCAP_MAGIC, &state);
+    /* version 2.4 */
+    write_uint32(l, 2 | (4 << 16), &state);
+    write_uint32(l, 0, &state);
+    write_uint32(l, 0, &state);
+    write_uint32(l, (uint32_t)snaplen, &state);
+    write_uint32(l, (uint32_t)linktype, &state);
+    batch->len = state.current_bit / CHAR_BIT;
+    return 1;
+}
+
+/*
+ * name
+ *      l_pcap_write
+ *
+ * description
+ *      lua_CFunction that adds a record to the batch of the writer. the
+ *      batch is written when it is full
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - bitstring.pcap_writer
+ *          2 - timestamp in seconds
+ *          3 - the packet as a string or bitstring.buffer
+ *          4 - optional original length of the packet
+ *
+ * returns
+ *      true or nil, error message and error number if the write failed
+ */
+static int l_pcap_write(lua_State *l)
+{
+    PCAP_WRITER *writer = check_open_pcap_writer(l, 1);
+    lua_Number timestamp = luaL_checknumber(l, 2);
+    size_t len = 0;
+    const unsigned char *packet = check_bytes(l, 3, &len);
+    lua_Integer origlen = luaL_optinteger(l, 4, (lua_Integer)len);
+    luaL_argcheck(l, timestamp >= 0, 2, "negative timestamp");
+
+    size_t caplen = len < writer->snaplen ? len : writer->snaplen;
+    uint32_t seconds = (uint32_t)floor(timestamp);
+    uint32_t microseconds = (uint32_t)floor((timestamp - floor(timestamp)) * 1e6 + 0.5);
+    if(microseconds >= 1000000)
+    {
+        ++seconds;
+        microseconds -= 1000000;
+    }
+
+    BUFFER *batch = writer->batch;
+    reserve_buffer(l, batch, batch->len + PCAP_RECORD_HEADER_BYTES + caplen + sizeof(lua_Integer) + 1);
+    PACK_STATE state;
+    state.buffer = NULL;
+    state.prep_buffer = batch->data + batch->len;
+    state.current_bit = 0;
+    state.result_bits = (batch->capacity - batch->len) * CHAR_BIT;
+    state.constant_count = 0;
+    write_uint32(l, seconds, &state);
+    write_uint32(l, microseconds, &state);
+    write_uint32(l, (uint32_t)caplen, &state);
+    write_uint32(l, (uint32_t)origlen, &state);
+    memcpy(batch->data + batch->len + PCAP_RECORD_HEADER_BYTES, packet, caplen);
+    batch->len += PCAP_RECORD_HEADER_BYTES + caplen;
+
+    if(batch->len >= PCAP_WRITE_BATCH)
+    {
+        int result = flush_pcap_writer(l, writer);
+        if(result != 0)
+        {
+            return result;
+        }
+    }
+    lua_pushboolean(l, 1);
+    return 1;
+}
+
+/*
+ * name
+ *      l_pcap_flush
+ *
+ * description
+ *      lua_CFunction that writes the collected records
+ *
+ * returns
+ *      true or nil, error message and error number if the write failed
+ */
+static int l_pcap_flush(lua_State *l)
+{
+    PCAP_WRITER *writer = check_open_pcap_writer(l, 1);
+    int result = flush_pcap_writer(l, writer);
+    if(result != 0)
+    {
+        return result;
+    }
+    lua_pushboolean(l, 1);
+    return 1;
+}
+
+/*
+ * name
+ *      l_pcap_close
+ *
+ * description
+ *      lua_CFunction that writes the collected records and closes the 
+ *      writer. the file is not closed, it belongs to the caller. closing
+ *      a closed writer does nothing
+ *
+ * returns
+ *      true or nil, error message and error number if the write failed.
+ *      the writer stays open when the write failed
+ */
+static int l_pcap_close(lua_State *l)
+{
+    PCAP_WRITER *writer = check_pcap_writer(l, 1);
+    if(writer->fd >= 0)
+    {
+        int result = flush_pcap_writer(l, writer);
+        if(result != 0)
+        {
+            return result;
+        }
+        writer->fd = -1;
+    }
+    lua_pushboolean(l, 1);
+    return 1;
+}
+
+/*
+ * name
+ *      pcap_writer_gc
+ *
+ * description
+ *      __gc metamethod. write the records that were not flushed
+ *
+ * rationale
+ *      records below the batch size would be lost silently when the 
+ *      writer is dropped without flush. write errors can not be reported
+ *      from a finalizer and are ignored
+ */
+static int pcap_writer_gc(lua_State *l)
+{
+    PCAP_WRITER *writer = check_pcap_writer(l, 1);
+    if(writer->fd >= 0 && writer->batch != NULL)
+    {
+        flush_pcap_writer(l, writer);
+        writer->fd = -1;
+    }
+    return 0;
+}
+
+static const struct luaL_reg pcap_reader_methods [] = 
+{
+    {"next", l_pcap_next},
+    {"records", l_pcap_records},
+    {"discard", l_pcap_discard},
+    {NULL, NULL}  /* sentinel */
+};
+
+static const struct luaL_reg pcap_writer_methods [] = 
+{
+    {"write", l_pcap_write},
+    {"flush", l_pcap_flush},
+    {"close", l_pcap_close},
+    {NULL, NULL}  /* sentinel */
+};
+
+/*
+ * name
+ *      init_pcap_types
+ *
+ * description
+ *      register metatables of bitstring.pcap_reader and bitstring.pcap_writer
+ */
+static void init_pcap_types(lua_State *l)
+{
+    luaL_newmetatable(l, PCAP_READER_TYPE);
+    lua_newtable(l);
+    luaL_register(l, NULL, pcap_reader_methods);
+    lua_setfield(l, -2, "__index");
+    lua_pop(l, 1);
+
+    luaL_newmetatable(l, PCAP_WRITER_TYPE);
+    lua_newtable(l);
+    luaL_register(l, NULL, pcap_writer_methods);
+    lua_setfield(l, -2, "__index");
+    lua_pushcfunction(l, pcap_writer_gc);
+    lua_setfield(l, -2, "__gc");
+    lua_pop(l, 1);
+}
@@ -0,0 +1,282 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * process level registry of compiled bitmatches.
+ * bitstring.compile and bitstring.project build a temporary bitmatch
+ * and look it up in the registry. equal bitmatches are shared by all lua
+ * states of the process, so the same layouts compiled by every worker
+ * state are stored once. the registry is keyed by the parsed elements,
+ * which are the normalized form of the format text, so formats that
+ * differ in white space only share the plan. a bitstring.bitmatch 
+ * userdata holds one reference and releases it in bitmatch_gc. shared 
+ * bitmatches are never modified. only the counters of a build with
+ * --enable-stats are updated.
+ */
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif // HAVE_PTHREAD
+
+#define PLANS_BUCKET_COUNT 256
+
+/*
+ * registry entry
+ */
+typedef struct SHARED_PLAN
+{
+    struct SHARED_PLAN *next;
+    size_t refcount;
+    uint32_t hash;
+#ifdef BITSTRING_STATS
+    STATS_COUNTERS counters;
+#endif // BITSTRING_STATS
+    /* must be the last member */
+    BITMATCH bitmatch;
+} SHARED_PLAN;
+
+static SHARED_PLAN *PLANS[PLANS_BUCKET_COUNT];
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t PLANS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_PLANS() pthread_mutex_lock(&PLANS_LOCK)
+#define UNLOCK_PLANS() pthread_mutex_unlock(&PLANS_LOCK)
+#else
+#define LOCK_PLANS()
+#define UNLOCK_PLANS()
+#endif // HAVE_PTHREAD
+
+/*
+ * name
+ *      hash_bits
+ *
+ * description
+ *      FNV-1a step over the bytes of a value
+ */
+static uint32_t hash_bits(uint32_t hash, const void *value, size_t len)
+{
+    const unsigned char *bytes = (const unsigned char *)value;
+    size_t i;
+    for(i = 0; i < len; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * name
+ *      hash_bitmatch
+ *
+ * description
+ *      hash of the elements. the members are hashed one by one so that
+ *      padding of the structure does not matter
+ */
+static uint32_t hash_bitmatch(const BITMATCH *bitmatch)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        const ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        int type = elem->type;
+        int endianess = elem->endianess;
+        hash = hash_bits(hash, &elem->size, sizeof(elem->size));
+        hash = hash_bits(hash, &type, sizeof(type));
+        hash = hash_bits(hash, &endianess, sizeof(endianess));
+        hash = hash_bits(hash, &elem->skip, sizeof(elem->skip));
+        hash = hash_bits(hash, &elem->constant, sizeof(elem->constant));
+        hash = hash_bits(hash, &elem->value, sizeof(elem->value));
+    }
+    return hash_bits(hash, &bitmatch->element_count, sizeof(bitmatch->element_count));
+}
+
+/*
+ * name
+ *      equal_bitmatches
+ *
+ * returns
+ *      1 if the bitmatches have the same elements, 0 otherwise
+ */
+static int equal_bitmatches(const BITMATCH *a, const BITMATCH *b)
+{
+    if(a->element_count != b->element_count)
+    {
+        return 0;
+    }
+    size_t i;
+    for(i = 0; i < a->element_count; ++i)
+    {
+        const ELEMENT_DESCRIPTION *x = &a->elements[i];
+        const ELEMENT_DESCRIPTION *y = &b->elements[i];
+        if(x->size != y->size || x->type != y->type || x->endianess != y->endianess ||
+                x->skip != y->skip || x->constant != y->constant || x->value != y->value)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * name
+ *      plan_from_bitmatch
+ *
+ * returns
+ *      registry entry that holds the bitmatch
+ */
+static SHARED_PLAN *plan_from_bitmatch(BITMATCH *bitmatch)
+{
+    return (SHARED_PLAN *)((char *)bitmatch - offsetof(SHARED_PLAN, bitmatch));
+}
+
+/*
+ * name
+ *      push_shared_bitmatch
+ *
+ * description
+ *      find equal bitmatch in the registry or add a copy of the bitmatch,
+ *      and push bitstring.bitmatch userdata that references it
+ *
+ * paramenters
+ *      l - lua state
+ *      bitmatch - temporary bitmatch that was compiled
+ *
+ * throws
+ *      memory error - the plan could not be allocated
+ */
+static void push_shared_bitmatch(lua_State *l, const BITMATCH *bitmatch)
+{
+    /* the userdata exists before the reference is taken, so that it is always released */
+    BITMATCH_HANDLE *handle = (BITMATCH_HANDLE *)lua_newuserdata(l, sizeof(BITMATCH_HANDLE));
+    handle->bitmatch = NULL;
+    luaL_getmetatable(l, "bitstring.bitmatch");
+    lua_setmetatable(l, -2);
+
+    size_t element_count = bitmatch->element_count;
+    SHARED_PLAN *plan = (SHARED_PLAN *)malloc(sizeof(SHARED_PLAN) + 
+            sizeof(ELEMENT_DESCRIPTION) * (element_count > 0 ? element_count - 1 : 0));
+    if(plan == NULL)
+    {
+        luaL_error(l, "not enough memory for bitmatch of %d elements", (int)element_count);
+    }
+    plan->refcount = 1;
+    plan->hash = hash_bitmatch(bitmatch);
+#ifdef BITSTRING_STATS
+    memset(&plan->counters, 0, sizeof(plan->counters));
+#endif // BITSTRING_STATS
+    plan->bitmatch.element_count = element_count;
+    memcpy(plan->bitmatch.elements, bitmatch->elements, sizeof(ELEMENT_DESCRIPTION) * element_count);
+
+    LOCK_PLANS();
+    SHARED_PLAN **bucket = &PLANS[plan->hash % PLANS_BUCKET_COUNT];
+    SHARED_PLAN *shared = *bucket;
+    while(shared != NULL && (shared->hash != plan->hash || !equal_bitmatches(&shared->bitmatch, bitmatch)))
+    {
+        shared = shared->next;
+    }
+    if(shared != NULL)
+    {
+        ++shared->refcount;
+    }
+    else
+    {
+        plan->next = *bucket;
+        *bucket = plan;
+        shared = plan;
+    }
+    UNLOCK_PLANS();
+
+    if(shared != plan)
+    {
+        free(plan);
+    }
+    handle->bitmatch = &shared->bitmatch;
+}
+
+/*
+ * name
+ *      release_bitmatch
+ *
+ * description
+ *      release a reference to shared bitmatch. the last reference
+ *      removes it from the registry
+ */
+static void release_bitmatch(BITMATCH *bitmatch)
+{
+    SHARED_PLAN *plan = plan_from_bitmatch(bitmatch);
+    int last = 0;
+    LOCK_PLANS();
+    if(--plan->refcount == 0)
+    {
+        SHARED_PLAN **link = &PLANS[plan->hash % PLANS_BUCKET_COUNT];
+        while(*link != plan)
+        {
+            link = &(*link)->next;
+        }
+        *link = plan->next;
+        last = 1;
+    }
+    UNLOCK_PLANS();
+
+    if(last)
+    {
+        free(plan);
+    }
+}
+
+/*
+ * name
+ *      l_plans
+ *
+ * description
+ *      lua_CFunction that reports the size of the registry
+ *
+ * returns
+ *      number of shared bitmatches and number of references to them
+ *      from all lua states of the process
+ */
+static int l_plans(lua_State *l)
+{
+    size_t count = 0;
+    size_t references = 0;
+    LOCK_PLANS();
+    size_t i;
+    for(i = 0; i < PLANS_BUCKET_COUNT; ++i)
+    {
+        SHARED_PLAN *plan;
+        for(plan = PLANS[i]; plan != NULL; plan = plan->next)
+        {
+            ++count;
+            references += plan->refcount;
+        }
+    }
+    UNLOCK_PLANS();
+    lua_pushinteger(l, (lua_Integer)count);
+    lua_pushinteger(l, (lua_Integer)references);
+    return 2;
+}
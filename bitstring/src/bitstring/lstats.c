@@ -0,0 +1,344 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * call counters.
+ * when configured with --enable-stats, pack, unpack, trypack and 
+ * tryunpack count calls, errors, bytes and time on the shared bitmatch
+ * of the call, or on one set of counters for all format strings. 
+ * bitstring.stats reads them. the counters are updated with atomic adds,
+ * because shared bitmatches are used by all lua states of the process.
+ * without --enable-stats the STATS_BEGIN and STATS_END macros are empty
+ * and bitstring.stats returns nil.
+ *
+ * allocations are the strings and userdata that the calls create with
+ * luaL_Buffer, lua_pushlstring and lua_newuserdata, and their bytes.
+ * strings that lua finds interned are counted as well. the allocator of
+ * the lua state is not wrapped, because bitstring may be unloaded before
+ * the state is closed.
+ *
+ * a call is counted as an error when it starts and the error count is
+ * decreased when it succeeds, so calls that raise a lua error are counted
+ * without catching it. calls in progress are counted as errors as well.
+ */
+
+#ifdef BITSTRING_STATS
+#include <time.h>
+
+#ifdef __GNUC__
+#define STATS_ADD(counter, value) __sync_fetch_and_add(&(counter), (uint64_t)(value))
+#define STATS_SUB(counter, value) __sync_fetch_and_sub(&(counter), (uint64_t)(value))
+#else
+#define STATS_ADD(counter, value) ((counter) += (uint64_t)(value))
+#define STATS_SUB(counter, value) ((counter) -= (uint64_t)(value))
+#endif // __GNUC__
+
+#ifdef __GNUC__
+#define STATS_THREAD __thread
+#else
+#define STATS_THREAD
+#endif // __GNUC__
+
+/* the counters of all calls with format strings */
+static STATS_COUNTERS FORMAT_COUNTERS;
+
+/* allocations of the calls of this thread */
+static STATS_THREAD uint64_t ALLOCATIONS;
+static STATS_THREAD uint64_t ALLOCATED_BYTES;
+
+/*
+ * name
+ *      stats_alloc
+ *
+ * description
+ *      count a string or userdata of bytes length created by a call
+ */
+static void stats_alloc(size_t bytes)
+{
+    ++ALLOCATIONS;
+    ALLOCATED_BYTES += bytes;
+}
+
+/*
+ * name
+ *      stats_now
+ *
+ * returns
+ *      monotonic time in nanoseconds
+ */
+static uint64_t stats_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * name
+ *      stats_begin
+ *
+ * description
+ *      count the start of a call. the counters are chosen by the first 
+ *      argument, a bitmatch or a format string
+ */
+static void stats_begin(lua_State *l, STATS_CALL *call)
+{
+    call->counters = &FORMAT_COUNTERS;
+    if(lua_type(l, 1) == LUA_TUSERDATA && lua_getmetatable(l, 1))
+    {
+        luaL_getmetatable(l, "bitstring.bitmatch");
+        if(lua_rawequal(l, -1, -2))
+        {
+            BITMATCH_HANDLE *handle = (BITMATCH_HANDLE *)lua_touserdata(l, 1);
+            call->counters = &plan_from_bitmatch(handle->bitmatch)->counters;
+        }
+        lua_pop(l, 2);
+    }
+    STATS_ADD(call->counters->calls, 1);
+    STATS_ADD(call->counters->errors, 1);
+    call->allocations = ALLOCATIONS;
+    call->allocated_bytes = ALLOCATED_BYTES;
+    call->start = stats_now();
+}
+
+/*
+ * name
+ *      stats_end
+ *
+ * description
+ *      count the end of a call that succeeded
+ */
+static void stats_end(STATS_CALL *call, size_t bytes_in, size_t bytes_out)
+{
+    STATS_ADD(call->counters->nanoseconds, stats_now() - call->start);
+    STATS_ADD(call->counters->bytes_in, bytes_in);
+    STATS_ADD(call->counters->bytes_out, bytes_out);
+    STATS_ADD(call->counters->allocations, ALLOCATIONS - call->allocations);
+    STATS_ADD(call->counters->allocated_bytes, ALLOCATED_BYTES - call->allocated_bytes);
+    STATS_SUB(call->counters->errors, 1);
+}
+
+/*
+ * name
+ *      set_counter
+ *
+ * description
+ *      set field of the table on top of the stack
+ */
+static void set_counter(lua_State *l, const char *name, uint64_t value)
+{
+    lua_pushnumber(l, (lua_Number)value);
+    lua_setfield(l, -2, name);
+}
+
+/*
+ * name
+ *      push_counters
+ *
+ * description
+ *      push table with the counters
+ */
+static void push_counters(lua_State *l, const STATS_COUNTERS *counters)
+{
+    lua_createtable(l, 0, 8);
+    set_counter(l, "calls", counters->calls);
+    set_counter(l, "errors", counters->errors);
+    set_counter(l, "bytes_in", counters->bytes_in);
+    set_counter(l, "bytes_out", counters->bytes_out);
+    set_counter(l, "nanoseconds", counters->nanoseconds);
+    set_counter(l, "allocations", counters->allocations);
+    set_counter(l, "allocated_bytes", counters->allocated_bytes);
+}
+
+/*
+ * name
+ *      format_layout
+ *
+ * description
+ *      write the elements of bitmatch in the format syntax. elements that
+ *      are skipped by bitstring.project are written with skip type
+ *
+ * paramenters
+ *      bitmatch - the bitmatch
+ *      text - out parameter. buffer for the text, may be NULL
+ *      text_len - size of the text buffer
+ *
+ * returns
+ *      length of the whole text without the terminating zero
+ */
+static size_t format_layout(const BITMATCH *bitmatch, char *text, size_t text_len)
+{
+    size_t len = 0;
+    size_t i;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        const ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        char part[64];
+        int part_len = 0;
+        if(elem->size == (size_t)ALL || elem->size == (size_t)REST || elem->size == (size_t)VAR)
+        {
+            part_len = snprintf(part, sizeof(part), "%s%s:%s",  i > 0 ? ", " : "", 
+                    elem->size == (size_t)ALL ? ALL_SPECIFIER : elem->size == (size_t)REST ? REST_SPECIFIER : VAR_SPECIFIER,
+                    elem->skip ? "skip" : TYPES[elem->type]);
+        }
+        else
+        {
+            part_len = snprintf(part, sizeof(part), "%s%u:%s",  i > 0 ? ", " : "", (unsigned)elem->size, 
+                    elem->skip ? "skip" : TYPES[elem->type]);
+        }
+        if(elem->endianess != EE_DEFAULT && !elem->skip)
+        {
+            part_len += snprintf(part + part_len, sizeof(part) - part_len, ":%s", ENDIANESSES[elem->endianess]);
+        }
+        if(elem->constant)
+        {
+            part_len += snprintf(part + part_len, sizeof(part) - part_len, "=0x%llx", 
+                    (unsigned long long)elem->value);
+        }
+        if(text != NULL && len + part_len < text_len)
+        {
+            memcpy(text + len, part, part_len + 1);
+        }
+        len += part_len;
+    }
+    return len;
+}
+
+/*
+ * plan counters copied while the registry is locked
+ */
+typedef struct
+{
+    STATS_COUNTERS counters;
+    /* offset of the layout text */
+    size_t layout;
+} STATS_SNAPSHOT;
+
+/*
+ * name
+ *      push_snapshot
+ *
+ * description
+ *      push counters of format strings and of all shared bitmatches
+ *
+ * rationale
+ *      the sizes are measured first and the snapshot is allocated while
+ *      the registry is not locked, because lua errors would leave it 
+ *      locked. plans that are added in between are left out
+ */
+static void push_snapshot(lua_State *l)
+{
+    size_t plan_count = 0;
+    size_t text_len = 0;
+    size_t i;
+    SHARED_PLAN *plan;
+    LOCK_PLANS();
+    for(i = 0; i < PLANS_BUCKET_COUNT; ++i)
+    {
+        for(plan = PLANS[i]; plan != NULL; plan = plan->next)
+        {
+            ++plan_count;
+            text_len += format_layout(&plan->bitmatch, NULL, 0) + 1;
+        }
+    }
+    UNLOCK_PLANS();
+
+    size_t snapshot_len = sizeof(STATS_SNAPSHOT) * plan_count + text_len;
+    STATS_SNAPSHOT *snapshots = (STATS_SNAPSHOT *)lua_newuserdata(l, snapshot_len > 0 ? snapshot_len : 1);
+    char *text = (char *)(snapshots + plan_count);
+    size_t count = 0;
+    size_t offset = 0;
+    LOCK_PLANS();
+    for(i = 0; i < PLANS_BUCKET_COUNT; ++i)
+    {
+        for(plan = PLANS[i]; plan != NULL && count < plan_count; plan = plan->next)
+        {
+            size_t len = format_layout(&plan->bitmatch, NULL, 0);
+            if(offset + len + 1 > text_len)
+            {
+                continue;
+            }
+            format_layout(&plan->bitmatch, text + offset, len + 1);
+            snapshots[count].counters = plan->counters;
+            snapshots[count].layout = offset;
+            offset += len + 1;
+            ++count;
+        }
+    }
+    UNLOCK_PLANS();
+
+    lua_createtable(l, 0, 2);
+    push_counters(l, &FORMAT_COUNTERS);
+    lua_setfield(l, -2, "formats");
+    lua_createtable(l, (int)count, 0);
+    for(i = 0; i < count; ++i)
+    {
+        push_counters(l, &snapshots[i].counters);
+        lua_pushstring(l, text + snapshots[i].layout);
+        lua_setfield(l, -2, "layout");
+        lua_rawseti(l, -2, (int)i + 1);
+    }
+    lua_setfield(l, -2, "bitmatches");
+    lua_remove(l, -2);
+}
+#endif // BITSTRING_STATS
+
+/*
+ * name
+ *      l_stats
+ *
+ * description
+ *      lua_CFunction that reads the counters
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - optional bitmatch
+ *
+ * returns
+ *      table with calls, errors, bytes_in, bytes_out, nanoseconds, 
+ *      allocations and allocated_bytes counters of the bitmatch, or without arguments a snapshot table
+ *      with counters of format strings in formats field and array of
+ *      counters of all shared bitmatches with their layout text in 
+ *      bitmatches field. nil when built without --enable-stats
+ */
+static int l_stats(lua_State *l)
+{
+#ifdef BITSTRING_STATS
+    if(lua_isnoneornil(l, 1))
+    {
+        push_snapshot(l);
+    }
+    else
+    {
+        BITMATCH *bitmatch = get_bitmatch(l, 1);
+        push_counters(l, &plan_from_bitmatch(bitmatch)->counters);
+    }
+#else
+    lua_pushnil(l);
+#endif // BITSTRING_STATS
+    return 1;
+}
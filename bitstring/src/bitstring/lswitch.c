@@ -0,0 +1,573 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * multi-pattern dispatch.
+ * bitstring.switch compiles a list of layouts into a decision tree over
+ * their constant int elements (discriminators). only constants at fixed
+ * bit offsets, before the first element of variable size, are used.
+ * every node of the tree reads one discriminator and selects a child by
+ * binary search over the values that the layouts expect. layouts that do
+ * not constrain the discriminator follow every child. the leaves keep the
+ * remaining layouts in the original order, the first one that matches
+ * the whole input is unpacked.
+ * because unconstrained layouts are copied into every child, the tree
+ * may grow exponentially with the number of discriminators. a node is 
+ * split only by a discriminator that at least two of its layouts 
+ * constrain, and only while the candidate budget of the tree lasts.
+ * past that the node is a leaf with the ordered candidates.
+ */
+
+#define SWITCH_TYPE "bitstring.switch"
+
+/* candidates that inner nodes of the tree may hold, per layout */
+#define SWITCH_BUDGET_PER_LAYOUT 64
+
+/*
+ * discriminator. int bits at fixed offset
+ */
+typedef struct
+{
+    size_t offset;
+    size_t size;
+    ELEMENT_ENDIANESS endianess;
+} SWITCH_KEY;
+
+/*
+ * decision tree node
+ */
+typedef struct
+{
+    /* index of the discriminator or -1 for a leaf */
+    int key;
+    /* cases sorted by value */
+    size_t first_case;
+    size_t case_count;
+    /* node for values without a case and for input that is too short */
+    size_t default_node;
+    /* layouts of a leaf in the original order */
+    size_t first_candidate;
+    size_t candidate_count;
+} SWITCH_NODE;
+
+/*
+ * child of a node for one value of the discriminator
+ */
+typedef struct
+{
+    lua_Integer value;
+    size_t node;
+} SWITCH_CASE;
+
+/*
+ * switch userdata. the arrays are owned by buffers that are kept 
+ * with the layouts in the environment table of the userdata
+ */
+typedef struct
+{
+    size_t layout_count;
+    BITMATCH **layouts;
+    SWITCH_KEY *keys;
+    SWITCH_NODE *nodes;
+    SWITCH_CASE *cases;
+    size_t *candidates;
+} SWITCH_TABLE;
+
+/*
+ * data used while building the tree
+ */
+typedef struct
+{
+    size_t key_count;
+    SWITCH_KEY *keys;
+    /* row of each layout has stride cells, one for every possible key */
+    size_t stride;
+    lua_Integer *values;
+    unsigned char *has_value;
+    /* keys that are tested on the path to the current node */
+    unsigned char *used;
+    BUFFER *nodes;
+    BUFFER *cases;
+    BUFFER *candidates;
+    /* candidates that inner nodes may still hold */
+    size_t budget;
+} SWITCH_BUILD;
+
+/*
+ * name
+ *      new_switch_buffer
+ *
+ * description
+ *      push an empty bitstring.buffer
+ */
+static BUFFER *new_switch_buffer(lua_State *l)
+{
+    lua_pushcfunction(l, l_buffer);
+    lua_call(l, 0, 1);
+    return check_buffer(l, -1);
+}
+
+/*
+ * name
+ *      compare_case_values
+ *
+ * description
+ *      qsort callback for lua_Integer values
+ */
+static int compare_case_values(const void *a, const void *b)
+{
+    lua_Integer x = *(const lua_Integer *)a;
+    lua_Integer y = *(const lua_Integer *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*
+ * name
+ *      build_switch_node
+ *
+ * description
+ *      append a node for the candidate layouts and build its children.
+ *      the discriminator that is constrained by most candidates is tested.
+ *      the node is a leaf when no discriminator is constrained by two 
+ *      candidates or the budget of the tree is spent
+ *
+ * paramenters
+ *      l - lua state
+ *      build - build data
+ *      candidates - layout indexes in the original order
+ *      count - number of candidates
+ *
+ * returns
+ *      index of the node
+ */
+static size_t build_switch_node(lua_State *l, SWITCH_BUILD *build, const size_t *candidates, size_t count)
+{
+    size_t node_index = build->nodes->len / sizeof(SWITCH_NODE);
+    resize_buffer(l, build->nodes, build->nodes->len + sizeof(SWITCH_NODE));
+
+    int key = -1;
+    size_t key_uses = 1;
+    size_t i, j;
+    for(j = 0; j < build->key_count && count <= build->budget; ++j)
+    {
+        size_t uses = 0;
+        for(i = 0; i < count && !build->used[j]; ++i)
+        {
+            uses += build->has_value[candidates[i] * build->stride + j];
+        }
+        if(uses > key_uses)
+        {
+            key = (int)j;
+            key_uses = uses;
+        }
+    }
+
+    SWITCH_NODE node;
+    memset(&node, 0, sizeof(node));
+    node.key = key;
+    if(key < 0)
+    {
+        node.first_candidate = build->candidates->len / sizeof(size_t);
+        node.candidate_count = count;
+        resize_buffer(l, build->candidates, build->candidates->len + count * sizeof(size_t));
+        memcpy((size_t *)build->candidates->data + node.first_candidate, candidates, count * sizeof(size_t));
+        ((SWITCH_NODE *)build->nodes->data)[node_index] = node;
+        return node_index;
+    }
+
+    if(!lua_checkstack(l, 4))
+    {
+        luaL_error(l, "too many discriminators");
+    }
+    build->budget -= count;
+
+    /* distinct values of the discriminator */
+    lua_Integer *values = (lua_Integer *)lua_newuserdata(l, count * sizeof(lua_Integer));
+    size_t value_count = 0;
+    for(i = 0; i < count; ++i)
+    {
+        size_t cell = candidates[i] * build->stride + key;
+        if(build->has_value[cell])
+        {
+            values[value_count++] = build->values[cell];
+        }
+    }
+    qsort(values, value_count, sizeof(lua_Integer), compare_case_values);
+    size_t unique_count = 0;
+    for(i = 0; i < value_count; ++i)
+    {
+        if(unique_count == 0 || values[unique_count - 1] != values[i])
+        {
+            values[unique_count++] = values[i];
+        }
+    }
+
+    node.first_case = build->cases->len / sizeof(SWITCH_CASE);
+    node.case_count = unique_count;
+    resize_buffer(l, build->cases, build->cases->len + unique_count * sizeof(SWITCH_CASE));
+
+    size_t *child = (size_t *)lua_newuserdata(l, (count + 1) * sizeof(size_t));
+    build->used[key] = 1;
+    for(j = 0; j <= unique_count; ++j)
+    {
+        /* the last child is the default node */
+        size_t child_count = 0;
+        for(i = 0; i < count; ++i)
+        {
+            size_t cell = candidates[i] * build->stride + key;
+            if(!build->has_value[cell] || (j < unique_count && build->values[cell] == values[j]))
+            {
+                child[child_count++] = candidates[i];
+            }
+        }
+        size_t child_node = build_switch_node(l, build, child, child_count);
+        if(j < unique_count)
+        {
+            SWITCH_CASE *c = (SWITCH_CASE *)build->cases->data + node.first_case + j;
+            c->value = values[j];
+            c->node = child_node;
+        }
+        else
+        {
+            node.default_node = child_node;
+        }
+    }
+    build->used[key] = 0;
+    lua_pop(l, 2);
+
+    ((SWITCH_NODE *)build->nodes->data)[node_index] = node;
+    return node_index;
+}
+
+/*
+ * name
+ *      add_switch_keys
+ *
+ * description
+ *      collect constant int elements at fixed offsets of a layout
+ *
+ * paramenters
+ *      l - lua state
+ *      build - build data. values of the layout are stored in its row
+ *      layout - index of the layout
+ *      bitmatch - the layout
+ */
+static void add_switch_keys(lua_State *l, SWITCH_BUILD *build, size_t layout, BITMATCH *bitmatch)
+{
+    size_t offset = 0;
+    size_t i, j;
+    for(i = 0; i < bitmatch->element_count; ++i)
+    {
+        ELEMENT_DESCRIPTION *elem = &bitmatch->elements[i];
+        size_t bits = elem->skip && elem->type == ET_UNDEFINED ? elem->size : fixed_bits(l, elem, (int)i + 2);
+        if(bits == 0)
+        {
+            break;
+        }
+        if(elem->constant && !elem->skip)
+        {
+            for(j = 0; j < build->key_count; ++j)
+            {
+                SWITCH_KEY *key = &build->keys[j];
+                if(key->offset == offset && key->size == elem->size && key->endianess == elem->endianess)
+                {
+                    break;
+                }
+            }
+            if(j == build->key_count)
+            {
+                build->keys[j].offset = offset;
+                build->keys[j].size = elem->size;
+                build->keys[j].endianess = elem->endianess;
+                ++build->key_count;
+            }
+            build->values[layout * build->stride + j] = elem->value;
+            build->has_value[layout * build->stride + j] = 1;
+        }
+        offset += bits;
+    }
+}
+
+/*
+ * name
+ *      check_switch
+ *
+ * description
+ *      get a userdata from index and verify that it is bitstring.switch
+ */
+static SWITCH_TABLE *check_switch(lua_State *l, int index)
+{
+    return (SWITCH_TABLE *)luaL_checkudata(l, index, SWITCH_TYPE);
+}
+
+/*
+ * name
+ *      l_switch
+ *
+ * description
+ *      lua_CFunction that compiles layouts into a decision tree
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - array of format strings or bitmatches
+ *
+ * returns
+ *      bitstring.switch userdata
+ *
+ * throws
+ *      wrong format - layout is not a format string or bitmatch
+ */
+static int l_switch(lua_State *l)
+{
+    luaL_checktype(l, 1, LUA_TTABLE);
+    size_t layout_count = lua_objlen(l, 1);
+    luaL_argcheck(l, layout_count > 0, 1, "no layouts");
+
+    /* the environment of the userdata keeps the layouts and the buffers */
+    lua_createtable(l, (int)layout_count, 5);
+    int env_index = lua_gettop(l);
+    size_t constant_count = 0;
+    size_t i, j;
+    for(i = 1; i <= layout_count; ++i)
+    {
+        lua_rawgeti(l, 1, (int)i);
+        if(lua_isstring(l, -1))
+        {
+            lua_pushcfunction(l, l_compile);
+            lua_insert(l, -2);
+            lua_call(l, 1, 1);
+        }
+        if(!lua_isuserdata(l, -1))
+        {
+            luaL_error(l, "wrong format: layout %d is not a format string or bitmatch", (int)i);
+        }
+        BITMATCH *bitmatch = get_bitmatch(l, -1);
+        for(j = 0; j < bitmatch->element_count; ++j)
+        {
+            constant_count += bitmatch->elements[j].constant;
+        }
+        lua_rawseti(l, env_index, (int)i);
+    }
+
+    SWITCH_BUILD build;
+    memset(&build, 0, sizeof(build));
+    build.stride = constant_count > 0 ? constant_count : 1;
+    build.budget = layout_count * SWITCH_BUDGET_PER_LAYOUT;
+
+    BUFFER *layouts = new_switch_buffer(l);
+    lua_setfield(l, env_index, "layouts");
+    BUFFER *keys = new_switch_buffer(l);
+    lua_setfield(l, env_index, "keys");
+    build.nodes = new_switch_buffer(l);
+    lua_setfield(l, env_index, "nodes");
+    build.cases = new_switch_buffer(l);
+    lua_setfield(l, env_index, "cases");
+    build.candidates = new_switch_buffer(l);
+    lua_setfield(l, env_index, "candidates");
+
+    resize_buffer(l, layouts, layout_count * sizeof(BITMATCH *));
+    resize_buffer(l, keys, build.stride * sizeof(SWITCH_KEY));
+    build.keys = (SWITCH_KEY *)keys->data;
+    size_t cells = layout_count * build.stride;
+    build.values = (lua_Integer *)lua_newuserdata(l, cells * sizeof(lua_Integer));
+    build.has_value = (unsigned char *)lua_newuserdata(l, cells);
+    memset(build.has_value, 0, cells);
+    build.used = (unsigned char *)lua_newuserdata(l, build.stride);
+    memset(build.used, 0, build.stride);
+    size_t *candidates = (size_t *)lua_newuserdata(l, layout_count * sizeof(size_t));
+
+    for(i = 0; i < layout_count; ++i)
+    {
+        lua_rawgeti(l, env_index, (int)i + 1);
+        BITMATCH *bitmatch = get_bitmatch(l, -1);
+        lua_pop(l, 1);
+        ((BITMATCH **)layouts->data)[i] = bitmatch;
+        add_switch_keys(l, &build, i, bitmatch);
+        candidates[i] = i;
+    }
+    build_switch_node(l, &build, candidates, layout_count);
+
+    SWITCH_TABLE *table = (SWITCH_TABLE *)lua_newuserdata(l, sizeof(SWITCH_TABLE));
+    table->layout_count = layout_count;
+    table->layouts = (BITMATCH **)layouts->data;
+    table->keys = build.keys;
+    table->nodes = (SWITCH_NODE *)build.nodes->data;
+    table->cases = (SWITCH_CASE *)build.cases->data;
+    table->candidates = (size_t *)build.candidates->data;
+    luaL_getmetatable(l, SWITCH_TYPE);
+    lua_setmetatable(l, -2);
+    lua_pushvalue(l, env_index);
+    lua_setfenv(l, -2);
+    return 1;
+}
+
+/*
+ * name
+ *      read_switch_key
+ *
+ * returns
+ *      value of the discriminator in the input. the caller checks 
+ *      that the input is long enough
+ */
+static lua_Integer read_switch_key(lua_State *l, const SWITCH_KEY *key, const unsigned char *source, size_t len)
+{
+    ELEMENT_DESCRIPTION elem;
+    memset(&elem, 0, sizeof(elem));
+    elem.size = key->size;
+    elem.type = ET_INTEGER;
+    elem.endianess = key->endianess;
+
+    UNPACK_STATE state;
+    state.return_count = 0;
+    state.current_bit = key->offset;
+    state.source_bits = len * CHAR_BIT - key->offset;
+    state.source = source;
+    state.source_end = source + len;
+    lua_Integer value = unpack_int_no_push(l, &elem, 0, &state);
+    if(key->size < sizeof(lua_Integer) * CHAR_BIT)
+    {
+        value &= ((lua_Integer)1 << key->size) - 1;
+    }
+    return value;
+}
+
+/*
+ * name
+ *      l_switch_unpack
+ *
+ * description
+ *      lua_CFunction that selects the first layout that matches the input 
+ *      and unpacks it
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - bitstring.switch
+ *          2 - input string or bitstring.buffer
+ *          3, 4 - optional start and end positions as in get_substring
+ *
+ * returns
+ *      index of the layout followed by the unpacked values or nil 
+ *      if no layout matches
+ */
+static int l_switch_unpack(lua_State *l)
+{
+    SWITCH_TABLE *table = check_switch(l, 1);
+    size_t len = 0;
+    const unsigned char *source = get_substring(l, &len, 2, 3, 4);
+
+    const SWITCH_NODE *node = &table->nodes[0];
+    while(node->key >= 0)
+    {
+        const SWITCH_KEY *key = &table->keys[node->key];
+        size_t next = node->default_node;
+        if(key->offset + key->size <= len * CHAR_BIT)
+        {
+            lua_Integer value = read_switch_key(l, key, source, len);
+            size_t low = node->first_case;
+            size_t high = node->first_case + node->case_count;
+            while(low < high)
+            {
+                size_t middle = low + (high - low) / 2;
+                if(table->cases[middle].value < value)
+                {
+                    low = middle + 1;
+                }
+                else
+                {
+                    high = middle;
+                }
+            }
+            if(low < node->first_case + node->case_count && table->cases[low].value == value)
+            {
+                next = table->cases[low].node;
+            }
+        }
+        node = &table->nodes[next];
+    }
+
+    size_t i, j;
+    for(i = 0; i < node->candidate_count; ++i)
+    {
+        size_t layout = table->candidates[node->first_candidate + i];
+        BITMATCH *bitmatch = table->layouts[layout];
+
+        MATCH_STATE match;
+        match.failed_element = 0;
+        match.failure = TE_NONE;
+        match.failed_bit = 0;
+        match.unpack.return_count = 0;
+        match.unpack.current_bit = 0;
+        match.unpack.source_bits = len * CHAR_BIT;
+        match.unpack.source = source;
+        match.unpack.source_end = source + len;
+        for(j = 0; j < bitmatch->element_count && match.failed_element == 0; ++j)
+        {
+            match_elem(l, &bitmatch->elements[j], (int)j + 2, &match);
+        }
+        if(match.failed_element != 0)
+        {
+            continue;
+        }
+
+        lua_pushinteger(l, (lua_Integer)layout + 1);
+        UNPACK_STATE state;
+        state.return_count = 0;
+        state.current_bit = 0;
+        state.source_bits = len * CHAR_BIT;
+        state.source = source;
+        state.source_end = source + len;
+        for(j = 0; j < bitmatch->element_count; ++j)
+        {
+            unpack_elem(l, &bitmatch->elements[j], (int)j + 2, &state);
+        }
+        return state.return_count + 1;
+    }
+    lua_pushnil(l);
+    return 1;
+}
+
+static const struct luaL_reg switch_methods [] = 
+{
+    {"unpack", l_switch_unpack},
+    {NULL, NULL}  /* sentinel */
+};
+
+/*
+ * name
+ *      init_switch_type
+ *
+ * description
+ *      register metatable of bitstring.switch
+ */
+static void init_switch_type(lua_State *l)
+{
+    luaL_newmetatable(l, SWITCH_TYPE);
+    lua_newtable(l);
+    luaL_register(l, NULL, switch_methods);
+    lua_setfield(l, -2, "__index");
+    lua_pop(l, 1);
+}
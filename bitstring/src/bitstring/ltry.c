@@ -0,0 +1,296 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * non-throwing variants of pack and unpack.
+ * errors that depend on the input and the arguments are returned as
+ * nil, error code, element number and bit offset. the message is built
+ * by bitstring.strerror only when it is needed. wrong format strings
+ * still raise errors.
+ *
+ * tryunpack runs the match checks first. after a successful match 
+ * unpack can not fail, so garbage input is rejected before any value is 
+ * created. trypack checks each argument before the element is packed.
+ */
+
+/*
+ * name
+ *      push_try_error
+ *
+ * description
+ *      push the results of failed tryunpack or trypack
+ *
+ * returns
+ *      number of the results
+ */
+static int push_try_error(lua_State *l, TRY_ERROR failure, int element, size_t bit)
+{
+    lua_pushnil(l);
+    lua_pushstring(l, TRY_ERRORS[failure]);
+    lua_pushinteger(l, element);
+    lua_pushinteger(l, (lua_Integer)bit);
+    return 4;
+}
+
+/*
+ * name
+ *      l_tryunpack
+ *
+ * description
+ *      lua_CFunction that unpacks like bitstring.unpack but returns
+ *      errors instead of raising them
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - format string or bitmatch
+ *          2 - input string or bitstring.buffer
+ *          3, 4 - optional start and end positions as in get_substring
+ *
+ * returns
+ *      the unpacked values or nil, error code, element number and bit
+ *      offset of the element
+ *
+ * throws
+ *      wrong format - the format can not be unpacked with any input
+ */
+static int l_tryunpack(lua_State *l)
+{
+    PROBE_PROTECT(unpack, l_tryunpack);
+    STATS_BEGIN(l);
+    size_t source_len = 0;
+    int start_position = 0;
+    int end_position = 0;
+    const unsigned char *source = find_substring(l, &source_len, 2, 3, 4, &start_position, &end_position);
+    PROBE_ENTRY(unpack, probe_layout(l), source_len);
+    if(source == NULL)
+    {
+        PROBE_RETURN(unpack, probe_layout(l), 0, source_len, 0, TE_POSITION);
+        return push_try_error(l, TE_POSITION, 0, 0);
+    }
+
+    MATCH_STATE match;
+    match.failed_element = 0;
+    match.failure = TE_NONE;
+    match.failed_bit = 0;
+    match.unpack.return_count = 0;
+    match.unpack.current_bit = 0;
+    match.unpack.source_bits = source_len * CHAR_BIT;
+    match.unpack.source = source;
+    match.unpack.source_end = source + source_len;
+    parse(l, match_elem, (void *)&match);
+    if(match.failed_element != 0)
+    {
+        PROBE_RETURN(unpack, probe_layout(l), probe_element_count(l), source_len, 0, match.failure);
+        return push_try_error(l, match.failure, match.failed_element, match.failed_bit);
+    }
+
+    UNPACK_STATE state;
+    state.return_count = 0;
+    state.current_bit = 0;
+    state.source_bits = source_len * CHAR_BIT;
+    state.source = source;
+    state.source_end = source + source_len;
+    parse(l, unpack_elem, (void *)&state);
+    STATS_END(bits_to_bytes(state.current_bit), 0);
+    PROBE_RETURN(unpack, probe_layout(l), probe_element_count(l), source_len, state.return_count, TE_NONE);
+    return state.return_count;
+}
+
+/*
+ * try pack state data that is passed between try_pack_elem invocations
+ */
+typedef struct
+{
+    PACK_STATE pack;
+    /* number of the first element with wrong argument. 0 if none */
+    int failed_element;
+    TRY_ERROR failure;
+    size_t failed_bit;
+} TRY_PACK_STATE;
+
+/*
+ * name
+ *      try_pack_elem
+ *
+ * description
+ *      check the argument of the element and pack it. after the first
+ *      element with wrong argument the rest of elements are ignored
+ *
+ * paramenters
+ *      l - lua state
+ *      elem - element description
+ *      arg_index - number of element in format string. starts from 2
+ *      arg - try pack state passed between invocations
+ */
+static void try_pack_elem(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, void *arg)
+{
+    TRY_PACK_STATE *state = (TRY_PACK_STATE *)arg;
+    if(state->failed_element != 0)
+    {
+        return;
+    }
+
+    TRY_ERROR failure = TE_NONE;
+    if(!elem->constant && !elem->skip)
+    {
+        int value_index = arg_index - state->pack.constant_count;
+        if(elem->type == ET_BINARY)
+        {
+            if(!lua_isstring(l, value_index))
+            {
+                failure = TE_TYPE;
+            }
+            else if(elem->size != (size_t)ALL && elem->size > lua_objlen(l, value_index))
+            {
+                failure = TE_SIZE;
+            }
+        }
+        else if(!lua_isnumber(l, value_index))
+        {
+            failure = TE_TYPE;
+        }
+        else if(is_var_type(elem->type) && !var_value_in_range(l, elem, value_index))
+        {
+            failure = TE_RANGE;
+        }
+    }
+
+    if(failure != TE_NONE)
+    {
+        state->failed_element = arg_index - 1;
+        state->failure = failure;
+        state->failed_bit = state->pack.current_bit;
+        return;
+    }
+    pack_elem(l, elem, arg_index, &state->pack);
+}
+
+/*
+ * name
+ *      l_trypack
+ *
+ * description
+ *      lua_CFunction that packs like bitstring.pack but returns errors 
+ *      of the arguments instead of raising them
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - format string or bitmatch
+ *          2.. - the values
+ *
+ * returns
+ *      the packed string or nil, error code, element number and bit 
+ *      offset of the element
+ *
+ * throws
+ *      wrong format - the format can not be packed with any arguments
+ */
+static int l_trypack(lua_State *l)
+{
+    PROBE_PROTECT(pack, l_trypack);
+    STATS_BEGIN(l);
+    PROBE_ENTRY(pack, probe_layout(l), lua_gettop(l) - 1);
+    luaL_Buffer b; 
+    luaL_buffinit(l, &b);
+
+    TRY_PACK_STATE state;
+    state.pack.buffer = &b;
+    state.pack.prep_buffer = (unsigned char *)luaL_prepbuffer(&b);
+    state.pack.current_bit = 0;
+    state.pack.result_bits = LUAL_BUFFERSIZE * CHAR_BIT;
+    state.pack.constant_count = 0;
+    state.failed_element = 0;
+    state.failure = TE_NONE;
+    state.failed_bit = 0;
+
+    parse(l, try_pack_elem, (void *)&state);
+    if(state.failed_element != 0)
+    {
+        PROBE_RETURN(pack, probe_layout(l), probe_element_count(l), 0, 0, state.failure);
+        return push_try_error(l, state.failure, state.failed_element, state.failed_bit);
+    }
+    luaL_addsize(&b, state.pack.current_bit / CHAR_BIT);
+    luaL_pushresult(&b);
+    STATS_ALLOC(lua_objlen(l, -1));
+    STATS_END(0, lua_objlen(l, -1));
+    PROBE_RETURN(pack, probe_layout(l), probe_element_count(l), lua_gettop(l) - 2, lua_objlen(l, -1), TE_NONE);
+    return 1;
+}
+
+/*
+ * name
+ *      l_strerror
+ *
+ * description
+ *      lua_CFunction that formats error returned by tryunpack or trypack
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - error code
+ *          2 - element number
+ *          3 - bit offset
+ *
+ * returns
+ *      the error message
+ */
+static int l_strerror(lua_State *l)
+{
+    TRY_ERROR failure = (TRY_ERROR)luaL_checkoption(l, 1, NULL, TRY_ERRORS);
+    int element = (int)luaL_optinteger(l, 2, 0);
+    int bit = (int)luaL_optinteger(l, 3, 0);
+    switch(failure)
+    {
+        case TE_SIZE:
+            lua_pushfstring(l, "size error: element %d at bit %d exceeds the remaining part of input", element, bit);
+            break;
+
+        case TE_VALUE:
+            lua_pushfstring(l, "match error: element %d at bit %d does not match the constant value", element, bit);
+            break;
+
+        case TE_ALIGN:
+            lua_pushfstring(l, "wrong format: using rest length specifier for incomplete bytes at element %d (bit %d)", 
+                    element, bit);
+            break;
+
+        case TE_POSITION:
+            lua_pushstring(l, "invalid parameter: start or end position is out of bounds of the input");
+            break;
+
+        case TE_TYPE:
+            lua_pushfstring(l, "invalid parameter: wrong type of argument for element %d", element);
+            break;
+
+        case TE_RANGE:
+            lua_pushfstring(l, "size error: argument for element %d is out of range", element);
+            break;
+
+        default:
+            lua_pushstring(l, "no error");
+    }
+    return 1;
+}
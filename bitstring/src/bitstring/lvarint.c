@@ -0,0 +1,655 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * variable length integers. the size part of these elements is var and
+ * the number of bits is taken from the encoded value.
+ * var types
+ *      uleb128 - unsigned LEB128. 7 bits per byte, least significant
+ *                group first, the high bit of a byte marks continuation
+ *      sleb128 - signed LEB128. two's complement in the same groups
+ *      quic - QUIC variable length integer (RFC 9000). the two most 
+ *             significant bits of the first byte give the length of 
+ *             1, 2, 4 or 8 bytes. values are up to 62 bits
+ *      berlen - ASN.1 BER/DER length octets. definite form only. 
+ *               packing produces the minimal (DER) encoding
+ *      ue - unsigned Exp-Golomb code (H.264 ue(v))
+ *      se - signed Exp-Golomb code (H.264 se(v))
+ *
+ * the elements may start at any bit position. values are limited to 
+ * lua_Integer.
+ */
+
+#define VAR_INTEGER_BITS (sizeof(lua_Integer) * CHAR_BIT)
+#define VAR_INTEGER_MAX ((((uint64_t)1) << (VAR_INTEGER_BITS - 1)) - 1)
+/* longest LEB128 encoding of 64 bit value */
+#define VAR_LEB128_MAX_BYTES 10
+#define VAR_QUIC_MAX ((((uint64_t)1) << 62) - 1)
+
+/*
+ * name
+ *      is_var_type
+ *
+ * returns
+ *      1 if the type is variable length integer
+ */
+static int is_var_type(ELEMENT_TYPE type)
+{
+    return type >= ET_ULEB128 && type <= ET_SE;
+}
+
+/*
+ * name
+ *      check_var_elem
+ *
+ * description
+ *      verify that var size is used with var types only and that
+ *      var types have no endianess
+ *
+ * throws
+ *      wrong format - size, type or endianess do not match
+ */
+static void check_var_elem(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index)
+{
+    if(!is_var_type(elem->type))
+    {
+        luaL_error(l, "wrong format: %s size at element %d is supported with variable length types only", 
+                VAR_SPECIFIER, arg_index);
+    }
+    if(elem->size != (size_t)VAR)
+    {
+        luaL_error(l, "wrong format: %s at element %d requires %s size", 
+                TYPES[elem->type], arg_index, VAR_SPECIFIER);
+    }
+    if(elem->endianess != EE_DEFAULT)
+    {
+        luaL_error(l, "wrong format: endianess is not supported by %s at element %d", 
+                TYPES[elem->type], arg_index);
+    }
+}
+
+/*
+ * name
+ *      pack_var_bits
+ *
+ * description
+ *      pack count_bits least significant bits of value
+ */
+static void pack_var_bits(lua_State *l, uint64_t value, size_t count_bits, PACK_STATE *state)
+{
+    ELEMENT_DESCRIPTION elem;
+    elem.type = ET_INTEGER;
+    elem.endianess = EE_BIG;
+    while(count_bits > 0)
+    {
+        elem.size = count_bits < VAR_INTEGER_BITS ? count_bits : VAR_INTEGER_BITS;
+        count_bits -= elem.size;
+        basic_pack_int(l, &elem, (lua_Integer)(value >> count_bits), state);
+    }
+}
+
+/*
+ * name
+ *      check_var_value
+ *
+ * description
+ *      get non negative integer argument not greater then max
+ *
+ * throws
+ *      size error - the value is negative or greater then max
+ */
+static uint64_t check_var_value(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, uint64_t max)
+{
+    lua_Integer value = luaL_checkinteger(l, arg_index);
+    if(value < 0 || (uint64_t)value > max)
+    {
+        luaL_error(l, "size error: argument %d value is out of range of %s", arg_index, TYPES[elem->type]);
+    }
+    return (uint64_t)value;
+}
+
+/*
+ * name
+ *      var_value_in_range
+ *
+ * description
+ *      check without raising that pack_var accepts the argument
+ *
+ * returns
+ *      1 if the argument is in range of the element type, 0 otherwise
+ */
+static int var_value_in_range(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index)
+{
+    lua_Integer value = lua_tointeger(l, arg_index);
+    switch(elem->type)
+    {
+        case ET_SLEB128:
+            return 1;
+
+        case ET_SE:
+            return (value > 0 ? (uint64_t)value : (uint64_t)0 - (uint64_t)value) <= (UINT64_MAX >> 1);
+
+        case ET_QUIC:
+            return value >= 0 && (uint64_t)value <= VAR_QUIC_MAX && (uint64_t)value <= VAR_INTEGER_MAX;
+
+        default:
+            return value >= 0 && (uint64_t)value <= VAR_INTEGER_MAX;
+    }
+}
+
+/*
+ * name
+ *      pack_exp_golomb
+ *
+ * description
+ *      pack code as Exp-Golomb code. code is less then UINT64_MAX
+ */
+static void pack_exp_golomb(lua_State *l, uint64_t code, PACK_STATE *state)
+{
+    uint64_t value = code + 1;
+    size_t count_bits = 0;
+    while(count_bits < 64 && (value >> count_bits) > 1)
+    {
+        ++count_bits;
+    }
+    /* count_bits zeros, the leading 1 and count_bits bits of value */
+    pack_var_bits(l, 0, count_bits, state);
+    pack_var_bits(l, value, count_bits + 1, state);
+}
+
+/*
+ * name
+ *      pack_var
+ *
+ * description
+ *      encode variable length integer and pack it into result buffer
+ *
+ * paramenters
+ *      l - lua state
+ *      elem - element description
+ *      arg_index - number of element in format string. starts from 1 
+ *      state - pack state and intermediate results that are passed between
+ *              invocations
+ *
+ * throws
+ *      wrong format - var type without var size
+ *      size error - the value can not be encoded
+ */
+static void pack_var(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, PACK_STATE *state)
+{
+    check_var_elem(l, elem, arg_index);
+
+    unsigned char bytes[VAR_LEB128_MAX_BYTES];
+    size_t len = 0;
+    switch(elem->type)
+    {
+        case ET_ULEB128:
+        {
+            uint64_t value = check_var_value(l, elem, arg_index, VAR_INTEGER_MAX);
+            do
+            {
+                bytes[len] = value & 0x7f;
+                value >>= 7;
+                if(value != 0)
+                {
+                    bytes[len] |= 0x80;
+                }
+                ++len;
+            } while(value != 0);
+            break;
+        }
+
+        case ET_SLEB128:
+        {
+            int64_t value = (int64_t)luaL_checkinteger(l, arg_index);
+            int more = 1;
+            while(more)
+            {
+                unsigned char byte = value & 0x7f;
+                /* arithmetic shift of negative values */
+                value = value < 0 ? ~(~value >> 7) : value >> 7;
+                more = !((value == 0 && (byte & 0x40) == 0) || (value == -1 && (byte & 0x40) != 0));
+                bytes[len++] = more ? byte | 0x80 : byte;
+            }
+            break;
+        }
+
+        case ET_QUIC:
+        {
+            uint64_t value = check_var_value(l, elem, arg_index, 
+                    VAR_QUIC_MAX < VAR_INTEGER_MAX ? VAR_QUIC_MAX : VAR_INTEGER_MAX);
+            size_t prefix = value < 0x40 ? 0 : value < 0x4000 ? 1 : value < 0x40000000 ? 2 : 3;
+            len = (size_t)1 << prefix;
+            size_t i;
+            for(i = 0; i < len; ++i)
+            {
+                bytes[i] = (unsigned char)(value >> ((len - i - 1) * CHAR_BIT));
+            }
+            bytes[0] |= (unsigned char)(prefix << 6);
+            break;
+        }
+
+        case ET_BERLEN:
+        {
+            uint64_t value = check_var_value(l, elem, arg_index, VAR_INTEGER_MAX);
+            if(value < 0x80)
+            {
+                bytes[len++] = (unsigned char)value;
+                break;
+            }
+            size_t count_bytes = 0;
+            while(count_bytes < sizeof(uint64_t) && (value >> (count_bytes * CHAR_BIT)) != 0)
+            {
+                ++count_bytes;
+            }
+            bytes[len++] = 0x80 | (unsigned char)count_bytes;
+            size_t i;
+            for(i = 0; i < count_bytes; ++i)
+            {
+                bytes[len++] = (unsigned char)(value >> ((count_bytes - i - 1) * CHAR_BIT));
+            }
+            break;
+        }
+
+        case ET_UE:
+            pack_exp_golomb(l, check_var_value(l, elem, arg_index, VAR_INTEGER_MAX), state);
+            return;
+
+        case ET_SE:
+        {
+            /* 1, -1, 2, -2 ... are coded as 1, 2, 3, 4 ... */
+            lua_Integer value = luaL_checkinteger(l, arg_index);
+            uint64_t magnitude = value > 0 ? (uint64_t)value : (uint64_t)0 - (uint64_t)value;
+            if(magnitude > (UINT64_MAX >> 1))
+            {
+                luaL_error(l, "size error: argument %d value is out of range of %s", arg_index, TYPES[elem->type]);
+            }
+            pack_exp_golomb(l, value > 0 ? magnitude * 2 - 1 : magnitude * 2, state);
+            return;
+        }
+
+        default:
+            luaL_error(l, "wrong format: unexpected type %d", elem->type);
+    }
+    basic_pack_bin(l, elem, bytes, len, state);
+}
+
+/*
+ * name
+ *      unpack_var_bits
+ *
+ * description
+ *      unpack count_bits bits as unsigned integer. count_bits is up to 64
+ *
+ * throws
+ *      size error - the input is too short
+ */
+static uint64_t unpack_var_bits(lua_State *l, size_t count_bits, int arg_index, UNPACK_STATE *state)
+{
+    ELEMENT_DESCRIPTION elem;
+    elem.type = ET_INTEGER;
+    elem.endianess = EE_BIG;
+    uint64_t value = 0;
+    while(count_bits > 0)
+    {
+        /* keep the chunk below the sign bit of lua_Integer */
+        elem.size = count_bits < VAR_INTEGER_BITS - 1 ? count_bits : VAR_INTEGER_BITS - 1;
+        count_bits -= elem.size;
+        value = (value << elem.size) | (uint64_t)unpack_int_no_push(l, &elem, arg_index, state);
+    }
+    return value;
+}
+
+/*
+ * name
+ *      var_overflow
+ *
+ * throws
+ *      size error - unpacked value exceeds lua_Integer
+ */
+static void var_overflow(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index)
+{
+    luaL_error(l, "size error: element %d value of %s exceeds the lua_Integer size (%d bits)", 
+            arg_index, TYPES[elem->type], (int)VAR_INTEGER_BITS);
+}
+
+/*
+ * name
+ *      unpack_exp_golomb
+ *
+ * returns
+ *      code of Exp-Golomb code
+ *
+ * throws
+ *      size error - the code is longer then 64 bits
+ */
+static uint64_t unpack_exp_golomb(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, UNPACK_STATE *state)
+{
+    size_t count_bits = 0;
+    while(unpack_var_bits(l, 1, arg_index, state) == 0)
+    {
+        ++count_bits;
+        if(count_bits >= 64)
+        {
+            luaL_error(l, "size error: element %d value of %s exceeds 64 bits", arg_index, TYPES[elem->type]);
+        }
+    }
+    uint64_t value = ((uint64_t)1 << count_bits) | unpack_var_bits(l, count_bits, arg_index, state);
+    return value - 1;
+}
+
+/*
+ * name
+ *      decode_var
+ *
+ * description
+ *      decode variable length integer from input buffer
+ *
+ * paramenters
+ *      l - lua state
+ *      elem - element description
+ *      arg_index - number of element in format string. starts from 1 
+ *      state - unpack state passed between invocations
+ *      value - out parameter. the decoded value
+ *
+ * returns
+ *      1 if the value fits lua_Integer, 0 otherwise
+ *
+ * throws
+ *      wrong format - var type without var size
+ *      wrong format - unsupported encoding
+ *      size error - the input ends inside the encoding
+ */
+static int decode_var(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, UNPACK_STATE *state, int64_t *value)
+{
+    check_var_elem(l, elem, arg_index);
+
+    switch(elem->type)
+    {
+        case ET_ULEB128:
+        case ET_SLEB128:
+        {
+            uint64_t bits = 0;
+            size_t shift = 0;
+            uint64_t byte = 0;
+            do
+            {
+                if(shift >= VAR_LEB128_MAX_BYTES * 7)
+                {
+                    luaL_error(l, "size error: element %d value of %s exceeds 64 bits", arg_index, TYPES[elem->type]);
+                }
+                byte = unpack_var_bits(l, CHAR_BIT, arg_index, state);
+                if(shift < 64)
+                {
+                    bits |= (byte & 0x7f) << shift;
+                }
+                shift += 7;
+            } while(byte & 0x80);
+
+            if(elem->type == ET_SLEB128)
+            {
+                if(shift < 64 && (byte & 0x40) != 0)
+                {
+                    bits |= ~(uint64_t)0 << shift;
+                }
+            }
+            else if(bits > VAR_INTEGER_MAX)
+            {
+                return 0;
+            }
+            *value = (int64_t)bits;
+            break;
+        }
+
+        case ET_QUIC:
+        {
+            uint64_t first = unpack_var_bits(l, CHAR_BIT, arg_index, state);
+            size_t len = (size_t)1 << (first >> 6);
+            *value = (int64_t)(((first & 0x3f) << ((len - 1) * CHAR_BIT)) | 
+                unpack_var_bits(l, (len - 1) * CHAR_BIT, arg_index, state));
+            break;
+        }
+
+        case ET_BERLEN:
+        {
+            uint64_t first = unpack_var_bits(l, CHAR_BIT, arg_index, state);
+            if(first < 0x80)
+            {
+                *value = (int64_t)first;
+                break;
+            }
+            size_t count_bytes = first & 0x7f;
+            if(count_bytes == 0)
+            {
+                luaL_error(l, "wrong format: indefinite length at element %d is not supported", arg_index);
+            }
+            if(count_bytes > sizeof(uint64_t))
+            {
+                luaL_error(l, "size error: element %d value of %s exceeds 64 bits", arg_index, TYPES[elem->type]);
+            }
+            uint64_t bits = unpack_var_bits(l, count_bytes * CHAR_BIT, arg_index, state);
+            if(bits > VAR_INTEGER_MAX)
+            {
+                return 0;
+            }
+            *value = (int64_t)bits;
+            break;
+        }
+
+        case ET_UE:
+        {
+            uint64_t code = unpack_exp_golomb(l, elem, arg_index, state);
+            if(code > VAR_INTEGER_MAX)
+            {
+                return 0;
+            }
+            *value = (int64_t)code;
+            break;
+        }
+
+        case ET_SE:
+        {
+            uint64_t code = unpack_exp_golomb(l, elem, arg_index, state);
+            /* 1, 2, 3, 4 ... are decoded as 1, -1, 2, -2 ... */
+            uint64_t magnitude = (code >> 1) + (code & 1);
+            if(magnitude > VAR_INTEGER_MAX + (code & 1 ? 0 : 1))
+            {
+                return 0;
+            }
+            *value = code & 1 ? (int64_t)magnitude : -(int64_t)(magnitude - 1) - 1;
+            break;
+        }
+
+        default:
+            luaL_error(l, "wrong format: unexpected type %d", elem->type);
+    }
+    return (int64_t)(lua_Integer)*value == *value;
+}
+
+/*
+ * name
+ *      unpack_var
+ *
+ * description
+ *      decode variable length integer from input buffer and push it onto 
+ *      lua stack. update the number of return values
+ *
+ * paramenters
+ *      l - lua state
+ *      elem - element description
+ *      arg_index - number of element in format string. starts from 1 
+ *      state - unpack state passed between invocations
+ *
+ * throws
+ *      wrong format - var type without var size
+ *      wrong format - unsupported encoding
+ *      size error - the input ends inside the encoding
+ *      size error - the value exceeds lua_Integer
+ */
+static void unpack_var(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, UNPACK_STATE *state)
+{
+    int64_t value = 0;
+    if(!decode_var(l, elem, arg_index, state, &value))
+    {
+        var_overflow(l, elem, arg_index);
+    }
+    ++state->return_count;
+    grow_unpack_stack(l, state);
+    lua_pushinteger(l, (lua_Integer)value);
+}
+
+/*
+ * name
+ *      peek_var_bits
+ *
+ * returns
+ *      count_bits bits at bit offset of the input. count_bits is up to 8.
+ *      the caller checks that the bits are in the input
+ */
+static unsigned int peek_var_bits(const UNPACK_STATE *state, size_t bit, size_t count_bits)
+{
+    unsigned char byte = 0;
+    copy_bits(&byte, state->source, state->source_end - state->source, bit, count_bits);
+    return byte >> (CHAR_BIT - count_bits);
+}
+
+/*
+ * name
+ *      skip_var
+ *
+ * description
+ *      find the length of variable length integer and check that 
+ *      unpack_var would accept it. the value is not pushed
+ *
+ * paramenters
+ *      l - lua state
+ *      elem - element description
+ *      arg_index - number of element in format string. starts from 1 
+ *      state - unpack state passed between invocations
+ *
+ * returns
+ *      1 if the encoding fits the input and the value fits lua_Integer, 
+ *      0 otherwise
+ *
+ * throws
+ *      wrong format - var type without var size
+ */
+static int skip_var(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, UNPACK_STATE *state)
+{
+    check_var_elem(l, elem, arg_index);
+
+    size_t bit = state->current_bit;
+    size_t end_bit = bit + state->source_bits;
+    switch(elem->type)
+    {
+        case ET_ULEB128:
+        case ET_SLEB128:
+        {
+            size_t count_bytes = 0;
+            unsigned int byte = 0x80;
+            while(byte & 0x80)
+            {
+                if(count_bytes == VAR_LEB128_MAX_BYTES || bit + CHAR_BIT > end_bit)
+                {
+                    return 0;
+                }
+                byte = peek_var_bits(state, bit, CHAR_BIT);
+                bit += CHAR_BIT;
+                ++count_bytes;
+            }
+            break;
+        }
+
+        case ET_QUIC:
+            if(bit + CHAR_BIT > end_bit)
+            {
+                return 0;
+            }
+            bit += ((size_t)1 << peek_var_bits(state, bit, 2)) * CHAR_BIT;
+            break;
+
+        case ET_BERLEN:
+        {
+            if(bit + CHAR_BIT > end_bit)
+            {
+                return 0;
+            }
+            unsigned int first = peek_var_bits(state, bit, CHAR_BIT);
+            bit += CHAR_BIT;
+            if(first == 0x80)
+            {
+                return 0;
+            }
+            if(first > 0x80)
+            {
+                /* long form. the low bits are the number of length bytes */
+                if((first & 0x7f) > sizeof(uint64_t))
+                {
+                    return 0;
+                }
+                bit += (first & 0x7f) * CHAR_BIT;
+            }
+            break;
+        }
+
+        case ET_UE:
+        case ET_SE:
+        {
+            size_t zeros = 0;
+            while(bit < end_bit && peek_var_bits(state, bit, 1) == 0)
+            {
+                ++bit;
+                ++zeros;
+            }
+            if(zeros >= 64)
+            {
+                return 0;
+            }
+            bit += zeros + 1;
+            break;
+        }
+
+        default:
+            luaL_error(l, "wrong format: unexpected type %d", elem->type);
+    }
+
+    if(bit > end_bit)
+    {
+        return 0;
+    }
+
+    /* the encoding fits the input. decoding can only fail on the range */
+    UNPACK_STATE decode_state = *state;
+    int64_t value = 0;
+    if(!decode_var(l, elem, arg_index, &decode_state, &value))
+    {
+        return 0;
+    }
+    state->source_bits -= bit - state->current_bit;
+    state->current_bit = bit;
+    return 1;
+}
@@ -0,0 +1,433 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * table driven decoder of prefix codes (Huffman, VLC).
+ * bitstring.vlc_table builds multi-level lookup tables from a table of
+ * codes. the first level is indexed by the next VLC_ROOT_BITS bits of 
+ * input. codes that are longer than a level continue in a sub-table that 
+ * is indexed by the following bits. vlc:decode reads the input through
+ * a 64 bit window that is refilled a byte at a time, so every symbol
+ * costs one or a few table lookups.
+ */
+
+#define VLC_TYPE "bitstring.vlc"
+#define VLC_ROOT_BITS 9
+#define VLC_MAX_CODE_BITS 32
+/* the window is refilled when less bits than the longest code are left */
+#define VLC_WINDOW_BITS 64
+
+/*
+ * table entry
+ */
+typedef struct
+{
+    /* symbol, or index of the sub-table when length is negative */
+    lua_Integer symbol;
+    /* 
+     * bits of the code that are used by this level when positive.
+     * minus number of index bits of the sub-table when negative.
+     * 0 for bits that do not start a code
+     */
+    int length;
+} VLC_ENTRY;
+
+/*
+ * vlc userdata
+ */
+typedef struct
+{
+    /* number of index bits of the first level */
+    int root_bits;
+    /* number of entries of all levels */
+    size_t entry_count;
+    /* first level followed by sub-tables */
+    VLC_ENTRY entries[1];
+} VLC_TABLE;
+
+/*
+ * code collected from the codes table
+ */
+typedef struct
+{
+    /* code bits. the last bit of the code is the least significant */
+    uint32_t bits;
+    int length;
+    lua_Integer symbol;
+} VLC_CODE;
+
+/*
+ * name
+ *      compare_codes
+ *
+ * description
+ *      qsort callback. orders codes as left aligned bit strings so
+ *      that codes with common prefix are adjacent
+ */
+static int compare_codes(const void *a, const void *b)
+{
+    const VLC_CODE *x = (const VLC_CODE *)a;
+    const VLC_CODE *y = (const VLC_CODE *)b;
+    uint64_t left_x = (uint64_t)x->bits << (VLC_WINDOW_BITS - x->length);
+    uint64_t left_y = (uint64_t)y->bits << (VLC_WINDOW_BITS - y->length);
+    if(left_x != left_y)
+    {
+        return left_x < left_y ? -1 : 1;
+    }
+    return x->length - y->length;
+}
+
+/*
+ * name
+ *      vlc_entry
+ *
+ * returns
+ *      entry at index of the table that is being built
+ */
+static VLC_ENTRY *vlc_entry(BUFFER *entries, size_t index)
+{
+    return (VLC_ENTRY *)entries->data + index;
+}
+
+/*
+ * name
+ *      build_vlc_level
+ *
+ * description
+ *      fill table of 2^table_bits entries at index first with codes.
+ *      the codes are sorted and consumed bits of each code are already
+ *      resolved by upper levels. sub-tables are appended to entries
+ *
+ * paramenters
+ *      l - lua state
+ *      entries - buffer with the entries
+ *      first - index of the first entry of the table
+ *      table_bits - number of index bits of the table
+ *      codes - codes that belong to the table
+ *      count - number of codes
+ *      consumed - number of bits of each code that are resolved by upper levels
+ *
+ * throws
+ *      wrong format - one code is a prefix of another
+ */
+static void build_vlc_level(
+        lua_State *l, 
+        BUFFER *entries, 
+        size_t first, 
+        int table_bits, 
+        const VLC_CODE *codes, 
+        size_t count, 
+        int consumed)
+{
+    size_t i = 0;
+    while(i < count)
+    {
+        int length = codes[i].length - consumed;
+        uint32_t bits = length < 32 ? codes[i].bits & ((1u << length) - 1) : codes[i].bits;
+        if(length <= table_bits)
+        {
+            size_t start = (size_t)bits << (table_bits - length);
+            size_t end = start + ((size_t)1 << (table_bits - length));
+            size_t j;
+            for(j = start; j < end; ++j)
+            {
+                VLC_ENTRY *entry = vlc_entry(entries, first + j);
+                if(entry->length != 0)
+                {
+                    luaL_error(l, "wrong format: code of symbol %d conflicts with another code", 
+                            (int)codes[i].symbol);
+                }
+                entry->symbol = codes[i].symbol;
+                entry->length = length;
+            }
+            ++i;
+            continue;
+        }
+
+        /* codes that share the index continue in a sub-table */
+        size_t index = bits >> (length - table_bits);
+        size_t group_end = i;
+        int max_length = 0;
+        while(group_end < count)
+        {
+            int group_length = codes[group_end].length - consumed;
+            uint32_t group_bits = codes[group_end].bits;
+            if(group_length <= table_bits || 
+                    ((group_bits >> (group_length - table_bits)) & ((1u << table_bits) - 1)) != index)
+            {
+                break;
+            }
+            if(group_length - table_bits > max_length)
+            {
+                max_length = group_length - table_bits;
+            }
+            ++group_end;
+        }
+
+        VLC_ENTRY *entry = vlc_entry(entries, first + index);
+        if(entry->length != 0)
+        {
+            luaL_error(l, "wrong format: code of symbol %d conflicts with another code", (int)codes[i].symbol);
+        }
+        int sub_bits = max_length < VLC_ROOT_BITS ? max_length : VLC_ROOT_BITS;
+        size_t sub_first = entries->len / sizeof(VLC_ENTRY);
+        entry->symbol = (lua_Integer)sub_first;
+        entry->length = -sub_bits;
+        resize_buffer(l, entries, entries->len + (sizeof(VLC_ENTRY) << sub_bits));
+        build_vlc_level(l, entries, sub_first, sub_bits, codes + i, group_end - i, consumed + table_bits);
+        i = group_end;
+    }
+}
+
+/*
+ * name
+ *      check_vlc
+ *
+ * description
+ *      get a userdata from index and verify that it is bitstring.vlc
+ */
+static VLC_TABLE *check_vlc(lua_State *l, int index)
+{
+    return (VLC_TABLE *)luaL_checkudata(l, index, VLC_TYPE);
+}
+
+/*
+ * name
+ *      l_vlc_table
+ *
+ * description
+ *      lua_CFunction that builds decoding tables of a prefix code
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - table of codes. keys are codes written as strings of 
+ *              '0' and '1' of up to 32 characters, values are integer
+ *              symbols. {["1"] = 0, ["01"] = 1, ["00"] = 2}
+ *
+ * returns
+ *      bitstring.vlc userdata
+ *
+ * throws
+ *      wrong format - code is not a string of '0' and '1'
+ *      wrong format - one code is a prefix of another
+ *      size error - code is longer then 32 bits
+ */
+static int l_vlc_table(lua_State *l)
+{
+    luaL_checktype(l, 1, LUA_TTABLE);
+
+    size_t count = 0;
+    lua_pushnil(l);
+    while(lua_next(l, 1) != 0)
+    {
+        ++count;
+        lua_pop(l, 1);
+    }
+    luaL_argcheck(l, count > 0, 1, "no codes");
+
+    VLC_CODE *codes = (VLC_CODE *)lua_newuserdata(l, count * sizeof(VLC_CODE));
+    int codes_index = lua_gettop(l);
+    int max_length = 0;
+    size_t i = 0;
+    lua_pushnil(l);
+    while(lua_next(l, 1) != 0)
+    {
+        size_t len = 0;
+        const char *code = lua_type(l, -2) == LUA_TSTRING ? lua_tolstring(l, -2, &len) : NULL;
+        if(code == NULL || len == 0)
+        {
+            luaL_error(l, "wrong format: code must be a string of '0' and '1'");
+        }
+        if(len > VLC_MAX_CODE_BITS)
+        {
+            luaL_error(l, "size error: code %s is longer then %d bits", code, VLC_MAX_CODE_BITS);
+        }
+        codes[i].bits = 0;
+        size_t j;
+        for(j = 0; j < len; ++j)
+        {
+            if(code[j] != '0' && code[j] != '1')
+            {
+                luaL_error(l, "wrong format: code must be a string of '0' and '1' (%s)", code);
+            }
+            codes[i].bits = (codes[i].bits << 1) | (uint32_t)(code[j] - '0');
+        }
+        codes[i].length = (int)len;
+        codes[i].symbol = luaL_checkinteger(l, -1);
+        if(codes[i].length > max_length)
+        {
+            max_length = codes[i].length;
+        }
+        ++i;
+        lua_pop(l, 1);
+    }
+    qsort(codes, count, sizeof(VLC_CODE), compare_codes);
+
+    /* build in a buffer that grows with the sub-tables */
+    lua_pushcfunction(l, l_buffer);
+    lua_call(l, 0, 1);
+    BUFFER *entries = check_buffer(l, -1);
+    int root_bits = max_length < VLC_ROOT_BITS ? max_length : VLC_ROOT_BITS;
+    resize_buffer(l, entries, sizeof(VLC_ENTRY) << root_bits);
+    build_vlc_level(l, entries, 0, root_bits, codes, count, 0);
+
+    size_t entry_count = entries->len / sizeof(VLC_ENTRY);
+    VLC_TABLE *vlc = (VLC_TABLE *)lua_newuserdata(l, 
+            sizeof(VLC_TABLE) + (entry_count - 1) * sizeof(VLC_ENTRY));
+    vlc->root_bits = root_bits;
+    vlc->entry_count = entry_count;
+    memcpy(vlc->entries, entries->data, entries->len);
+    luaL_getmetatable(l, VLC_TYPE);
+    lua_setmetatable(l, -2);
+    lua_replace(l, codes_index);
+    lua_settop(l, codes_index);
+    return 1;
+}
+
+/*
+ * name
+ *      l_vlc_decode
+ *
+ * description
+ *      lua_CFunction that decodes a sequence of symbols
+ *
+ * paramenters
+ *      l - lua state
+ *          1 - bitstring.vlc
+ *          2 - input string or bitstring.buffer
+ *          3 - bit offset of the first code. 0 is the most significant
+ *              bit of the first byte
+ *          4 - number of symbols to decode
+ *
+ * returns
+ *      array of the symbols and bit offset after the last code
+ *
+ * throws
+ *      wrong format - input bits do not start a code
+ *      size error - the input ends inside a code
+ */
+static int l_vlc_decode(lua_State *l)
+{
+    VLC_TABLE *vlc = check_vlc(l, 1);
+    size_t len = 0;
+    const unsigned char *input = check_bytes(l, 2, &len);
+    lua_Integer start_bit = luaL_checkinteger(l, 3);
+    luaL_argcheck(l, start_bit >= 0, 3, "negative bit offset");
+    lua_Integer count = luaL_checkinteger(l, 4);
+    luaL_argcheck(l, count >= 0, 4, "negative count");
+
+    size_t total_bits = len * CHAR_BIT;
+    size_t bit = (size_t)start_bit;
+    if(bit > total_bits)
+    {
+        luaL_error(l, "size error: bit offset %d exceeds the input (%d bits)", (int)bit, (int)total_bits);
+    }
+
+    lua_createtable(l, (int)count, 0);
+
+    /* the window holds input bits from bit, left aligned */
+    uint64_t window = 0;
+    int window_bits = 0;
+    size_t next_byte = bit / CHAR_BIT;
+    int skip = (int)(bit % CHAR_BIT);
+
+    lua_Integer i;
+    for(i = 1; i <= count; ++i)
+    {
+        if(bit == total_bits)
+        {
+            luaL_error(l, "size error: code at bit %d exceeds the input (%d bits)", (int)bit, (int)total_bits);
+        }
+        if(window_bits < VLC_MAX_CODE_BITS + CHAR_BIT)
+        {
+            /* bytes after the end of input are read as zeros */
+            while(window_bits <= VLC_WINDOW_BITS - CHAR_BIT)
+            {
+                uint64_t byte = next_byte < len ? input[next_byte] : 0;
+                window |= byte << (VLC_WINDOW_BITS - CHAR_BIT - window_bits);
+                window_bits += CHAR_BIT;
+                ++next_byte;
+            }
+            if(skip > 0)
+            {
+                window <<= skip;
+                window_bits -= skip;
+                skip = 0;
+            }
+        }
+
+        const VLC_ENTRY *entry = &vlc->entries[window >> (VLC_WINDOW_BITS - vlc->root_bits)];
+        int consumed = 0;
+        int table_bits = vlc->root_bits;
+        while(entry->length < 0)
+        {
+            consumed += table_bits;
+            table_bits = -entry->length;
+            entry = &vlc->entries[entry->symbol + ((window << consumed) >> (VLC_WINDOW_BITS - table_bits))];
+        }
+        if(entry->length == 0)
+        {
+            luaL_error(l, "wrong format: no code at bit %d", (int)bit);
+        }
+
+        int length = consumed + entry->length;
+        if(bit + length > total_bits)
+        {
+            luaL_error(l, "size error: code at bit %d exceeds the input (%d bits)", (int)bit, (int)total_bits);
+        }
+        window <<= length;
+        window_bits -= length;
+        bit += length;
+
+        lua_pushinteger(l, entry->symbol);
+        lua_rawseti(l, -2, (int)i);
+    }
+    lua_pushinteger(l, (lua_Integer)bit);
+    return 2;
+}
+
+static const struct luaL_reg vlc_methods [] = 
+{
+    {"decode", l_vlc_decode},
+    {NULL, NULL}  /* sentinel */
+};
+
+/*
+ * name
+ *      init_vlc_type
+ *
+ * description
+ *      register metatable of bitstring.vlc
+ */
+static void init_vlc_type(lua_State *l)
+{
+    luaL_newmetatable(l, VLC_TYPE);
+    lua_newtable(l);
+    luaL_register(l, NULL, vlc_methods);
+    lua_setfield(l, -2, "__index");
+    lua_pop(l, 1);
+}
@@ -0,0 +1,283 @@
+/* 
+ * Copyright (c) 2009, Giora Kosoi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY Giora Kosoi ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Giora Kosoi BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * scatter-gather pack.
+ * bitstring.writev packs values the same way as bitstring.pack and writes
+ * the result to a file descriptor with one writev call. large binary
+ * strings that start on a byte boundary are not copied. they are passed
+ * to writev by reference between the packed parts of the message, which
+ * are collected in a scratch buffer of the lua state.
+ */
+
+#include <lualib.h>
+
+#ifndef LUA_FILEHANDLE
+#define LUA_FILEHANDLE "FILE*"
+#endif // LUA_FILEHANDLE
+
+#ifdef HAVE_WRITEV
+#include <sys/uio.h>
+#include <unistd.h>
+#endif // HAVE_WRITEV
+
+/* binary strings shorter than this are copied, an extra iovec costs more */
+#define WRITEV_MIN_REFERENCE 512
+/* binary strings after this number of references are copied */
+#define WRITEV_MAX_REFERENCES 64
+/* upper bound of one packed element other than binary string */
+#define WRITEV_ELEM_BYTES 32
+
+/*
+ * binary string passed by reference
+ */
+typedef struct
+{
+    /* number of packed bytes in the scratch buffer before the string */
+    size_t offset;
+    const unsigned char *data;
+    size_t len;
+} WRITEV_REFERENCE;
+
+/*
+ * writev state passed between invocations of writev_elem
+ */
+typedef struct
+{
+    PACK_STATE pack;
+    /* first stack index that is not a value to pack */
+    int value_end;
+    size_t scratch_len;
+    size_t reference_count;
+    WRITEV_REFERENCE references[WRITEV_MAX_REFERENCES];
+} WRITEV_STATE;
+
+/*
+ * name
+ *      writev_elem
+ *
+ * description
+ *      element handler of writev. collects reference to large aligned
+ *      binary strings and packs other elements into the scratch buffer
+ *
+ * paramenters
+ *      l - lua state
+ *      elem - element description
+ *      arg_index - number of element in format string plus one
+ *      arg - writev state
+ *
+ * throws
+ *      same errors as pack_elem
+ *      size error - value is missing
+ */
+static void writev_elem(lua_State *l, ELEMENT_DESCRIPTION *elem, int arg_index, void *arg)
+{
+    WRITEV_STATE *state = (WRITEV_STATE *)arg;
+    size_t needed = WRITEV_ELEM_BYTES;
+    if(!elem->constant && !elem->skip)
+    {
+        int value_index = arg_index - state->pack.constant_count;
+        if(value_index >= state->value_end)
+        {
+            luaL_error(l, "size error: argument %d is missing", value_index);
+        }
+
+        if(elem->type == ET_BINARY && elem->size != (size_t)VAR && lua_type(l, value_index) == LUA_TSTRING)
+        {
+            size_t len = 0;
+            const unsigned char *bin = (const unsigned char *)lua_tolstring(l, value_index, &len);
+            if(elem->size != (size_t)ALL && elem->size <= len)
+            {
+                len = elem->size;
+            }
+            if(len >= WRITEV_MIN_REFERENCE &&
+                    (elem->size == (size_t)ALL || elem->size == len) &&
+                    state->pack.current_bit % CHAR_BIT == 0 &&
+                    state->reference_count < WRITEV_MAX_REFERENCES)
+            {
+                WRITEV_REFERENCE *reference = &state->references[state->reference_count++];
+                reference->offset = state->pack.current_bit / CHAR_BIT;
+                reference->data = bin;
+                reference->len = len;
+                return;
+            }
+            needed += len;
+        }
+    }
+
+    needed += state->pack.current_bit / CHAR_BIT;
+    if(needed > state->scratch_len)
+    {
+        state->scratch_len = needed > state->scratch_len * 2 ? needed : state->scratch_len * 2;
+        state->pack.prep_buffer = pack_scratch(l, state->scratch_len);
+        state->pack.result_bits = state->scratch_len * CHAR_BIT;
+    }
+    pack_elem(l, elem, arg_index, &state->pack);
+}
+
+/*
+ * name
+ *      check_fd
+ *
+ * description
+ *      get file descriptor from integer or lua file
+ *
+ * throws
+ *      bad argument - not a number or a lua file
+ *      attempt to use a closed file
+ */
+static int check_fd(lua_State *l, int index)
+{
+    if(lua_type(l, index) == LUA_TNUMBER)
+    {
+        return (int)lua_tointeger(l, index);
+    }
+
+    FILE **file = (FILE **)luaL_checkudata(l, index, LUA_FILEHANDLE);
+    if(*file == NULL)
+    {
+        luaL_error(l, "attempt to use a closed file");
+    }
+    /* data buffered by io.write goes first */
+    fflush(*file);
+#ifdef WIN32
+    return _fileno(*file);
+#else
+    return fileno(*file);
+#endif
+}
+
+/*
+ * name
+ *      l_writev
+ *
+ * description
+ *      lua_CFunction for scatter-gather pack.
+ *      bitstring.writev(fd_or_file, format_or_bitmatch, ...)
+ *
+ * paramenters
+ *      l - lua state
+ *
+ * returns
+ *      number of written bytes or nil, error message, error number and
+ *      number of bytes that were written before the error. the caller of
+ *      a non-blocking descriptor continues the message from that byte
+ *
+ * throws
+ *      same errors as bitstring.pack
+ *
+ * rationale
+ *      the whole message goes out in one system call and binary strings
+ *      that are passed by reference are not copied in user space.
+ *      writev may write part of the message to sockets and pipes, the
+ *      call is repeated for the rest
+ */
+static int l_writev(lua_State *l)
+{
+#ifdef HAVE_WRITEV
+    int fd = check_fd(l, 1);
+
+    /* move the file to the top to keep it alive while parse expects the format first */
+    lua_pushvalue(l, 1);
+    lua_remove(l, 1);
+
+    WRITEV_STATE state;
+    state.value_end = lua_gettop(l);
+    state.scratch_len = LUAL_BUFFERSIZE;
+    state.reference_count = 0;
+    state.pack.buffer = NULL;
+    state.pack.prep_buffer = pack_scratch(l, state.scratch_len);
+    state.pack.current_bit = 0;
+    state.pack.result_bits = state.scratch_len * CHAR_BIT;
+    state.pack.constant_count = 0;
+
+    parse(l, writev_elem, (void *)&state);
+
+    struct iovec iov[WRITEV_MAX_REFERENCES * 2 + 1];
+    int count = 0;
+    size_t offset = 0;
+    size_t total = 0;
+    size_t i;
+    for(i = 0; i <= state.reference_count; ++i)
+    {
+        size_t end = i < state.reference_count ? state.references[i].offset : state.pack.current_bit / CHAR_BIT;
+        if(end > offset)
+        {
+            iov[count].iov_base = state.pack.prep_buffer + offset;
+            iov[count].iov_len = end - offset;
+            total += iov[count++].iov_len;
+            offset = end;
+        }
+        if(i < state.reference_count && state.references[i].len > 0)
+        {
+            iov[count].iov_base = (void *)state.references[i].data;
+            iov[count].iov_len = state.references[i].len;
+            total += iov[count++].iov_len;
+        }
+    }
+
+    struct iovec *current = iov;
+    size_t written = 0;
+    while(written < total)
+    {
+        ssize_t result = writev(fd, current, count);
+        if(result < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            int error = errno;
+            release_pack_scratch(l);
+            lua_pushnil(l);
+            lua_pushstring(l, strerror(error));
+            lua_pushinteger(l, error);
+            lua_pushinteger(l, (lua_Integer)written);
+            return 4;
+        }
+
+        written += (size_t)result;
+        while(count > 0 && (size_t)result >= current->iov_len)
+        {
+            result -= current->iov_len;
+            ++current;
+            --count;
+        }
+        if(count > 0)
+        {
+            current->iov_base = (unsigned char *)current->iov_base + result;
+            current->iov_len -= result;
+        }
+    }
+
+    release_pack_scratch(l);
+    lua_pushinteger(l, (lua_Integer)written);
+    return 1;
+#else
+    return luaL_error(l, "writev is not supported on this platform");
+#endif // HAVE_WRITEV
+}
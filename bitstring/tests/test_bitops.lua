@@ -0,0 +1,333 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+-- reference search with unpack at each bit offset
+local find_with_unpack = function(s, pattern, pattern_bits, start_bit, max_errors)
+    for bit = start_bit or 0, #s * 8 - pattern_bits do
+        local skip = bit % 8
+        local format = skip > 0 and skip..":int, "..pattern_bits..":int" or pattern_bits..":int"
+        local value = {bitstring.unpack(format, s, math.floor(bit / 8) + 1)}
+        value = value[#value]
+        local errors = 0
+        local x, y = value, pattern
+        for k = 1, pattern_bits do
+            if x % 2 ~= y % 2 then errors = errors + 1 end
+            x, y = math.floor(x / 2), math.floor(y / 2)
+        end
+        if errors <= (max_errors or 0) then
+            return bit, errors
+        end
+    end
+    return nil
+end
+
+local test1 = function()
+    -- 16 bit sync word 0x47d3 at bit offset 13
+    local s = bitstring.pack("13:int, 16:int, 19:int", 0, 0x47d3, 0x5a5a)
+    test_helpers.assert_tables_equal({bitstring.findbits(s, 0x47d3, 16)}, {13, 0})
+    test_helpers.assert_tables_equal({bitstring.findbits(s, "\71\211", 16)}, {13, 0})
+    assert(bitstring.findbits(s, 0x47d3, 16, 14) == nil)
+    test_helpers.assert_equal(bitstring.findbits(s, 0x47d3, 16, 13), 13)
+end
+
+local test2 = function()
+    -- noisy sync word
+    local s = bitstring.pack("5:int, 32:int, 3:int", 0, 0x1acffc1d, 0)
+    local noisy = bitstring.pack("5:int, 32:int, 3:int", 0, 0x1acffc1d + 0x00100001, 0)
+    test_helpers.assert_tables_equal({bitstring.findbits(s, 0x1acffc1d, 32)}, {5, 0})
+    assert(bitstring.findbits(noisy, 0x1acffc1d, 32) == nil)
+    test_helpers.assert_tables_equal({bitstring.findbits(noisy, 0x1acffc1d, 32, 0, 2)}, {5, 2})
+end
+
+local test3 = function()
+    -- 64 bit pattern at the end of input
+    local pattern = "\1\2\3\4\5\6\7\8"
+    local s = bitstring.pack("7:int, 8:bin, 1:int", 0x55, pattern, 0)
+    test_helpers.assert_tables_equal({bitstring.findbits(s, pattern, 64)}, {7, 0})
+    assert(bitstring.findbits(s, pattern, 64, 8) == nil)
+    assert(bitstring.findbits("", 1, 1) == nil)
+end
+
+local test4 = function()
+    local s = "\18\52\86\120\154\188\222\240\15\237\203\169\135\101\67\33"
+    for _, case in ipairs({{0x5, 3}, {0x2d, 6}, {0x159, 9}, {0x3c, 7, 0, 1}, {0x1234, 16, 3, 2}, {0x7, 3, 40}}) do
+        test_helpers.assert_tables_equal(
+            {bitstring.findbits(s, case[1], case[2], case[3], case[4])}, 
+            {find_with_unpack(s, case[1], case[2], case[3], case[4])})
+    end
+end
+
+local test5 = function()
+    test_helpers.assert_throw(function() bitstring.findbits("abc", 1, 0) end, "pattern_bits must be 1..64")
+    test_helpers.assert_throw(function() bitstring.findbits("abc", 1, 65) end, "pattern_bits must be 1..64")
+    test_helpers.assert_throw(function() bitstring.findbits("abc", "a", 9) end, "pattern is shorter")
+    test_helpers.assert_throw(function() bitstring.findbits("abc", 1, 1, -1) end, "negative start_bit")
+end
+
+local byte_op = function(a, b, op)
+    local result = {}
+    for i = 1, #a do
+        local x = a:byte(i)
+        local y = b:byte((i - 1) % #b + 1)
+        local r = 0
+        for k = 0, 7 do
+            local p = 2 ^ k
+            local bx = math.floor(x / p) % 2
+            local by = math.floor(y / p) % 2
+            r = r + op(bx, by) * p
+        end
+        result[i] = string.char(r)
+    end
+    return table.concat(result)
+end
+
+local AND = function(x, y) return x * y end
+local OR = function(x, y) return math.max(x, y) end
+local XOR = function(x, y) return (x + y) % 2 end
+
+local test6 = function()
+    local a = "\0\1\2\3\4\5\6\7\8\9\10\11\12\13\14\15\16\255\128\127"
+    for _, b in ipairs({"\170", "\1\2\3\4", "0123456789abcdefghij", "0123456789abcdefghijklmnop"}) do
+        test_helpers.assert_equal(bitstring.band(a, b), byte_op(a, b, AND))
+        test_helpers.assert_equal(bitstring.bor(a, b), byte_op(a, b, OR))
+        test_helpers.assert_equal(bitstring.bxor(a, b), byte_op(a, b, XOR))
+    end
+    test_helpers.assert_equal(bitstring.bnot(a), byte_op(a, "\255", XOR))
+    assert(bitstring.bxor("", "\1") == "")
+
+    -- websocket style mask over a long payload
+    local payload = string.rep("payload ", 200)
+    local mask = "\55\250\33\61"
+    local masked = bitstring.bxor(payload, mask)
+    test_helpers.assert_equal(masked, byte_op(payload, mask, XOR))
+    test_helpers.assert_equal(bitstring.bxor(masked, mask), payload)
+end
+
+local test7 = function()
+    local buffer = bitstring.buffer()
+    assert(#buffer == 0)
+    assert(buffer:tostring() == "")
+    assert(bitstring.bxor("abcdef", "\32", buffer) == buffer)
+    test_helpers.assert_equal(buffer:tostring(), "ABCDEF")
+    test_helpers.assert_equal(buffer:tostring(2, 3), "BC")
+
+    -- in place
+    bitstring.bnot(buffer, buffer)
+    bitstring.bnot(buffer, buffer)
+    bitstring.bxor(buffer, "\32", buffer)
+    test_helpers.assert_equal(buffer:tostring(), "abcdef")
+
+    -- buffer is reused with a different length
+    bitstring.band("ab", "\255", buffer)
+    test_helpers.assert_equal(buffer:tostring(), "ab")
+    bitstring.bor(string.rep("\0", 300), "c", buffer)
+    test_helpers.assert_equal(buffer:tostring(), string.rep("c", 300))
+
+    local zeros = bitstring.buffer(3)
+    test_helpers.assert_equal(zeros:tostring(), "\0\0\0")
+    test_helpers.assert_equal(bitstring.bor(bitstring.buffer("xyz"), zeros), "xyz")
+end
+
+local test8 = function()
+    assert(bitstring.popcount("\255") == 8)
+    assert(bitstring.popcount("\1\3\7\15\31\63\127\255\128") == 37)
+    assert(bitstring.popcount("\1\3\7\15\31\63\127\255\128", 2, 4) == 9)
+    assert(bitstring.popcount("\1\3\7\15\31\63\127\255\128", -2) == 9)
+    assert(bitstring.popcount(string.rep("\85", 1001)) == 4004)
+    assert(bitstring.popcount(bitstring.buffer("\15\15")) == 8)
+    assert(bitstring.findbits(bitstring.buffer("\0\1"), 1, 1) == 15)
+end
+
+local test9 = function()
+    test_helpers.assert_throw(function() bitstring.bxor("abc", "") end, "empty mask")
+    test_helpers.assert_throw(function() bitstring.bxor("abc", "a", {}) end, "bitstring.buffer expected")
+    test_helpers.assert_throw(function() bitstring.buffer(-1) end, "negative length")
+    local mask = bitstring.buffer("a")
+    test_helpers.assert_throw(function() bitstring.bxor("abc", mask, mask) end, "output buffer is a mask")
+end
+
+-- reference implementation on strings of '0' and '1'
+local pad_bits = function(bits, len)
+    return bits .. string.rep("0", len - #bits)
+end
+
+local subbits_with_binstream = function(s, first_bit, count_bits)
+    local bits = bitstring.binstream(s):sub(first_bit + 1, first_bit + count_bits)
+    return bitstring.frombinstream(pad_bits(bits, math.ceil(count_bits / 8) * 8))
+end
+
+local shift_with_binstream = function(s, n)
+    local bits = bitstring.binstream(s)
+    if n >= 0 then
+        bits = pad_bits(bits:sub(n + 1), #bits)
+    else
+        bits = (string.rep("0", -n) .. bits):sub(1, #bits)
+    end
+    return bitstring.frombinstream(bits)
+end
+
+local test10 = function()
+    local s = ""
+    for i = 1, 41 do
+        s = s .. string.char((i * 97 + 13) % 256)
+    end
+    for _, first_bit in ipairs({0, 1, 5, 7, 8, 13, 64, 65, 200}) do
+        for _, count_bits in ipairs({1, 7, 8, 9, 63, 64, 65, 100, 128 - first_bit % 8}) do
+            test_helpers.assert_equal(bitstring.subbits(s, first_bit, count_bits), 
+                    subbits_with_binstream(s, first_bit, count_bits))
+        end
+    end
+    test_helpers.assert_equal(bitstring.subbits(s, 5, #s * 8 - 5), subbits_with_binstream(s, 5, #s * 8 - 5))
+    assert(bitstring.subbits(s, #s * 8, 0) == "")
+
+    -- payload after an odd width header
+    local packet = bitstring.pack("3:int, 5:int, 4:int, 8:bin, 4:int", 1, 2, 3, "payload!", 0)
+    test_helpers.assert_equal(bitstring.subbits(packet, 12, 64), "payload!")
+end
+
+local test11 = function()
+    local s = "\1\35\69\103\137\171\205\239\254\220\186\152\118\84\50\16\255"
+    for _, n in ipairs({0, 1, 3, 8, 9, 63, 64, 65, 130, 136, 200, -1, -3, -8, -9, -63, -64, -65, -130, -136, -200}) do
+        test_helpers.assert_equal(bitstring.shift(s, n), shift_with_binstream(s, n))
+    end
+    assert(bitstring.shift("", 3) == "")
+
+    local buffer = bitstring.buffer(s)
+    bitstring.shift(buffer, 12, buffer)
+    test_helpers.assert_equal(buffer:tostring(), shift_with_binstream(s, 12))
+    bitstring.shift(buffer, -12, buffer)
+    test_helpers.assert_equal(buffer:tostring(), shift_with_binstream(shift_with_binstream(s, 12), -12))
+    bitstring.subbits(buffer, 4, 20, buffer)
+    assert(#buffer == 3)
+    test_helpers.assert_equal(bitstring.subbits(s, 4, 20, bitstring.buffer()):tostring(), 
+            subbits_with_binstream(s, 4, 20))
+end
+
+local test12 = function()
+    test_helpers.assert_throw(function() bitstring.subbits("ab", 10, 7) end, "size error")
+    test_helpers.assert_throw(function() bitstring.subbits("ab", 17, 0) end, "size error")
+    test_helpers.assert_throw(function() bitstring.subbits("ab", -1, 1) end, "negative first_bit")
+    test_helpers.assert_throw(function() bitstring.subbits("ab", 0, -1) end, "negative number of bits")
+end
+
+local test13 = function()
+    -- read a file into a buffer in parts and unpack from the buffer
+    local name = os.tmpname()
+    local file = io.open(name, "wb")
+    local records = {}
+    for i = 1, 1000 do
+        records[i] = bitstring.pack("16:int:big, 8:int, all:bin", i, 3, "abc")
+    end
+    file:write(table.concat(records))
+    file:close()
+
+    file = io.open(name, "rb")
+    local buffer = bitstring.buffer()
+    local count = 0
+    while true do
+        local n = buffer:readfrom(file, 1000)
+        assert(n >= 0 and n <= 1000)
+        while #buffer >= 6 do
+            local id, len, payload = bitstring.unpack("16:int:big, 8:int, 3:bin", buffer)
+            count = count + 1
+            assert(id == count and len == 3 and payload == "abc")
+            buffer:discard(6)
+        end
+        if n == 0 then
+            break
+        end
+    end
+    file:close()
+    assert(count == 1000)
+    assert(#buffer == 0)
+
+    -- bytes are appended to the contents
+    file = io.open(name, "rb")
+    buffer = bitstring.buffer("xy")
+    assert(buffer:readfrom(file, 3) == 3)
+    test_helpers.assert_equal(buffer:tostring(), "xy\0\1\3")
+    assert(buffer:discard(1) == buffer)
+    test_helpers.assert_equal(buffer:tostring(), "y\0\1\3")
+    buffer:discard()
+    assert(#buffer == 0)
+    file:close()
+    os.remove(name)
+end
+
+local test14 = function()
+    local buffer = bitstring.buffer("abcdef")
+    -- errors
+    local name = os.tmpname()
+    local file = io.open(name, "wb")
+    local result, message, code = buffer:readfrom(file)
+    assert(result == nil)
+    assert(type(message) == "string" and type(code) == "number")
+    test_helpers.assert_throw(function() buffer:readfrom(file, 0) end, "positive length expected")
+    test_helpers.assert_throw(function() buffer:discard(7) end, "out of range")
+    file:close()
+    test_helpers.assert_throw(function() buffer:readfrom(file) end, "closed file")
+    os.remove(name)
+end
+
+local test15 = function()
+    -- string results longer than LUAL_BUFFERSIZE are built in chunks
+    local bytes = {}
+    for i = 0, 19999 do
+        bytes[i + 1] = string.char((i * 37 + 11) % 256)
+    end
+    local s = table.concat(bytes)
+    local total = #s * 8
+    local in_buffer = function(f, ...)
+        local args = {...}
+        table.insert(args, bitstring.buffer())
+        return f(unpack(args)):tostring()
+    end
+
+    local mask = "\1\2\3"
+    local long_mask = string.rep(mask, #s / 3 + 1):sub(1, #s)
+    test_helpers.assert_equal(bitstring.bxor(s, mask), bitstring.bxor(s, long_mask))
+    test_helpers.assert_equal(bitstring.bxor(s, mask), in_buffer(bitstring.bxor, s, mask))
+    test_helpers.assert_equal(bitstring.bxor(bitstring.bxor(s, mask), mask), s)
+    test_helpers.assert_equal(bitstring.bnot(bitstring.bnot(s)), s)
+    test_helpers.assert_equal(bitstring.bnot(s), in_buffer(bitstring.bnot, s))
+
+    test_helpers.assert_equal(bitstring.subbits(s, 8 * 3, 8 * 19000), s:sub(4, 19003))
+    test_helpers.assert_equal(bitstring.subbits(s, 13, 150003), in_buffer(bitstring.subbits, s, 13, 150003))
+
+    local zeros = function(bits)
+        return string.rep("\0", bits / 8)
+    end
+    test_helpers.assert_equal(bitstring.shift(s, 8 * 9000), s:sub(9001) .. zeros(8 * 9000))
+    test_helpers.assert_equal(bitstring.shift(s, -8 * 9000), zeros(8 * 9000) .. s:sub(1, #s - 9000))
+    for _, shift in ipairs({13, -13, 8 * 9000 + 5, -8 * 9000 - 5}) do
+        test_helpers.assert_equal(bitstring.shift(s, shift), in_buffer(bitstring.shift, s, shift))
+    end
+    test_helpers.assert_equal(bitstring.shift(bitstring.shift(s, -13), 13), 
+        bitstring.subbits(s, 0, total - 13) .. "\0")
+    test_helpers.assert_equal(bitstring.shift(bitstring.shift(s, 8 * 9000 + 5), -8 * 9000 - 5), 
+        zeros(8 * 9000) .. bitstring.band(s:sub(9001, 9001), "\7") .. s:sub(9002))
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    test_helpers.run_test("test4", test4)
+    test_helpers.run_test("test5", test5)
+    test_helpers.run_test("test6", test6)
+    test_helpers.run_test("test7", test7)
+    test_helpers.run_test("test8", test8)
+    test_helpers.run_test("test9", test9)
+    test_helpers.run_test("test10", test10)
+    test_helpers.run_test("test11", test11)
+    test_helpers.run_test("test12", test12)
+    test_helpers.run_test("test13", test13)
+    test_helpers.run_test("test14", test14)
+    test_helpers.run_test("test15", test15)
+    os.exit(0)
+end
+
+run_tests()
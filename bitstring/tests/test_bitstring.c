@@ -1,12 +1,152 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <bitstring/bitstring.h>
 
+#define CHECK(condition) \
+    do \
+    { \
+        if(!(condition)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            return 1; \
+        } \
+    } while(0)
 
-int main (int argc, char **argv)
+/* EAP-TLS header from README */
+static const char *EAP_TLS_FORMAT = "8:int, 8:int, 16:int:big, 8:int, 1:int, 1:int, 1:int, 5:int";
+static const unsigned char EAP_TLS_MESSAGE[] = {0x01, 0x00, 0x00, 0x06, 0x0d, 0x20};
+
+static int test_pack_unpack()
+{
+    char error[256];
+    BITSTRING_PLAN *plan = bitstring_compile(EAP_TLS_FORMAT, error, sizeof(error));
+    CHECK(plan != NULL);
+    CHECK(bitstring_count(plan) == 8);
+    CHECK(bitstring_bits(plan) == 48);
+
+    int64_t values[8] = {1, 0, 6, 13, 0, 0, 1, 0};
+    unsigned char buffer[16];
+    size_t bits = 0;
+    CHECK(bitstring_pack(plan, values, 8, buffer, sizeof(buffer), &bits) == BITSTRING_OK);
+    CHECK(bits == 48);
+    CHECK(memcmp(buffer, EAP_TLS_MESSAGE, sizeof(EAP_TLS_MESSAGE)) == 0);
+
+    int64_t unpacked[8];
+    CHECK(bitstring_unpack(plan, EAP_TLS_MESSAGE, sizeof(EAP_TLS_MESSAGE), unpacked, 8, &bits) == BITSTRING_OK);
+    CHECK(bits == 48);
+    CHECK(memcmp(values, unpacked, sizeof(values)) == 0);
+
+    bitstring_free(plan);
+    return 0;
+}
+
+static int test_unaligned()
+{
+    BITSTRING_PLAN *plan = bitstring_compile("4:int, 8:int, 16:int:big, 32:int:little, 4:int", NULL, 0);
+    CHECK(plan != NULL);
+
+    int64_t values[5] = {0x0f, 0x01, 0x0102, 0x01020304, 0x0f};
+    unsigned char buffer[16];
+    CHECK(bitstring_buffer_size(plan) == 9);
+    CHECK(bitstring_pack(plan, values, 5, buffer, 8, NULL) == BITSTRING_ERROR_SIZE);
+    CHECK(bitstring_pack(plan, values, 5, buffer, 9, NULL) == BITSTRING_OK);
+    CHECK(memcmp(buffer, "\xf0\x10\x10\x20\x40\x30\x20\x1f", 8) == 0);
+
+    int64_t unpacked[5];
+    CHECK(bitstring_unpack(plan, buffer, 7, unpacked, 5, NULL) == BITSTRING_ERROR_SIZE);
+    CHECK(bitstring_unpack(plan, buffer, 8, unpacked, 5, NULL) == BITSTRING_OK);
+    CHECK(memcmp(values, unpacked, sizeof(values)) == 0);
+
+    bitstring_free(plan);
+    return 0;
+}
+
+typedef struct
+{
+    uint8_t code;
+    uint8_t identifier;
+    uint16_t length;
+    uint8_t type;
+    uint8_t l_bit;
+    uint8_t m_bit;
+    uint8_t s_bit;
+    uint32_t reserved;
+} EAP_TLS_HEADER;
+
+static int test_unpack_fields()
 {
+    BITSTRING_PLAN *plan = bitstring_compile(EAP_TLS_FORMAT, NULL, 0);
+    CHECK(plan != NULL);
+
+    BITSTRING_FIELD fields[8] =
+    {
+        {offsetof(EAP_TLS_HEADER, code), 1},
+        {offsetof(EAP_TLS_HEADER, identifier), 1},
+        {offsetof(EAP_TLS_HEADER, length), 2},
+        {offsetof(EAP_TLS_HEADER, type), 1},
+        {offsetof(EAP_TLS_HEADER, l_bit), 1},
+        {offsetof(EAP_TLS_HEADER, m_bit), 1},
+        {offsetof(EAP_TLS_HEADER, s_bit), 1},
+        {offsetof(EAP_TLS_HEADER, reserved), 4},
+    };
+
+    EAP_TLS_HEADER header;
+    memset(&header, 0xff, sizeof(header));
+    CHECK(bitstring_unpack_fields(plan, EAP_TLS_MESSAGE, sizeof(EAP_TLS_MESSAGE),
+                &header, fields, 8, NULL) == BITSTRING_OK);
+    CHECK(header.code == 1);
+    CHECK(header.identifier == 0);
+    CHECK(header.length == 6);
+    CHECK(header.type == 13);
+    CHECK(header.l_bit == 0);
+    CHECK(header.m_bit == 0);
+    CHECK(header.s_bit == 1);
+    CHECK(header.reserved == 0);
+
+    fields[7].size = 3;
+    CHECK(bitstring_unpack_fields(plan, EAP_TLS_MESSAGE, sizeof(EAP_TLS_MESSAGE),
+                &header, fields, 8, NULL) == BITSTRING_ERROR_ARGUMENT);
+
+    bitstring_free(plan);
     return 0;
 }
 
+static int test_errors()
+{
+    char error[256];
+    CHECK(bitstring_compile("8:in:little", error, sizeof(error)) == NULL);
+    CHECK(strstr(error, "wrong format") != NULL);
+
+    CHECK(bitstring_compile("8:int, 4:bin", error, sizeof(error)) == NULL);
+    CHECK(strstr(error, "wrong format") != NULL);
+
+    CHECK(bitstring_compile("12:int:little", error, sizeof(error)) == NULL);
+    CHECK(strstr(error, "wrong format") != NULL);
+
+    CHECK(bitstring_compile("0:int", error, sizeof(error)) == NULL);
+    CHECK(strstr(error, "size error") != NULL);
+
+    BITSTRING_PLAN *plan = bitstring_compile("8:int, 8:int", error, sizeof(error));
+    CHECK(plan != NULL);
+    int64_t values[2] = {1, 2};
+    unsigned char buffer[4];
+    CHECK(bitstring_pack(plan, values, 1, buffer, sizeof(buffer), NULL) == BITSTRING_ERROR_ARGUMENT);
+    bitstring_free(plan);
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    if(test_pack_unpack() != 0 ||
+            test_unaligned() != 0 ||
+            test_unpack_fields() != 0 ||
+            test_errors() != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
@@ -385,7 +385,22 @@ local test29 = function()
         bitstring.pack("8:int, 8:int", 1, 2, 3))
 end
 
+local test30 = function()
+    -- unaligned integers that end on the last byte of a buffer
+    local buffer = bitstring.buffer("\171")
+    local a, b = bitstring.unpack("4:int, 4:int", buffer)
+    assert(a == 10 and b == 11)
+    a, b = bitstring.unpack(bitstring.compile("4:int, 4:int"), buffer)
+    assert(a == 10 and b == 11)
+    a, b = bitstring.tryunpack("4:int, 4:int", buffer)
+    assert(a == 10 and b == 11)
+    a, b = bitstring.unpack("3:int, 13:int:big", bitstring.buffer("\171\205"))
+    assert(a == 5 and b == 0x0bcd)
+    assert(bitstring.match("4:int, 4:int=11", buffer))
+end
+
 local run_tests = function()
+    test_helpers.run_test("test30", test30)
     test_helpers.run_test("test29", test29)
     test_helpers.run_test("test28", test28)
     test_helpers.run_test("test27", test27)
@@ -5,11 +5,26 @@ rm -f libbitstring.so
 ln -s ../src/bitstring/.libs/bitstring.so libbitstring.so
 ln -s ../src/bitstring/.libs/bitstring.so bitstring.so
 
-LUA=lua
+LUA=${LUA:-lua}
 TESTS="test_bitstring \
        test_hexdump\
        test_bindump\
        test_compile\
+       test_codegen\
+       test_checksum\
+       test_bitops\
+       test_varint\
+       test_vlc\
+       test_match\
+       test_constant\
+       test_switch\
+       test_try\
+       test_columns\
+       test_plans\
+       test_pack\
+       test_writev\
+       test_pcap\
+       test_stats\
        test_profiler"
 
 for test_name in $TESTS; do
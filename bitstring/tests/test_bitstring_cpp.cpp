@@ -0,0 +1,80 @@
+
+#include <cstdio>
+#include <cstring>
+#include <tuple>
+#include <bitstring/bitstring.hpp>
+
+#define CHECK(condition) \
+    do \
+    { \
+        if(!(condition)) \
+        { \
+            std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            return 1; \
+        } \
+    } while(0)
+
+/* EAP-TLS header from README */
+static constexpr char EAP_TLS[] = "8:int, 8:int, 16:int:big, 8:int, 1:int, 1:int, 1:int, 5:int";
+static const unsigned char EAP_TLS_MESSAGE[] = {0x01, 0x00, 0x00, 0x06, 0x0d, 0x20};
+
+static constexpr char UNALIGNED[] = "4:int, 8:int, 16:int:big, 32:int:little, 4:int";
+static constexpr char WIDE[] = "3:int, 64:int, 64:int:little, 5:int";
+
+static int test_pack_unpack()
+{
+    using eap_tls = bitstring::layout<EAP_TLS>;
+    static_assert(eap_tls::count == 8, "count");
+    static_assert(eap_tls::bits == 48, "bits");
+    static_assert(std::is_same<std::tuple_element_t<2, eap_tls::tuple_type>, std::uint16_t>::value, "width");
+
+    auto [code, identifier, length, type, l, m, s, r] = eap_tls::unpack(EAP_TLS_MESSAGE, sizeof(EAP_TLS_MESSAGE));
+    CHECK(code == 1 && identifier == 0 && length == 6 && type == 13);
+    CHECK(l == 0 && m == 0 && s == 1 && r == 0);
+
+    std::array<unsigned char, eap_tls::bytes> message = eap_tls::pack(code, identifier, length, type, l, m, s, r);
+    CHECK(std::memcmp(message.data(), EAP_TLS_MESSAGE, sizeof(EAP_TLS_MESSAGE)) == 0);
+    return 0;
+}
+
+static int test_unaligned()
+{
+    using layout = bitstring::layout<UNALIGNED>;
+    unsigned char buffer[8];
+    CHECK(layout::pack_into(buffer, sizeof(buffer), 0x0f, 0x01, 0x0102, 0x01020304, 0x0f) == 64);
+    CHECK(std::memcmp(buffer, "\xf0\x10\x10\x20\x40\x30\x20\x1f", 8) == 0);
+    CHECK(layout::unpack(buffer, sizeof(buffer)) == std::make_tuple(0x0f, 0x01, 0x0102, 0x01020304, 0x0f));
+
+    bool thrown = false;
+    try
+    {
+        layout::unpack(buffer, 7);
+    }
+    catch(const std::length_error &e)
+    {
+        thrown = std::strstr(e.what(), "size error") != NULL;
+    }
+    CHECK(thrown);
+    return 0;
+}
+
+static int test_wide()
+{
+    using layout = bitstring::layout<WIDE>;
+    static_assert(layout::bits == 136, "bits");
+    auto packed = layout::pack(5, 0x0102030405060708ull, 0x0102030405060708ull, 0x1f);
+    CHECK(layout::unpack(packed) == std::make_tuple(5, 0x0102030405060708ull, 0x0102030405060708ull, 0x1f));
+    CHECK(packed[0] == 0xa0 && packed[8] == 0x01 && packed[9] == 0x00 && packed[10] == 0xe0 && packed[16] == 0x3f);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if(test_pack_unpack() != 0 ||
+            test_unaligned() != 0 ||
+            test_wide() != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+local check_values = function(input, crc16, crc32, crc32c, inet_checksum)
+    test_helpers.assert_equal(bitstring.crc("crc16", input), crc16)
+    test_helpers.assert_equal(bitstring.crc("crc32", input), crc32)
+    test_helpers.assert_equal(bitstring.crc("crc32c", input), crc32c)
+    test_helpers.assert_equal(bitstring.inet_checksum(input), inet_checksum)
+end
+
+local make_data = function()
+    local data = {}
+    for i = 0, 999 do
+        data[i + 1] = string.char((i * 37 + 11) % 256)
+    end
+    return table.concat(data)
+end
+
+local test1 = function()
+    check_values("123456789", 0x29b1, 0xcbf43926, 0xe3069283, 0xf62a)
+    check_values("The quick brown fox jumps over the lazy dog", 0x8fdd, 0x414fa339, 0x22620404, 0x72a4)
+end
+
+local test2 = function()
+    check_values(make_data(), 0x4b3f, 0xc3905a1d, 0x38ad7d3a, 0xfeb8)
+end
+
+local test3 = function()
+    -- substring
+    local data = make_data()
+    test_helpers.assert_equal(bitstring.crc("crc16", data, 4, 997), 0x10ed)
+    test_helpers.assert_equal(bitstring.crc("crc32", data, 4, -4), 0x348230dd)
+    test_helpers.assert_equal(bitstring.crc("crc32c", "xx"..data:sub(4, 997), 3), 0x481aff60)
+    test_helpers.assert_equal(bitstring.inet_checksum(data, 4, 997), 0x7ba8)
+    test_helpers.assert_equal(bitstring.crc("crc32", "x123456789x", 2, 10), 0xcbf43926)
+end
+
+local test4 = function()
+    -- RFC 1071 example and odd length
+    test_helpers.assert_equal(bitstring.inet_checksum("\0\1\242\3\244\245\246\247"), 0x220d)
+    test_helpers.assert_equal(bitstring.inet_checksum("\0\1\242"), 0x0dfe)
+    -- a message with the checksum in place sums to zero
+    test_helpers.assert_equal(bitstring.inet_checksum("\0\1\242\3\244\245\246\247\34\13"), 0)
+end
+
+local test5 = function()
+    test_helpers.assert_throw(function() bitstring.crc("crc8", "abc") end, "invalid option")
+    test_helpers.assert_throw(function() bitstring.crc("crc32", "abc", 3, 2) end, "invalid parameter")
+    test_helpers.assert_throw(function() bitstring.inet_checksum() end, "bad argument #1 to 'inet_checksum'")
+end
+
+local test6 = function()
+    -- empty input
+    check_values("", 0xffff, 0, 0, 0xffff)
+    check_values(bitstring.buffer(), 0xffff, 0, 0, 0xffff)
+    test_helpers.assert_equal(bitstring.crc("crc32", "", 1), 0)
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    test_helpers.run_test("test4", test4)
+    test_helpers.run_test("test5", test5)
+    test_helpers.run_test("test6", test6)
+    os.exit(0)
+end
+
+run_tests()
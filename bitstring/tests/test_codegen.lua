@@ -0,0 +1,131 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+local load_generated = function(format)
+    local source = bitstring.codegen(bitstring.compile(format), "lua", "generated")
+    print(source)
+    return assert(loadstring(source))()
+end
+
+local run_codegen_test = function(format, packed_values, expected)
+    local generated = load_generated(format)
+    local bitmatch = bitstring.compile(format)
+    test_helpers.assert_equal(bitstring.pack(bitmatch, unpack(packed_values)), expected)
+    test_helpers.assert_equal(generated.pack(unpack(packed_values)), expected)
+    local unpacked_values = {generated.unpack(expected)}
+    test_helpers.assert_equal(#unpacked_values, #packed_values)
+    test_helpers.assert_tables_equal(unpacked_values, {bitstring.unpack(bitmatch, expected)})
+    test_helpers.assert_tables_equal(unpacked_values, packed_values)
+end
+
+local test1 = function()
+    run_codegen_test("8:int, 8:int, 16:int:big, 8:int, 1:int, 1:int, 1:int, 5:int", 
+            {1, 0, 6, 13, 0, 0, 1, 0}, "\1\0\0\6\13\32")
+end
+
+local test2 = function()
+    run_codegen_test("8:int:little, 16:int:little, 32:int:little, 5:bin", 
+            {0x1, 0x0102, 0x01020304, "hello"}, "\1\2\1\4\3\2\1hello")
+end
+
+local test3 = function()
+    run_codegen_test("4:int, 8:int, 16:int:big, 32:int:big, 4:int", 
+            {0x0f, 0x1, 0x0102, 0x01020304, 0x0f}, "\240\16\16\32\16\32\48\79")
+end
+
+local test4 = function()
+    run_codegen_test("4:int, 8:int, 16:int:big, 32:int:little, 4:int", 
+            {0x0f, 0x1, 0x0102, 0x01020304, 0x0f}, "\240\16\16\32\64\48\32\31")
+end
+
+local test5 = function()
+    run_codegen_test("3:int, 2:bin, 5:int, 48:int, 8:int", 
+            {5, "ab", 17, 0x010203040506, 0xff}, 
+            bitstring.pack("3:int, 2:bin, 5:int, 48:int, 8:int", 5, "ab", 17, 0x010203040506, 0xff))
+end
+
+local test6 = function()
+    -- pack truncates the incomplete last byte the same way as the engine
+    local generated = load_generated("8:int, 4:int")
+    test_helpers.assert_equal(generated.pack(1, 15), bitstring.pack("8:int, 4:int", 1, 15))
+    -- values are truncated to the element size
+    test_helpers.assert_equal(generated.pack(0x101, 0), "\1")
+    test_helpers.assert_equal(load_generated("16:int").pack(-1), "\255\255")
+end
+
+local test7 = function()
+    local pack_generated = load_generated("16:int, all:bin, 8:int, all:bin")
+    local expected = bitstring.pack("16:int, all:bin, 8:int, all:bin", 0x0102, "hello", 3, "world")
+    test_helpers.assert_equal(pack_generated.pack(0x0102, "hello", 3, "world"), expected)
+    test_helpers.assert_throw(function() pack_generated.unpack(expected) end, "all length specifier")
+
+    local unpack_generated = load_generated("16:int, 8:int, rest:bin")
+    test_helpers.assert_tables_equal({unpack_generated.unpack("\1\2\3hello")}, {0x0102, 3, "hello"})
+    test_helpers.assert_tables_equal({unpack_generated.unpack("xx\1\2\3hello", 3)}, {0x0102, 3, "hello"})
+    test_helpers.assert_throw(function() unpack_generated.pack(1, 2, "") end, "rest length specifier")
+end
+
+local test8 = function()
+    local generated = load_generated("16:int, 2:bin")
+    test_helpers.assert_throw(function() generated.unpack("\1\2\3") end, "size error")
+    test_helpers.assert_throw(function() generated.pack(1, "a") end, "size error")
+end
+
+local test9 = function()
+    local format = string.rep("7:int, ", 96)
+    local values = {}
+    for i = 1, 96 do values[i] = i end
+    run_codegen_test(format, values, bitstring.pack(format, unpack(values)))
+end
+
+local test10 = function()
+    local source = bitstring.codegen("8:int, 16:int:little, 32:float, 3:bin", "c", "eap")
+    assert(string.find(source, "int luaopen_eap(lua_State *l)", 1, true))
+    assert(string.find(source, "static int l_pack(lua_State *l)", 1, true))
+    assert(string.find(source, "static int l_unpack(lua_State *l)", 1, true))
+
+    test_helpers.assert_throw(function() bitstring.codegen("8:int", "java") end, "invalid option")
+    test_helpers.assert_throw(function() bitstring.codegen("8:int", "c", "bad-name") end, "C identifier")
+    test_helpers.assert_throw(function() bitstring.codegen("32:float", "lua") end, "float is not supported")
+    test_helpers.assert_throw(function() bitstring.codegen("64:int", "lua") end, "size error")
+    test_helpers.assert_throw(function() bitstring.codegen("4:int, rest:bin", "lua") end, "byte bounds")
+end
+
+local test11 = function()
+    if jit == nil then
+        test_helpers.assert_equal(bitstring.backend, "c")
+        return
+    end
+
+    -- builds with stats keep the engine under LuaJIT
+    test_helpers.assert_equal(bitstring.backend, bitstring.stats() == nil and "luajit" or "c")
+    local format = "4:int, 8:int, 16:int:big, 32:int:little, 3:bin, 64:int, 32:float, 4:int"
+    local generated = assert(loadstring(bitstring.codegen(format, "luajit")))()
+    local values = {0x0f, 0x1, 0x0102, 0x01020304, "abc", -2, 1.5, 0x0f}
+    local expected = bitstring.pack(format, unpack(values))
+    test_helpers.assert_equal(generated.pack(unpack(values)), expected)
+    test_helpers.assert_tables_equal({generated.unpack(expected)}, values)
+    test_helpers.assert_throw(function() generated.unpack("\1\2") end, "size error")
+    test_helpers.assert_throw(function() generated.pack(1) end, "bad argument #3 to 'pack'")
+    test_helpers.assert_throw(function() bitstring.codegen(string.rep("8:int, ", 65), "luajit") end, "limit")
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    test_helpers.run_test("test4", test4)
+    test_helpers.run_test("test5", test5)
+    test_helpers.run_test("test6", test6)
+    test_helpers.run_test("test7", test7)
+    test_helpers.run_test("test8", test8)
+    test_helpers.run_test("test9", test9)
+    test_helpers.run_test("test10", test10)
+    test_helpers.run_test("test11", test11)
+    os.exit(0)
+end
+
+run_tests()
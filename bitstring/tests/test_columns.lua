@@ -0,0 +1,82 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+-- linear congruential generator. the sequence does not depend on math.random
+local seed = 12345
+local next_random = function(max)
+    seed = (seed * 1103515245 + 12345) % 2147483648
+    return seed % (max + 1)
+end
+
+local make_records = function(format, count, values)
+    local records = {}
+    for i = 1, count do
+        local record = {next_random(255), next_random(4095), next_random(15), next_random(65535)}
+        table.insert(values, record)
+        table.insert(records, bitstring.pack(format, unpack(record)))
+    end
+    return table.concat(records)
+end
+
+local test1 = function()
+    -- columns agree with unpacking every record
+    local format = "8:int, 12:int, 4:int, 16:int:little"
+    local values = {}
+    local input = make_records(format, 40000, values)
+    for _, threads in ipairs({1, 3, 64}) do
+        local columns, count = bitstring.decode_columns(format, input, threads)
+        assert(count == 40000)
+        assert(#columns == 4)
+        for c = 1, 4 do
+            assert(#columns[c] == 40000)
+        end
+        for r = 1, count, 97 do
+            for c = 1, 4 do
+                assert(columns[c][r] == values[r][c])
+            end
+        end
+        assert(columns[4][count] == values[count][4])
+    end
+    local columns = bitstring.decode_columns(bitstring.compile(format), bitstring.buffer(input))
+    test_helpers.assert_tables_equal(columns[2]:totable(1, 3), {values[1][2], values[2][2], values[3][2]})
+    assert(columns[1][0] == nil)
+    assert(columns[1][40001] == nil)
+end
+
+local test2 = function()
+    -- constants are checked and projected elements are not decoded
+    local format = "8:int=0x7e, 8:int, 4:int, 4:int"
+    local input = string.rep("\126\1\35", 30000) .. "\126\2\69"
+    local columns, count = bitstring.decode_columns(format, input, 4)
+    assert(#columns == 3)
+    assert(count == 30001)
+    assert(columns[1][1] == 1 and columns[2][1] == 2 and columns[3][1] == 3)
+    assert(columns[1][30001] == 2 and columns[3][30001] == 5)
+    local ok, message = pcall(bitstring.decode_columns, format, input .. "\127\1\35", 4)
+    assert(not ok and message:find("record 30002"))
+
+    columns = bitstring.decode_columns(bitstring.project(format, {3}), input)
+    assert(#columns == 1)
+    assert(columns[1][30001] == 4)
+end
+
+local test3 = function()
+    assert(not pcall(bitstring.decode_columns, "8:int, 2:bin", "abc"))
+    assert(not pcall(bitstring.decode_columns, "var:uleb128", "a"))
+    assert(not pcall(bitstring.decode_columns, "16:int", "abc"))
+    assert(not pcall(bitstring.decode_columns, "16:int", "ab", 0))
+    local columns, count = bitstring.decode_columns("16:int", "")
+    assert(count == 0 and #columns[1] == 0)
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    os.exit(0)
+end
+
+run_tests()
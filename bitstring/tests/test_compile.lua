@@ -235,8 +235,70 @@ local test24 = function()
     end
 end
 
+local test25 = function()
+    -- rest size is not remembered between calls with the same bitmatch
+    local bitmatch = bitstring.compile("8:int, rest:bin")
+    test_helpers.assert_tables_equal({bitstring.unpack(bitmatch, "\1abc")}, {1, "abc"})
+    test_helpers.assert_tables_equal({bitstring.unpack(bitmatch, "\1abcdef")}, {1, "abcdef"})
+end
+
+local test26 = function()
+    -- projection unpacks the selected elements only
+    local format = "8:int, 16:int:big, 4:int, 4:int, 3:bin, 1:int, 7:int, 8:int"
+    local values = {1, 0x0203, 4, 5, "abc", 1, 6, 7}
+    local packed = bitstring.pack(format, unpack(values))
+    local projected = bitstring.project(format, {7, 2})
+    test_helpers.assert_tables_equal({bitstring.unpack(projected, packed)}, {0x0203, 6})
+    projected = bitstring.compile(format, {fields = {5, 8, 5}})
+    test_helpers.assert_tables_equal({bitstring.unpack(projected, packed)}, {"abc", 7})
+    projected = bitstring.project(bitstring.compile(format), {1})
+    test_helpers.assert_tables_equal({bitstring.unpack(projected, packed)}, {1})
+    -- skipped elements are checked against the input length
+    assert(not pcall(bitstring.unpack, projected, packed:sub(1, -2)))
+    -- without fields the whole format is compiled
+    test_helpers.assert_tables_equal({bitstring.unpack(bitstring.compile(format, {}), packed)}, values)
+    local ok, match_bits = bitstring.match(bitstring.project(format, {2}), packed)
+    assert(ok and match_bits == 72)
+end
+
+local test27 = function()
+    -- projection skips variable size elements
+    local format = "8:int, var:uleb128, 8:int, rest:bin"
+    local packed = bitstring.pack("8:int, var:uleb128, 8:int, all:bin", 1, 300, 2, "xyz")
+    test_helpers.assert_tables_equal({bitstring.unpack(bitstring.project(format, {3, 4}), packed)}, {2, "xyz"})
+    test_helpers.assert_tables_equal({bitstring.unpack(bitstring.project(format, {1}), packed)}, {1})
+    test_helpers.assert_tables_equal({bitstring.unpack(bitstring.project(format, {}), packed)}, {})
+
+    local projected = bitstring.project(format, {3})
+    assert(not pcall(bitstring.pack, projected, 2))
+    assert(not pcall(bitstring.project, format, {5}))
+    assert(not pcall(bitstring.project, format, {0}))
+    assert(not pcall(bitstring.codegen, projected, "lua"))
+end
+
+local test28 = function()
+    -- projection of a projected bitmatch
+    local format = "64:int, 64:int, 8:int"
+    local packed = bitstring.pack("32:int, 32:int, 32:int, 32:int, 8:int", 0, 1, 0, 2, 3)
+    local projected = bitstring.project(format, {3})
+    test_helpers.assert_tables_equal({bitstring.unpack(projected, packed)}, {3})
+    -- element 1 is the merged 128 bits, element 2 the int
+    test_helpers.assert_tables_equal({bitstring.unpack(bitstring.project(projected, {2}), packed)}, {3})
+    test_helpers.assert_tables_equal({bitstring.unpack(bitstring.project(projected, {1, 2}), packed)}, {3})
+    test_helpers.assert_tables_equal({bitstring.unpack(bitstring.project(projected, {1}), packed)}, {})
+    assert(not pcall(bitstring.unpack, bitstring.project(projected, {1}), packed:sub(1, -3)))
+
+    format = "8:int, 16:int:big, var:uleb128, 8:int"
+    packed = bitstring.pack(format, 1, 2, 300, 4)
+    projected = bitstring.project(format, {4})
+    test_helpers.assert_tables_equal({bitstring.unpack(bitstring.project(projected, {2, 3}), packed)}, {300, 4})
+end
 
 local run_tests = function()
+    test_helpers.run_test("test28", test28)
+    test_helpers.run_test("test27", test27)
+    test_helpers.run_test("test26", test26)
+    test_helpers.run_test("test25", test25)
     test_helpers.run_test("test24", test24)
     test_helpers.run_test("test21", test21)
     test_helpers.run_test("test20", test20)
@@ -0,0 +1,66 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+local test1 = function()
+    -- constants are packed without arguments
+    local format = "8:int=0x01, 8:int, 16:int:big=260, 4:int=0, 4:int"
+    local packed = bitstring.pack(format, 7, 9)
+    test_helpers.assert_equal(packed, "\1\7\1\4\9")
+    test_helpers.assert_equal(bitstring.pack(bitstring.compile(format), 7, 9), packed)
+    -- and checked but not returned by unpack
+    test_helpers.assert_tables_equal({bitstring.unpack(format, packed)}, {7, 9})
+    test_helpers.assert_tables_equal({bitstring.unpack(bitstring.compile(format), packed)}, {7, 9})
+    assert(not pcall(bitstring.unpack, format, "\2\7\1\4\9"))
+    assert(not pcall(bitstring.unpack, format, "\1\7\1\4\25"))
+end
+
+local test2 = function()
+    -- negative constants and endianess
+    local format = "8:int=-1, 16:int:little=0x0102, 64:int=-2, 8:int"
+    local packed = bitstring.pack(format, 3)
+    test_helpers.assert_equal(packed, "\255\2\1\255\255\255\255\255\255\255\254\3")
+    test_helpers.assert_tables_equal({bitstring.unpack(format, packed)}, {3})
+end
+
+local test3 = function()
+    -- mismatch is reported by match as a failed element
+    local format = "8:int=0x45, 4:int, 4:int=5, 8:int"
+    local packed = bitstring.pack(format, 4, 6)
+    local ok, bits = bitstring.match(format, packed)
+    assert(ok and bits == 24)
+    ok, element = bitstring.match(format, "\69\70\6")
+    assert(not ok and element == 3)
+    ok, element = bitstring.match(format, "\70\69\6")
+    assert(not ok and element == 1)
+    ok, element = bitstring.match(format, "\69")
+    assert(not ok and element == 2)
+    -- projection keeps constants checked
+    local projected = bitstring.project(format, {4})
+    test_helpers.assert_tables_equal({bitstring.unpack(projected, packed)}, {6})
+    assert(not pcall(bitstring.unpack, projected, "\69\70\6"))
+end
+
+local test4 = function()
+    -- wrong constants
+    assert(not pcall(bitstring.compile, "4:int=16"))
+    assert(not pcall(bitstring.compile, "4:int=-9"))
+    assert(not pcall(bitstring.compile, "8:int=1x"))
+    assert(not pcall(bitstring.compile, "8:int="))
+    assert(not pcall(bitstring.compile, "2:bin=1"))
+    assert(not pcall(bitstring.compile, "32:float=1"))
+    assert(not pcall(bitstring.codegen, "8:int=1, 8:int", "lua"))
+    bitstring.compile("4:int=15, 4:int=-8, 8:int:big=255")
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    test_helpers.run_test("test4", test4)
+    os.exit(0)
+end
+
+run_tests()
@@ -68,6 +68,17 @@ local run_pack_unpack_test = function(pack_format, unpack_format, packed_values,
     assert_tables_equal(unpacked_values, packed_values)
 end
 
+-- pseudo random bytes of a linear congruential generator
+local payload = function(len, seed)
+    local bytes = {}
+    local x = seed
+    for i = 1, len do
+        x = (x * 1103515245 + 12345) % 2147483648
+        bytes[i] = string.char(math.floor(x / 65536) % 256)
+    end
+    return table.concat(bytes)
+end
+
 module("test_helpers", package.seeall)
 test_helpers.run_test = run_test
 test_helpers.assert_equal = assert_equal
@@ -76,5 +87,6 @@ test_helpers.assert_tables_equal = assert_tables_equal
 test_helpers.assert_throw = assert_throw
 test_helpers.run_pack_unpack_test = run_pack_unpack_test
 test_helpers.hexdump = hexdump
+test_helpers.payload = payload
 
 
@@ -0,0 +1,69 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+-- EAP-TLS header from README
+local EAP_TLS_FORMAT = "8:int, 8:int, 16:int:big, 8:int, 1:int, 1:int, 1:int, 5:int, rest:bin"
+
+local assert_match = function(expected_ok, expected_number, ok, number)
+    assert(ok == expected_ok)
+    assert(number == expected_number)
+end
+
+local test1 = function()
+    local message = bitstring.pack((EAP_TLS_FORMAT:gsub("rest", "all")), 1, 0, 10, 13, 0, 0, 1, 0, "data")
+    assert_match(true, 80, bitstring.match(EAP_TLS_FORMAT, message))
+    local bitmatch = bitstring.compile(EAP_TLS_FORMAT)
+    assert_match(true, 80, bitstring.match(bitmatch, message))
+    assert_match(true, 48, bitstring.match(bitmatch, message, 1, 6))
+    assert_match(false, 5, bitstring.match(bitmatch, message, 1, 5))
+    assert_match(false, 3, bitstring.match(bitmatch, message, 1, 3))
+    assert_match(true, 80, bitstring.match(bitmatch, bitstring.buffer(message)))
+    assert_match(false, 3, bitstring.match("8:int, 3:bin, 2:int", "abcd"))
+    assert_match(false, 2, bitstring.match("3:int, rest:bin", "abcd"))
+    assert_match(true, 36, bitstring.match("4:int, 32:float", "abcde"))
+    assert_match(false, 2, bitstring.match("4:int, 64:float", "abcde"))
+end
+
+local test2 = function()
+    -- match agrees with unpack for variable length integers
+    local format = "3:int, var:ue, var:uleb128, var:quic, var:berlen, var:se, 7:int"
+    local packed = bitstring.pack(format, 1, 100, 300, 20000, 1000, -9, 0)
+    local _, bits = bitstring.match(format, packed)
+    assert(bits == #packed * 8)
+    for i = 1, #packed - 1 do
+        local ok = bitstring.match(format, packed, 1, i)
+        assert(not ok)
+        assert(not pcall(bitstring.unpack, format, packed, 1, i))
+    end
+    assert_match(false, 1, bitstring.match("var:berlen", "\128"))
+    assert_match(false, 1, bitstring.match("var:berlen", "\137"))
+    -- short form lengths above the long form byte count limit
+    assert_match(true, 32, bitstring.match("var:berlen, rest:bin", "\24abc"))
+    assert_match(true, 8, bitstring.match("var:berlen", "\127"))
+    test_helpers.assert_tables_equal({bitstring.unpack("var:berlen, rest:bin", "\24abc")}, {24, "abc"})
+    test_helpers.assert_tables_equal({bitstring.tryunpack("var:berlen, rest:bin", "\24abc")}, {24, "abc"})
+    test_helpers.assert_equal(bitstring.unpack(bitstring.project("var:berlen, rest:bin", {2}), "\24abc"), "abc")
+    assert_match(false, 1, bitstring.match("var:uleb128", string.rep("\255", 10) .. "\1"))
+    assert_match(false, 1, bitstring.match("var:ue", "\0\0\0\0\0\0\0\0\1"))
+    assert_match(false, 2, bitstring.match("8:int, var:quic", "\1\64"))
+end
+
+local test3 = function()
+    test_helpers.assert_throw(function() bitstring.match("all:bin", "abc") end, "can not be unpacked")
+    test_helpers.assert_throw(function() bitstring.match("12:float", "abc") end, "unsupported float size")
+    test_helpers.assert_throw(function() bitstring.match("12:int:little, 4:int", "ab") end, "little endianess")
+    test_helpers.assert_throw(function() bitstring.match("8:quic", "abc") end, "requires var size")
+    test_helpers.assert_throw(function() bitstring.match("8:int, 8:in", "abc") end, "unexpected type token")
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    os.exit(0)
+end
+
+run_tests()
@@ -0,0 +1,74 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+local test1 = function()
+    -- large aligned payloads through compiled bitmatch
+    local format = "8:int, 16:int:big, all:bin, 32:int:little"
+    local bitmatch = bitstring.compile(format)
+    local lens = {0, 1, 100, 65536, 70000, 200001}
+    for _, len in ipairs(lens) do
+        local data = test_helpers.payload(len, len)
+        local packed = bitstring.pack(bitmatch, 1, 2, data, 0x01020304)
+        assert(#packed == len + 7)
+        assert(packed == bitstring.pack(format, 1, 2, data, 0x01020304))
+        local a, b, c, d = bitstring.unpack("8:int, 16:int:big, " .. len .. ":bin, 32:int:little", packed)
+        assert(a == 1 and b == 2 and c == data and d == 0x01020304)
+    end
+end
+
+local test2 = function()
+    -- unaligned payloads, fixed size bin and constants
+    local data = test_helpers.payload(100000, 7)
+    local format = "3:int, 8:int=0x5a, 100000:bin, 5:int, all:bin"
+    local bitmatch = bitstring.compile(format)
+    local packed = bitstring.pack(bitmatch, 5, data, 17, "tail")
+    assert(packed == bitstring.pack(format, 5, data, 17, "tail"))
+    assert(#packed == 1 + 100000 + 4 + 1)
+    local a, b, c, d = bitstring.unpack("3:int, 8:int=0x5a, 100000:bin, 5:int, 4:bin", packed)
+    assert(a == 5 and b == data and c == 17 and d == "tail")
+end
+
+local test3 = function()
+    -- the scratch buffer is reused by smaller results
+    local bitmatch = bitstring.compile("all:bin, 8:int")
+    local big = test_helpers.payload(300000, 3)
+    local small = test_helpers.payload(20000, 4)
+    assert(bitstring.pack(bitmatch, big, 1) == big .. "\1")
+    assert(bitstring.pack(bitmatch, small, 2) == small .. "\2")
+    assert(bitstring.pack(bitmatch, big, 3) == big .. "\3")
+end
+
+local test4 = function()
+    -- errors inside large packs
+    local bitmatch = bitstring.compile("all:bin, 8:int, 8:int")
+    local data = test_helpers.payload(70000, 5)
+    assert(not pcall(bitstring.pack, bitmatch, data, 1))
+    assert(not pcall(bitstring.pack, bitmatch, data, 1, "x"))
+    assert(bitstring.pack(bitmatch, data, 1, 2) == data .. "\1\2")
+end
+
+local test5 = function()
+    -- results above the kept scratch size, after and around failed packs
+    local bitmatch = bitstring.compile("8:int, all:bin, 16:int:big")
+    for _, len in ipairs({3000000, 100000, 2000000}) do
+        local data = string.rep("x", len)
+        local packed = bitstring.pack(bitmatch, 1, data, 2)
+        assert(#packed == len + 3)
+        assert(packed == "\1" .. data .. "\0\2")
+        assert(not pcall(bitstring.pack, bitmatch, 1, data, "not a number"))
+    end
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    test_helpers.run_test("test4", test4)
+    test_helpers.run_test("test5", test5)
+    os.exit(0)
+end
+
+run_tests()
@@ -0,0 +1,252 @@
+require "os"
+require "io"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+local ETHERNET_HEADER = "48:int:big, 48:int:big, 16:int:big"
+
+local frame = function(i)
+    return bitstring.pack(ETHERNET_HEADER .. ", all:bin", i, i + 1, 0x0800, string.rep(string.char(i % 256), i))
+end
+
+local pcap = function(endianess, magic, frames)
+    local header = "32:int:" .. endianess .. ", 16:int:" .. endianess .. ", 16:int:" .. endianess ..
+            ", 32:int:" .. endianess .. ", 32:int:" .. endianess .. ", 32:int:" .. endianess .. ", 32:int:" .. endianess
+    local record = "32:int:" .. endianess .. ", 32:int:" .. endianess .. ", 32:int:" .. endianess .. 
+            ", 32:int:" .. endianess .. ", all:bin"
+    local parts = {bitstring.pack(header, magic, 2, 4, 0, 0, 65535, 1)}
+    for i, f in ipairs(frames) do
+        table.insert(parts, bitstring.pack(record, 1000 + i, 250000, #f, #f + 4, f))
+    end
+    return table.concat(parts)
+end
+
+local block = function(endianess, block_type, body)
+    local padded = body .. string.rep("\0", (4 - #body % 4) % 4)
+    local int = "32:int:" .. endianess
+    return bitstring.pack(int .. ", " .. int .. ", all:bin, " .. int, 
+            block_type, #padded + 12, padded, #padded + 12)
+end
+
+local pcapng = function(endianess, frames)
+    local int = "32:int:" .. endianess
+    local short = "16:int:" .. endianess
+    local parts = {
+        block(endianess, 0x0a0d0d0a, bitstring.pack(int .. ", " .. short .. ", " .. short .. ", 64:int", 
+            0x1a2b3c4d, 1, 0, -1)),
+        -- microseconds
+        block(endianess, 1, bitstring.pack(short .. ", " .. short .. ", " .. int, 1, 0, 65535)),
+        -- nanoseconds
+        block(endianess, 1, bitstring.pack(short .. ", " .. short .. ", " .. int .. ", " ..
+            short .. ", " .. short .. ", 8:int, 24:int, 32:int", 105, 0, 0, 9, 1, 9, 0, 0)),
+        -- unknown block
+        block(endianess, 0x0bad, "xyz"),
+    }
+    for i, f in ipairs(frames) do
+        local interface = i % 2
+        local ticks = interface == 0 and (1000 + i) * 1000000 + 250000 or (1000 + i) * 1000000000 + 250000000
+        table.insert(parts, block(endianess, 6, bitstring.pack(string.rep(int .. ", ", 5) .. "all:bin",
+            interface, math.floor(ticks / 4294967296), ticks % 4294967296, #f, #f + 4, f)))
+    end
+    table.insert(parts, block(endianess, 3, bitstring.pack(int .. ", all:bin", 3, "abc")))
+    return table.concat(parts)
+end
+
+local frames = {}
+for i = 1, 20 do
+    frames[i] = frame(i)
+end
+
+local check_records = function(capture, expected_frames, linktypes)
+    local reader = bitstring.pcap_reader(capture)
+    local i = 0
+    for timestamp, caplen, first, last, origlen, linktype in reader:records() do
+        i = i + 1
+        local f = expected_frames[i]
+        if f then
+            assert(math.abs(timestamp - (1000 + i + 0.25)) < 1e-6)
+            assert(caplen == #f and origlen == #f + 4)
+            assert(last - first + 1 == caplen)
+            local dst, src, ethertype, payload = bitstring.unpack(ETHERNET_HEADER .. ", rest:bin", capture, first, last)
+            assert(dst == i and src == i + 1 and ethertype == 0x0800)
+            assert(payload == string.rep(string.char(i), i))
+            assert(linktype == (linktypes and linktypes[i % 2 + 1] or 1))
+        else
+            -- simple packet block
+            assert(timestamp == 0 and caplen == 3 and origlen == 3 and linktype == 1)
+            assert(bitstring.unpack("3:bin", capture, first, last) == "abc")
+        end
+    end
+    return i
+end
+
+local test1 = function()
+    -- pcap in both byte orders and resolutions
+    assert(check_records(pcap("little", 0xa1b2c3d4, frames), frames) == 20)
+    assert(check_records(pcap("big", 0xa1b2c3d4, frames), frames) == 20)
+    local nsec = pcap("little", 0xa1b23c4d, {frames[1]})
+    local reader = bitstring.pcap_reader(nsec)
+    assert(math.abs(reader:next() - 1001.00025) < 1e-9)
+    assert(reader:next() == nil)
+end
+
+local test2 = function()
+    -- pcapng with two interfaces and sections in both byte orders
+    assert(check_records(pcapng("little", frames), frames, {1, 105}) == 21)
+    assert(check_records(pcapng("big", frames), frames, {1, 105}) == 21)
+    local capture = pcapng("big", {frames[1]}) .. pcapng("little", {frames[1], frames[2]})
+    local reader = bitstring.pcap_reader(capture)
+    local count = 0
+    for _ in reader:records() do
+        count = count + 1
+    end
+    assert(count == 5)
+end
+
+local test3 = function()
+    -- capture that grows in a buffer
+    for _, capture in ipairs({pcap("little", 0xa1b2c3d4, frames), pcapng("little", frames)}) do
+        local name = os.tmpname()
+        local file = io.open(name, "wb")
+        file:write(capture)
+        file:close()
+
+        file = io.open(name, "rb")
+        local buffer = bitstring.buffer()
+        while #buffer < 24 do
+            buffer:readfrom(file, 24)
+        end
+        local reader = bitstring.pcap_reader(buffer)
+        local count = 0
+        while true do
+            local n = buffer:readfrom(file, 7)
+            while true do
+                local timestamp, caplen, first, last = reader:next()
+                if not timestamp then
+                    break
+                end
+                count = count + 1
+                if count <= 20 then
+                    local dst = bitstring.unpack("48:int:big", buffer, first, last)
+                    assert(dst == count)
+                end
+            end
+            reader:discard()
+            if n == 0 then
+                break
+            end
+        end
+        file:close()
+        os.remove(name)
+        assert(count == #frames + (capture:byte(1) == 10 and 1 or 0))
+        assert(#buffer == 0)
+    end
+end
+
+local test4 = function()
+    -- writer
+    local name = os.tmpname()
+    local file = io.open(name, "wb")
+    local writer = bitstring.pcap_writer(file)
+    local many = {}
+    for i = 1, 3000 do
+        many[i] = frames[i % 20 + 1]
+        assert(writer:write(1000 + i + 0.25, bitstring.buffer(many[i]), #many[i] + 4))
+    end
+    assert(writer:flush())
+    file:close()
+
+    file = io.open(name, "rb")
+    local capture = file:read("*a")
+    file:close()
+    local reader = bitstring.pcap_reader(capture)
+    local i = 0
+    for timestamp, caplen, first, last, origlen, linktype in reader:records() do
+        i = i + 1
+        assert(math.abs(timestamp - (1000 + i + 0.25)) < 1e-6)
+        assert(caplen == #many[i] and origlen == #many[i] + 4 and linktype == 1)
+        assert(bitstring.unpack(caplen .. ":bin", capture, first, last) == many[i])
+    end
+    assert(i == 3000)
+
+    -- snapshot length truncates packets
+    file = io.open(name, "wb")
+    writer = bitstring.pcap_writer(file, 101, 10)
+    writer:write(1.5, frames[20])
+    writer:flush()
+    file:close()
+    file = io.open(name, "rb")
+    capture = file:read("*a")
+    file:close()
+    local timestamp, caplen, first, last, origlen, linktype = bitstring.pcap_reader(capture):next()
+    assert(timestamp == 1.5 and caplen == 10 and origlen == #frames[20] and linktype == 101)
+    os.remove(name)
+end
+
+local test5 = function()
+    -- errors
+    test_helpers.assert_throw(function() bitstring.pcap_reader("abcdefgh") end, "not a pcap")
+    test_helpers.assert_throw(function() bitstring.pcap_reader("\212\195") end, "size error")
+    local capture = pcap("little", 0xa1b2c3d4, {frames[1]})
+    test_helpers.assert_throw(function() bitstring.pcap_reader(capture):discard() end, "not a bitstring.buffer")
+    -- truncated record is not returned
+    assert(bitstring.pcap_reader(capture:sub(1, -2)):next() == nil)
+    -- corrupted block length
+    local corrupted = pcapng("little", {frames[1]})
+    corrupted = corrupted:sub(1, 4) .. "\5\0\0\0" .. corrupted:sub(9)
+    test_helpers.assert_throw(function() bitstring.pcap_reader(corrupted):next() end, "wrong length")
+end
+
+local test6 = function()
+    -- close and collection write the records below the batch size
+    local read_records = function(name)
+        local file = io.open(name, "rb")
+        local capture = file:read("*a")
+        file:close()
+        local count = 0
+        for timestamp, caplen, first, last in bitstring.pcap_reader(capture):records() do
+            count = count + 1
+            assert(bitstring.unpack(caplen .. ":bin", capture, first, last) == frames[count])
+        end
+        return count
+    end
+
+    local name = os.tmpname()
+    local file = io.open(name, "wb")
+    local writer = bitstring.pcap_writer(file)
+    for i = 1, 3 do
+        writer:write(i, frames[i])
+    end
+    assert(writer:close())
+    assert(writer:close())
+    test_helpers.assert_throw(function() writer:write(4, frames[4]) end, "closed pcap writer")
+    test_helpers.assert_throw(function() writer:flush() end, "closed pcap writer")
+    file:close()
+    assert(read_records(name) == 3)
+
+    file = io.open(name, "wb")
+    writer = bitstring.pcap_writer(file)
+    for i = 1, 5 do
+        writer:write(i, frames[i])
+    end
+    writer = nil
+    collectgarbage()
+    collectgarbage()
+    file:close()
+    assert(read_records(name) == 5)
+    os.remove(name)
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    test_helpers.run_test("test4", test4)
+    test_helpers.run_test("test5", test5)
+    test_helpers.run_test("test6", test6)
+    os.exit(0)
+end
+
+run_tests()
@@ -0,0 +1,61 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+local test1 = function()
+    -- equal formats share one plan
+    collectgarbage("collect")
+    local count, references = bitstring.plans()
+    local a = bitstring.compile("8:int, 16:int:big, rest:bin")
+    local b = bitstring.compile(" 8:int,16:int:big,\trest:bin, ")
+    local c = bitstring.compile("8:int, 16:int:little, rest:bin")
+    local new_count, new_references = bitstring.plans()
+    assert(new_count == count + 2)
+    assert(new_references == references + 3)
+    test_helpers.assert_tables_equal({bitstring.unpack(b, "\1\0\2ab")}, {1, 2, "ab"})
+    test_helpers.assert_tables_equal({bitstring.unpack(c, "\1\2\0ab")}, {1, 2, "ab"})
+
+    -- projections are shared as well
+    local p1 = bitstring.project(a, {2})
+    local p2 = bitstring.compile("8:int, 16:int:big, rest:bin", {fields = {2}})
+    collectgarbage("collect")
+    new_count, new_references = bitstring.plans()
+    assert(new_count == count + 3)
+    assert(new_references == references + 5)
+    test_helpers.assert_tables_equal({bitstring.unpack(p2, "\1\0\2ab")}, {2})
+
+    -- the last reference releases the plan
+    a, b, c, p1, p2 = nil, nil, nil, nil, nil
+    collectgarbage("collect")
+    new_count, new_references = bitstring.plans()
+    assert(new_count == count)
+    assert(new_references == references)
+end
+
+local test2 = function()
+    -- many layouts
+    local bitmatches = {}
+    for i = 1, 1000 do
+        bitmatches[i] = bitstring.compile(string.format("8:int, 16:int=%d", i))
+    end
+    local count = bitstring.plans()
+    assert(count >= 1000)
+    for i = 1, 1000 do
+        bitstring.compile(string.format("8:int, 16:int=%d", i))
+    end
+    assert(bitstring.plans() == count)
+    test_helpers.assert_tables_equal({bitstring.unpack(bitmatches[5], "\6\0\5")}, {6})
+    bitmatches = nil
+    collectgarbage("collect")
+    assert(bitstring.plans() < 1000)
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    os.exit(0)
+end
+
+run_tests()
@@ -0,0 +1,104 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+local test1 = function()
+    -- counters of a bitmatch
+    local format = "8:int=0x01, 16:int:big, 3:bin"
+    local bitmatch = bitstring.compile(format)
+    local stats = bitstring.stats(bitmatch)
+    if stats == nil then
+        -- built without --enable-stats
+        assert(bitstring.stats() == nil)
+        return
+    end
+    local before = stats.calls
+
+    local message = bitstring.pack(bitmatch, 5, "abc")
+    for i = 1, 10 do
+        assert(select(2, bitstring.unpack(bitmatch, message)) == "abc")
+    end
+    assert(not pcall(bitstring.unpack, bitmatch, "\2\0\5"))
+    assert(not pcall(bitstring.pack, bitmatch, "x"))
+    assert(bitstring.tryunpack(bitmatch, "\1") == nil)
+    assert(bitstring.trypack(bitmatch, 1, "xyz") == "\1\0\1xyz")
+
+    stats = bitstring.stats(bitmatch)
+    assert(stats.calls == before + 15)
+    assert(stats.errors == 3)
+    assert(stats.bytes_in == 10 * 6)
+    assert(stats.bytes_out == 6 + 6)
+    assert(stats.nanoseconds > 0)
+
+    -- equal bitmatches share the counters
+    assert(bitstring.stats(bitstring.compile(" 8:int=1,16:int:big, 3:bin")).calls == stats.calls)
+end
+
+local test2 = function()
+    -- snapshot
+    local bitmatch = bitstring.compile("4:int, 12:int, 8:int:little, 2:bin, 32:float")
+    local projected = bitstring.project(bitmatch, {2})
+    local snapshot = bitstring.stats()
+    if snapshot == nil then
+        return
+    end
+    local formats = snapshot.formats.calls
+    bitstring.unpack("8:int", "a")
+    bitstring.pack(bitmatch, 1, 2, 3, "xy", 1.5)
+    assert(bitstring.unpack(projected, "\1\2\3\4\5\6\7\8\9") == 0x102)
+    snapshot = bitstring.stats()
+    assert(snapshot.formats.calls == formats + 1)
+    local found = {}
+    for _, stats in ipairs(snapshot.bitmatches) do
+        found[stats.layout] = stats
+    end
+    assert(found["4:int, 12:int, 8:int:little, 2:bin, 32:float"].calls == 1)
+    assert(found["4:skip, 12:int, 56:skip"].bytes_in == 9)
+end
+
+local test3 = function()
+    -- allocations per call
+    local ints = bitstring.compile("8:int, 16:int:big, 32:int:little")
+    local bins = bitstring.compile("8:int, 1000:bin")
+    if bitstring.stats(ints) == nil then
+        return
+    end
+    local message = bitstring.pack(ints, 1, 2, 3)
+    bitstring.unpack(ints, message)
+    local before = bitstring.stats(ints)
+    for i = 1, 1000 do
+        bitstring.unpack(ints, message)
+    end
+    local after = bitstring.stats(ints)
+    -- integers do not create garbage
+    assert(after.allocations - before.allocations == 0)
+
+    before = after
+    for i = 1, 1000 do
+        bitstring.pack(ints, i % 256, i, i)
+    end
+    after = bitstring.stats(ints)
+    -- one result string for each call
+    assert(after.allocations - before.allocations == 1000)
+
+    local payload = bitstring.pack(bins, 1, string.rep("x", 1000))
+    before = bitstring.stats(bins)
+    for i = 1, 100 do
+        bitstring.unpack(bins, payload)
+    end
+    after = bitstring.stats(bins)
+    -- one string for each bin element
+    assert(after.allocations - before.allocations == 100)
+    assert(after.allocated_bytes - before.allocated_bytes == 100000)
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    os.exit(0)
+end
+
+run_tests()
@@ -0,0 +1,133 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+-- EAP packets discriminated by code and type
+local EAP_FORMATS = {
+    "8:int=1, 8:int, 16:int:big, 8:int=1, rest:bin",
+    "8:int=2, 8:int, 16:int:big, 8:int=1, rest:bin",
+    "8:int=1, 8:int, 16:int:big, 8:int=13, 1:int, 1:int, 1:int, 5:int, rest:bin",
+    "8:int=3, 8:int, 16:int:big",
+    "8:int=4, 8:int, 16:int:big",
+}
+
+local test1 = function()
+    local switch = bitstring.switch(EAP_FORMATS)
+    local identity = bitstring.pack("8:int, 8:int, 16:int:big, 8:int, all:bin", 1, 7, 9, 1, "user")
+    test_helpers.assert_tables_equal({switch:unpack(identity)}, {1, 7, 9, "user"})
+    local response = bitstring.pack("8:int, 8:int, 16:int:big, 8:int, all:bin", 2, 7, 9, 1, "user")
+    test_helpers.assert_tables_equal({bitstring.switch_unpack(switch, response)}, {2, 7, 9, "user"})
+    local tls = bitstring.pack("8:int, 8:int, 16:int:big, 8:int, 8:int, all:bin", 1, 5, 10, 13, 0x20, "tls")
+    test_helpers.assert_tables_equal({switch:unpack(tls)}, {3, 5, 10, 0, 0, 1, 0, "tls"})
+    test_helpers.assert_tables_equal({switch:unpack("\4\1\0\4")}, {5, 1, 4})
+    -- trailing data and substrings
+    test_helpers.assert_tables_equal({switch:unpack("xx\3\1\0\4", 3)}, {4, 1, 4})
+    -- no layout matches
+    assert(switch:unpack("\5\1\0\4") == nil)
+    assert(switch:unpack("\1\1\0\4\2") == nil)
+    assert(switch:unpack("\1") == nil)
+end
+
+local test2 = function()
+    -- the first matching layout wins and layouts without constants are a fallback
+    local switch = bitstring.switch({
+        bitstring.compile("4:int=10, 4:int, 8:int"),
+        "4:int, 4:int=3, 8:int",
+        "8:int, 8:int=0xff",
+        "16:int",
+    })
+    test_helpers.assert_tables_equal({switch:unpack("\163\1")}, {1, 3, 1})
+    test_helpers.assert_tables_equal({switch:unpack("\19\1")}, {2, 1, 1})
+    test_helpers.assert_tables_equal({switch:unpack("\19\255")}, {2, 1, 255})
+    test_helpers.assert_tables_equal({switch:unpack("\20\255")}, {3, 20})
+    test_helpers.assert_tables_equal({switch:unpack("\20\1")}, {4, 0x1401})
+    assert(switch:unpack("\20") == nil)
+end
+
+local test3 = function()
+    -- agrees with trying the layouts in order
+    local formats = {}
+    for i = 0, 15 do
+        table.insert(formats, string.format("4:int=%d, 4:int=%d, 8:int", i % 4, i))
+    end
+    table.insert(formats, "8:int, 8:int:little=0x11")
+    local switch = bitstring.switch(formats)
+    for b = 0, 255 do
+        for _, second in ipairs({0x11, 0x12}) do
+            local input = string.char(b, second)
+            local expected = {}
+            for index, format in ipairs(formats) do
+                if bitstring.match(format, input) then
+                    expected = {index, bitstring.unpack(format, input)}
+                    break
+                end
+            end
+            local result = {switch:unpack(input)}
+            assert(#result == #expected)
+            for i = 1, #result do
+                assert(result[i] == expected[i])
+            end
+        end
+    end
+end
+
+local test4 = function()
+    assert(not pcall(bitstring.switch, {}))
+    assert(not pcall(bitstring.switch, {1}))
+    assert(not pcall(bitstring.switch, {{}}))
+    assert(not pcall(bitstring.switch_unpack, "8:int", "a"))
+end
+
+local test5 = function()
+    -- layouts discriminated at different offsets keep the tree small
+    local check_in_order = function(formats, inputs)
+        local switch = bitstring.switch(formats)
+        for _, input in ipairs(inputs) do
+            local expected = {}
+            for index, format in ipairs(formats) do
+                if bitstring.match(format, input) then
+                    expected = {index, bitstring.unpack(format, input)}
+                    break
+                end
+            end
+            local result = {switch:unpack(input)}
+            assert(#result == #expected)
+            for i = 1, #result do
+                assert(result[i] == expected[i])
+            end
+        end
+    end
+
+    local start = os.clock()
+    local formats = {}
+    local inputs = {}
+    for i = 1, 40 do
+        table.insert(formats, string.rep("8:int, ", i - 1) .. "8:int=1, rest:bin")
+        table.insert(inputs, string.rep("\0", i - 1) .. "\1" .. string.rep("\1", 40 - i))
+    end
+    table.insert(inputs, string.rep("\0", 40))
+    check_in_order(formats, inputs)
+
+    -- two layouts at each offset
+    formats = {}
+    for i = 1, 32 do
+        table.insert(formats, string.rep("8:int, ", i - 1) .. "8:int=1, rest:bin")
+        table.insert(formats, string.rep("8:int, ", i - 1) .. "8:int=2, rest:bin")
+        table.insert(inputs, string.rep("\0", i - 1) .. "\2" .. string.rep("\3", 40 - i))
+    end
+    check_in_order(formats, inputs)
+    assert(os.clock() - start < 5)
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    test_helpers.run_test("test4", test4)
+    test_helpers.run_test("test5", test5)
+    os.exit(0)
+end
+
+run_tests()
@@ -0,0 +1,71 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+local assert_error = function(expected_code, expected_element, expected_bit, result, code, element, bit)
+    assert(result == nil)
+    assert(code == expected_code)
+    assert(element == expected_element)
+    assert(bit == expected_bit)
+end
+
+local test1 = function()
+    -- tryunpack returns the values like unpack
+    local format = "8:int, 16:int:big, 3:bin, 8:int=7, var:uleb128, rest:bin"
+    local packed = bitstring.pack("8:int, 16:int:big, 3:bin, 8:int, var:uleb128, all:bin", 1, 2, "abc", 7, 300, "xy")
+    test_helpers.assert_tables_equal({bitstring.tryunpack(format, packed)}, {1, 2, "abc", 300, "xy"})
+    test_helpers.assert_tables_equal({bitstring.tryunpack(bitstring.compile(format), packed)}, {1, 2, "abc", 300, "xy"})
+    test_helpers.assert_tables_equal({bitstring.tryunpack("8:int", "ab", 2)}, {string.byte("b")})
+
+    -- and errors instead of raising them
+    assert_error("size", 3, 24, bitstring.tryunpack(format, packed:sub(1, 5)))
+    assert_error("value", 4, 48, bitstring.tryunpack(format, packed:sub(1, 6) .. "\8" .. packed:sub(8)))
+    assert_error("size", 5, 56, bitstring.tryunpack(format, packed:sub(1, 7) .. "\255"))
+    assert_error("align", 2, 4, bitstring.tryunpack("4:int, rest:bin", "abc"))
+    assert_error("position", 0, 0, bitstring.tryunpack("8:int", ""))
+    assert_error("position", 0, 0, bitstring.tryunpack("8:int", "ab", 3))
+    -- uleb128 that exceeds lua_Integer
+    assert_error("size", 1, 0, bitstring.tryunpack("var:uleb128", string.rep("\255", 9) .. "\127"))
+    assert(not bitstring.match("var:uleb128", string.rep("\255", 9) .. "\127"))
+
+    -- wrong formats still raise
+    assert(not pcall(bitstring.tryunpack, "8:foo", "a"))
+    assert(not pcall(bitstring.tryunpack, "all:bin", "a"))
+end
+
+local test2 = function()
+    -- trypack packs like pack
+    local format = "8:int=1, 8:int, 3:bin, var:quic, 32:float, all:bin"
+    local expected = bitstring.pack(format, 2, "abc", 64, 1.5, "rest")
+    test_helpers.assert_equal(bitstring.trypack(format, 2, "abc", 64, 1.5, "rest"), expected)
+    test_helpers.assert_equal(bitstring.trypack(bitstring.compile(format), 2, "abcd", 64, 1.5, "rest"), expected)
+
+    assert_error("type", 2, 8, bitstring.trypack(format, "x", "abc", 64, 1.5, "rest"))
+    assert_error("type", 2, 8, bitstring.trypack(format))
+    assert_error("size", 3, 16, bitstring.trypack(format, 2, "ab", 64, 1.5, "rest"))
+    assert_error("range", 4, 40, bitstring.trypack(format, 2, "abc", -1, 1.5, "rest"))
+    assert_error("type", 5, 56, bitstring.trypack(format, 2, "abc", 64, {}, "rest"))
+    assert_error("type", 6, 88, bitstring.trypack(format, 2, "abc", 64, 1.5))
+    assert(not pcall(bitstring.trypack, "8:foo", 1))
+end
+
+local test3 = function()
+    -- messages are built on request
+    local result, code, element, bit = bitstring.tryunpack("8:int, 8:int", "a")
+    local message = bitstring.strerror(code, element, bit)
+    assert(message:find("size error") and message:find("element 2"))
+    assert(bitstring.strerror("value", 1, 0):find("match error"))
+    assert(bitstring.strerror("position"):find("invalid parameter"))
+    assert(not pcall(bitstring.strerror, "unknown"))
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    os.exit(0)
+end
+
+run_tests()
@@ -0,0 +1,128 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+-- values over 32 bits are tested when lua_Integer has 64 bits.
+-- they are exact in lua_Number
+local INTEGER_64 = pcall(bitstring.unpack, "64:int", string.rep("\1", 8))
+
+local check_bytes = function(format, value, bytes)
+    test_helpers.assert_equal(bitstring.pack(format, value), bytes)
+    local unpacked = bitstring.unpack(format, bytes)
+    assert(unpacked == value)
+end
+
+local check_bits = function(format, value, bits)
+    -- marker bit after the code and zero padding to the byte bound
+    local padding = (8 - (#bits + 1) % 8) % 8
+    local padded_format = format .. ", 1:int" .. (padding > 0 and (", " .. padding .. ":int") or "")
+    local packed = bitstring.pack(padded_format, value, 1, 0)
+    test_helpers.assert_equal(bitstring.binstream(packed), bits .. "1" .. string.rep("0", padding))
+    local unpacked, marker = bitstring.unpack(padded_format, packed)
+    assert(unpacked == value)
+    assert(marker == 1)
+end
+
+local test1 = function()
+    -- LEB128
+    check_bytes("var:uleb128", 0, "\0")
+    check_bytes("var:uleb128", 127, "\127")
+    check_bytes("var:uleb128", 128, "\128\1")
+    check_bytes("var:uleb128", 624485, "\229\142\38")
+    check_bytes("var:sleb128", 0, "\0")
+    check_bytes("var:sleb128", -1, "\127")
+    check_bytes("var:sleb128", 63, "\63")
+    check_bytes("var:sleb128", 64, "\192\0")
+    check_bytes("var:sleb128", -64, "\64")
+    check_bytes("var:sleb128", -65, "\191\127")
+    check_bytes("var:sleb128", -123456, "\192\187\120")
+    -- non minimal encoding is accepted
+    assert(bitstring.unpack("var:uleb128", "\130\128\0") == 2)
+end
+
+local test2 = function()
+    -- QUIC, RFC 9000 appendix A.1
+    check_bytes("var:quic", 37, "\37")
+    check_bytes("var:quic", 15293, "\123\189")
+    check_bytes("var:quic", 494878333, "\157\127\62\125")
+    assert(bitstring.unpack("var:quic", "\64\37") == 37)
+    if INTEGER_64 then
+        check_bytes("var:quic", 2 ^ 40 + 5, "\192\0\1\0\0\0\0\5")
+    end
+
+    -- ASN.1 length
+    check_bytes("var:berlen", 5, "\5")
+    check_bytes("var:berlen", 127, "\127")
+    check_bytes("var:berlen", 128, "\129\128")
+    check_bytes("var:berlen", 256, "\130\1\0")
+    check_bytes("var:berlen", 0x12345678, "\132\18\52\86\120")
+end
+
+local test3 = function()
+    -- Exp-Golomb
+    check_bits("var:ue", 0, "1")
+    check_bits("var:ue", 1, "010")
+    check_bits("var:ue", 2, "011")
+    check_bits("var:ue", 3, "00100")
+    check_bits("var:ue", 7, "0001000")
+    check_bits("var:ue", 1000, "0000000001111101001")
+    check_bits("var:se", 0, "1")
+    check_bits("var:se", 1, "010")
+    check_bits("var:se", -1, "011")
+    check_bits("var:se", 2, "00100")
+    check_bits("var:se", -2, "00101")
+    check_bits("var:ue", 2147483647, string.rep("0", 31) .. "1" .. string.rep("0", 31))
+end
+
+local test4 = function()
+    -- var elements at arbitrary bit positions followed by fixed elements
+    local format = "3:int, var:ue, var:se, var:uleb128, 5:int, var:quic, var:berlen, var:sleb128, 8:bin, 2:int"
+    local values = {5, 12, -7, 300, 17, 16000, 200, -3000, "trailer!", 0}
+    local packed = bitstring.pack(format, unpack(values))
+    test_helpers.assert_tables_equal({bitstring.unpack(format, packed)}, values)
+
+    local bitmatch = bitstring.compile(format)
+    test_helpers.assert_equal(bitstring.pack(bitmatch, unpack(values)), packed)
+    test_helpers.assert_tables_equal({bitstring.unpack(bitmatch, packed)}, values)
+
+    if INTEGER_64 then
+        local big = {2 ^ 62, -2 ^ 63, 2 ^ 61}
+        local packed = bitstring.pack("var:uleb128, var:sleb128, var:quic", unpack(big))
+        test_helpers.assert_tables_equal({bitstring.unpack("var:uleb128, var:sleb128, var:quic", packed)}, big)
+        -- 125 + 127 + 72 bits and padding
+        packed = bitstring.pack("var:ue, var:se, var:berlen, 4:int", big[1], -big[1], big[1], 0)
+        test_helpers.assert_tables_equal({bitstring.unpack("var:ue, var:se, var:berlen, 4:int", packed)}, 
+                {big[1], -big[1], big[1], 0})
+    end
+end
+
+local test5 = function()
+    test_helpers.assert_throw(function() bitstring.pack("8:uleb128", 1) end, "requires var size")
+    test_helpers.assert_throw(function() bitstring.pack("var:int", 1) end, "variable length types only")
+    test_helpers.assert_throw(function() bitstring.unpack("var:bin", "a") end, "variable length types only")
+    test_helpers.assert_throw(function() bitstring.pack("var:quic:big", 1) end, "endianess is not supported")
+    test_helpers.assert_throw(function() bitstring.pack("var:uleb128", -1) end, "out of range")
+    test_helpers.assert_throw(function() bitstring.pack("var:ue", -1) end, "out of range")
+    test_helpers.assert_throw(function() bitstring.unpack("var:uleb128", "\128\128") end, "size error")
+    test_helpers.assert_throw(function() bitstring.unpack("var:quic", "\64") end, "size error")
+    test_helpers.assert_throw(function() bitstring.unpack("var:berlen", "\128") end, "indefinite length")
+    test_helpers.assert_throw(function() bitstring.unpack("var:berlen", "\137") end, "exceeds 64 bits")
+    test_helpers.assert_throw(function() bitstring.unpack("var:ue", "\0\0\0\0\0\0\0\0\1") end, "exceeds 64 bits")
+    test_helpers.assert_throw(function() bitstring.unpack("var:uleb128", string.rep("\255", 10) .. "\1") end, 
+            "exceeds 64 bits")
+    test_helpers.assert_throw(function() bitstring.codegen("8:int, var:uleb128", "lua") end, 
+            "variable length integers are not supported")
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    test_helpers.run_test("test4", test4)
+    test_helpers.run_test("test5", test5)
+    os.exit(0)
+end
+
+run_tests()
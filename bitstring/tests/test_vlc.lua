@@ -0,0 +1,92 @@
+require "os"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+-- Exp-Golomb codes of 0..count-1 as a vlc table
+local exp_golomb_codes = function(count)
+    local codes = {}
+    for value = 0, count - 1 do
+        local bits = bitstring.binstream(bitstring.pack("var:ue, 7:int", value, 0))
+        codes[bits:match("^(0*1" .. string.rep(".", #bits:match("^0*")) .. ")")] = value
+    end
+    return codes
+end
+
+local test1 = function()
+    local vlc = bitstring.vlc_table({["1"] = 0, ["01"] = 1, ["001"] = 2, ["000"] = 3})
+    -- 1 01 001 000 1 and padding
+    local input = bitstring.frombinstream("1010010001000000")
+    local symbols, bit = vlc:decode(input, 0, 5)
+    test_helpers.assert_tables_equal(symbols, {0, 1, 2, 3, 0})
+    assert(bit == 10)
+
+    symbols, bit = bitstring.vlc_decode(vlc, input, 1, 3)
+    test_helpers.assert_tables_equal(symbols, {1, 2, 3})
+    assert(bit == 9)
+
+    symbols, bit = vlc:decode(input, 3, 0)
+    test_helpers.assert_tables_equal(symbols, {})
+    assert(bit == 3)
+end
+
+local test2 = function()
+    -- codes of up to 17 bits use sub-tables
+    local vlc = bitstring.vlc_table(exp_golomb_codes(300))
+    local values = {}
+    local format = {"5:int"}
+    local bits = 5
+    for i = 1, 200 do
+        values[i] = (i * 37) % 300
+        format[i + 1] = "var:ue"
+        bits = bits + #bitstring.binstream(bitstring.pack("var:ue, 7:int", values[i], 0)):match("^0*") * 2 + 1
+    end
+    format[#format + 1] = (8 - bits % 8) .. ":int"
+    local args = {0, unpack(values)}
+    args[#args + 1] = 0
+    local packed = bitstring.pack(table.concat(format, ", "), unpack(args))
+    local symbols, bit = vlc:decode(packed, 5, #values)
+    test_helpers.assert_tables_equal(symbols, values)
+    assert(bit == bits)
+end
+
+local test3 = function()
+    -- unary codes of up to 32 bits
+    local codes = {}
+    for i = 0, 31 do
+        codes[string.rep("0", i) .. "1"] = i
+    end
+    local vlc = bitstring.vlc_table(codes)
+    local input = bitstring.frombinstream(string.rep("0", 31) .. "1" .. string.rep("0", 9) .. "11" .. 
+            string.rep("0", 20) .. "1" .. string.rep("0", 8))
+    local symbols, bit = vlc:decode(input, 0, 4)
+    test_helpers.assert_tables_equal(symbols, {31, 9, 0, 20})
+    assert(bit == 64)
+    symbols = vlc:decode(bitstring.buffer(input), 32, 2)
+    test_helpers.assert_tables_equal(symbols, {9, 0})
+end
+
+local test4 = function()
+    test_helpers.assert_throw(function() bitstring.vlc_table({["1"] = 0, ["10"] = 1}) end, "conflicts")
+    test_helpers.assert_throw(function() bitstring.vlc_table({["0"] = 0, ["0000000000101"] = 1}) end, "conflicts")
+    test_helpers.assert_throw(function() bitstring.vlc_table({["012"] = 0}) end, "string of '0' and '1'")
+    test_helpers.assert_throw(function() bitstring.vlc_table({[string.rep("0", 33)] = 0}) end, "longer then 32 bits")
+    test_helpers.assert_throw(function() bitstring.vlc_table({}) end, "no codes")
+
+    local vlc = bitstring.vlc_table({["1"] = 0, ["01"] = 1})
+    test_helpers.assert_throw(function() vlc:decode("\0", 0, 1) end, "no code at bit 0")
+    test_helpers.assert_throw(function() vlc:decode("\255", 6, 3) end, "code at bit 8 exceeds the input")
+    test_helpers.assert_throw(function() vlc:decode("\1", 7, 2) end, "exceeds the input")
+    test_helpers.assert_throw(function() vlc:decode("\1", 9, 1) end, "bit offset 9 exceeds the input")
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    test_helpers.run_test("test4", test4)
+    os.exit(0)
+end
+
+run_tests()
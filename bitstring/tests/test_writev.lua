@@ -0,0 +1,87 @@
+require "os"
+require "io"
+require "bitstring"
+require "test_helpers"
+
+print = function(...) end
+
+local written = function(name)
+    local file = io.open(name, "rb")
+    local result = file:read("*a")
+    file:close()
+    return result
+end
+
+local test1 = function()
+    -- the file receives the same bytes as pack returns
+    local name = os.tmpname()
+    local body = test_helpers.payload(1048576, 1)
+    local cases = {
+        {"16:int:big, all:bin", 0x0102, body},
+        {"8:int=0x7f, 16:int:big, all:bin, 32:int, all:bin", #body, body, 5, "trailer"},
+        {"3:int, all:bin, 5:int", 5, body, 17},
+        {"8:int, 4096:bin, all:bin, var:uleb128", 1, body, body, 300},
+        {"8:int, 10:bin", 1, "0123456789abcdef"},
+    }
+    for _, case in ipairs(cases) do
+        local file = io.open(name, "wb")
+        file:write("head")
+        local count = bitstring.writev(file, unpack(case))
+        file:close()
+        local expected = bitstring.pack(unpack(case))
+        assert(count == #expected)
+        assert(written(name) == "head" .. expected)
+
+        file = io.open(name, "wb")
+        count = bitstring.writev(file, bitstring.compile(case[1]), unpack(case, 2))
+        file:close()
+        assert(count == #expected)
+        assert(written(name) == expected)
+    end
+    os.remove(name)
+end
+
+local test2 = function()
+    -- more references than iovecs reserved for them
+    local name = os.tmpname()
+    local parts = {}
+    local format = {}
+    for i = 1, 100 do
+        parts[i] = test_helpers.payload(600, i)
+        format[i] = "all:bin"
+    end
+    format = table.concat(format, ", ")
+    local file = io.open(name, "wb")
+    assert(bitstring.writev(file, format, unpack(parts)) == 60000)
+    file:close()
+    assert(written(name) == table.concat(parts))
+    os.remove(name)
+end
+
+local test3 = function()
+    -- errors
+    local name = os.tmpname()
+    local file = io.open(name, "wb")
+    assert(not pcall(bitstring.writev, file, "8:int, 8:int", 1))
+    assert(not pcall(bitstring.writev, file, "8:int, 2000:bin", 1, test_helpers.payload(1000, 1)))
+    assert(not pcall(bitstring.writev, "file", "8:int", 1))
+    file:close()
+    assert(not pcall(bitstring.writev, file, "8:int", 1))
+
+    file = io.open(name, "rb")
+    local result, message, code, count = bitstring.writev(file, "16:int, all:bin", 1, test_helpers.payload(1000, 2))
+    assert(result == nil)
+    assert(type(message) == "string" and type(code) == "number")
+    assert(count == 0)
+    file:close()
+    os.remove(name)
+end
+
+local run_tests = function()
+    test_helpers.run_test("test1", test1)
+    test_helpers.run_test("test2", test2)
+    test_helpers.run_test("test3", test3)
+    os.exit(0)
+end
+
+run_tests()
@@ -0,0 +1,14 @@
+-- workload_benchmark.lua baseline. messages per second and allocations per message
+-- regenerate on the reference machine with: lua workload_benchmark.lua --update
+return {
+    ["radius parse"] = {rate = 29226, allocations = 23.00},
+    ["radius compose"] = {rate = 67453, allocations = 12.00},
+    ["eap_tls parse"] = {rate = 1375182, allocations = 0.00},
+    ["eap_tls compose"] = {rate = 1388077, allocations = 1.00},
+    ["ints16 parse"] = {rate = 1408233, allocations = 0.00},
+    ["ints16 compose"] = {rate = 872617, allocations = 1.00},
+    ["bins64 parse"] = {rate = 228838, allocations = 64.00},
+    ["bins64 compose"] = {rate = 338829, allocations = 1.00},
+    ["capture parse"] = {rate = 798363, allocations = 0.00},
+    ["capture compose"] = {rate = 159677, allocations = 1.00},
+}
@@ -0,0 +1,237 @@
+-- workload_benchmark.lua
+-- Protocol workload benchmarks. Each workload reports messages per second
+-- for parse and compose and is compared with the baseline file. The run 
+-- fails when throughput drops below the baseline by more than the 
+-- threshold percentage. When bitstring is built with --enable-stats the
+-- lua strings and userdata created per message are reported and compared as well.
+--
+-- usage: lua workload_benchmark.lua [--update]
+--   --update                 write the measured results as the new baseline
+-- environment:
+--   BENCH_SECONDS            minimal measured time of each result. default 0.5
+--   BENCH_THRESHOLD          allowed throughput drop in percent. default 20
+--   BENCH_BASELINE           baseline file. default workload_baseline.lua
+-- ---------------------------------------
+require "os"
+require "io"
+require "bitstring"
+
+local SECONDS = tonumber(os.getenv("BENCH_SECONDS") or "0.5")
+local THRESHOLD = tonumber(os.getenv("BENCH_THRESHOLD") or "20")
+local BASELINE = os.getenv("BENCH_BASELINE") or "workload_baseline.lua"
+local UPDATE = arg and arg[1] == "--update"
+
+-- RADIUS message from parse-radius.lua
+local radius_message = bitstring.fromhexstream("01e40088abe03a1b2b38bbd7edcf08b26334f417010867696f7261300c06000005781e10303034302e393661302e343931301f10303034302e393662312e653036330606000000015012efbdb1bd5e4fe4147a95a78d001c51844f0d0202000b0167696f7261303d06000000130506000044f504060a383e83200f63642d617031313230622d3031")
+
+local parse_radius = function(message)
+    local code, identifier, message_length, authenticator = 
+        bitstring.unpack("8:int, 8:int, 16:int:big, 16:bin", message)
+    local attribute_list = {}
+    local len = #message - 20
+    local start_pos = 21
+    local end_pos = 22
+    while(len > 0) do
+        local number, attr_length = bitstring.unpack("8:int, 8:int", message, start_pos, end_pos)
+        local value = bitstring.unpack((attr_length - 2) .. ":bin, rest:bin", message, end_pos + 1, end_pos +  attr_length - 2)
+        start_pos = start_pos + attr_length
+        end_pos = start_pos + 1
+        len = len - attr_length
+        table.insert(attribute_list, {number = number, length = attr_length, value = value})
+    end
+    return code, identifier, authenticator, attribute_list
+end
+
+local compose_radius = function(code, identifier, authenticator, attribute_list)
+    local attributes = {}
+    for i, a in ipairs(attribute_list) do
+        table.insert(attributes, bitstring.pack("8:int, 8:int, all:bin", a.number, a.length, a.value))
+    end
+    attributes = table.concat(attributes)
+    return bitstring.pack("8:int, 8:int, 16:int:big, 16:bin, all:bin",
+        code, identifier, 20 + #attributes, authenticator, attributes) 
+end
+
+local radius = {parse_radius(radius_message)}
+assert(compose_radius(unpack(radius)) == radius_message)
+
+-- EAP-TLS header from README
+local eap_tls = bitstring.compile("8:int, 8:int, 16:int:big, 8:int, 1:int, 1:int, 1:int, 5:int")
+local eap_tls_message = bitstring.pack(eap_tls, 1, 0, 6, 13, 0, 0, 1, 0)
+
+-- high element count formats from test_profiler.lua
+local ints = bitstring.compile(string.rep("32:int, ", 15) .. "32:int")
+local ints_message = bitstring.pack(ints, 1, 2, 3, 4, 1, 2, 3, 4, 1, 2, 3, 4, 1, 2, 3, 4)
+local bins = bitstring.compile(string.rep("8:bin,", 64))
+local bins_message = string.rep("01234567", 64)
+local bins_values = {bitstring.unpack(bins, bins_message)}
+
+-- synthetic capture of ethernet, IPv4 and UDP frames
+local FRAME_HEADER = bitstring.compile(
+    "48:int:big, 48:int:big, 16:int:big, " ..
+    "4:int, 4:int, 8:int, 16:int:big, 16:int:big, 3:int, 13:int, 8:int, 8:int, 16:int:big, 32:int:big, 32:int:big, " ..
+    "16:int:big, 16:int:big, 16:int:big, 16:int:big")
+local CAPTURE_FRAMES = 10000
+local payloads = {}
+local seed = 1
+for i = 1, 64 do
+    seed = (seed * 1103515245 + 12345) % 2147483648
+    payloads[i] = string.rep(string.char(i), 64 + seed % 1200)
+end
+
+local compose_frame = function(i)
+    local payload = payloads[i % 64 + 1]
+    return bitstring.pack(FRAME_HEADER, 
+        0x0000c0ffee01, 0x0000c0ffee02, 0x0800,
+        4, 5, 0, 28 + #payload, i % 65536, 2, 0, 64, 17, 0, 0x0a000001, 0x0a000002,
+        5000 + i % 1000, 53, 8 + #payload, 0) .. payload
+end
+
+local compose_capture = function(file)
+    local writer = bitstring.pcap_writer(file)
+    for i = 1, CAPTURE_FRAMES do
+        writer:write(1000 + i / 1000, compose_frame(i))
+    end
+    assert(writer:flush())
+end
+
+local capture_name = os.tmpname()
+local capture_file = io.open(capture_name, "wb")
+compose_capture(capture_file)
+capture_file:close()
+capture_file = io.open(capture_name, "rb")
+local capture = capture_file:read("*a")
+capture_file:close()
+
+local parse_capture = function()
+    local count = 0
+    for timestamp, caplen, first, last in bitstring.pcap_reader(capture):records() do
+        local dst, src, ethertype, version, ihl, tos, length = bitstring.unpack(FRAME_HEADER, capture, first, last)
+        count = count + 1
+    end
+    assert(count == CAPTURE_FRAMES)
+end
+
+local workloads = {
+    {name = "radius", messages = 1,
+        parse = function() parse_radius(radius_message) end,
+        compose = function() compose_radius(unpack(radius)) end},
+    {name = "eap_tls", messages = 1,
+        parse = function() bitstring.unpack(eap_tls, eap_tls_message) end,
+        compose = function() bitstring.pack(eap_tls, 1, 0, 6, 13, 0, 0, 1, 0) end},
+    {name = "ints16", messages = 1,
+        parse = function() bitstring.unpack(ints, ints_message) end,
+        compose = function() bitstring.pack(ints, 1, 2, 3, 4, 1, 2, 3, 4, 1, 2, 3, 4, 1, 2, 3, 4) end},
+    {name = "bins64", messages = 1,
+        parse = function() bitstring.unpack(bins, bins_message) end,
+        compose = function() bitstring.pack(bins, unpack(bins_values)) end},
+    {name = "capture", messages = CAPTURE_FRAMES,
+        parse = parse_capture,
+        compose = function() 
+            local file = io.open(capture_name, "wb")
+            compose_capture(file)
+            file:close()
+        end},
+}
+
+-- sum of allocations of all counted calls. nil without --enable-stats
+local allocations = function()
+    local snapshot = bitstring.stats()
+    if snapshot == nil then
+        return nil
+    end
+    local total = snapshot.formats.allocations
+    for _, stats in ipairs(snapshot.bitmatches) do
+        total = total + stats.allocations
+    end
+    return total
+end
+
+-- calls per second of f over at least SECONDS
+local measure = function(f)
+    local n = 1
+    while true do
+        local start = os.clock()
+        for i = 1, n do
+            f()
+        end
+        local elapsed = os.clock() - start
+        if elapsed >= SECONDS then
+            return n / elapsed
+        end
+        n = n * 2
+    end
+end
+
+local load_baseline = function()
+    local chunk = loadfile(BASELINE)
+    return chunk and chunk() or {}
+end
+
+local save_baseline = function(results)
+    local file = assert(io.open(BASELINE, "w"))
+    file:write("-- workload_benchmark.lua baseline. messages per second and allocations per message\n")
+    file:write("-- regenerate on the reference machine with: lua workload_benchmark.lua --update\n")
+    file:write("return {\n")
+    for _, result in ipairs(results) do
+        file:write(string.format("    [%q] = {rate = %d", result.name, math.floor(result.rate)))
+        if result.allocations then
+            file:write(string.format(", allocations = %.2f", result.allocations))
+        end
+        file:write("},\n")
+    end
+    file:write("}\n")
+    file:close()
+end
+
+local run = function()
+    local baseline = load_baseline()
+    local results = {}
+    local failed = false
+    print(string.format("%-18s %14s %14s %8s %12s", "workload", "msg/s", "baseline", "change", "allocs/msg"))
+    for _, workload in ipairs(workloads) do
+        for _, operation in ipairs({"parse", "compose"}) do
+            local f = workload[operation]
+            local name = workload.name .. " " .. operation
+            local rate = measure(f) * workload.messages
+
+            local per_message = nil
+            local before = allocations()
+            if before then
+                f()
+                per_message = (allocations() - before) / workload.messages
+            end
+
+            local expected = baseline[name]
+            local change = ""
+            local status = ""
+            if expected and not UPDATE then
+                change = string.format("%+7.1f%%", (rate / expected.rate - 1) * 100)
+                if rate < expected.rate * (1 - THRESHOLD / 100) then
+                    status = " throughput regression"
+                    failed = true
+                end
+                if per_message and expected.allocations and per_message > expected.allocations + 0.05 then
+                    status = status .. " allocation regression"
+                    failed = true
+                end
+            end
+            print(string.format("%-18s %14.0f %14s %8s %12s%s", name, rate, 
+                expected and tostring(expected.rate) or "-", change, 
+                per_message and string.format("%.2f", per_message) or "-", status))
+            table.insert(results, {name = name, rate = rate, allocations = per_message})
+        end
+    end
+    os.remove(capture_name)
+
+    if UPDATE then
+        save_baseline(results)
+        print("baseline written to " .. BASELINE)
+    elseif failed then
+        print(string.format("throughput dropped by more than %d%% or allocations grew", THRESHOLD))
+        os.exit(1)
+    end
+    os.exit(0)
+end
+
+run()
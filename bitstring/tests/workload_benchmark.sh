@@ -0,0 +1,10 @@
+#!/bin/sh
+
+rm -f bitstring.so
+ln -s ../src/bitstring/.libs/bitstring.so bitstring.so
+
+LUA=${LUA:-lua}
+BENCH_BASELINE=${BENCH_BASELINE:-$(dirname $0)/workload_baseline.lua}
+export BENCH_BASELINE
+
+LUA_CPATH="./?.so" LUA_PATH="$(dirname $0)/?.lua" $LUA $(dirname $0)/workload_benchmark.lua "$@"